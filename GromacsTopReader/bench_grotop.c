@@ -0,0 +1,214 @@
+/*
+ * Benchmark driver for the GROMACS topology plugin
+ *
+ * Times open_grotop_read(), read_grotop_structure(), read_grotop_bonds() and
+ * read_grotop_angles() over repeated runs of each topology given on the
+ * command line, and prints one JSON object per topology with the best and
+ * mean phase times, throughput and the peak resident set size of the process.
+ *
+ * Usage: bench_grotop [-r runs] [-l label] <topology.top> [...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* We'll compile the plugin directly into this benchmark */
+#define STATIC_PLUGIN
+#include "grotopplugin.c"
+
+#define NUM_PHASES 4
+
+static const char *phase_names[NUM_PHASES] = { "open", "structure", "bonds", "angles" };
+
+/* Everything one topology reports */
+typedef struct {
+  int natoms;
+  int nbonds, nangles, ndihedrals, nimpropers;
+  long long lines, bytes, files;
+  double best[NUM_PHASES];
+  double sum[NUM_PHASES];
+  double best_total, sum_total;
+} bench_result_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Peak resident set size of this process so far, in kilobytes */
+static long peak_rss_kb(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+/* One full load; returns 0 on success */
+static int run_once(const char *filename, bench_result_t *res, double *phase) {
+  int natoms = 0;
+  double t0 = now_seconds();
+  void *handle = open_grotop_read(filename, "grotop", &natoms);
+  double t1 = now_seconds();
+  if (!handle) {
+    fprintf(stderr, "ERROR: Failed to open %s\n", filename);
+    return -1;
+  }
+
+  molfile_atom_t *atoms = (molfile_atom_t *)calloc(natoms > 0 ? natoms : 1, sizeof(molfile_atom_t));
+  if (!atoms) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for atoms\n");
+    close_grotop_read(handle);
+    return -1;
+  }
+
+  int optflags = 0;
+  int rc = read_grotop_structure(handle, &optflags, atoms);
+  double t2 = now_seconds();
+
+  int nbonds = 0, nbondtypes = 0;
+  int *from = NULL, *to = NULL, *bondtype = NULL;
+  float *bondorder = NULL;
+  char **bondtypename = NULL;
+  if (rc == MOLFILE_SUCCESS)
+    rc = read_grotop_bonds(handle, &nbonds, &from, &to, &bondorder,
+                           &bondtype, &nbondtypes, &bondtypename);
+  double t3 = now_seconds();
+
+  int nangles = 0, ndihedrals = 0, nimpropers = 0, ncterms = 0, ctermcols = 0, ctermrows = 0;
+  int *angles = NULL, *angletypes = NULL, *dihedrals = NULL, *dihedraltypes = NULL;
+  int *impropers = NULL, *impropertypes = NULL, *cterms = NULL;
+  int nangletypes = 0, ndihedraltypes = 0, nimpropertypes = 0;
+  char **angletypenames = NULL, **dihedraltypenames = NULL, **impropertypenames = NULL;
+  if (rc == MOLFILE_SUCCESS)
+    rc = read_grotop_angles(handle, &nangles, &angles, &angletypes, &nangletypes, &angletypenames,
+                            &ndihedrals, &dihedrals, &dihedraltypes, &ndihedraltypes, &dihedraltypenames,
+                            &nimpropers, &impropers, &impropertypes, &nimpropertypes, &impropertypenames,
+                            &ncterms, &cterms, &ctermcols, &ctermrows);
+  double t4 = now_seconds();
+
+  if (rc != MOLFILE_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to read %s\n", filename);
+    free(atoms);
+    close_grotop_read(handle);
+    return -1;
+  }
+
+  grotop_stats_t stats;
+  grotop_get_stats(handle, &stats);
+
+  res->natoms = natoms;
+  res->nbonds = nbonds;
+  res->nangles = nangles;
+  res->ndihedrals = ndihedrals;
+  res->nimpropers = nimpropers;
+  res->lines = stats.lines;
+  res->bytes = stats.bytes;
+  res->files = stats.files;
+
+  phase[0] = t1 - t0;
+  phase[1] = t2 - t1;
+  phase[2] = t3 - t2;
+  phase[3] = t4 - t3;
+
+  free(atoms);
+  close_grotop_read(handle);
+  return 0;
+}
+
+static int bench_file(const char *filename, int runs, bench_result_t *res) {
+  memset(res, 0, sizeof(*res));
+
+  for (int run = 0; run < runs; run++) {
+    double phase[NUM_PHASES];
+    if (run_once(filename, res, phase) != 0) return -1;
+
+    double total = 0.0;
+    for (int p = 0; p < NUM_PHASES; p++) {
+      if (run == 0 || phase[p] < res->best[p]) res->best[p] = phase[p];
+      res->sum[p] += phase[p];
+      total += phase[p];
+    }
+    if (run == 0 || total < res->best_total) res->best_total = total;
+    res->sum_total += total;
+  }
+
+  return 0;
+}
+
+/* JSON string with the few escapes a file name can need */
+static void print_json_string(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') putchar('\\');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+static void print_result(const char *label, const char *filename, int runs, const bench_result_t *res) {
+  printf("{\"label\": ");
+  print_json_string(label);
+  printf(", \"file\": ");
+  print_json_string(filename);
+  printf(", \"runs\": %d, \"threads\": %d", runs, configured_threads());
+  printf(", \"atoms\": %d, \"bonds\": %d, \"angles\": %d, \"dihedrals\": %d, \"impropers\": %d",
+         res->natoms, res->nbonds, res->nangles, res->ndihedrals, res->nimpropers);
+  printf(", \"files\": %lld, \"lines\": %lld, \"bytes\": %lld", res->files, res->lines, res->bytes);
+
+  for (int p = 0; p < NUM_PHASES; p++)
+    printf(", \"%s_best_s\": %.6f, \"%s_mean_s\": %.6f",
+           phase_names[p], res->best[p], phase_names[p], res->sum[p] / runs);
+  printf(", \"total_best_s\": %.6f, \"total_mean_s\": %.6f", res->best_total, res->sum_total / runs);
+
+  /* Throughput from the best run */
+  double open_s = res->best[0] > 0 ? res->best[0] : 1e-9;
+  double total_s = res->best_total > 0 ? res->best_total : 1e-9;
+  printf(", \"parse_mb_per_s\": %.3f, \"parse_lines_per_s\": %.0f, \"atoms_per_s\": %.0f",
+         res->bytes / open_s / 1e6, res->lines / open_s, res->natoms / total_s);
+  printf(", \"peak_rss_kb\": %ld}\n", peak_rss_kb());
+}
+
+int main(int argc, char *argv[]) {
+  int runs = 5;
+  const char *label = "";
+  int first = 1;
+
+  while (first < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-r") == 0 && first + 1 < argc) {
+      runs = atoi(argv[first + 1]);
+      first += 2;
+    } else if (strcmp(argv[first], "-l") == 0 && first + 1 < argc) {
+      label = argv[first + 1];
+      first += 2;
+    } else {
+      break;
+    }
+  }
+
+  if (first >= argc || runs < 1) {
+    fprintf(stderr, "Usage: %s [-r runs] [-l label] <topology_file.top> [...]\n", argv[0]);
+    return 1;
+  }
+
+  VMDPLUGIN_init();
+
+  int failed = 0;
+  for (int i = first; i < argc; i++) {
+    bench_result_t res;
+    if (bench_file(argv[i], runs, &res) != 0) {
+      failed = 1;
+      continue;
+    }
+    print_result(label, argv[i], runs, &res);
+    fflush(stdout);
+  }
+
+  return failed;
+}
@@ -0,0 +1,230 @@
+/*
+ * Microbenchmark: field parsing of topology data lines
+ *
+ * Times the field scanner used by the section parsers against the sscanf()
+ * formats it replaced, on synthetic [ atoms ], [ atomtypes ], [ bonds ],
+ * [ angles ] and [ dihedrals ] lines, after checking that both produce the
+ * same fields for every line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* We'll compile the plugin directly into this benchmark */
+#define STATIC_PLUGIN
+#include "grotopplugin.c"
+
+#define NUM_LINES 200000
+#define LINE_SIZE 128
+
+/* Fields of any supported line kind; n is the sscanf-style conversion count */
+typedef struct {
+  int n;
+  int ints[6];
+  float floats[2];
+  char words[3][32];
+} fields_t;
+
+typedef int (*extract_fn)(const char *line, fields_t *f);
+
+/* Formats used before the field scanner */
+static int old_atom(const char *line, fields_t *f) {
+  return f->n = sscanf(line, "%d %15s %d %7s %15s %d %f %f",
+                       &f->ints[0], f->words[0], &f->ints[1], f->words[1],
+                       f->words[2], &f->ints[2], &f->floats[0], &f->floats[1]);
+}
+
+static int old_atomtype(const char *line, fields_t *f) {
+  f->n = sscanf(line, "%15s %f", f->words[0], &f->floats[0]);
+  if (f->n != 2) f->n = sscanf(line, "%15s %*s %*s %f", f->words[0], &f->floats[0]);
+  return f->n;
+}
+
+static int old_bond(const char *line, fields_t *f) {
+  return f->n = sscanf(line, "%d %d", &f->ints[0], &f->ints[1]);
+}
+
+static int old_angle(const char *line, fields_t *f) {
+  return f->n = sscanf(line, "%d %d %d", &f->ints[0], &f->ints[1], &f->ints[2]);
+}
+
+static int old_dihedral(const char *line, fields_t *f) {
+  return f->n = sscanf(line, "%d %d %d %d %d", &f->ints[0], &f->ints[1],
+                       &f->ints[2], &f->ints[3], &f->ints[4]);
+}
+
+/* The same fields through the scanner, as the section parsers read them */
+static int new_atom(const char *line, fields_t *f) {
+  int n = 0;
+  if (n == 0 && scan_int(&line, &f->ints[0])) n = 1;
+  if (n == 1 && scan_word(&line, f->words[0], 16)) n = 2;
+  if (n == 2 && scan_int(&line, &f->ints[1])) n = 3;
+  if (n == 3 && scan_word(&line, f->words[1], 8)) n = 4;
+  if (n == 4 && scan_word(&line, f->words[2], 16)) n = 5;
+  if (n == 5 && scan_int(&line, &f->ints[2])) n = 6;
+  if (n == 6 && scan_float(&line, &f->floats[0])) n = 7;
+  if (n == 7 && scan_float(&line, &f->floats[1])) n = 8;
+  return f->n = n;
+}
+
+static int new_atomtype(const char *line, fields_t *f) {
+  f->n = 0;
+  if (!scan_word(&line, f->words[0], 16)) return f->n;
+  f->n = 1;
+  const char *p = line;
+  if (scan_float(&p, &f->floats[0])) return f->n = 2;
+  p = line;
+  if (skip_word(&p) && skip_word(&p) && scan_float(&p, &f->floats[0])) f->n = 2;
+  return f->n;
+}
+
+static int new_bond(const char *line, fields_t *f) {
+  return f->n = scan_ints(line, f->ints, 2);
+}
+
+static int new_angle(const char *line, fields_t *f) {
+  return f->n = scan_ints(line, f->ints, 3);
+}
+
+static int new_dihedral(const char *line, fields_t *f) {
+  return f->n = scan_ints(line, f->ints, 5);
+}
+
+/* Compare only the fields both extractors claim to have converted */
+static int same_fields(const fields_t *a, const fields_t *b, extract_fn kind_old) {
+  if ((a->n < 1 ? 0 : a->n) != (b->n < 1 ? 0 : b->n)) return 0;
+  int n = a->n;
+
+  if (kind_old == old_atom) {
+    static const int slot[8] = { 'i', 'w', 'i', 'w', 'w', 'i', 'f', 'f' };
+    int ii = 0, wi = 0, fi = 0;
+    for (int k = 0; k < n; k++) {
+      if (slot[k] == 'i' && a->ints[ii] != b->ints[ii]) return 0;
+      if (slot[k] == 'w' && strcmp(a->words[wi], b->words[wi]) != 0) return 0;
+      if (slot[k] == 'f' && memcmp(&a->floats[fi], &b->floats[fi], sizeof(float)) != 0) return 0;
+      if (slot[k] == 'i') ii++;
+      else if (slot[k] == 'w') wi++;
+      else fi++;
+    }
+    return 1;
+  }
+
+  if (kind_old == old_atomtype) {
+    if (n >= 1 && strcmp(a->words[0], b->words[0]) != 0) return 0;
+    return n < 2 || memcmp(&a->floats[0], &b->floats[0], sizeof(float)) == 0;
+  }
+
+  return n < 1 || memcmp(a->ints, b->ints, n * sizeof(int)) == 0;
+}
+
+/* Synthetic lines, including a few malformed ones to exercise failure paths */
+static const char *names[] = { "C1", "NC3", "PO4", "GL1", "GL2", "C1A", "D2A", "C3A",
+                               "W", "SC1", "BB", "OVERLONGATOMNAMEXYZ" };
+
+static float rnd_float(void) {
+  return (float)(rand() % 200001 - 100000) / (float)(1 + rand() % 10000);
+}
+
+static void make_line(int kind, int i, char *line) {
+  const char *a = names[rand() % 12];
+  const char *b = names[rand() % 12];
+  int variant = rand() % 50;
+
+  switch (kind) {
+    case 0:
+      if (variant == 0) snprintf(line, LINE_SIZE, "%d %s %d", i, a, i);
+      else if (variant == 1) snprintf(line, LINE_SIZE, "%d\t%s\t%d POPC %s %d %.3e", i, a, i / 12, b, i, rnd_float());
+      else snprintf(line, LINE_SIZE, "%6d %5s %5d  POPC %5s %5d %9.5f %8.4f", i, a, i / 12, b, i, rnd_float(), 72.0f + rand() % 10);
+      break;
+    case 1:
+      if (variant == 0) snprintf(line, LINE_SIZE, "%s %d %d %.4f 0.000 A 0.0 0.0", a, 6, 6, 12.011f);
+      else if (variant == 1) snprintf(line, LINE_SIZE, "%s", a);
+      else snprintf(line, LINE_SIZE, "%s %.3f 0.000 A 0.47 3.5", a, 72.0f + rand() % 100 / 10.0f);
+      break;
+    case 2:
+      if (variant == 0) snprintf(line, LINE_SIZE, "%d.5 %d 1", i, i + 1);
+      else snprintf(line, LINE_SIZE, "%5d %5d %5d %7.3f %7.1f", i, i + 1, 1, 0.47f, 1250.0f);
+      break;
+    case 3:
+      snprintf(line, LINE_SIZE, "%5d %5d %5d %5d %7.1f %7.1f", i, i + 1, i + 2, 2, 180.0f, 25.0f);
+      break;
+    default:
+      if (variant == 0) snprintf(line, LINE_SIZE, "%d %d %d %d", i, i + 1, i + 2, i + 3);
+      else snprintf(line, LINE_SIZE, "%5d %5d %5d %5d %5d %7.1f %7.1f %d", i, i + 1, i + 2, i + 3,
+                    1 + rand() % 9, 180.0f, 2.0f, 3);
+      break;
+  }
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Best of several runs, in lines per second */
+static double time_extract(extract_fn fn, char (*lines)[LINE_SIZE], int nlines) {
+  double best = 0.0;
+  fields_t f;
+  volatile int sink = 0;
+
+  for (int run = 0; run < 5; run++) {
+    double t0 = now_seconds();
+    for (int i = 0; i < nlines; i++) sink += fn(lines[i], &f);
+    double dt = now_seconds() - t0;
+    if (dt > 0 && nlines / dt > best) best = nlines / dt;
+  }
+
+  return best;
+}
+
+int main(void) {
+  static const struct {
+    const char *name;
+    extract_fn old_fn, new_fn;
+  } kinds[] = {
+    { "atoms",     old_atom,     new_atom },
+    { "atomtypes", old_atomtype, new_atomtype },
+    { "bonds",     old_bond,     new_bond },
+    { "angles",    old_angle,    new_angle },
+    { "dihedrals", old_dihedral, new_dihedral }
+  };
+  int nkinds = (int)(sizeof(kinds) / sizeof(kinds[0]));
+
+  char (*lines)[LINE_SIZE] = malloc((size_t)NUM_LINES * LINE_SIZE);
+  if (!lines) {
+    fprintf(stderr, "ERROR: Failed to allocate lines\n");
+    return 1;
+  }
+
+  printf("%-10s %14s %14s %8s\n", "section", "sscanf l/s", "scanner l/s", "speedup");
+
+  int failed = 0;
+  for (int k = 0; k < nkinds; k++) {
+    srand(1234 + k);
+    for (int i = 0; i < NUM_LINES; i++) make_line(k, i + 1, lines[i]);
+
+    /* Both extractors must agree on every line before timing means anything */
+    for (int i = 0; i < NUM_LINES; i++) {
+      fields_t a, b;
+      memset(&a, 0, sizeof(a));
+      memset(&b, 0, sizeof(b));
+      kinds[k].old_fn(lines[i], &a);
+      kinds[k].new_fn(lines[i], &b);
+      if (!same_fields(&a, &b, kinds[k].old_fn)) {
+        fprintf(stderr, "ERROR: %s fields differ for line '%s'\n", kinds[k].name, lines[i]);
+        failed = 1;
+        break;
+      }
+    }
+
+    double before = time_extract(kinds[k].old_fn, lines, NUM_LINES);
+    double after = time_extract(kinds[k].new_fn, lines, NUM_LINES);
+    printf("%-10s %14.0f %14.0f %7.1fx\n", kinds[k].name, before, after, after / before);
+  }
+
+  free(lines);
+  return failed;
+}
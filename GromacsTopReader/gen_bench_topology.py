@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""
+Synthetic GROMACS topology generator for the reader benchmarks
+
+Writes a self-contained topology tree (topol.top plus .itp files) whose size
+and shape are set on the command line: lipid copies, protein chains, depth of
+the include tree, nesting of #ifdef blocks and number of [ molecules ] lines.
+The output is deterministic for a given set of parameters.
+
+Author: Diego E.B. Gomes
+"""
+
+import argparse
+from pathlib import Path
+
+
+# Martini-like lipid: (name, type, mass)
+LIPID_ATOMS = [
+    ("NC3", "Q0", 72.0), ("PO4", "Qa", 72.0), ("GL1", "Na", 72.0), ("GL2", "Na", 72.0),
+    ("C1A", "C1", 72.0), ("D2A", "C3", 72.0), ("C3A", "C1", 72.0), ("C4A", "C1", 72.0),
+    ("C1B", "C1", 72.0), ("C2B", "C1", 72.0), ("C3B", "C1", 72.0), ("C4B", "C1", 72.0),
+]
+LIPID_BONDS = [(1, 2), (2, 3), (3, 4), (3, 5), (5, 6), (6, 7), (7, 8),
+               (4, 9), (9, 10), (10, 11), (11, 12)]
+LIPID_ANGLES = [(2, 3, 4), (2, 3, 5), (3, 5, 6), (5, 6, 7), (6, 7, 8),
+                (4, 9, 10), (9, 10, 11), (10, 11, 12)]
+
+# Backbone of one protein residue: (name, type, mass)
+RESIDUE_ATOMS = [("N", "NH1", 14.007), ("CA", "CT1", 12.011), ("C", "C", 12.011), ("O", "O", 15.999)]
+RESIDUE_NAMES = ["ALA", "GLY", "LEU", "LYS", "GLU", "SER", "VAL", "PHE"]
+
+ATOMTYPES = {}
+for _name, _type, _mass in LIPID_ATOMS + RESIDUE_ATOMS + [("W", "P4", 72.0)]:
+    ATOMTYPES[_type] = _mass
+
+
+def ifdef_blocks(name, depth, natoms):
+    """Nested false conditionals around restraint tables, as force fields do"""
+    if depth == 0:
+        return []
+    lines = []
+    for level in range(depth):
+        lines.append(f"#ifdef {name}_POSRES_{level}")
+    lines.append("[ position_restraints ]")
+    lines += [f"{i:6d}    1  1000  1000  1000" for i in range(1, natoms + 1)]
+    lines += ["#endif"] * depth
+    lines.append("")
+    return lines
+
+
+def write_forcefield(ff_dir):
+    lines = ["; Synthetic force field", "", "[ atomtypes ]",
+             "; name  mass  charge ptype  sigma  epsilon"]
+    for atype, mass in ATOMTYPES.items():
+        lines.append(f"{atype:6s} {mass:9.4f} 0.000 A 0.47 3.5")
+    lines.append("")
+    (ff_dir / "forcefield.itp").write_text("\n".join(lines) + "\n")
+
+
+def write_lipid(ff_dir, ifdef_depth):
+    lines = ["[ moleculetype ]", "POPC 1", "", "[ atoms ]"]
+    for i, (name, atype, mass) in enumerate(LIPID_ATOMS, 1):
+        charge = 1.0 if name == "NC3" else (-1.0 if name == "PO4" else 0.0)
+        lines.append(f"{i:6d} {atype:5s} 1  POPC {name:5s} {i:5d} {charge:6.3f} {mass:8.4f}")
+    lines += ["", "[ bonds ]"] + [f"{a:5d} {b:5d} 1 0.47 1250" for a, b in LIPID_BONDS]
+    lines += ["", "[ angles ]"] + [f"{a:5d} {b:5d} {c:5d} 2 180.0 25.0" for a, b, c in LIPID_ANGLES]
+    lines.append("")
+    lines += ifdef_blocks("POPC", ifdef_depth, len(LIPID_ATOMS))
+
+    lines += ["[ moleculetype ]", "W 1", "", "[ atoms ]",
+              "     1 P4    1  W     W      1  0.000  72.0000", ""]
+    (ff_dir / "lipids.itp").write_text("\n".join(lines) + "\n")
+
+
+def write_protein(ff_dir, residues, ifdef_depth):
+    per = len(RESIDUE_ATOMS)
+    natoms = residues * per
+    lines = ["[ moleculetype ]", "PROT 3", "", "[ atoms ]"]
+    for r in range(residues):
+        resname = RESIDUE_NAMES[r % len(RESIDUE_NAMES)]
+        for k, (name, atype, mass) in enumerate(RESIDUE_ATOMS):
+            i = r * per + k + 1
+            charge = (-0.47, 0.07, 0.51, -0.51)[k]
+            lines.append(f"{i:6d} {atype:5s} {r + 1:5d} {resname:4s} {name:5s} {i:5d} {charge:6.3f} {mass:8.4f}")
+
+    def atom(r, k):
+        return r * per + k + 1
+
+    bonds, angles, dihedrals, impropers, pairs = [], [], [], [], []
+    for r in range(residues):
+        n, ca, c, o = (atom(r, k) for k in range(4))
+        bonds += [(n, ca), (ca, c), (c, o)]
+        angles += [(n, ca, c), (ca, c, o)]
+        impropers.append((c, ca, atom(r + 1, 0) if r + 1 < residues else o, o))
+        if r + 1 < residues:
+            n2, ca2 = atom(r + 1, 0), atom(r + 1, 1)
+            bonds.append((c, n2))
+            angles += [(ca, c, n2), (c, n2, ca2)]
+            dihedrals += [(n, ca, c, n2), (ca, c, n2, ca2)]
+            pairs += [(n, n2), (ca, ca2), (o, ca2)]
+
+    lines += ["", "[ bonds ]"] + [f"{a:6d} {b:6d} 1 0.1335 334720" for a, b in bonds]
+    lines += ["", "[ pairs ]"] + [f"{a:6d} {b:6d} 1" for a, b in pairs]
+    lines += ["", "[ angles ]"] + [f"{a:6d} {b:6d} {c:6d} 5 114.0 292.88" for a, b, c in angles]
+    lines += ["", "[ dihedrals ]"] + [f"{a:6d} {b:6d} {c:6d} {d:6d} 9 180.0 10.46 2"
+                                      for a, b, c, d in dihedrals]
+    lines += ["", "[ dihedrals ]"] + [f"{a:6d} {b:6d} {c:6d} {d:6d} 2 0.0 418.4"
+                                      for a, b, c, d in impropers]
+    lines.append("")
+    lines += ifdef_blocks("PROT", ifdef_depth, natoms)
+    (ff_dir / "protein.itp").write_text("\n".join(lines) + "\n")
+
+
+def write_include_tree(ff_dir, depth):
+    """A chain of nested includes, each level defining one small moltype"""
+    for level in range(depth):
+        lines = [f"; include level {level}", "[ moleculetype ]", f"FILL{level} 1", "", "[ atoms ]",
+                 f"     1 C1    1  FIL   C1     1  0.000  72.0000",
+                 f"     2 C1    1  FIL   C2     2  0.000  72.0000", "",
+                 "[ bonds ]", "     1     2  1 0.47 1250", ""]
+        if level + 1 < depth:
+            lines.append(f'#include "inc_{level + 1}.itp"')
+        (ff_dir / f"inc_{level}.itp").write_text("\n".join(lines) + "\n")
+
+
+def write_top(out_dir, args):
+    lines = ["; Synthetic benchmark topology",
+             f"; lipids={args.lipids} chains={args.chains} residues={args.residues} "
+             f"include_depth={args.include_depth} ifdef_depth={args.ifdef_depth} "
+             f"molecule_lines={args.molecule_lines}",
+             "", "[ defaults ]", "1 1", "",
+             '#include "ff/forcefield.itp"',
+             '#include "ff/lipids.itp"']
+    if args.chains > 0:
+        lines.append('#include "ff/protein.itp"')
+    if args.include_depth > 0:
+        lines.append('#include "ff/inc_0.itp"')
+    lines += ["", "[ system ]", "Synthetic benchmark system", "", "[ molecules ]"]
+
+    if args.chains > 0:
+        lines.append(f"PROT {args.chains}")
+    for level in range(args.include_depth):
+        lines.append(f"FILL{level} 1")
+
+    # Lipids and water alternate over the requested number of lines
+    nlines = max(1, args.molecule_lines)
+    lipid_lines = (nlines + 1) // 2
+    water_lines = nlines // 2
+    for i in range(nlines):
+        if i % 2 == 0:
+            share = args.lipids // lipid_lines + (1 if i // 2 < args.lipids % lipid_lines else 0)
+            if share > 0:
+                lines.append(f"POPC {share}")
+        else:
+            share = args.waters // water_lines + (1 if i // 2 < args.waters % water_lines else 0)
+            if share > 0:
+                lines.append(f"W {share}")
+    (out_dir / "topol.top").write_text("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a synthetic GROMACS topology for benchmarking")
+    parser.add_argument("out_dir", help="Output directory (topol.top and ff/*.itp)")
+    parser.add_argument("--lipids", type=int, default=10000, help="Lipid copies")
+    parser.add_argument("--waters", type=int, default=0, help="Water copies")
+    parser.add_argument("--chains", type=int, default=1, help="Protein chains")
+    parser.add_argument("--residues", type=int, default=300, help="Residues per protein chain")
+    parser.add_argument("--include-depth", type=int, default=4, help="Depth of the nested include chain (the reader allows 100)")
+    parser.add_argument("--ifdef-depth", type=int, default=2, help="Nesting of false #ifdef blocks (the reader allows 20)")
+    parser.add_argument("--molecule-lines", type=int, default=2, help="Lines in [ molecules ]")
+    args = parser.parse_args()
+
+    out_dir = Path(args.out_dir)
+    ff_dir = out_dir / "ff"
+    ff_dir.mkdir(parents=True, exist_ok=True)
+
+    write_forcefield(ff_dir)
+    write_lipid(ff_dir, args.ifdef_depth)
+    if args.chains > 0:
+        write_protein(ff_dir, args.residues, args.ifdef_depth)
+    write_include_tree(ff_dir, args.include_depth)
+    write_top(out_dir, args)
+    print(f"Wrote {out_dir / 'topol.top'}")
+
+
+if __name__ == "__main__":
+    main()
@@ -8,10 +8,14 @@ Designed with modularity in mind for future VMD molfile plugin implementation in
 Author: Diego E.B. Gomes
 """
 
+import os
 import re
+import struct
 import argparse
+import ctypes
+import ctypes.util
 from pathlib import Path
-from typing import List, Dict, Tuple, Optional
+from typing import List, Dict, Tuple, Optional, Iterable
 from dataclasses import dataclass, field
 
 
@@ -642,92 +646,211 @@ def build_system(topology: Topology) -> None:
 # PSF Writer
 # =============================================================================
 
-def write_psf(topology: Topology, output_path: Path) -> None:
-    """Write topology to PSF format file"""
+# id, segid, resid, resname, name, type, charge, mass
+PSF_ATOM_FORMAT = "%8d %-4s %-4d %-4s %-4s %-6s %10.6f %13.4f            0\n"
+
+# Connectivity sections: (title, atoms per item, items per line)
+PSF_SECTIONS = [
+    ("!NBOND: bonds", 2, 4),
+    ("!NTHETA: angles", 3, 3),
+    ("!NPHI: dihedrals", 4, 2),
+    ("!NIMPHI: impropers", 4, 2),
+]
+
+
+def write_psf_stream(output_path: Path, system_name: str, natoms: int,
+                     atom_rows: Iterable[tuple], sections: List[Tuple[int, Iterable[list]]]) -> None:
+    """
+    Write a PSF file from atom records and flat index chunks
+
+    atom_rows yields (id, segid, resid, resname, name, type, charge, mass).
+    sections has one (count, chunks) pair per PSF_SECTIONS entry; chunks yield
+    flat lists of atom indices, each a whole number of PSF lines except the last.
+    """
     print(f"\nWriting PSF file: {output_path}")
 
     with open(output_path, 'w') as f:
         # PSF header
         f.write("PSF CMAP\n\n")
         f.write("       1 !NTITLE\n")
-        f.write(f" REMARKS {topology.system_name}\n\n")
+        f.write(f" REMARKS {system_name}\n\n")
 
         # Atoms section
-        natoms = len(topology.atoms)
         f.write(f"{natoms:8d} !NATOM\n")
-
-        for atom in topology.atoms:
-            f.write(f"{atom.atom_id:8d} "
-                   f"{atom.segment_id:4s} "
-                   f"{atom.residue_number:<4d} "
-                   f"{atom.residue_name:4s} "
-                   f"{atom.atom_name:4s} "
-                   f"{atom.atom_type:6s} "
-                   f"{atom.charge:10.6f} "
-                   f"{atom.mass:13.4f} "
-                   f"           0\n")
+        f.writelines(PSF_ATOM_FORMAT % row for row in atom_rows)
 
         f.write("\n")
 
-        # Bonds section
-        nbonds = len(topology.bonds)
-        f.write(f"{nbonds:8d} !NBOND: bonds\n")
-
-        for i, bond in enumerate(topology.bonds):
-            f.write(f"{bond[0]:8d}{bond[1]:8d}")
-            if (i + 1) % 4 == 0:
-                f.write("\n")
-        if nbonds % 4 != 0:
+        # Bonds, angles, dihedrals and impropers, a fixed number per line
+        for (title, width, per_line), (count, chunks) in zip(PSF_SECTIONS, sections):
+            f.write(f"{count:8d} {title}\n")
+            per = width * per_line
+            line = "%8d" * per + "\n"
+            for chunk in chunks:
+                full = len(chunk) - len(chunk) % per
+                f.write("".join(line % tuple(chunk[i:i + per]) for i in range(0, full, per)))
+                if full < len(chunk):
+                    f.write("%8d" * (len(chunk) - full) % tuple(chunk[full:]) + "\n")
             f.write("\n")
 
-        f.write("\n")
+        # Empty sections (required by PSF format)
+        f.write("       0 !NDON: donors\n\n")
+        f.write("       0 !NACC: acceptors\n\n")
+        f.write("       0 !NNB: non-bonded exclusions\n\n")
+        f.write("       0       0 !NGRP: groups\n\n")
 
-        # Angles section
-        nangles = len(topology.angles)
-        f.write(f"{nangles:8d} !NTHETA: angles\n")
 
-        for i, angle in enumerate(topology.angles):
-            f.write(f"{angle[0]:8d}{angle[1]:8d}{angle[2]:8d}")
-            if (i + 1) % 3 == 0:
-                f.write("\n")
-        if nangles % 3 != 0:
-            f.write("\n")
+def write_psf(topology: Topology, output_path: Path) -> None:
+    """Write topology to PSF format file"""
+    atom_rows = ((a.atom_id, a.segment_id, a.residue_number, a.residue_name,
+                  a.atom_name, a.atom_type, a.charge, a.mass) for a in topology.atoms)
+    sections = [(len(items), [[i for item in items for i in item]])
+                for items in (topology.bonds, topology.angles, topology.dihedrals, topology.impropers)]
+    write_psf_stream(output_path, topology.system_name, len(topology.atoms), atom_rows, sections)
 
-        f.write("\n")
 
-        # Dihedrals section
-        ndihedrals = len(topology.dihedrals)
-        f.write(f"{ndihedrals:8d} !NPHI: dihedrals\n")
+# =============================================================================
+# libgrotop Fast Path
+# =============================================================================
 
-        for i, dihedral in enumerate(topology.dihedrals):
-            f.write(f"{dihedral[0]:8d}{dihedral[1]:8d}"
-                   f"{dihedral[2]:8d}{dihedral[3]:8d}")
-            if (i + 1) % 2 == 0:
-                f.write("\n")
-        if ndihedrals % 2 != 0:
-            f.write("\n")
+GROTOP_API_VERSION = 1
+GROTOP_NAME_SIZE = 16
+GROTOP_RESNAME_SIZE = 8
+CHUNK_ATOMS = 65536
+CHUNK_ITEMS = 12 * 4096    # A whole number of PSF lines for every section
 
-        f.write("\n")
 
-        # Impropers section
-        nimpropers = len(topology.impropers)
-        f.write(f"{nimpropers:8d} !NIMPHI: impropers\n")
+def load_libgrotop() -> Optional[ctypes.CDLL]:
+    """
+    Load the C reader built by `make libgrotop`, or None if it is not found
 
-        for i, improper in enumerate(topology.impropers):
-            f.write(f"{improper[0]:8d}{improper[1]:8d}"
-                   f"{improper[2]:8d}{improper[3]:8d}")
-            if (i + 1) % 2 == 0:
-                f.write("\n")
-        if nimpropers % 2 != 0:
-            f.write("\n")
+    Looks at $GROTOP_LIBRARY, then next to this script, then on the system
+    library path.
+    """
+    here = Path(__file__).resolve().parent
+    candidates = [os.environ.get("GROTOP_LIBRARY"),
+                  str(here / "libgrotop.so"), str(here / "libgrotop.dylib"),
+                  ctypes.util.find_library("grotop")]
 
-        f.write("\n")
+    for path in candidates:
+        if not path or (os.sep in path and not Path(path).exists()):
+            continue
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        lib.grotop_api_version.restype = ctypes.c_int
+        if lib.grotop_api_version() != GROTOP_API_VERSION:
+            print(f"Warning: {path} has an incompatible API version, not using it")
+            continue
 
-        # Empty sections (required by PSF format)
-        f.write("       0 !NDON: donors\n\n")
-        f.write("       0 !NACC: acceptors\n\n")
-        f.write("       0 !NNB: non-bonded exclusions\n\n")
-        f.write("       0       0 !NGRP: groups\n\n")
+        handle = ctypes.c_void_p
+        lib.grotop_open.restype = handle
+        lib.grotop_open.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.POINTER(ctypes.c_int),
+                                    ctypes.c_char_p, ctypes.c_size_t]
+        lib.grotop_last_error.restype = ctypes.c_char_p
+        lib.grotop_last_error.argtypes = [handle]
+        lib.grotop_get_totals.restype = ctypes.c_int
+        lib.grotop_get_totals.argtypes = [handle, ctypes.POINTER(ctypes.c_longlong),
+                                          ctypes.POINTER(ctypes.c_longlong)]
+        lib.grotop_read_atom_fields.restype = ctypes.c_int
+        lib.grotop_read_atom_fields.argtypes = [handle, ctypes.c_int, ctypes.c_int] + [ctypes.c_char_p] * 4 + [
+            ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_float), ctypes.POINTER(ctypes.c_float)]
+        lib.grotop_read_connectivity.restype = ctypes.c_int
+        lib.grotop_read_connectivity.argtypes = [handle, ctypes.c_int, ctypes.c_longlong, ctypes.c_int,
+                                                 ctypes.POINTER(ctypes.c_int)]
+        lib.grotop_close.restype = None
+        lib.grotop_close.argtypes = [handle]
+        return lib
+
+    return None
+
+
+def read_system_name(filepath: Path) -> str:
+    """Last line of [ system ] in the top-level file, as parse_top_file() keeps it"""
+    name, section = "SYSTEM", None
+    with open(filepath, 'r') as f:
+        for line in f:
+            line = strip_comments(line)
+            if not line or line.startswith('#'):
+                continue
+            header = is_section_header(line)
+            if header:
+                section = header
+            elif section == 'system':
+                name = line
+    return name
+
+
+def decode_names(raw: bytes, size: int, n: int) -> List[str]:
+    """Split n NUL-padded records of size bytes into strings"""
+    return [field.rstrip(b"\0").decode() for field, in struct.iter_unpack(f"{size}s", raw[:n * size])]
+
+
+def convert_with_library(lib: ctypes.CDLL, top_path: Path, output_path: Path, verbose: bool) -> int:
+    """Parse and instantiate with libgrotop and write the PSF; 0 on success"""
+    print(f"Parsing {top_path} with libgrotop")
+
+    natoms = ctypes.c_int(0)
+    error = ctypes.create_string_buffer(256)
+    handle = lib.grotop_open(str(top_path).encode(), 1 if verbose else -1,
+                             ctypes.byref(natoms), error, len(error))
+    if not handle:
+        print(f"ERROR: {error.value.decode()}")
+        return 1
+
+    try:
+        total_atoms = ctypes.c_longlong(0)
+        counts = (ctypes.c_longlong * len(PSF_SECTIONS))()
+        lib.grotop_get_totals(handle, ctypes.byref(total_atoms), counts)
+
+        print(f"\nInstantiated system:")
+        print(f"  {total_atoms.value:8d} atoms")
+        for (title, _, _), count in zip(PSF_SECTIONS, counts):
+            print(f"  {count:8d} {title.split(': ')[1]}")
+
+        def atom_rows():
+            names = ctypes.create_string_buffer(CHUNK_ATOMS * GROTOP_NAME_SIZE)
+            types = ctypes.create_string_buffer(CHUNK_ATOMS * GROTOP_NAME_SIZE)
+            resnames = ctypes.create_string_buffer(CHUNK_ATOMS * GROTOP_RESNAME_SIZE)
+            segids = ctypes.create_string_buffer(CHUNK_ATOMS * GROTOP_RESNAME_SIZE)
+            resids = (ctypes.c_int * CHUNK_ATOMS)()
+            charges = (ctypes.c_float * CHUNK_ATOMS)()
+            masses = (ctypes.c_float * CHUNK_ATOMS)()
+
+            first = 0
+            while first < total_atoms.value:
+                n = lib.grotop_read_atom_fields(handle, first, CHUNK_ATOMS, names, types, resnames,
+                                                segids, resids, charges, masses)
+                if n <= 0:
+                    raise RuntimeError(lib.grotop_last_error(handle).decode() or "Failed to read atoms")
+                yield from zip(range(first + 1, first + n + 1),
+                               decode_names(segids.raw, GROTOP_RESNAME_SIZE, n), resids[:n],
+                               decode_names(resnames.raw, GROTOP_RESNAME_SIZE, n),
+                               decode_names(names.raw, GROTOP_NAME_SIZE, n),
+                               decode_names(types.raw, GROTOP_NAME_SIZE, n), charges[:n], masses[:n])
+                first += n
+
+        def chunks(kind, width):
+            buffer = (ctypes.c_int * (CHUNK_ITEMS * width))()
+            first = 0
+            while first < counts[kind]:
+                n = lib.grotop_read_connectivity(handle, kind, first, CHUNK_ITEMS, buffer)
+                if n <= 0:
+                    raise RuntimeError(lib.grotop_last_error(handle).decode() or "Failed to read connectivity")
+                yield buffer[:n * width]
+                first += n
+
+        sections = [(counts[kind], chunks(kind, width)) for kind, (_, width, _) in enumerate(PSF_SECTIONS)]
+        write_psf_stream(output_path, read_system_name(top_path), total_atoms.value, atom_rows(), sections)
+    except RuntimeError as e:
+        print(f"ERROR: {e}")
+        return 1
+    finally:
+        lib.grotop_close(handle)
+
+    print("\nConversion complete!")
+    return 0
 
 
 def print_topology_summary(topology: Topology) -> None:
@@ -781,8 +904,9 @@ Notes:
   The .top file typically includes .itp files automatically via #include
   directives. Additional .itp files can be specified with -p if needed.
 
-  This tool is designed with modularity for future VMD molfile plugin
-  development in C.
+  When libgrotop is available (make libgrotop, or $GROTOP_LIBRARY), the
+  C reader parses the topology; -p, -f and --pure-python use the Python
+  parser instead.
         """
     )
 
@@ -796,9 +920,17 @@ Notes:
                        help='Output PSF file')
     parser.add_argument('-v', '--verbose', action='store_true',
                        help='Verbose output')
+    parser.add_argument('--pure-python', action='store_true',
+                       help='Do not use libgrotop even if it is available')
 
     args = parser.parse_args()
 
+    # The C reader resolves includes itself; extra files need the Python parser
+    if not (args.pure_python or args.itp or args.forcefield):
+        lib = load_libgrotop()
+        if lib:
+            return convert_with_library(lib, Path(args.top), Path(args.output), args.verbose)
+
     # Create topology object
     topology = Topology()
 
@@ -0,0 +1,150 @@
+/*
+ * Stable C API of the GROMACS topology reader (libgrotop)
+ *
+ * The same parser as the VMD plugin, for programs that are not VMD: open a
+ * topology, ask for its totals, copy atoms and connectivity into buffers
+ * the caller allocated, close it. Only plain C types cross this interface,
+ * so it can be called through ctypes or any other FFI; gromacs_to_psf.py
+ * uses it when libgrotop is found.
+ *
+ * Atom and connectivity indices are 0-based on input (first) and the
+ * connectivity written is 1-based global atom indices, as in a PSF file.
+ * A handle is used by one thread at a time; separate handles are
+ * independent. Build with `make libgrotop`.
+ */
+
+#ifndef GROTOP_H
+#define GROTOP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped when a declaration below changes incompatibly */
+#define GROTOP_API_VERSION 1
+
+/* Connectivity kinds for grotop_read_connectivity() */
+enum {
+  GROTOP_BONDS,
+  GROTOP_ANGLES,
+  GROTOP_DIHEDRALS,
+  GROTOP_IMPROPERS
+};
+#define GROTOP_NUM_KINDS 4
+
+/* Bytes per record of the string columns of grotop_read_atom_fields() */
+#define GROTOP_NAME_SIZE    16   /* Atom name and type */
+#define GROTOP_RESNAME_SIZE 8    /* Residue name and segment ID */
+
+/* GROTOP_API_VERSION of the library that was loaded */
+int grotop_api_version(void);
+
+/*
+ * Open a .top (or a compiled .tpb) topology. verbosity is -1 for silent up
+ * to 2 for a trace of every file; the reason for a failure is copied to
+ * error (if not NULL). Returns NULL on failure.
+ */
+void *grotop_open(const char *filepath, int verbosity, int *natoms, char *error, size_t error_size);
+
+/*
+ * Keep parsed include files in memory for the rest of the process and
+ * share them with every topology opened afterwards, on any thread, as
+ * GROTOP_CACHE_DIR does on disk. Returns the previous setting.
+ */
+int grotop_share_include_cache(int enable);
+
+/* Entries and bytes held by the shared include cache */
+void grotop_shared_cache_usage(long long *entries, long long *bytes);
+
+/* Drop the shared include cache; no topology may be opening meanwhile */
+void grotop_clear_shared_cache(void);
+
+/* Error that made the last call on a handle fail, "" if none */
+const char *grotop_last_error(void *handle);
+
+/* Number of atoms and of each connectivity kind (counts[GROTOP_NUM_KINDS]) */
+int grotop_get_totals(void *handle, long long *natoms, long long *counts);
+
+/*
+ * Copy up to max atoms starting at atom index first, one column per field.
+ * names and types take GROTOP_NAME_SIZE bytes per atom, resnames and
+ * segids GROTOP_RESNAME_SIZE, all NUL-padded; any column may be NULL.
+ * Returns the number of atoms written, 0 past the end, -1 on failure.
+ */
+int grotop_read_atom_fields(void *handle, int first, int max, char *names, char *types,
+                            char *resnames, char *segids, int *resids, float *charges,
+                            float *masses);
+
+/* Atom indices per item of a connectivity kind, 0 if unknown */
+int grotop_connectivity_width(int kind);
+
+/*
+ * Copy up to max items of a kind starting at item index first into out
+ * (width ints per item). Returns the number of items written, 0 past the
+ * end, -1 for an unknown kind or connectivity that cannot be parsed.
+ */
+int grotop_read_connectivity(void *handle, int kind, long long first, int max, int *out);
+
+/*
+ * Every instantiated connectivity array of a handle, 1-based global atom
+ * indices as from grotop_read_connectivity(); arrays of kinds with no items
+ * are NULL. All of them live in one slab, owned by the handle for a
+ * borrowed view and by the caller once taken.
+ */
+typedef struct {
+  long long counts[GROTOP_NUM_KINDS];
+  int *bond_from;            /* counts[GROTOP_BONDS] each */
+  int *bond_to;
+  int *angles;               /* 3 ints per angle */
+  int *dihedrals;            /* 4 ints per dihedral */
+  int *impropers;            /* 4 ints per improper */
+  void *slab;                /* Owned slab, NULL in a borrowed view */
+  size_t slab_bytes;
+  int slab_mapped;
+} grotop_connectivity_t;
+
+/*
+ * Fill the handle's connectivity and point view at it without copying.
+ * The view is valid until the handle is reloaded, closed or taken from.
+ * Returns 0 on success, -1 on failure.
+ */
+int grotop_borrow_connectivity(void *handle, grotop_connectivity_t *view);
+
+/*
+ * As grotop_borrow_connectivity(), but the slab passes to the caller, who
+ * releases it with grotop_free_connectivity(); the handle builds a new one
+ * if its connectivity is read again.
+ */
+int grotop_take_connectivity(void *handle, grotop_connectivity_t *conn);
+
+/* Release connectivity taken from a handle; a borrowed view is only cleared */
+void grotop_free_connectivity(grotop_connectivity_t *conn);
+
+/* Number of bonded fragments (molecules joined by bonds), -1 on failure */
+long long grotop_fragment_count(void *handle);
+
+/*
+ * Copy the 0-based fragment of up to max atoms starting at atom index first.
+ * Fragments are numbered in order of their first atom. Returns the number
+ * of atoms written, 0 past the end, -1 on failure.
+ */
+int grotop_read_fragments(void *handle, int first, int max, int *out);
+
+/*
+ * Bond graph of up to max atoms starting at atom index first, as CSR rows:
+ * start gets n + 1 offsets into the neighbor list of the whole system and
+ * neighbors (if not NULL) the start[n] - start[0] 0-based atom indices
+ * bonded to those atoms. Returns n, 0 past the end, -1 on failure.
+ */
+int grotop_read_bond_graph(void *handle, int first, int max, long long *start, int *neighbors);
+
+/* Release a handle and everything read from it */
+void grotop_close(void *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GROTOP_H */
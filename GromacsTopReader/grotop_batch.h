@@ -0,0 +1,253 @@
+/*
+ * Batch mode of the converters
+ *
+ * A manifest lists one conversion per line as whitespace-separated fields
+ * (the input topology first, then what the converter needs); blank lines
+ * and lines starting with '#' or ';' are skipped. The jobs run on a pool
+ * of worker threads, one per online CPU unless -j says otherwise, and all
+ * of them share the in-memory include cache of the reader, so a force
+ * field included by every system is parsed once per campaign rather than
+ * once per system. Per-job timings and the overall throughput are printed
+ * when every job has finished.
+ *
+ * Include after grotopplugin.c.
+ */
+
+#ifndef GROTOP_BATCH_H
+#define GROTOP_BATCH_H
+
+#define BATCH_MAX_FIELDS 4
+
+typedef struct {
+  char *fields[BATCH_MAX_FIELDS];
+  int nfields;
+  int line;                  /* Line of the manifest */
+  int ok;
+  long long natoms;          /* Atoms converted, see batch_record() */
+  long long cache_hits;      /* Includes replayed from the cache */
+  long long cache_misses;    /* Includes parsed */
+  double seconds;
+  char error[GROTOP_ERROR_LENGTH];  /* Reason for a failure, set by the converter */
+} batch_job_t;
+
+/* Convert one job; returns non-zero on success */
+typedef int (*batch_convert_t)(batch_job_t *job, void *options);
+
+typedef struct {
+  batch_job_t *jobs;
+  int njobs;
+  int next;                  /* Next job to hand out */
+  batch_convert_t convert;
+  void *options;
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif
+} batch_queue_t;
+
+/* Worker threads for -j 0: one per online CPU */
+static int batch_default_threads(void) {
+  int n = 1;
+#ifndef _WIN32
+  n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1) n = 1;
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  return n;
+}
+
+/*
+ * Read the manifest into text and split it into jobs of min_fields to
+ * BATCH_MAX_FIELDS fields, pointing into text. Returns the number of
+ * jobs, -1 on failure.
+ */
+static int batch_read_manifest(const char *path, int min_fields, char **text, batch_job_t **jobs) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "ERROR: Failed to open manifest %s\n", path);
+    return -1;
+  }
+
+  size_t len = 0, allocated = 65536;
+  char *buf = (char *)malloc(allocated);
+  size_t n;
+  while (buf && (n = fread(buf + len, 1, allocated - len - 1, fp)) > 0) {
+    len += n;
+    if (allocated - len - 1 == 0) {
+      char *grown = (char *)realloc(buf, allocated * 2);
+      if (!grown) {
+        free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = grown;
+      allocated *= 2;
+    }
+  }
+  fclose(fp);
+  if (!buf) {
+    fprintf(stderr, "ERROR: Out of memory reading manifest %s\n", path);
+    return -1;
+  }
+  buf[len] = '\0';
+
+  int lines = 1;
+  for (size_t i = 0; i < len; i++) lines += buf[i] == '\n';
+  batch_job_t *list = (batch_job_t *)calloc(lines, sizeof(batch_job_t));
+  if (!list) {
+    free(buf);
+    fprintf(stderr, "ERROR: Out of memory reading manifest %s\n", path);
+    return -1;
+  }
+
+  int njobs = 0, line = 0;
+  for (char *p = buf; *p; ) {
+    char *end = strchr(p, '\n');
+    if (end) *end = '\0';
+    line++;
+
+    batch_job_t *job = &list[njobs];
+    job->line = line;
+    for (char *tok = strtok(p, " \t\r"); tok; tok = strtok(NULL, " \t\r")) {
+      if (job->nfields == 0 && (tok[0] == '#' || tok[0] == ';')) break;
+      if (job->nfields == BATCH_MAX_FIELDS) {
+        job->nfields++;
+        break;
+      }
+      job->fields[job->nfields++] = tok;
+    }
+
+    if (job->nfields > 0 && (job->nfields < min_fields || job->nfields > BATCH_MAX_FIELDS)) {
+      fprintf(stderr, "ERROR: %s:%d: expected %d to %d fields\n", path, line, min_fields, BATCH_MAX_FIELDS);
+      free(list);
+      free(buf);
+      return -1;
+    }
+    if (job->nfields > 0) njobs++;
+    else memset(job, 0, sizeof(*job));
+
+    if (!end) break;
+    p = end + 1;
+  }
+
+  *text = buf;
+  *jobs = list;
+  return njobs;
+}
+
+/* Called by a converter on its open handle: atoms and include cache use of the job */
+static void batch_record(batch_job_t *job, void *handle) {
+  grotop_stats_t stats;
+  grotop_get_totals(handle, &job->natoms, NULL);
+  grotop_get_stats(handle, &stats);
+  job->cache_hits = stats.cache_hits;
+  job->cache_misses = stats.cache_misses;
+}
+
+static void *batch_worker(void *arg) {
+  batch_queue_t *queue = (batch_queue_t *)arg;
+
+  for (;;) {
+#ifndef _WIN32
+    pthread_mutex_lock(&queue->lock);
+#endif
+    int idx = queue->next++;
+#ifndef _WIN32
+    pthread_mutex_unlock(&queue->lock);
+#endif
+    if (idx >= queue->njobs) break;
+
+    batch_job_t *job = &queue->jobs[idx];
+    double start = wall_seconds();
+    job->ok = queue->convert(job, queue->options);
+    job->seconds = wall_seconds() - start;
+    if (!job->ok && !job->error[0]) snprintf(job->error, sizeof(job->error), "Conversion failed");
+  }
+
+  return NULL;
+}
+
+/*
+ * Run every job of a manifest on nthreads workers (0 for one per CPU) and
+ * print the report. Returns 0 if every job succeeded.
+ */
+static int batch_run(const char *manifest, int nthreads, int min_fields,
+                     batch_convert_t convert, void *options) {
+  char *text = NULL;
+  batch_job_t *jobs = NULL;
+  int njobs = batch_read_manifest(manifest, min_fields, &text, &jobs);
+  if (njobs < 0) return 1;
+
+  if (nthreads <= 0) nthreads = batch_default_threads();
+  if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+  if (nthreads > njobs) nthreads = njobs > 0 ? njobs : 1;
+
+  printf("=======================================================\n");
+  printf("Batch: %d jobs from %s on %d threads\n", njobs, manifest, nthreads);
+  printf("=======================================================\n");
+
+  int previous = grotop_share_include_cache(1);
+
+  batch_queue_t queue;
+  queue.jobs = jobs;
+  queue.njobs = njobs;
+  queue.next = 0;
+  queue.convert = convert;
+  queue.options = options;
+
+  double start = wall_seconds();
+#ifndef _WIN32
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS];
+
+  /* Worker 0 is the calling thread; workers that fail to start are not needed */
+  for (int t = 1; t < nthreads; t++) {
+    started[t] = pthread_create(&threads[t], NULL, batch_worker, &queue) == 0;
+  }
+  batch_worker(&queue);
+  for (int t = 1; t < nthreads; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+  }
+  pthread_mutex_destroy(&queue.lock);
+#else
+  batch_worker(&queue);
+#endif
+  double elapsed = wall_seconds() - start;
+
+  long long entries = 0, bytes = 0;
+  grotop_shared_cache_usage(&entries, &bytes);
+  grotop_share_include_cache(previous);
+  grotop_clear_shared_cache();
+
+  printf("%5s %10s %12s  %-6s %s\n", "Line", "Seconds", "Atoms", "Status", "Topology");
+  int failed = 0;
+  long long atoms = 0, hits = 0, misses = 0;
+  double busy = 0.0;
+  for (int i = 0; i < njobs; i++) {
+    const batch_job_t *job = &jobs[i];
+    printf("%5d %10.3f %12lld  %-6s %s\n", job->line, job->seconds, job->natoms,
+           job->ok ? "OK" : "FAILED", job->fields[0]);
+    if (!job->ok) printf("%5s %s\n", "", job->error);
+    failed += !job->ok;
+    if (job->ok) atoms += job->natoms;
+    hits += job->cache_hits;
+    misses += job->cache_misses;
+    busy += job->seconds;
+  }
+
+  printf("=======================================================\n");
+  printf("Jobs:        %d converted, %d failed\n", njobs - failed, failed);
+  printf("Wall time:   %.3f s (%.3f s of work, %.2fx)\n", elapsed, busy,
+         elapsed > 0.0 ? busy / elapsed : 0.0);
+  printf("Throughput:  %.2f jobs/s, %.0f atoms/s\n", elapsed > 0.0 ? (njobs - failed) / elapsed : 0.0,
+         elapsed > 0.0 ? atoms / elapsed : 0.0);
+  printf("Includes:    %lld parsed, %lld from the cache (%lld entries, %lld bytes shared)\n",
+         misses, hits, entries, bytes);
+  printf("=======================================================\n");
+
+  free(jobs);
+  free(text);
+  return failed ? 1 : 0;
+}
+
+#endif /* GROTOP_BATCH_H */
@@ -0,0 +1,492 @@
+/*
+ * Write-behind output of the converters
+ *
+ * The streaming writers format into OUTPUT_BUFFERS page-aligned buffers of
+ * OUTPUT_BUFFER_SIZE bytes. A full buffer is handed to a writer thread and
+ * the caller goes on pulling and formatting the next chunk from the
+ * reader, so instantiation overlaps with output to a slow filesystem and
+ * the file is written in large writes at buffer-aligned offsets. The
+ * caller only waits when every buffer is queued.
+ *
+ * The writer thread uses pwrite() by default, or write() to a pipe or a
+ * device. Built with GROTOP_IO_URING (make IO_URING=1, Linux), it submits
+ * the queued buffers of a regular file to an io_uring instead, with all of
+ * them in flight at once; it falls back to pwrite() if the ring cannot be
+ * set up. GROTOP_WRITE_BEHIND=0 writes each buffer on the calling thread.
+ *
+ * Include after grotopplugin.c.
+ */
+
+#ifndef GROTOP_OUTPUT_H
+#define GROTOP_OUTPUT_H
+
+#include <stdint.h>
+
+#ifdef GROTOP_IO_URING
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#define OUTPUT_BUFFERS 4
+#define OUTPUT_BUFFER_SIZE (4 << 20)
+#define OUTPUT_ALIGN 4096
+#define OUTPUT_LINE 512          /* Scratch for a line that straddles two buffers */
+
+enum {
+  OUTPUT_FREE,                   /* Being filled by the caller, or unused */
+  OUTPUT_QUEUED,                 /* Full, waiting for the writer */
+  OUTPUT_WRITING                 /* Handed to the kernel */
+};
+
+typedef struct {
+  char *data;
+  size_t len;
+  long long offset;              /* File offset of data[0] */
+  int state;
+} output_buffer_t;
+
+typedef struct {
+  long long bytes;
+  long long writes;              /* Buffers written */
+  double stall_seconds;          /* Caller waiting for a free buffer */
+  const char *backend;           /* "io_uring", "pwrite", "write" or "synchronous" */
+} output_stats_t;
+
+#ifdef GROTOP_IO_URING
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} output_ring_t;
+#endif
+
+typedef struct {
+#ifndef _WIN32
+  int fd;
+  int seekable;                  /* Regular file: pwrite() at the buffer's offset */
+#else
+  FILE *fp;
+#endif
+  output_buffer_t buffers[OUTPUT_BUFFERS];
+  int current;                   /* Buffer being filled */
+  int next_write;                /* Oldest buffer the writer has not taken */
+  long long offset;              /* File offset of the current buffer */
+  int error;                     /* errno of the first failure, 0 if none */
+  int threaded;
+  int stop;                      /* Caller is closing; write what is queued and exit */
+  output_stats_t stats;
+  char line[OUTPUT_LINE];
+#ifndef _WIN32
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+#ifdef GROTOP_IO_URING
+  output_ring_t ring;
+  int uring;
+#endif
+} output_t;
+
+/* Write one buffer through the blocking path; 0 or an errno */
+static int output_write_buffer(output_t *out, const output_buffer_t *b, size_t done) {
+#ifndef _WIN32
+  while (done < b->len) {
+    ssize_t n = out->seekable ? pwrite(out->fd, b->data + done, b->len - done, (off_t)(b->offset + done))
+                              : write(out->fd, b->data + done, b->len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return n < 0 ? errno : EIO;
+    done += (size_t)n;
+  }
+#else
+  if (fwrite(b->data + done, 1, b->len - done, out->fp) != b->len - done) return EIO;
+#endif
+  return 0;
+}
+
+/*
+ * io_uring backend
+ *
+ * Set up with the raw system calls, so no library is needed: one ring of
+ * OUTPUT_BUFFERS entries, a write per queued buffer, and pwrite() for
+ * whatever a completion leaves unwritten.
+ */
+
+#ifdef GROTOP_IO_URING
+static void ring_close(output_ring_t *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+static int ring_open(output_ring_t *ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) return 0;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_SQ_RING);
+  void *cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  ring->sq_ring = sq == MAP_FAILED ? NULL : sq;
+  ring->cq_ring = cq == MAP_FAILED ? NULL : cq;
+  ring->sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe *)sqes;
+  if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+    ring_close(ring);
+    return 0;
+  }
+
+  char *s = (char *)ring->sq_ring, *c = (char *)ring->cq_ring;
+  ring->sq_head = (unsigned *)(s + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(s + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(s + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(s + p.sq_off.array);
+  ring->cq_head = (unsigned *)(c + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(c + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(c + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(c + p.cq_off.cqes);
+  return 1;
+}
+
+/* Queue a write of buffer idx; submitted by the next ring_enter() */
+static void ring_queue_write(output_ring_t *ring, int fd, const output_buffer_t *b, int idx) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long long)(uintptr_t)b->data;
+  sqe->len = (unsigned)b->len;
+  sqe->off = (unsigned long long)b->offset;
+  sqe->user_data = (unsigned long long)idx;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Queued entries the kernel has not consumed yet */
+static unsigned ring_pending(const output_ring_t *ring) {
+  return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int ring_enter(output_ring_t *ring, unsigned submit, unsigned wait) {
+  for (;;) {
+    long rc = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                      NULL, 0);
+    if (rc >= 0 || errno != EINTR) return rc < 0 ? errno : 0;
+  }
+}
+#endif
+
+/*
+ * Writer Thread
+ */
+
+#ifndef _WIN32
+/* Take the queued buffers in file order; called with the lock held */
+static int output_take_queued(output_t *out, int *taken) {
+  int n = 0;
+  while (out->buffers[out->next_write].state == OUTPUT_QUEUED && n < OUTPUT_BUFFERS) {
+    out->buffers[out->next_write].state = OUTPUT_WRITING;
+    taken[n++] = out->next_write;
+    out->next_write = (out->next_write + 1) % OUTPUT_BUFFERS;
+  }
+  return n;
+}
+
+static void output_release(output_t *out, int idx, int error) {
+  pthread_mutex_lock(&out->lock);
+  if (error && !out->error) out->error = error;
+  out->stats.bytes += (long long)out->buffers[idx].len;
+  out->stats.writes++;
+  out->buffers[idx].len = 0;
+  out->buffers[idx].state = OUTPUT_FREE;
+  pthread_cond_broadcast(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+}
+
+#ifdef GROTOP_IO_URING
+/* Release the buffers of every completion posted so far; returns how many */
+static int output_reap(output_t *out) {
+  int reaped = 0;
+  unsigned head = *out->ring.cq_head;
+  unsigned tail = __atomic_load_n(out->ring.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++, reaped++) {
+    const struct io_uring_cqe *cqe = &out->ring.cqes[head & *out->ring.cq_mask];
+    int idx = (int)cqe->user_data;
+    size_t written = cqe->res > 0 ? (size_t)cqe->res : 0;
+    /* Short or failed writes (old kernels without IORING_OP_WRITE) are retried with pwrite */
+    int error = written < out->buffers[idx].len ? output_write_buffer(out, &out->buffers[idx], written) : 0;
+    output_release(out, idx, error);
+  }
+  __atomic_store_n(out->ring.cq_head, head, __ATOMIC_RELEASE);
+  return reaped;
+}
+#endif
+
+static void *output_writer(void *arg) {
+  output_t *out = (output_t *)arg;
+  int taken[OUTPUT_BUFFERS];
+  int inflight = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&out->lock);
+    while (!inflight && out->buffers[out->next_write].state != OUTPUT_QUEUED && !out->stop)
+      pthread_cond_wait(&out->cond, &out->lock);
+    int n = output_take_queued(out, taken);
+    int done = !n && !inflight && out->stop;
+    pthread_mutex_unlock(&out->lock);
+    if (done) break;
+
+#ifdef GROTOP_IO_URING
+    if (out->uring) {
+      for (int i = 0; i < n; i++) ring_queue_write(&out->ring, out->fd, &out->buffers[taken[i]], taken[i]);
+      inflight += n;
+      /* Everything not consumed yet, including what a short submission left behind */
+      int error = ring_enter(&out->ring, ring_pending(&out->ring), 1);
+      if (error) {
+        /*
+         * The ring is unusable. Take back what the kernel did not consume,
+         * and let the writes it did finish before their buffers are
+         * touched again; whatever is still being written then was never
+         * submitted and is written the blocking way.
+         */
+        unsigned unsent = ring_pending(&out->ring);
+        __atomic_store_n(out->ring.sq_tail, *out->ring.sq_tail - unsent, __ATOMIC_RELEASE);
+        inflight -= (int)unsent;
+        while (inflight > 0) {
+          int reaped = output_reap(out);
+          inflight -= reaped;
+          if (!reaped && ring_enter(&out->ring, 0, 1) != 0) sched_yield();
+        }
+        for (int i = 0; i < OUTPUT_BUFFERS; i++) {
+          if (out->buffers[i].state == OUTPUT_WRITING) output_release(out, i, output_write_buffer(out, &out->buffers[i], 0));
+        }
+        ring_close(&out->ring);
+        out->uring = 0;
+        out->stats.backend = "pwrite";
+        continue;
+      }
+
+      inflight -= output_reap(out);
+      continue;
+    }
+#endif
+
+    for (int i = 0; i < n; i++) output_release(out, taken[i], output_write_buffer(out, &out->buffers[taken[i]], 0));
+  }
+
+  return NULL;
+}
+#endif
+
+/*
+ * Output Stream
+ */
+
+static void output_free_buffers(output_t *out) {
+  for (int i = 0; i < OUTPUT_BUFFERS; i++) {
+#ifndef _WIN32
+    free(out->buffers[i].data);
+#else
+    _aligned_free(out->buffers[i].data);
+#endif
+  }
+}
+
+/* Create or truncate path; NULL on failure with errno set */
+static output_t *output_open(const char *path) {
+  output_t *out = (output_t *)calloc(1, sizeof(output_t));
+  if (!out) return NULL;
+
+  for (int i = 0; i < OUTPUT_BUFFERS; i++) {
+#ifndef _WIN32
+    void *p = NULL;
+    if (posix_memalign(&p, OUTPUT_ALIGN, OUTPUT_BUFFER_SIZE) != 0) p = NULL;
+#else
+    void *p = _aligned_malloc(OUTPUT_BUFFER_SIZE, OUTPUT_ALIGN);
+#endif
+    out->buffers[i].data = (char *)p;
+    if (!p) {
+      output_free_buffers(out);
+      free(out);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+#ifndef _WIN32
+  out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out->fd < 0) {
+#else
+  out->fp = fopen(path, "wb");
+  if (!out->fp) {
+#endif
+    int error = errno;
+    output_free_buffers(out);
+    free(out);
+    errno = error;
+    return NULL;
+  }
+#ifndef _WIN32
+  struct stat st;
+  out->seekable = fstat(out->fd, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+
+  out->stats.backend = "synchronous";
+#ifndef _WIN32
+  const char *env = getenv("GROTOP_WRITE_BEHIND");
+  if (!env || atoi(env) != 0) {
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->cond, NULL);
+#ifdef GROTOP_IO_URING
+    /* Buffers are written in file order either way, but io_uring needs offsets */
+    out->uring = out->seekable && ring_open(&out->ring, OUTPUT_BUFFERS);
+#endif
+    out->threaded = pthread_create(&out->writer, NULL, output_writer, out) == 0;
+    if (out->threaded) {
+      out->stats.backend = out->seekable ? "pwrite" : "write";
+#ifdef GROTOP_IO_URING
+      if (out->uring) out->stats.backend = "io_uring";
+#endif
+    } else {
+#ifdef GROTOP_IO_URING
+      if (out->uring) ring_close(&out->ring);
+      out->uring = 0;
+#endif
+      pthread_mutex_destroy(&out->lock);
+      pthread_cond_destroy(&out->cond);
+    }
+  }
+#endif
+  return out;
+}
+
+/* Hand the current buffer to the writer and move on to the next one */
+static void output_submit(output_t *out) {
+  output_buffer_t *b = &out->buffers[out->current];
+  if (b->len == 0) return;
+  b->offset = out->offset;
+  out->offset += (long long)b->len;
+
+#ifndef _WIN32
+  if (out->threaded) {
+    pthread_mutex_lock(&out->lock);
+    b->state = OUTPUT_QUEUED;
+    pthread_cond_broadcast(&out->cond);
+    out->current = (out->current + 1) % OUTPUT_BUFFERS;
+    if (out->buffers[out->current].state != OUTPUT_FREE) {
+      double start = wall_seconds();
+      while (out->buffers[out->current].state != OUTPUT_FREE) pthread_cond_wait(&out->cond, &out->lock);
+      out->stats.stall_seconds += wall_seconds() - start;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return;
+  }
+#endif
+
+  int error = output_write_buffer(out, b, 0);
+  if (error && !out->error) out->error = error;
+  out->stats.bytes += (long long)b->len;
+  out->stats.writes++;
+  b->len = 0;
+}
+
+static void output_write(output_t *out, const char *text, size_t len) {
+  while (len > 0) {
+    output_buffer_t *b = &out->buffers[out->current];
+    size_t n = OUTPUT_BUFFER_SIZE - b->len;
+    if (n > len) n = len;
+    memcpy(b->data + b->len, text, n);
+    b->len += n;
+    text += n;
+    len -= n;
+    if (b->len == OUTPUT_BUFFER_SIZE) output_submit(out);
+  }
+}
+
+static void output_putc(output_t *out, char c) {
+  output_buffer_t *b = &out->buffers[out->current];
+  b->data[b->len++] = c;
+  if (b->len == OUTPUT_BUFFER_SIZE) output_submit(out);
+}
+
+/* printf into the stream; a full buffer is never left unsubmitted */
+static void output_printf(output_t *out, const char *fmt, ...) {
+  output_buffer_t *b = &out->buffers[out->current];
+  size_t room = OUTPUT_BUFFER_SIZE - b->len;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(b->data + b->len, room, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    if (!out->error) out->error = EINVAL;
+    return;
+  }
+  if ((size_t)n < room) {
+    b->len += (size_t)n;
+    return;
+  }
+
+  /* Straddles the end of the buffer: format it whole, then split it */
+  char *text = (size_t)n < sizeof(out->line) ? out->line : (char *)malloc((size_t)n + 1);
+  if (!text) {
+    if (!out->error) out->error = ENOMEM;
+    return;
+  }
+  va_start(ap, fmt);
+  vsnprintf(text, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  output_write(out, text, (size_t)n);
+  if (text != out->line) free(text);
+}
+
+/*
+ * Write what is left, wait for the writer and close the file; the stream
+ * is freed either way. Returns 0, or -1 with errno set if any write failed.
+ */
+static int output_close(output_t *out, output_stats_t *stats) {
+  output_submit(out);
+
+#ifndef _WIN32
+  if (out->threaded) {
+    pthread_mutex_lock(&out->lock);
+    out->stop = 1;
+    pthread_cond_broadcast(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+    pthread_join(out->writer, NULL);
+    pthread_mutex_destroy(&out->lock);
+    pthread_cond_destroy(&out->cond);
+  }
+#ifdef GROTOP_IO_URING
+  if (out->uring) ring_close(&out->ring);
+#endif
+  if (close(out->fd) != 0 && !out->error) out->error = errno;
+#else
+  if (fclose(out->fp) != 0 && !out->error) out->error = errno;
+#endif
+
+  int error = out->error;
+  if (stats) *stats = out->stats;
+  output_free_buffers(out);
+  free(out);
+  if (!error) return 0;
+  errno = error;
+  return -1;
+}
+
+#endif /* GROTOP_OUTPUT_H */
@@ -30,41 +30,150 @@
  * - Supports both MARTINI v3 format (name mass charge ...)
  *   and GROMACS standard format (name bond_type atomic_num mass ...)
  * - These forcefield .itp files could be shipped with VMD for convenience
+ *
+ * Library:
+ * - Built on its own as libgrotop (make libgrotop), the reader exposes the
+ *   flat C API declared in grotop.h, used by gromacs_to_psf.py via ctypes
+ *
+ * Compiled topologies:
+ * - A resolved topology can be saved as a binary .tpb snapshot (see
+ *   test_grotop_to_tpb), which the "grotpb" reader maps without parsing
+ *
+ * Diagnostics:
+ * - Quiet by default; GROTOP_VERBOSE=1 prints a summary per topology and
+ *   GROTOP_VERBOSE=2 traces every file, section and directive, while
+ *   GROTOP_VERBOSE=-1 silences errors too
+ * - grotop_get_stats() returns phase timings and parser counters, and
+ *   grotop_last_error() the reason a call on a handle failed
+ * - grotop_get_memory() returns the bytes a handle holds per category
+ *   (templates, connectivity, string pool, preprocessor, ...) with their
+ *   high-water marks; the test programs print them with --memory
+ *
+ * Deferred connectivity:
+ * - Opening a topology parses atoms and [ molecules ] only; bonds, angles
+ *   and dihedrals are counted and their lines located, then parsed when
+ *   first read. Files edited in between make that read fail until the
+ *   handle is brought up to date with grotop_reload()
+ *
+ * Bond graph:
+ * - grotop_read_bond_graph() and grotop_read_fragments() return CSR
+ *   adjacency and bonded fragments of any atom range, offset from a graph
+ *   built once per moltype rather than from the system's bond list
+ *
+ * Connectivity:
+ * - Bonds, angles, dihedrals and impropers share one page-aligned slab;
+ *   grotop_borrow_connectivity() returns views of it and
+ *   grotop_take_connectivity() hands it to the caller, so a converter can
+ *   release it once its writer holds a copy
+ *
+ * Reloading:
+ * - grotop_reload() brings an open handle up to date after its files were
+ *   edited, parsing only the includes that changed and keeping identical
+ *   moltypes and the connectivity of unchanged [ molecules ] entries
+ *
+ * Thread safety:
+ * - All parser state lives in the handle, so separate handles can be
+ *   opened and read concurrently; one handle is used by one thread at a time
+ * - grotop_open() takes the verbosity per handle and returns the reason for
+ *   a failed open; the environment is read but never modified
+ *
+ * Batch conversion:
+ * - grotop_share_include_cache() keeps parsed includes in memory for the
+ *   whole process, so every topology opened afterwards (on any thread)
+ *   replays the force field it shares with earlier ones; the converters
+ *   use it in their --batch mode
+ *
+ * Environment:
+ * - GROTOP_CACHE_DIR: directory for a persistent cache of parsed include
+ *   files, reused while the files and the active #defines are unchanged
+ * - GROTOP_THREADS: number of threads used to parse the includes of the
+ *   top-level file and to instantiate atoms and connectivity (default 1,
+ *   0 for one per online CPU)
+ * - GROTOP_INCLUDE_MOLECULES, GROTOP_EXCLUDE_MOLECULES: comma- or
+ *   space-separated moltype names; only [ molecules ] entries of included
+ *   (and not excluded) moltypes are instantiated, see grotop_select_molecules()
+ * - GROTOP_HUGE_PAGES=1: ask for transparent huge pages for the slab that
+ *   holds the instantiated connectivity (Linux)
+ *
+ * Compressed input:
+ * - Built with GROTOP_ZLIB and/or GROTOP_ZSTD (make ZLIB=1 ZSTD=1), gzip
+ *   and zstd files are inflated as they are read, whatever their name;
+ *   an #include of foo.itp opens foo.itp.gz or foo.itp.zst when only that
+ *   file exists
  */
 
 #include "molfile_plugin.h"
+#include "grotop.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#endif
+
+#ifdef GROTOP_ZLIB
+#include <zlib.h>
+#endif
+#ifdef GROTOP_ZSTD
+#include <zstd.h>
+#endif
 
 #define GROTOP_RECORD_LENGTH 512
 #define MAX_INCLUDES 100
-#define MAX_MOLTYPES 500      /* Increased for large force fields like Martini */
-#define MAX_MOLECULES 1000
-#define MAX_ATOMTYPES 1000    /* Increased for large force fields */
-#define MAX_DEFINES 100       /* Maximum number of #define symbols */
 #define MAX_IFDEF_DEPTH 20    /* Maximum nesting depth for #ifdef */
+#define ARENA_BLOCK_SIZE 65536
+#define INITIAL_ARRAY_SIZE 16
+#define MAX_THREADS 64
+#define GROTOP_ERROR_LENGTH 256
+#define MIN_COPIES_PER_THREAD 256  /* Smaller jobs are not worth a thread */
+
+/* Verbosity levels; errors go to stderr at LOG_QUIET and above */
+#define LOG_SILENT  -1           /* Nothing printed; errors are only recorded */
+#define LOG_QUIET   0
+#define LOG_SUMMARY 1            /* One line per topology, cache and thread use */
+#define LOG_DEBUG   2            /* Every file, section, directive and molecule */
+
+#define GROTOP_LOG(data, level, ...) \
+  do { if ((data)->verbosity >= (level)) printf(__VA_ARGS__); } while (0)
 
 /* Forward declarations */
 typedef struct moltype_t moltype_t;
-typedef struct atom_data_t atom_data_t;
 typedef struct bond_data_t bond_data_t;
 typedef struct atomtype_t atomtype_t;
+typedef struct symbol_t symbol_t;
 
-/* Atom data within a molecule type */
-struct atom_data_t {
-  int id;                    /* Atom ID within molecule (1-based) */
-  char atom_type[16];        /* Atom type */
-  int resnr;                 /* Residue number */
-  char residue[8];           /* Residue name */
-  char atom_name[16];        /* Atom name */
-  int cgnr;                  /* Charge group number */
-  float charge;              /* Partial charge */
-  float mass;                /* Atomic mass */
-};
+/*
+ * Atoms of a molecule type, one column per field. Names are indices into
+ * the string pool of the topology (its symbol table), so a template atom
+ * takes 36 bytes and the numeric columns can be scanned on their own. All
+ * columns live in one block, column k starting at k * stride elements.
+ */
+typedef struct {
+  int *id;                   /* Atom ID within molecule (1-based) */
+  int *type;                 /* Atom type name (string index) */
+  int *resnr;                /* Residue number */
+  int *residue;              /* Residue name (string index) */
+  int *name;                 /* Atom name (string index) */
+  int *cgnr;                 /* Charge group number */
+  float *charge;             /* Partial charge */
+  float *mass;               /* Atomic mass (0 if not given in [ atoms ]) */
+  int *atomtype;             /* Index into atomtypes, -1 if unresolved */
+} atom_columns_t;
+
+#define ATOM_COLUMNS 9
+#define ATOM_STRING_COLUMN(k) ((k) == 1 || (k) == 3 || (k) == 4)  /* type, residue, name */
 
 /* Bond data within a molecule type */
 struct bond_data_t {
@@ -82,6 +191,14 @@ typedef struct {
   int funct;                 /* Function type (for identifying impropers) */
 } dihedral_data_t;
 
+/* Run of connectivity lines of a moltype, parsed on first use */
+typedef struct {
+  int file;                  /* Index into the file table */
+  int section;               /* section_t of the lines */
+  long long offset;          /* Byte offset of the first line */
+  long long length;          /* Bytes up to the line that ended the run */
+} conn_span_t;
+
 /* Atom type definition */
 struct atomtype_t {
   char name[16];             /* Atom type name */
@@ -92,7 +209,7 @@ struct atomtype_t {
 struct moltype_t {
   char name[32];             /* Molecule type name */
   int nrexcl;                /* Number of exclusions */
-  atom_data_t *atoms;        /* Array of atoms */
+  atom_columns_t atoms;      /* Atoms, atoms_allocated per column */
   int natoms;                /* Number of atoms */
   int atoms_allocated;       /* Allocated size */
   bond_data_t *bonds;        /* Array of bonds */
@@ -101,37 +218,213 @@ struct moltype_t {
   angle_data_t *angles;      /* Array of angles */
   int nangles;               /* Number of angles */
   int angles_allocated;      /* Allocated size */
-  dihedral_data_t *dihedrals; /* Array of dihedrals */
-  int ndihedrals;            /* Number of dihedrals */
+  dihedral_data_t *dihedrals; /* Array of proper dihedrals */
+  int ndihedrals;            /* Number of proper dihedrals */
   int dihedrals_allocated;   /* Allocated size */
+  dihedral_data_t *impropers; /* Array of improper dihedrals (funct 2 and 4) */
+  int nimpropers;            /* Number of improper dihedrals */
+  int impropers_allocated;   /* Allocated size */
+  conn_span_t *spans;        /* Where its connectivity lines are, in file order */
+  int nspans;
+  int spans_allocated;
+  int pending;               /* Connectivity counted but not yet parsed from the spans */
+  molfile_atom_t *atom_template; /* One copy, resids relative; built on first use */
+  int *graph_start;          /* Bond graph (CSR): neighbors of atom i are */
+  int *graph_neighbors;      /*   graph_neighbors[graph_start[i] .. graph_start[i + 1]) */
+  int *fragment;             /* Bonded fragment of each atom, numbered by first atom */
+  int nfragments;            /* All three built together on first use */
+  int nresidues;             /* Residue numbers consumed by each copy */
+  int reused;                /* Identical to the moltype before grotop_reload() */
 };
 
-/* Main topology data structure */
+/* Interned name shared by molecule types, atom types and #define symbols */
+struct symbol_t {
+  const char *name;          /* NUL-terminated, owned by the string pool */
+  unsigned int hash;         /* FNV-1a hash of name */
+  int moltype;               /* Index into moltypes, -1 if none */
+  int atomtype;              /* Index into atomtypes, -1 if none */
+  int defined;               /* Non-zero if set by #define */
+};
+
+/* What memory of a handle is used for, see grotop_get_memory() */
+enum {
+  GROTOP_MEM_TEMPLATES,      /* Moltypes and atom types: atom columns, template connectivity */
+  GROTOP_MEM_CONNECTIVITY,   /* Instantiated bond, angle, dihedral and improper arrays */
+  GROTOP_MEM_STRINGS,        /* String pool: symbol table and interned names */
+  GROTOP_MEM_PREPROCESSOR,   /* Defines, include jobs and their results */
+  GROTOP_MEM_SYSTEM,         /* [ molecules ], instance ranges and the molecule filter */
+  GROTOP_MEM_INPUT,          /* File images (mapped or read) and cache buffers */
+  GROTOP_MEM_OTHER,          /* The handle itself and its file records */
+  GROTOP_MEM_ARENA_FREE,     /* Arena space not (or no longer) holding anything */
+  GROTOP_MEM_CATEGORIES
+};
+
+/* Bytes held by a handle per category, with high-water marks */
+typedef struct {
+  long long current[GROTOP_MEM_CATEGORIES];
+  long long peak[GROTOP_MEM_CATEGORIES];
+  long long total;           /* Sum of current */
+  long long peak_total;      /* High-water mark of total */
+} grotop_memory_t;
+
+/* Arena block; blocks are never moved so pointers into them stay valid */
+typedef struct arena_block_t {
+  struct arena_block_t *next;
+  size_t used;
+  size_t size;
+  double buf[1];             /* Keeps allocations suitably aligned */
+} arena_block_t;
+
+/* Per-handle bump allocator; everything in it is released at once */
+typedef struct {
+  arena_block_t *head;       /* Block currently being filled */
+  void *last;                /* Most recent allocation, can grow in place */
+  grotop_memory_t *memory;   /* Account charged for blocks and allocations */
+} arena_t;
+
+/* Hashed symbol table with open addressing over symbol indices */
+typedef struct {
+  arena_t *arena;            /* Owner of syms, buckets and the name strings */
+  symbol_t *syms;            /* Symbols in order of first appearance */
+  int nsyms;
+  int syms_allocated;
+  int *buckets;              /* Symbol index per slot, -1 if empty */
+  int nbuckets;              /* Always a power of two */
+} symtab_t;
+
+/* Sizes of the topology arrays, marking where the contributions of a file start or end */
+typedef struct {
+  int files, atomtypes, moltypes, molecules, defines;
+} contrib_mark_t;
+
+/*
+ * File read while parsing the topology, with the state used to validate
+ * caches. Records are in include order, so the records of a file and of
+ * everything it includes are the range begin.files to end.files.
+ */
+typedef struct {
+  const char *path;          /* Canonical path (arena) */
+  long long mtime;           /* Modification time, nanoseconds since the epoch */
+  long long size;            /* Size in bytes */
+  double seconds;            /* Time spent parsing it and its includes, 0 if not parsed here */
+  const char *defines_key;   /* Sorted defines where it was included (arena), see defines_key() */
+  size_t defines_key_len;
+  contrib_mark_t begin, end; /* What it and its includes contributed; end.files 0 if unknown */
+  int changed;               /* Differs from the file on disk, set by grotop_reload() */
+} file_record_t;
+
+/* Timings and counters of one topology handle, see grotop_get_stats() */
+typedef struct {
+  double preprocess_seconds; /* Prescan and parallel parsing of includes */
+  double parse_seconds;      /* Pass over the top-level file and its includes */
+  double totals_seconds;     /* Type resolution and instance offsets */
+  double structure_seconds;  /* read_structure instantiation, or atoms read in chunks */
+  double bonds_seconds;      /* read_bonds instantiation, or bonds read in chunks */
+  double angles_seconds;     /* read_angles instantiation, or other items read in chunks */
+  double connectivity_seconds; /* Deferred parsing of connectivity sections */
+  long long files;           /* Files read, from disk or from the cache */
+  long long lines;           /* Lines scanned */
+  long long bytes;           /* Bytes scanned */
+  long long includes;        /* Active #include directives */
+  long long skipped_lines;   /* Lines inside false conditional blocks */
+  long long cache_hits;      /* Includes replayed from the cache */
+  long long cache_misses;    /* Includes parsed and stored in the cache */
+  long long reused;          /* Includes copied from the handle by grotop_reload() */
+} grotop_stats_t;
+
+/* Entry of the [ molecules ] section */
+typedef struct {
+  const char *name;          /* Molecule type name (interned) */
+  int count;                 /* Number of copies */
+  moltype_t *mt;             /* Resolved by resolve_molecules() */
+} molecule_t;
+
+/* Where one [ molecules ] entry lands in the instantiated system */
+typedef struct {
+  moltype_t *mt;
+  int count;                 /* Number of copies (never negative) */
+  long long first_copy;      /* Global index of the first copy */
+  long long atom_offset;     /* Output offsets of the first copy */
+  long long residue_offset;
+  long long bond_offset;
+  long long angle_offset;
+  long long dihedral_offset;
+  long long improper_offset;
+  int dirty;                 /* Output not in the arrays kept by grotop_reload() */
+} instance_range_t;
+
+/* Topology file held in memory and handed out one line span at a time */
 typedef struct {
+  const char *buf;           /* File contents (not NUL-terminated) */
+  size_t len;                /* File size in bytes */
+  size_t pos;                /* Offset of the next line */
+  int mapped;                /* Non-zero if buf is a mmap() view */
+  long long mtime;           /* File modification time, nanoseconds */
+  long long size;            /* Bytes on disk: len, unless the file is compressed */
+  grotop_memory_t *memory;   /* Charged for the image as input, may be NULL */
+  size_t held;               /* Bytes charged: the mapping or the read buffer */
+  const char *failure;       /* Why a compressed file could not be read, NULL otherwise */
+} lexer_t;
+
+/* One allocation holding every instantiated connectivity array */
+typedef struct {
+  void *base;                /* Page-aligned when mapped */
+  size_t bytes;
+  int mapped;                /* Non-zero if base is an anonymous mmap() */
+} connectivity_slab_t;
+
+#define SLAB_BONDS  1        /* bond_from and bond_to */
+#define SLAB_ANGLES 2        /* angles, dihedrals and impropers */
+
+/* Main topology data structure */
+typedef struct grotop_data_t {
   FILE *fp;
   char filepath[512];
 
+  /* Backing store for everything parsed from the topology */
+  arena_t arena;
+  grotop_memory_t memory;    /* Bytes held, see grotop_get_memory() */
+
   /* Molecule type definitions */
-  moltype_t *moltypes[MAX_MOLTYPES];
+  moltype_t **moltypes;
   int num_moltypes;
+  int moltypes_allocated;
 
   /* Atom type definitions */
-  atomtype_t atomtypes[MAX_ATOMTYPES];
+  atomtype_t *atomtypes;
   int num_atomtypes;
+  int atomtypes_allocated;
 
   /* Molecules section (instances) */
-  char molnames[MAX_MOLECULES][32];
-  int molcounts[MAX_MOLECULES];
+  molecule_t *molecules;
   int num_molecules;
+  int molecules_allocated;
 
   /* Instantiated system */
-  int total_atoms;
-  int total_bonds;
-  int total_angles;
-  int total_dihedrals;
-  int total_impropers;
-
-  /* For returning to VMD */
+  long long total_atoms;
+  long long total_bonds;
+  long long total_angles;
+  long long total_dihedrals;
+  long long total_impropers;
+
+  /* Prefix sums over [ molecules ]; entry num_molecules is a sentinel */
+  instance_range_t *ranges;
+  long long total_copies;
+  int nthreads;              /* Threads used to instantiate, >= 1 */
+
+  /* Molecule filter: entries of other moltypes get no copies */
+  const char *include_molecules;   /* Names to keep, NULL for all */
+  const char *exclude_molecules;   /* Names to drop, NULL for none */
+  long long system_atoms;    /* Atoms before filtering */
+  long long *atom_runs;      /* Kept atoms as (first, count) pairs of the whole system */
+  int num_atom_runs;
+
+  /* Neighbor and fragment offsets per [ molecules ] entry, see "Bond Graph" */
+  long long *graph_offsets;
+
+  /* For returning to VMD: views of one slab, see "Connectivity Slab" */
+  connectivity_slab_t slab;
+  int slab_filled;    /* SLAB_BONDS | SLAB_ANGLES written at least once */
   int *bond_from;
   int *bond_to;
   int *angles;        /* 3 ints per angle: i, j, k */
@@ -139,8 +432,39 @@ typedef struct {
   int *impropers;     /* 4 ints per improper: i, j, k, l */
 
   /* Preprocessor state */
-  char defines[MAX_DEFINES][64];  /* Defined symbols */
+  int *defines;       /* Symbol indices in order of definition */
   int num_defines;
+  int defines_allocated;
+
+  /* Names of moltypes, atomtypes and defines */
+  symtab_t symtab;
+
+  /* Every file parsed or loaded from cache, in order */
+  file_record_t *files;
+  int num_files;
+  int files_allocated;
+
+  /* Directory of the parsed-include cache, NULL if disabled */
+  const char *cache_dir;
+  int shared_cache;          /* Also use the in-memory cache of the process */
+
+  /* Diagnostics */
+  int verbosity;             /* LOG_SILENT to LOG_DEBUG */
+  int speculative;           /* Worker handle; the owner reports its failures */
+  char error[GROTOP_ERROR_LENGTH];  /* Last error, see grotop_last_error() */
+  grotop_stats_t stats;
+
+  /* Mapped .tpb file that moltype templates point into, if any */
+  lexer_t image;
+
+  /* Includes of the top-level file parsed ahead on worker threads */
+  struct include_job_t *include_jobs;
+  int num_include_jobs;
+  int include_jobs_allocated;
+  int prescan;               /* Preprocessor-only pass that collects the jobs */
+
+  /* Handle being reloaded, whose unchanged includes are copied, see grotop_reload() */
+  struct grotop_data_t *previous;
 
 } grotop_data;
 
@@ -149,26 +473,29 @@ typedef struct {
  * Helper Functions
  */
 
-/* Strip comments (everything after semicolon) and trim whitespace */
-static char* strip_comments(char *line) {
-  char *comment = strchr(line, ';');
-  if (comment) *comment = '\0';
+/* Whitespace as isspace() sees it in the C locale, without the locale lookup */
+#define IS_BLANK(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+/* Strip the comment and surrounding whitespace from a line of len bytes; returns the new length */
+static size_t strip_comments(char *line, size_t len) {
+  /* memchr scans a word or vector at a time, unlike a byte loop */
+  char *comment = (char *)memchr(line, ';', len);
+  if (comment) len = comment - line;
 
   /* Trim trailing whitespace */
-  int len = strlen(line);
-  while (len > 0 && isspace(line[len-1])) {
-    line[--len] = '\0';
-  }
+  while (len > 0 && IS_BLANK(line[len - 1])) len--;
+  line[len] = '\0';
 
   /* Trim leading whitespace */
-  char *start = line;
-  while (*start && isspace(*start)) start++;
+  size_t start = 0;
+  while (start < len && IS_BLANK(line[start])) start++;
 
-  if (start != line) {
-    memmove(line, start, strlen(start) + 1);
+  if (start > 0) {
+    len -= start;
+    memmove(line, line + start, len + 1);
   }
 
-  return line;
+  return len;
 }
 
 /* Check if line is a section header [section_name] */
@@ -208,32 +535,606 @@ static int is_section_header(const char *line, char *section_name) {
   return 1;
 }
 
-/* Check if a symbol is defined */
-static int is_defined(grotop_data *data, const char *symbol) {
-  for (int i = 0; i < data->num_defines; i++) {
-    if (strcmp(data->defines[i], symbol) == 0) {
-      return 1;
+/* Monotonic wall-clock time in seconds */
+static double wall_seconds(void) {
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Process-wide defaults
+ *
+ * The only state shared between handles: the verbosity that
+ * open_grotop_read() and open_tpb_read() give new handles. It is guarded so
+ * that setting it races with nothing; grotop_open() takes the level as an
+ * argument instead. The environment is only read, never modified.
+ */
+
+/* Verbosity set through grotop_set_verbosity(), -2 if left to GROTOP_VERBOSE */
+static int default_verbosity = -2;
+#ifndef _WIN32
+static pthread_mutex_t defaults_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int clamp_verbosity(int level) {
+  if (level < LOG_SILENT) return LOG_SILENT;
+  if (level > LOG_DEBUG) return LOG_DEBUG;
+  return level;
+}
+
+/* Set the verbosity of topologies opened from now on (LOG_SILENT to LOG_DEBUG) */
+void grotop_set_verbosity(int level) {
+#ifndef _WIN32
+  pthread_mutex_lock(&defaults_lock);
+#endif
+  default_verbosity = clamp_verbosity(level);
+#ifndef _WIN32
+  pthread_mutex_unlock(&defaults_lock);
+#endif
+}
+
+static int configured_verbosity(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&defaults_lock);
+#endif
+  int level = default_verbosity;
+#ifndef _WIN32
+  pthread_mutex_unlock(&defaults_lock);
+#endif
+  if (level >= LOG_SILENT) return level;
+
+  const char *env = getenv("GROTOP_VERBOSE");
+  return (env && env[0]) ? clamp_verbosity(atoi(env)) : LOG_QUIET;
+}
+
+/*
+ * Errors
+ *
+ * Every handle keeps the first error reported on it, the cause of any
+ * follow-up errors (grotop_last_error()). Each message also goes to stderr
+ * unless the handle is LOG_SILENT, or is a worker's private handle whose
+ * failures the owner parses again and reports itself.
+ */
+
+static void vreport(grotop_data *data, int record, const char *fmt, va_list ap) {
+  char message[GROTOP_ERROR_LENGTH];
+  vsnprintf(message, sizeof(message), fmt, ap);
+  if (record && !data->error[0]) memcpy(data->error, message, sizeof(message));
+  if (!data->speculative && data->verbosity >= LOG_QUIET)
+    fprintf(stderr, "grotopplugin) %s\n", message);
+}
+
+static void report_error(grotop_data *data, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vreport(data, 1, fmt, ap);
+  va_end(ap);
+}
+
+static void report_warning(grotop_data *data, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vreport(data, 0, fmt, ap);
+  va_end(ap);
+}
+
+/* strerror() for any thread, into a caller buffer */
+static const char *errno_string(int err, char *buf, size_t size) {
+#if defined(_WIN32)
+  if (strerror_s(buf, size, err) != 0) snprintf(buf, size, "error %d", err);
+#elif defined(__GLIBC__) && defined(_GNU_SOURCE)
+  const char *msg = strerror_r(err, buf, size);
+  if (msg != buf) snprintf(buf, size, "%s", msg);
+#else
+  if (strerror_r(err, buf, size) != 0) snprintf(buf, size, "error %d", err);
+#endif
+  return buf;
+}
+
+/*
+ * Field Scanner
+ *
+ * Replacements for the sscanf() conversions used on data lines. Each scans
+ * one field from a cursor the way the matching conversion would (%d, %f,
+ * %Ns, %*s): leading whitespace is skipped and the cursor stops right after
+ * the characters the conversion consumes. They return 1 on success and 0
+ * on failure, leaving the cursor unspecified, so a parser counts successful
+ * fields exactly like sscanf's return value. Numbers are converted without
+ * consulting the locale, so a host application's LC_NUMERIC cannot change
+ * the decimal separator.
+ */
+
+static const char *skip_blanks(const char *p) {
+  while (IS_BLANK(*p)) p++;
+  return p;
+}
+
+/* %d */
+static int scan_int(const char **cursor, int *value) {
+  const char *p = skip_blanks(*cursor);
+  int negative = 0;
+  if (*p == '-' || *p == '+') negative = (*p++ == '-');
+  if (*p < '0' || *p > '9') return 0;
+
+  long long v = 0;
+  while (*p >= '0' && *p <= '9') {
+    if (v < INT_MAX) v = v * 10 + (*p - '0');
+    p++;
+  }
+  if (v > INT_MAX) v = INT_MAX;
+
+  *value = (int)(negative ? -v : v);
+  *cursor = p;
+  return 1;
+}
+
+/* %f: decimal with optional fraction and exponent */
+static int scan_float(const char **cursor, float *value) {
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *p = skip_blanks(*cursor);
+  const char *start = p;
+  int negative = 0;
+  if (*p == '-' || *p == '+') negative = (*p++ == '-');
+
+  /* inf and nan have no decimal point, so the C library is safe for them */
+  if (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N') {
+    char *end;
+    float v = strtof(start, &end);
+    if (end == start) return 0;
+    *value = v;
+    *cursor = end;
+    return 1;
+  }
+
+  /* Up to 19 significant digits fit the mantissa; the rest only scale it */
+  unsigned long long mantissa = 0;
+  int digits = 0, exponent = 0, seen = 0;
+  for (; *p >= '0' && *p <= '9'; p++, seen = 1) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa) digits++;
+    } else {
+      exponent++;
     }
   }
-  return 0;
+  if (*p == '.') {
+    for (p++; *p >= '0' && *p <= '9'; p++, seen = 1) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa) digits++;
+        exponent--;
+      }
+    }
+  }
+  if (!seen) return 0;
+
+  if (*p == 'e' || *p == 'E') {
+    const char *q = p + 1;
+    int eneg = 0, e = 0;
+    if (*q == '-' || *q == '+') eneg = (*q++ == '-');
+    if (*q >= '0' && *q <= '9') {
+      for (; *q >= '0' && *q <= '9'; q++) {
+        if (e < 10000) e = e * 10 + (*q - '0');
+      }
+      exponent += eneg ? -e : e;
+      p = q;
+    }
+  }
+
+  /* Exact for |exponent| <= 22, which covers every value in a topology */
+  double v = (double)mantissa;
+  while (exponent > 22 && v != 0.0 && v < 1e300) { v *= 1e22; exponent -= 22; }
+  while (exponent < -22 && v != 0.0) { v /= 1e22; exponent += 22; }
+  if (exponent > 22) exponent = 22;
+  if (exponent < -22) exponent = -22;
+  v = exponent >= 0 ? v * pow10[exponent] : v / pow10[-exponent];
+
+  *value = (float)(negative ? -v : v);
+  *cursor = p;
+  return 1;
 }
 
-/* Add a defined symbol */
-static void add_define(grotop_data *data, const char *symbol) {
-  if (data->num_defines >= MAX_DEFINES) {
-    fprintf(stderr, "grotopplugin) WARNING: Maximum number of #define symbols (%d) exceeded\n", MAX_DEFINES);
-    return;
+/* %Ns with N = size - 1: at most size - 1 characters of a word */
+static int scan_word(const char **cursor, char *dst, size_t size) {
+  const char *p = skip_blanks(*cursor);
+  size_t len = 0;
+  while (*p && !IS_BLANK(*p) && len < size - 1) dst[len++] = *p++;
+  dst[len] = '\0';
+  if (len == 0) return 0;
+
+  *cursor = p;
+  return 1;
+}
+
+/* %*s */
+static int skip_word(const char **cursor) {
+  const char *p = skip_blanks(*cursor);
+  if (!*p) return 0;
+  while (*p && !IS_BLANK(*p)) p++;
+
+  *cursor = p;
+  return 1;
+}
+
+/* A run of %d conversions; returns how many succeeded, like sscanf */
+static int scan_ints(const char *line, int *values, int count) {
+  int n = 0;
+  while (n < count && scan_int(&line, &values[n])) n++;
+  return n;
+}
+
+/*
+ * Memory Accounting
+ *
+ * Every allocation of a handle is charged to one category of its
+ * grotop_memory_t, so the peak of a large conversion can be traced to the
+ * stage that caused it. Arena blocks are charged as free arena space and
+ * moved to a category as they are handed out; space left behind when an
+ * array grows by copying goes back to free space, since the arena only
+ * releases it when the handle is closed.
+ */
+
+static const char *memory_category_names[GROTOP_MEM_CATEGORIES] = {
+  "Templates", "Connectivity", "Strings", "Preprocessor", "System", "Input", "Other", "Arena free"
+};
+
+/* Add (or remove, if negative) bytes to a category and update the marks */
+static void mem_charge(grotop_memory_t *m, int category, long long bytes) {
+  if (!m) return;
+  m->current[category] += bytes;
+  m->total += bytes;
+  if (m->current[category] > m->peak[category]) m->peak[category] = m->current[category];
+  if (m->total > m->peak_total) m->peak_total = m->total;
+}
+
+/* Move bytes between categories without changing the total */
+static void mem_move(grotop_memory_t *m, int from, int to, long long bytes) {
+  if (!m) return;
+  m->current[from] -= bytes;
+  m->total -= bytes;
+  mem_charge(m, to, bytes);
+}
+
+static void *mem_realloc(grotop_memory_t *m, int category, void *ptr, size_t old_size, size_t new_size) {
+  void *grown = realloc(ptr, new_size);
+  if (grown) mem_charge(m, category, (long long)new_size - (long long)old_size);
+  return grown;
+}
+
+static void mem_free(grotop_memory_t *m, int category, void *ptr, size_t size) {
+  if (!ptr) return;
+  free(ptr);
+  mem_charge(m, category, -(long long)size);
+}
+
+/* Point the arena and the symbol table of a handle at its own members */
+static void bind_handle(grotop_data *data) {
+  data->symtab.arena = &data->arena;
+  data->arena.memory = &data->memory;
+}
+
+/* Empty handle for filepath, charged for its own size */
+static grotop_data *alloc_handle(const char *filepath) {
+  grotop_data *data = (grotop_data *)calloc(1, sizeof(grotop_data));
+  if (!data) return NULL;
+
+  snprintf(data->filepath, sizeof(data->filepath), "%s", filepath);
+  bind_handle(data);
+  mem_charge(&data->memory, GROTOP_MEM_OTHER, (long long)sizeof(grotop_data));
+  return data;
+}
+
+/*
+ * Connectivity Slab
+ *
+ * The bond, angle, dihedral and improper arrays are sized from the totals
+ * known at open and carved out of one slab, allocated the first time any
+ * of them is read: one mapping rather than five heap blocks, page-aligned
+ * so it can be backed by huge pages (GROTOP_HUGE_PAGES=1, where the system
+ * supports it) and released in one piece. Each array starts on a cache
+ * line. grotop_take_connectivity() hands the whole slab to the caller,
+ * who can then close or reload the handle and keep the arrays.
+ */
+
+#define SLAB_ALIGN 64
+
+static size_t slab_round(size_t bytes) {
+  return (bytes + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+static void *slab_alloc(connectivity_slab_t *slab, size_t bytes) {
+  slab->bytes = bytes;
+#ifndef _WIN32
+  void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (map != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+    const char *env = getenv("GROTOP_HUGE_PAGES");
+    if (env && atoi(env) > 0) madvise(map, bytes, MADV_HUGEPAGE);
+#endif
+    slab->base = map;
+    slab->mapped = 1;
+    return map;
+  }
+#endif
+  slab->base = malloc(bytes);
+  slab->mapped = 0;
+  return slab->base;
+}
+
+static void slab_free(connectivity_slab_t *slab) {
+  if (!slab->base) return;
+#ifndef _WIN32
+  if (slab->mapped) munmap(slab->base, slab->bytes);
+  else
+#endif
+  free(slab->base);
+  memset(slab, 0, sizeof(*slab));
+}
+
+/* Release the arrays returned by read_grotop_bonds() and read_grotop_angles() */
+static void free_connectivity(grotop_data *data) {
+  mem_charge(&data->memory, GROTOP_MEM_CONNECTIVITY, -(long long)data->slab.bytes);
+  slab_free(&data->slab);
+  data->slab_filled = 0;
+  data->bond_from = data->bond_to = NULL;
+  data->angles = data->dihedrals = data->impropers = NULL;
+}
+
+/*
+ * Allocate the slab for the current totals and point the arrays into it;
+ * arrays of kinds with no items stay NULL. Nothing to do if it exists.
+ */
+static int alloc_slab(grotop_data *data) {
+  if (data->slab.base) return 1;
+
+  long long counts[GROTOP_NUM_KINDS] = {
+    data->total_bonds, data->total_angles, data->total_dihedrals, data->total_impropers
+  };
+  int **arrays[] = { &data->bond_from, &data->bond_to, &data->angles, &data->dihedrals, &data->impropers };
+  const int kinds[] = { GROTOP_BONDS, GROTOP_BONDS, GROTOP_ANGLES, GROTOP_DIHEDRALS, GROTOP_IMPROPERS };
+  const int widths[] = { 1, 1, 3, 4, 4 };
+  size_t offsets[5], bytes = 0;
+
+  for (int a = 0; a < 5; a++) {
+    long long count = counts[kinds[a]];
+    if ((size_t)count > ((size_t)-1 / 2 - bytes) / ((size_t)widths[a] * sizeof(int))) {
+      report_error(data, "Connectivity of %lld items does not fit in memory", count);
+      return 0;
+    }
+    offsets[a] = bytes;
+    bytes += slab_round((size_t)count * widths[a] * sizeof(int));
+  }
+  if (bytes == 0) return 1;
+
+  char *base = (char *)slab_alloc(&data->slab, bytes);
+  if (!base) {
+    report_error(data, "Out of memory allocating %zu bytes of connectivity", bytes);
+    return 0;
+  }
+  mem_charge(&data->memory, GROTOP_MEM_CONNECTIVITY, (long long)bytes);
+
+  for (int a = 0; a < 5; a++) {
+    *arrays[a] = counts[kinds[a]] > 0 ? (int *)(base + offsets[a]) : NULL;
+  }
+  return 1;
+}
+
+/*
+ * Arena Allocator
+ */
+
+/* Round up so every allocation keeps the alignment of arena_block_t::buf */
+#define ARENA_ALIGN(n) (((n) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+/* Allocate zeroed memory from the arena, charged to a memory category */
+static void *arena_alloc(arena_t *arena, int category, size_t size) {
+  size = ARENA_ALIGN(size ? size : 1);
+
+  if (!arena->head || arena->head->used + size > arena->head->size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    arena_block_t *blk = (arena_block_t *)malloc(sizeof(arena_block_t) + block_size);
+    if (!blk) return NULL;
+    blk->next = arena->head;
+    blk->used = 0;
+    blk->size = block_size;
+    arena->head = blk;
+    mem_charge(arena->memory, GROTOP_MEM_ARENA_FREE, (long long)(sizeof(arena_block_t) + block_size));
+  }
+
+  void *ptr = (char *)arena->head->buf + arena->head->used;
+  arena->head->used += size;
+  arena->last = ptr;
+  memset(ptr, 0, size);
+  mem_move(arena->memory, GROTOP_MEM_ARENA_FREE, category, (long long)size);
+  return ptr;
+}
+
+/* Resize an arena allocation; grows in place when it was the latest one */
+static void *arena_realloc(arena_t *arena, int category, void *ptr, size_t old_size, size_t new_size) {
+  old_size = ptr ? ARENA_ALIGN(old_size) : 0;
+  new_size = ARENA_ALIGN(new_size);
+
+  if (ptr && ptr == arena->last) {
+    size_t offset = (char *)ptr - (char *)arena->head->buf;
+    if (offset + new_size <= arena->head->size) {
+      if (new_size > old_size) memset((char *)ptr + old_size, 0, new_size - old_size);
+      arena->head->used = offset + new_size;
+      mem_move(arena->memory, GROTOP_MEM_ARENA_FREE, category, (long long)new_size - (long long)old_size);
+      return ptr;
+    }
+  }
+
+  void *copy = arena_alloc(arena, category, new_size);
+  if (copy && ptr) {
+    memcpy(copy, ptr, old_size < new_size ? old_size : new_size);
+    mem_move(arena->memory, category, GROTOP_MEM_ARENA_FREE, (long long)old_size);
+  }
+  return copy;
+}
+
+/* Release every block of the arena */
+static void arena_reset(arena_t *arena) {
+  while (arena->head) {
+    arena_block_t *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+  arena->last = NULL;
+}
+
+/* Make room for one more element in an arena-backed growable array */
+static int arena_grow_array(arena_t *arena, int category, void **array, int *allocated,
+                            int count, size_t elsize) {
+  if (count < *allocated) return 1;
+
+  int new_allocated = *allocated ? 2 * *allocated : INITIAL_ARRAY_SIZE;
+  void *grown = arena_realloc(arena, category, *array, (size_t)*allocated * elsize,
+                              (size_t)new_allocated * elsize);
+  if (!grown) return 0;
+
+  *array = grown;
+  *allocated = new_allocated;
+  return 1;
+}
+
+/* Duplicate a string into the arena */
+static const char *arena_strdup(arena_t *arena, int category, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = (char *)arena_alloc(arena, category, len);
+  if (copy) memcpy(copy, str, len);
+  return copy;
+}
+
+
+/*
+ * Symbol Table
+ */
+
+#define SYMTAB_INITIAL_BUCKETS 256
+
+static unsigned int hash_name(const char *name) {
+  unsigned int h = 2166136261u;
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* 64 bit FNV-1a of n bytes, continuing from h; start from FNV1A64_BASIS */
+#define FNV1A64_BASIS 14695981039346656037ULL
+
+static unsigned long long fnv1a64(unsigned long long h, const void *p, size_t n) {
+  const unsigned char *b = (const unsigned char *)p;
+  for (size_t i = 0; i < n; i++) {
+    h ^= b[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Rebuild the bucket array with the given (power of two) size */
+static int symtab_rehash(symtab_t *st, int nbuckets) {
+  int *buckets = (int *)arena_alloc(st->arena, GROTOP_MEM_STRINGS, nbuckets * sizeof(int));
+  if (!buckets) return 0;
+
+  for (int i = 0; i < nbuckets; i++) buckets[i] = -1;
+  for (int i = 0; i < st->nsyms; i++) {
+    unsigned int slot = st->syms[i].hash & (nbuckets - 1);
+    while (buckets[slot] >= 0) slot = (slot + 1) & (nbuckets - 1);
+    buckets[slot] = i;
+  }
+
+  st->buckets = buckets;
+  st->nbuckets = nbuckets;
+  return 1;
+}
+
+/* Find a symbol by name, NULL if it was never interned */
+static symbol_t *symtab_find(symtab_t *st, const char *name) {
+  if (st->nbuckets == 0) return NULL;
+
+  unsigned int hash = hash_name(name);
+  unsigned int slot = hash & (st->nbuckets - 1);
+  while (st->buckets[slot] >= 0) {
+    symbol_t *sym = &st->syms[st->buckets[slot]];
+    if (sym->hash == hash && strcmp(sym->name, name) == 0) return sym;
+    slot = (slot + 1) & (st->nbuckets - 1);
+  }
+  return NULL;
+}
+
+/* Find a symbol by name, adding it if needed */
+static symbol_t *symtab_intern(symtab_t *st, const char *name) {
+  symbol_t *sym = symtab_find(st, name);
+  if (sym) return sym;
+
+  /* Keep the load factor at or below one half */
+  if (2 * (st->nsyms + 1) > st->nbuckets) {
+    int nbuckets = st->nbuckets ? 2 * st->nbuckets : SYMTAB_INITIAL_BUCKETS;
+    if (!symtab_rehash(st, nbuckets)) return NULL;
+  }
+
+  if (!arena_grow_array(st->arena, GROTOP_MEM_STRINGS, (void **)&st->syms, &st->syms_allocated,
+                        st->nsyms, sizeof(symbol_t))) {
+    return NULL;
   }
 
+  const char *copy = arena_strdup(st->arena, GROTOP_MEM_STRINGS, name);
+  if (!copy) return NULL;
+
+  unsigned int hash = hash_name(name);
+  unsigned int slot = hash & (st->nbuckets - 1);
+  while (st->buckets[slot] >= 0) slot = (slot + 1) & (st->nbuckets - 1);
+  st->buckets[slot] = st->nsyms;
+
+  sym = &st->syms[st->nsyms++];
+  sym->name = copy;
+  sym->hash = hash;
+  sym->moltype = -1;
+  sym->atomtype = -1;
+  sym->defined = 0;
+  return sym;
+}
+
+/* Check if a symbol is defined */
+static int is_defined(grotop_data *data, const char *symbol) {
+  symbol_t *sym = symtab_find(&data->symtab, symbol);
+  return sym && sym->defined;
+}
+
+/* Define a symbol; returns 1 if it was not defined before */
+static int set_define(grotop_data *data, const char *symbol) {
+  symbol_t *sym = symtab_intern(&data->symtab, symbol);
+  if (!sym) return 0;
+
   /* Check if already defined */
-  if (is_defined(data, symbol)) {
-    return;
+  if (sym->defined) {
+    return 0;
+  }
+
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_PREPROCESSOR, (void **)&data->defines, &data->defines_allocated,
+                        data->num_defines, sizeof(int))) {
+    return 0;
   }
 
-  strncpy(data->defines[data->num_defines], symbol, 63);
-  data->defines[data->num_defines][63] = '\0';
-  data->num_defines++;
-  printf("grotopplugin) Defined symbol: %s\n", symbol);
+  sym->defined = 1;
+  data->defines[data->num_defines++] = (int)(sym - data->symtab.syms);
+  return 1;
+}
+
+static void add_define(grotop_data *data, const char *symbol) {
+  if (set_define(data, symbol)) {
+    GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) Defined symbol: %s\n", symbol);
+  }
 }
 
 /* Parse #define directive */
@@ -265,8 +1166,10 @@ static int parse_define(const char *line, grotop_data *data) {
   return 1;
 }
 
+static void resolve_compressed(char *path, size_t size);
+
 /* Parse #include directive */
-static int parse_include(const char *line, const char *base_path, char *include_path) {
+static int parse_include(const char *line, const char *base_path, char *include_path, size_t size) {
   const char *p = line;
 
   /* Skip whitespace */
@@ -298,15 +1201,10 @@ static int parse_include(const char *line, const char *base_path, char *include_
   /* Build full path: base_path/filename */
   /* Extract directory from base_path */
   const char *last_slash = strrchr(base_path, '/');
-  if (last_slash) {
-    int dir_len = last_slash - base_path + 1;
-    strncpy(include_path, base_path, dir_len);
-    include_path[dir_len] = '\0';
-    strcat(include_path, filename);
-  } else {
-    strcpy(include_path, filename);
-  }
+  int dir_len = last_slash ? (int)(last_slash - base_path + 1) : 0;
+  snprintf(include_path, size, "%.*s%s", dir_len, base_path, filename);
 
+  resolve_compressed(include_path, size);
   return 1;
 }
 
@@ -376,1110 +1274,3997 @@ static int is_preprocessor_directive(const char *line) {
 
 /* Find molecule type by name */
 static moltype_t* find_moltype(grotop_data *data, const char *name) {
-  for (int i = 0; i < data->num_moltypes; i++) {
-    if (strcmp(data->moltypes[i]->name, name) == 0) {
-      return data->moltypes[i];
-    }
-  }
-  return NULL;
+  symbol_t *sym = symtab_find(&data->symtab, name);
+  if (!sym || sym->moltype < 0) return NULL;
+  return data->moltypes[sym->moltype];
 }
 
-/* Find atom type mass */
-static float find_atomtype_mass(grotop_data *data, const char *type) {
-  for (int i = 0; i < data->num_atomtypes; i++) {
-    if (strcmp(data->atomtypes[i].name, type) == 0) {
-      return data->atomtypes[i].mass;
-    }
-  }
-  return 0.0f;  /* Default if not found */
+/* String of a pool index stored in the atom columns */
+static const char *atom_string(const grotop_data *data, int index) {
+  return data->symtab.syms[index].name;
 }
 
-/* Create new molecule type */
-static moltype_t* create_moltype(void) {
-  moltype_t *mt = (moltype_t *)calloc(1, sizeof(moltype_t));
-  if (!mt) return NULL;
+/* Pool index of a string, adding it if needed; -1 if out of memory */
+static int intern_string(grotop_data *data, const char *str) {
+  symbol_t *sym = symtab_intern(&data->symtab, str);
+  return sym ? (int)(sym - data->symtab.syms) : -1;
+}
+
+/* Column pointers in block order */
+static void atom_column_list(const atom_columns_t *c, void *cols[ATOM_COLUMNS]) {
+  cols[0] = c->id;
+  cols[1] = c->type;
+  cols[2] = c->resnr;
+  cols[3] = c->residue;
+  cols[4] = c->name;
+  cols[5] = c->cgnr;
+  cols[6] = c->charge;
+  cols[7] = c->mass;
+  cols[8] = c->atomtype;
+}
 
-  mt->atoms_allocated = 100;
-  mt->atoms = (atom_data_t *)calloc(mt->atoms_allocated, sizeof(atom_data_t));
+/* Point the columns into a block of ATOM_COLUMNS * stride 4-byte elements */
+static void set_atom_columns(atom_columns_t *c, void *block, int stride) {
+  int *b = (int *)block;
+  if (!b) {
+    memset(c, 0, sizeof(*c));
+    return;
+  }
+  c->id = b;
+  c->type = b + (size_t)stride;
+  c->resnr = b + 2 * (size_t)stride;
+  c->residue = b + 3 * (size_t)stride;
+  c->name = b + 4 * (size_t)stride;
+  c->cgnr = b + 5 * (size_t)stride;
+  c->charge = (float *)(b + 6 * (size_t)stride);
+  c->mass = (float *)(b + 7 * (size_t)stride);
+  c->atomtype = b + 8 * (size_t)stride;
+}
 
-  mt->bonds_allocated = 100;
-  mt->bonds = (bond_data_t *)calloc(mt->bonds_allocated, sizeof(bond_data_t));
+/* Make room for one more atom; the block is reallocated with every column in it */
+static int grow_atom_columns(grotop_data *data, moltype_t *mt) {
+  if (mt->natoms < mt->atoms_allocated) return 1;
 
-  mt->angles_allocated = 100;
-  mt->angles = (angle_data_t *)calloc(mt->angles_allocated, sizeof(angle_data_t));
+  int allocated = mt->atoms_allocated ? 2 * mt->atoms_allocated : INITIAL_ARRAY_SIZE;
+  void *block = arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (size_t)allocated * ATOM_COLUMNS * sizeof(int));
+  if (!block) return 0;
 
-  mt->dihedrals_allocated = 100;
-  mt->dihedrals = (dihedral_data_t *)calloc(mt->dihedrals_allocated, sizeof(dihedral_data_t));
+  atom_columns_t grown;
+  set_atom_columns(&grown, block, allocated);
 
-  if (!mt->atoms || !mt->bonds || !mt->angles || !mt->dihedrals) {
-    if (mt->atoms) free(mt->atoms);
-    if (mt->bonds) free(mt->bonds);
-    if (mt->angles) free(mt->angles);
-    if (mt->dihedrals) free(mt->dihedrals);
-    free(mt);
-    return NULL;
+  void *from[ATOM_COLUMNS], *to[ATOM_COLUMNS];
+  atom_column_list(&mt->atoms, from);
+  atom_column_list(&grown, to);
+  for (int k = 0; k < ATOM_COLUMNS && mt->natoms > 0; k++) {
+    memcpy(to[k], from[k], (size_t)mt->natoms * sizeof(int));
   }
 
-  return mt;
+  mt->atoms = grown;
+  mt->atoms_allocated = allocated;
+  return 1;
 }
 
-/* Free molecule type */
-static void free_moltype(moltype_t *mt) {
-  if (!mt) return;
-  if (mt->atoms) free(mt->atoms);
-  if (mt->bonds) free(mt->bonds);
-  if (mt->angles) free(mt->angles);
-  if (mt->dihedrals) free(mt->dihedrals);
-  free(mt);
+/* Mass of an atom, from its [ atoms ] line or its resolved atom type */
+static float atom_mass(const grotop_data *data, const moltype_t *mt, int i) {
+  if (mt->atoms.mass[i] > 0.0f) return mt->atoms.mass[i];
+  if (mt->atoms.atomtype[i] >= 0) return data->atomtypes[mt->atoms.atomtype[i]].mass;
+  return 0.0f;  /* Default if not found */
+}
+
+/* Create new molecule type */
+static moltype_t* create_moltype(grotop_data *data) {
+  return (moltype_t *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, sizeof(moltype_t));
+}
+
+/* Append an atom type; the first definition of a name wins lookups */
+static int add_atomtype(grotop_data *data, const char *name, float mass) {
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_TEMPLATES, (void **)&data->atomtypes, &data->atomtypes_allocated,
+                        data->num_atomtypes, sizeof(atomtype_t))) {
+    return 0;
+  }
+
+  atomtype_t *at = &data->atomtypes[data->num_atomtypes];
+  strncpy(at->name, name, 15);
+  at->name[15] = '\0';
+  at->mass = mass;
+
+  symbol_t *sym = symtab_intern(&data->symtab, at->name);
+  if (!sym) return 0;
+  if (sym->atomtype < 0) sym->atomtype = data->num_atomtypes;
+
+  data->num_atomtypes++;
+  return 1;
+}
+
+/* Append a named molecule type; the first definition of a name wins lookups */
+static int add_moltype(grotop_data *data, moltype_t *mt) {
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_TEMPLATES, (void **)&data->moltypes, &data->moltypes_allocated,
+                        data->num_moltypes, sizeof(moltype_t *))) {
+    return 0;
+  }
+
+  symbol_t *sym = symtab_intern(&data->symtab, mt->name);
+  if (!sym) return 0;
+  if (sym->moltype < 0) sym->moltype = data->num_moltypes;
+
+  data->moltypes[data->num_moltypes++] = mt;
+  return 1;
+}
+
+/* Append a [ molecules ] entry */
+static int add_molecule(grotop_data *data, const char *name, int count) {
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_SYSTEM, (void **)&data->molecules, &data->molecules_allocated,
+                        data->num_molecules, sizeof(molecule_t))) {
+    return 0;
+  }
+
+  symbol_t *sym = symtab_intern(&data->symtab, name);
+  if (!sym) return 0;
+
+  data->molecules[data->num_molecules].name = sym->name;
+  data->molecules[data->num_molecules].count = count;
+  data->molecules[data->num_molecules].mt = NULL;
+  data->num_molecules++;
+  return 1;
+}
+
+/* Canonical form of a path, used to key caches; falls back to the path itself */
+static void canonical_path(const char *path, char *out, size_t outsize) {
+#ifndef _WIN32
+  char resolved[PATH_MAX];
+  if (realpath(path, resolved)) path = resolved;
+#endif
+  size_t len = strlen(path);
+  if (len >= outsize) len = outsize - 1;
+  memcpy(out, path, len);
+  out[len] = '\0';
+}
+
+/* Remember a file that contributed to the topology */
+static int add_file_record(grotop_data *data, const char *path, long long mtime, long long size) {
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_OTHER, (void **)&data->files, &data->files_allocated,
+                        data->num_files, sizeof(file_record_t))) {
+    return 0;
+  }
+
+  char canonical[1024];
+  canonical_path(path, canonical, sizeof(canonical));
+
+  file_record_t *rec = &data->files[data->num_files];
+  memset(rec, 0, sizeof(*rec));
+  rec->path = arena_strdup(&data->arena, GROTOP_MEM_OTHER, canonical);
+  rec->mtime = mtime;
+  rec->size = size;
+  if (!rec->path) return 0;
+
+  data->num_files++;
+  return 1;
 }
 
 
 /*
- * Section Parsing Functions
+ * Lexer
  */
 
-/* Parse [ atomtypes ] section */
-static int parse_atomtypes_section(FILE *fp, grotop_data *data) {
-  char line[GROTOP_RECORD_LENGTH];
-  int atomtypes_start = data->num_atomtypes;
+/* Modification time in nanoseconds, to catch edits within the same second */
+static long long stat_mtime(const struct stat *st) {
+#if defined(__APPLE__)
+  return (long long)st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+  return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+  return (long long)st->st_mtime * 1000000000LL;
+#endif
+}
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+/* Current state of a file, for checking cache dependencies */
+static int stat_file(const char *path, long long *mtime, long long *size) {
+  struct stat st;
+  if (stat(path, &st) != 0) return 0;
+  *mtime = stat_mtime(&st);
+  *size = (long long)st.st_size;
+  return 1;
+}
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    if (is_preprocessor_directive(line)) {
-      fseek(fp, pos_before, SEEK_SET);
-      printf("grotopplugin)   Loaded %d atomtypes\n", data->num_atomtypes - atomtypes_start);
-      return 1;
-    }
+/*
+ * Compressed Input
+ *
+ * Archived topologies and coordinates are often kept as .gz or .zst. Such
+ * a file is recognized by its magic bytes, not its name, and inflated
+ * INFLATE_CHUNK bytes at a time into the lexer's buffer as it is read, so
+ * no uncompressed copy is written anywhere. Concatenated gzip members and
+ * zstd frames are read as one file. gzip needs GROTOP_ZLIB and zstd
+ * GROTOP_ZSTD at build time.
+ */
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+enum {
+  INPUT_PLAIN,
+  INPUT_GZIP,
+  INPUT_ZSTD
+};
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      printf("grotopplugin)   Loaded %d atomtypes\n", data->num_atomtypes - atomtypes_start);
-      /* Seek back and return so main parser can handle new section */
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+#define INFLATE_CHUNK (256 * 1024)
+#define INFLATE_MAX_STEP (1 << 30)   /* Output per call, within what zlib can count */
 
-    /* Parse atomtype line - support multiple formats:
-     * MARTINI v3:          name mass charge ptype sigma epsilon
-     * GROMACS (full):      name bond_type atomic_num mass charge ptype sigma epsilon
-     * GROMACS (simple):    name mass
-     */
-    char name[16];
-    float mass;
-    int parsed = 0;
+static int input_format(const unsigned char *magic, size_t n) {
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return INPUT_GZIP;
+  if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    return INPUT_ZSTD;
+  return INPUT_PLAIN;
+}
+
+/*
+ * An include that does not exist may have been archived compressed:
+ * foo.itp resolves to foo.itp.gz, then foo.itp.zst, if only that exists.
+ */
+static void resolve_compressed(char *path, size_t size) {
+  static const char *suffixes[] = { ".gz", ".zst" };
+  struct stat st;
+  if (stat(path, &st) == 0) return;
+
+  size_t len = strlen(path);
+  for (int i = 0; i < 2; i++) {
+    if (len + strlen(suffixes[i]) >= size) continue;
+    strcpy(path + len, suffixes[i]);
+    if (stat(path, &st) == 0) return;
+  }
+  path[len] = '\0';
+}
 
-    /* Try MARTINI format: name mass ... (mass is 2nd field) */
-    if (sscanf(line, "%15s %f", name, &mass) == 2) {
-      parsed = 1;
+/* Decompressed image, grown by doubling */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t allocated;
+} inflate_out_t;
+
+#if defined(GROTOP_ZLIB) || defined(GROTOP_ZSTD)
+static int inflate_reserve(inflate_out_t *out, size_t room) {
+  if (out->allocated - out->len >= room) return 1;
+  size_t allocated = out->allocated ? out->allocated : INFLATE_CHUNK;
+  while (allocated - out->len < room) allocated *= 2;
+  char *grown = (char *)realloc(out->buf, allocated);
+  if (!grown) return 0;
+  out->buf = grown;
+  out->allocated = allocated;
+  return 1;
+}
+#endif
+
+#ifdef GROTOP_ZLIB
+static const char *inflate_gzip(FILE *fp, unsigned char *in, inflate_out_t *out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) return "out of memory for gzip";
+
+  const char *failure = NULL;
+  int member = 0;            /* Inside a gzip member */
+  int pending = 0;           /* The last call filled the output, more may be buffered */
+  for (;;) {
+    if (zs.avail_in == 0 && !pending) {
+      zs.next_in = in;
+      zs.avail_in = (uInt)fread(in, 1, INFLATE_CHUNK, fp);
+      if (zs.avail_in == 0) break;
     }
-    /* Try GROMACS full format: name bond_type atomic_num mass ... (mass is 4th field) */
-    else if (sscanf(line, "%15s %*s %*s %f", name, &mass) == 2) {
-      parsed = 1;
+    if (!inflate_reserve(out, INFLATE_CHUNK)) {
+      failure = "out of memory for the decompressed file";
+      break;
     }
 
-    if (parsed && data->num_atomtypes < MAX_ATOMTYPES) {
-      strncpy(data->atomtypes[data->num_atomtypes].name, name, 15);
-      data->atomtypes[data->num_atomtypes].name[15] = '\0';
-      data->atomtypes[data->num_atomtypes].mass = mass;
-      data->num_atomtypes++;
+    size_t room = out->allocated - out->len;
+    if (room > INFLATE_MAX_STEP) room = INFLATE_MAX_STEP;
+    zs.next_out = (Bytef *)out->buf + out->len;
+    zs.avail_out = (uInt)room;
+    member = 1;
+    int rc = inflate(&zs, Z_NO_FLUSH);
+    out->len += room - zs.avail_out;
+    pending = zs.avail_out == 0;
+
+    if (rc == Z_STREAM_END) {
+      /* Another member may follow, as in files that were appended to */
+      member = pending = 0;
+      if (inflateReset(&zs) != Z_OK) {
+        failure = "corrupt gzip data";
+        break;
+      }
+    } else if (rc == Z_BUF_ERROR) {
+      pending = 0;
+    } else if (rc != Z_OK) {
+      failure = "corrupt gzip data";
+      break;
     }
   }
+  if (!failure && member) failure = "truncated gzip data";
 
-  printf("grotopplugin)   Loaded %d atomtypes\n", data->num_atomtypes - atomtypes_start);
-  return 1;
+  inflateEnd(&zs);
+  return failure;
 }
-
-/* Parse [ moleculetype ] section header */
-static int parse_moleculetype_header(FILE *fp, moltype_t *mt) {
-  char line[GROTOP_RECORD_LENGTH];
-
-  /* Next non-empty line should be: name nrexcl */
-  while (fgets(line, sizeof(line), fp)) {
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
-
-    /* Check if it's another section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      return 0;  /* No molecule type data found */
+#endif
+
+#ifdef GROTOP_ZSTD
+static const char *inflate_zstd(FILE *fp, unsigned char *in, inflate_out_t *out) {
+  ZSTD_DStream *zds = ZSTD_createDStream();
+  if (!zds) return "out of memory for zstd";
+  ZSTD_initDStream(zds);
+
+  ZSTD_inBuffer input = { in, 0, 0 };
+  const char *failure = NULL;
+  size_t hint = 1;           /* 0 at the end of a frame */
+  int pending = 0;           /* The last call filled the output, more may be buffered */
+  for (;;) {
+    if (input.pos == input.size && !pending) {
+      input.size = fread(in, 1, INFLATE_CHUNK, fp);
+      input.pos = 0;
+      if (input.size == 0) break;
+    }
+    if (!inflate_reserve(out, INFLATE_CHUNK)) {
+      failure = "out of memory for the decompressed file";
+      break;
     }
 
-    /* Parse: name nrexcl */
-    char name[32];
-    int nrexcl = 3;
-    if (sscanf(line, "%31s %d", name, &nrexcl) >= 1) {
-      strncpy(mt->name, name, 31);
-      mt->name[31] = '\0';
-      mt->nrexcl = nrexcl;
-      return 1;
+    ZSTD_outBuffer output = { out->buf + out->len, out->allocated - out->len, 0 };
+    hint = ZSTD_decompressStream(zds, &output, &input);
+    if (ZSTD_isError(hint)) {
+      failure = "corrupt zstd data";
+      break;
     }
+    out->len += output.pos;
+    pending = output.pos == output.size;
   }
+  if (!failure && hint != 0) failure = "truncated zstd data";
 
-  return 0;
+  ZSTD_freeDStream(zds);
+  return failure;
 }
+#endif
+
+/* Inflate an open compressed file into the lexer; closes fp */
+static int lexer_inflate(lexer_t *lx, FILE *fp, int format) {
+  inflate_out_t out;
+  memset(&out, 0, sizeof(out));
+  unsigned char *in = (unsigned char *)malloc(INFLATE_CHUNK);
+
+  if (!in) {
+    lx->failure = "out of memory for the compressed file";
+  } else if (format == INPUT_GZIP) {
+#ifdef GROTOP_ZLIB
+    lx->failure = inflate_gzip(fp, in, &out);
+#else
+    lx->failure = "gzip-compressed, and this build cannot read gzip (GROTOP_ZLIB)";
+#endif
+  } else {
+#ifdef GROTOP_ZSTD
+    lx->failure = inflate_zstd(fp, in, &out);
+#else
+    lx->failure = "zstd-compressed, and this build cannot read zstd (GROTOP_ZSTD)";
+#endif
+  }
+  if (!lx->failure && ferror(fp)) lx->failure = "read error in the compressed file";
+  free(in);
+  fclose(fp);
 
-/* Forward declare for recursion */
-static int process_section(FILE *fp, const char *section, grotop_data *data, moltype_t **current_mt);
+  if (lx->failure) {
+    free(out.buf);
+    return 0;
+  }
 
-/* Parse [ atoms ] section within a moleculetype */
-static int parse_atoms_section(FILE *fp, moltype_t *mt, grotop_data *data, moltype_t **current_mt) {
-  char line[GROTOP_RECORD_LENGTH];
+  lx->buf = out.buf;
+  lx->len = out.len;
+  lx->pos = 0;
+  lx->mapped = 0;
+  lx->held = out.allocated;
+  mem_charge(lx->memory, GROTOP_MEM_INPUT, (long long)lx->held);
+  return 1;
+}
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+/* Map (or read, or inflate) a whole file so it can be scanned in one forward pass */
+static int lexer_open(lexer_t *lx, const char *filepath, grotop_memory_t *memory) {
+  memset(lx, 0, sizeof(lexer_t));
+  lx->memory = memory;
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    /* If found, seek back and return so main parser can handle it */
-    if (is_preprocessor_directive(line)) {
-      /* Seek back to before this line */
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+#ifndef _WIN32
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0) return 0;
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return 0;
+  }
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      /* Seek back and return so main parser can handle new section */
-      fseek(fp, pos_before, SEEK_SET);
+  /* Compressed files are inflated by the buffered path below */
+  unsigned char magic[4];
+  ssize_t nmagic = pread(fd, magic, sizeof(magic), 0);
+  int plain = input_format(magic, nmagic > 0 ? (size_t)nmagic : 0) == INPUT_PLAIN;
+
+  lx->len = (size_t)st.st_size;
+  lx->size = (long long)st.st_size;
+  lx->mtime = stat_mtime(&st);
+  if (lx->len > 0 && plain) {
+    void *map = mmap(NULL, lx->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      lx->buf = (const char *)map;
+      lx->mapped = 1;
+      lx->held = lx->len;
+      mem_charge(memory, GROTOP_MEM_INPUT, (long long)lx->held);
+      close(fd);
       return 1;
     }
+  }
+  close(fd);
+#endif
+
+  /* Fall back to a single buffered read */
+  struct stat fst;
+  if (stat(filepath, &fst) != 0) return 0;
+
+  FILE *fp = fopen(filepath, "rb");
+  if (!fp) return 0;
+
+  lx->mtime = stat_mtime(&fst);
+  lx->size = (long long)fst.st_size;
+
+  unsigned char head[4];
+  size_t nhead = fread(head, 1, sizeof(head), fp);
+  int format = input_format(head, nhead);
+  rewind(fp);
+  if (format != INPUT_PLAIN) return lexer_inflate(lx, fp, format);
+
+  size_t allocated = 65536, len = 0;
+  char *buf = (char *)malloc(allocated);
+  while (buf) {
+    len += fread(buf + len, 1, allocated - len, fp);
+    if (len < allocated) break;
+    allocated *= 2;
+    char *grown = (char *)realloc(buf, allocated);
+    if (!grown) {
+      free(buf);
+      buf = NULL;
+    }
+    buf = grown;
+  }
+  fclose(fp);
+  if (!buf) return 0;
+
+  lx->buf = buf;
+  lx->len = len;
+  lx->pos = 0;
+  lx->mapped = 0;
+  lx->held = allocated;
+  mem_charge(memory, GROTOP_MEM_INPUT, (long long)lx->held);
+  return 1;
+}
 
-    /* Parse atom line: id type resnr residue atom cgnr charge [mass] */
-    atom_data_t atom;
-    memset(&atom, 0, sizeof(atom));
-
-    int n = sscanf(line, "%d %15s %d %7s %15s %d %f %f",
-                   &atom.id, atom.atom_type, &atom.resnr,
-                   atom.residue, atom.atom_name, &atom.cgnr,
-                   &atom.charge, &atom.mass);
+static void lexer_close(lexer_t *lx) {
+#ifndef _WIN32
+  if (lx->mapped) {
+    munmap((void *)lx->buf, lx->len);
+  } else
+#endif
+  free((void *)lx->buf);
+  mem_charge(lx->memory, GROTOP_MEM_INPUT, -(long long)lx->held);
+  memset(lx, 0, sizeof(lexer_t));
+}
 
-    if (n >= 7) {
-      /* Expand array if needed */
-      if (mt->natoms >= mt->atoms_allocated) {
-        mt->atoms_allocated *= 2;
-        mt->atoms = (atom_data_t *)realloc(mt->atoms,
-                                           mt->atoms_allocated * sizeof(atom_data_t));
-        if (!mt->atoms) return 0;
-      }
+/* Return the next line (without its newline) as a span; 0 at end of file */
+static int lexer_next_line(lexer_t *lx, const char **line, size_t *len) {
+  if (lx->pos >= lx->len) return 0;
 
-      mt->atoms[mt->natoms] = atom;
-      mt->natoms++;
-    }
-  }
+  const char *start = lx->buf + lx->pos;
+  const char *nl = (const char *)memchr(start, '\n', lx->len - lx->pos);
+  size_t n = nl ? (size_t)(nl - start) : lx->len - lx->pos;
 
+  *line = start;
+  *len = n;
+  lx->pos += nl ? n + 1 : n;
   return 1;
 }
 
-/* Parse [ bonds ] section within a moleculetype */
-static int parse_bonds_section(FILE *fp, moltype_t *mt, grotop_data *data, moltype_t **current_mt) {
-  char line[GROTOP_RECORD_LENGTH];
+/* Whether the next line starts (after blanks) with '#', or '[' if headers is set */
+static int lexer_at_marker(const lexer_t *lx, int headers) {
+  const char *c = lx->buf + lx->pos, *end = lx->buf + lx->len;
+  while (c < end && *c != '\n' && IS_BLANK(*c)) c++;
+  return c < end && (*c == '#' || (headers && *c == '['));
+}
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+/*
+ * Move past the lines that cannot change the parser state without copying
+ * or tokenizing them: every line up to the next one whose first non-blank
+ * character is '#' (or '[' if headers is set). Returns the lines skipped;
+ * the next lexer_next_line() returns the line it stopped at.
+ */
+static long long lexer_skip_lines(lexer_t *lx, int headers) {
+  long long skipped = 0;
+
+  while (lx->pos < lx->len && !lexer_at_marker(lx, headers)) {
+    const char *p = lx->buf + lx->pos;
+    const char *nl = (const char *)memchr(p, '\n', lx->len - lx->pos);
+    lx->pos = nl ? (size_t)(nl + 1 - lx->buf) : lx->len;
+    skipped++;
+  }
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    if (is_preprocessor_directive(line)) {
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+  return skipped;
+}
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+/* Copy a line span into a NUL-terminated record buffer, truncating long lines */
+static size_t copy_line(char *dst, const char *src, size_t len) {
+  if (len > GROTOP_RECORD_LENGTH - 1) len = GROTOP_RECORD_LENGTH - 1;
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+  return len;
+}
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      /* Seek back and return so main parser can handle new section */
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
 
-    /* Parse bond line: ai aj [func params...] */
-    int ai, aj;
-    if (sscanf(line, "%d %d", &ai, &aj) == 2) {
-      /* Expand array if needed */
-      if (mt->nbonds >= mt->bonds_allocated) {
-        mt->bonds_allocated *= 2;
-        mt->bonds = (bond_data_t *)realloc(mt->bonds,
-                                           mt->bonds_allocated * sizeof(bond_data_t));
-        if (!mt->bonds) return 0;
-      }
+/*
+ * Section Parsing Functions
+ */
 
-      mt->bonds[mt->nbonds].ai = ai;
-      mt->bonds[mt->nbonds].aj = aj;
-      mt->nbonds++;
-    }
+/* Sections the parser understands; anything else is skipped */
+typedef enum {
+  SECTION_NONE,
+  SECTION_ATOMTYPES,
+  SECTION_MOLECULETYPE,
+  SECTION_ATOMS,
+  SECTION_BONDS,
+  SECTION_CONSTRAINTS,
+  SECTION_ANGLES,
+  SECTION_DIHEDRALS,
+  SECTION_MOLECULES,
+  SECTION_IGNORED            /* system, defaults, pairs, exclusions, settles, ... */
+} section_t;
+
+static const struct {
+  const char *name;
+  section_t section;
+} section_names[] = {
+  { "atomtypes",    SECTION_ATOMTYPES },
+  { "moleculetype", SECTION_MOLECULETYPE },
+  { "atoms",        SECTION_ATOMS },
+  { "bonds",        SECTION_BONDS },
+  { "constraints",  SECTION_CONSTRAINTS },
+  { "angles",       SECTION_ANGLES },
+  { "dihedrals",    SECTION_DIHEDRALS },
+  { "molecules",    SECTION_MOLECULES }
+};
+
+static section_t lookup_section(const char *name) {
+  for (size_t i = 0; i < sizeof(section_names) / sizeof(section_names[0]); i++) {
+    if (strcmp(section_names[i].name, name) == 0) return section_names[i].section;
   }
+  return SECTION_IGNORED;
+}
 
-  return 1;
+/* Parser state for one file; nothing carries over into or out of includes */
+typedef struct {
+  const char *filepath;
+  int depth;
+  section_t section;         /* Section the next data line belongs to */
+  moltype_t *mt;             /* Current [ moleculetype ] */
+  int need_molname;          /* [ moleculetype ] seen, name line still pending */
+  int section_items;         /* Entries parsed in the current section */
+  int ifdef_stack[MAX_IFDEF_DEPTH];  /* 1 if condition is true, 0 if false */
+  int ifdef_depth;
+  int ifdef_false;           /* False entries on the stack; lines are skipped unless 0 */
+} parse_state_t;
+
+/* Parse [ atomtypes ] line */
+static int parse_atomtype_line(grotop_data *data, const char *line) {
+  /* Parse atomtype line - support multiple formats:
+   * MARTINI v3:          name mass charge ptype sigma epsilon
+   * GROMACS (full):      name bond_type atomic_num mass charge ptype sigma epsilon
+   * GROMACS (simple):    name mass
+   */
+  char name[16];
+  float mass;
+
+  if (!scan_word(&line, name, sizeof(name))) return 1;
+
+  /* Try MARTINI format: name mass ... (mass is 2nd field) */
+  const char *p = line;
+  if (!scan_float(&p, &mass)) {
+    /* Try GROMACS full format: name bond_type atomic_num mass ... (mass is 4th field) */
+    p = line;
+    if (!skip_word(&p) || !skip_word(&p) || !scan_float(&p, &mass)) return 1;
+  }
+
+  return add_atomtype(data, name, mass);
 }
 
-/* Parse [ constraints ] section within a moleculetype - treat as bonds */
-static int parse_constraints_section(FILE *fp, moltype_t *mt, grotop_data *data, moltype_t **current_mt) {
-  char line[GROTOP_RECORD_LENGTH];
+/* Parse the name line of a [ moleculetype ] section and register the moltype */
+static int parse_moleculetype_line(grotop_data *data, parse_state_t *ps, const char *line) {
+  /* Parse: name nrexcl */
+  char name[32];
+  int nrexcl = 3;
+  if (!scan_word(&line, name, sizeof(name))) return 1;
+  scan_int(&line, &nrexcl);
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+  moltype_t *mt = create_moltype(data);
+  if (!mt) return 0;
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    if (is_preprocessor_directive(line)) {
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+  strncpy(mt->name, name, 31);
+  mt->name[31] = '\0';
+  mt->nrexcl = nrexcl;
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+  if (!add_moltype(data, mt)) return 0;
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      /* Seek back and return so main parser can handle new section */
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+  ps->mt = mt;
+  ps->need_molname = 0;
+  return 1;
+}
 
-    /* Parse constraint line: ai aj [func params...] */
-    int ai, aj;
-    if (sscanf(line, "%d %d", &ai, &aj) == 2) {
-      /* Expand array if needed */
-      if (mt->nbonds >= mt->bonds_allocated) {
-        mt->bonds_allocated *= 2;
-        mt->bonds = (bond_data_t *)realloc(mt->bonds,
-                                           mt->bonds_allocated * sizeof(bond_data_t));
-        if (!mt->bonds) return 0;
-      }
+/* Parse [ atoms ] line within a moleculetype */
+static int parse_atom_line(grotop_data *data, moltype_t *mt, const char *line) {
+  /* Parse atom line: id type resnr residue atom cgnr charge [mass] */
+  char type[16], residue[8], name[16];
+  int id, resnr, cgnr;
+  float charge, mass;
+
+  if (!scan_int(&line, &id) ||
+      !scan_word(&line, type, sizeof(type)) ||
+      !scan_int(&line, &resnr) ||
+      !scan_word(&line, residue, sizeof(residue)) ||
+      !scan_word(&line, name, sizeof(name)) ||
+      !scan_int(&line, &cgnr) ||
+      !scan_float(&line, &charge)) {
+    return 1;
+  }
+  if (!scan_float(&line, &mass)) mass = 0.0f;
+
+  if (!grow_atom_columns(data, mt)) return 0;
+
+  int t = intern_string(data, type);
+  int r = intern_string(data, residue);
+  int n = intern_string(data, name);
+  if (t < 0 || r < 0 || n < 0) return 0;
+
+  atom_columns_t *a = &mt->atoms;
+  int i = mt->natoms;
+  a->id[i] = id;
+  a->type[i] = t;
+  a->resnr[i] = resnr;
+  a->residue[i] = r;
+  a->name[i] = n;
+  a->cgnr[i] = cgnr;
+  a->charge[i] = charge;
+  a->mass[i] = mass;
+
+  /* Resolve the atom type now; types defined later are picked up by resolve_atomtypes() */
+  a->atomtype[i] = data->symtab.syms[t].atomtype;
+
+  mt->natoms++;
+  return 1;
+}
+
+/*
+ * Connectivity sections are not parsed while the topology is opened. The
+ * open pass counts their entries, with the same checks the parser applies,
+ * and records each run of lines as a span of its file. The arrays are
+ * filled from the spans by load_connectivity() when bonds or angles are
+ * first read, so loads that only need atoms never build them.
+ */
 
-      /* Add constraint as a bond */
-      mt->bonds[mt->nbonds].ai = ai;
-      mt->bonds[mt->nbonds].aj = aj;
-      mt->nbonds++;
+/* Atom indices of a connectivity line and the array it belongs to (GROTOP_BONDS, ...), -1 if none */
+static int connectivity_item(int section, const char *line, int idx[5]) {
+  switch (section) {
+    case SECTION_BONDS:
+    case SECTION_CONSTRAINTS:
+      /* ai aj [func params...]; constraints are treated as bonds */
+      return scan_ints(line, idx, 2) == 2 ? GROTOP_BONDS : -1;
+    case SECTION_ANGLES:
+      /* ai aj ak [func params...] */
+      return scan_ints(line, idx, 3) == 3 ? GROTOP_ANGLES : -1;
+    case SECTION_DIHEDRALS: {
+      /* ai aj ak al [func params...]; function types 2 and 4 are impropers */
+      int n = scan_ints(line, idx, 5);
+      if (n < 4) return -1;
+      if (n == 4) idx[4] = 0;
+      return (idx[4] == 2 || idx[4] == 4) ? GROTOP_IMPROPERS : GROTOP_DIHEDRALS;
     }
+    default:
+      return -1;
   }
+}
 
-  return 1;
+static int is_connectivity_section(section_t section) {
+  return section == SECTION_BONDS || section == SECTION_CONSTRAINTS ||
+         section == SECTION_ANGLES || section == SECTION_DIHEDRALS;
 }
 
-/* Parse [ angles ] section within a moleculetype */
-static int parse_angles_section(FILE *fp, moltype_t *mt, grotop_data *data, moltype_t **current_mt) {
+/* Count the connectivity lines up to the next directive or header and record them as a span */
+static int index_connectivity(grotop_data *data, parse_state_t *ps, lexer_t *lx, int file,
+                              long long *lines) {
+  moltype_t *mt = ps->mt;
+  size_t start = lx->pos;
+  const char *span;
+  size_t span_len;
   char line[GROTOP_RECORD_LENGTH];
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+  while (lx->pos < lx->len && !lexer_at_marker(lx, 1)) {
+    lexer_next_line(lx, &span, &span_len);
+    (*lines)++;
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    if (is_preprocessor_directive(line)) {
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
+    size_t len = copy_line(line, span, span_len);
+    if (strip_comments(line, len) == 0) continue;
+
+    int idx[5];
+    switch (connectivity_item(ps->section, line, idx)) {
+      case GROTOP_BONDS:     mt->nbonds++; break;
+      case GROTOP_ANGLES:    mt->nangles++; break;
+      case GROTOP_DIHEDRALS: mt->ndihedrals++; break;
+      case GROTOP_IMPROPERS: mt->nimpropers++; break;
+      default: break;
     }
+    ps->section_items++;
+  }
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+  if (lx->pos == start) return 1;
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_TEMPLATES, (void **)&mt->spans, &mt->spans_allocated,
+                        mt->nspans, sizeof(conn_span_t))) {
+    return 0;
+  }
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      /* Seek back and return so main parser can handle new section */
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+  conn_span_t *sp = &mt->spans[mt->nspans++];
+  sp->file = file;
+  sp->section = ps->section;
+  sp->offset = (long long)start;
+  sp->length = (long long)(lx->pos - start);
+  mt->pending = 1;
+  return 1;
+}
 
-    /* Parse angle line: ai aj ak [func params...] */
-    int ai, aj, ak;
-    if (sscanf(line, "%d %d %d", &ai, &aj, &ak) == 3) {
-      /* Expand array if needed */
-      if (mt->nangles >= mt->angles_allocated) {
-        mt->angles_allocated *= 2;
-        mt->angles = (angle_data_t *)realloc(mt->angles,
-                                             mt->angles_allocated * sizeof(angle_data_t));
-        if (!mt->angles) return 0;
-      }
+/* Allocate an exactly sized connectivity array; NULL is only an error if count > 0 */
+static void *alloc_connectivity(grotop_data *data, int count, size_t elsize, int *allocated) {
+  *allocated = count;
+  return count > 0 ? arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (size_t)count * elsize) : NULL;
+}
 
-      mt->angles[mt->nangles].ai = ai;
-      mt->angles[mt->nangles].aj = aj;
-      mt->angles[mt->nangles].ak = ak;
-      mt->nangles++;
-    }
+/* Store item number filled[kind] of a counted array; 0 if there are more items than counted */
+static int store_connectivity_item(moltype_t *mt, int kind, const int idx[5], int filled[4]) {
+  if (kind < 0) return 1;
+
+  const int counted[4] = { mt->nbonds, mt->nangles, mt->ndihedrals, mt->nimpropers };
+  if (filled[kind] == counted[kind]) return 0;
+  int k = filled[kind]++;
+
+  if (kind == GROTOP_BONDS) {
+    mt->bonds[k].ai = idx[0];
+    mt->bonds[k].aj = idx[1];
+  } else if (kind == GROTOP_ANGLES) {
+    mt->angles[k].ai = idx[0];
+    mt->angles[k].aj = idx[1];
+    mt->angles[k].ak = idx[2];
+  } else {
+    dihedral_data_t *d = kind == GROTOP_DIHEDRALS ? &mt->dihedrals[k] : &mt->impropers[k];
+    d->ai = idx[0];
+    d->aj = idx[1];
+    d->ak = idx[2];
+    d->al = idx[3];
+    d->funct = idx[4];
   }
-
   return 1;
 }
 
-/* Parse [ dihedrals ] section within a moleculetype */
-static int parse_dihedrals_section(FILE *fp, moltype_t *mt, grotop_data *data, moltype_t **current_mt) {
-  char line[GROTOP_RECORD_LENGTH];
+/* Parse the spans of a moltype; lx holds the file of the previous span, if any */
+static int load_moltype_connectivity(grotop_data *data, moltype_t *mt, lexer_t *lx, int *open_file) {
+  mt->bonds = (bond_data_t *)alloc_connectivity(data, mt->nbonds, sizeof(bond_data_t),
+                                                &mt->bonds_allocated);
+  mt->angles = (angle_data_t *)alloc_connectivity(data, mt->nangles, sizeof(angle_data_t),
+                                                  &mt->angles_allocated);
+  mt->dihedrals = (dihedral_data_t *)alloc_connectivity(data, mt->ndihedrals, sizeof(dihedral_data_t),
+                                                        &mt->dihedrals_allocated);
+  mt->impropers = (dihedral_data_t *)alloc_connectivity(data, mt->nimpropers, sizeof(dihedral_data_t),
+                                                        &mt->impropers_allocated);
+  if ((mt->nbonds && !mt->bonds) || (mt->nangles && !mt->angles) ||
+      (mt->ndihedrals && !mt->dihedrals) || (mt->nimpropers && !mt->impropers)) {
+    report_error(data, "Out of memory for the connectivity of %s", mt->name);
+    return 0;
+  }
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+  int filled[4] = { 0, 0, 0, 0 };
+  for (int s = 0; s < mt->nspans; s++) {
+    const conn_span_t *sp = &mt->spans[s];
+    const file_record_t *rec = &data->files[sp->file];
+
+    if (*open_file != sp->file) {
+      if (*open_file >= 0) lexer_close(lx);
+      *open_file = -1;
+      if (!lexer_open(lx, rec->path, &data->memory)) {
+        char reason[128];
+        report_error(data, "Cannot open file '%s': %s", rec->path,
+                     lx->failure ? lx->failure : errno_string(errno, reason, sizeof(reason)));
+        return 0;
+      }
+      *open_file = sp->file;
+    }
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    if (is_preprocessor_directive(line)) {
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
+    /* The spans are only valid for the file as it was parsed */
+    if (lx->mtime != rec->mtime || lx->size != rec->size ||
+        sp->offset < 0 || sp->length < 0 || sp->offset + sp->length > (long long)lx->len) {
+      report_error(data, "File '%s' changed since the topology was read", rec->path);
+      return 0;
     }
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+    lexer_t view;
+    memset(&view, 0, sizeof(view));
+    view.buf = lx->buf + sp->offset;
+    view.len = (size_t)sp->length;
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      /* Seek back and return so main parser can handle new section */
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+    const char *span;
+    size_t span_len;
+    char line[GROTOP_RECORD_LENGTH];
+    while (lexer_next_line(&view, &span, &span_len)) {
+      size_t len = copy_line(line, span, span_len);
+      if (strip_comments(line, len) == 0) continue;
 
-    /* Parse dihedral line: ai aj ak al [func params...] */
-    int ai, aj, ak, al, funct;
-    /* Try to parse with function type */
-    int n = sscanf(line, "%d %d %d %d %d", &ai, &aj, &ak, &al, &funct);
-    if (n >= 4) {
-      /* Expand array if needed */
-      if (mt->ndihedrals >= mt->dihedrals_allocated) {
-        mt->dihedrals_allocated *= 2;
-        mt->dihedrals = (dihedral_data_t *)realloc(mt->dihedrals,
-                                                    mt->dihedrals_allocated * sizeof(dihedral_data_t));
-        if (!mt->dihedrals) return 0;
+      int idx[5];
+      if (!store_connectivity_item(mt, connectivity_item(sp->section, line, idx), idx, filled)) {
+        report_error(data, "Connectivity of %s no longer matches its files", mt->name);
+        return 0;
       }
-
-      mt->dihedrals[mt->ndihedrals].ai = ai;
-      mt->dihedrals[mt->ndihedrals].aj = aj;
-      mt->dihedrals[mt->ndihedrals].ak = ak;
-      mt->dihedrals[mt->ndihedrals].al = al;
-      mt->dihedrals[mt->ndihedrals].funct = (n == 5) ? funct : 0;
-      mt->ndihedrals++;
     }
   }
 
+  if (filled[GROTOP_BONDS] != mt->nbonds || filled[GROTOP_ANGLES] != mt->nangles ||
+      filled[GROTOP_DIHEDRALS] != mt->ndihedrals || filled[GROTOP_IMPROPERS] != mt->nimpropers) {
+    report_error(data, "Connectivity of %s no longer matches its files", mt->name);
+    return 0;
+  }
+
+  mt->pending = 0;
   return 1;
 }
 
-/* Parse [ molecules ] section */
-static int parse_molecules_section(FILE *fp, grotop_data *data) {
-  char line[GROTOP_RECORD_LENGTH];
+/*
+ * Parse the connectivity of every moltype with copies in the system, or
+ * of every moltype if all is set. Returns 0 with the handle's error set
+ * if a file cannot be read or no longer matches what was counted.
+ */
+static int load_connectivity(grotop_data *data, int all) {
+  lexer_t lx;
+  memset(&lx, 0, sizeof(lx));
+  int open_file = -1, ok = 1;
+  double start = wall_seconds();
+
+  int n = all ? data->num_moltypes : data->num_molecules;
+  for (int i = 0; i < n && ok; i++) {
+    moltype_t *mt = all ? data->moltypes[i] : data->ranges[i].mt;
+    if (!mt->pending || (!all && data->ranges[i].count == 0)) continue;
+    ok = load_moltype_connectivity(data, mt, &lx, &open_file);
+  }
 
-  printf("grotopplugin) Parsing [molecules] section\n");
+  if (open_file >= 0) lexer_close(&lx);
+  data->stats.connectivity_seconds += wall_seconds() - start;
+  return ok;
+}
 
-  while (1) {
-    long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-    if (!fgets(line, sizeof(line), fp)) break;
+/* Parse [ molecules ] line */
+static int parse_molecule_line(grotop_data *data, const char *line) {
+  /* Parse: molname count */
+  char molname[32];
+  int count;
+  if (!scan_word(&line, molname, sizeof(molname)) || !scan_int(&line, &count)) return 1;
 
-    /* Check for preprocessor directives BEFORE stripping comments */
-    if (is_preprocessor_directive(line)) {
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+  GROTOP_LOG(data, LOG_DEBUG, "grotopplugin)   Found molecule: %s x %d\n", molname, count);
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+  return add_molecule(data, molname, count);
+}
 
-    /* Check for new section */
-    char section[64];
-    if (is_section_header(line, section)) {
-      fseek(fp, pos_before, SEEK_SET);
-      return 1;
-    }
+/* Close the current section before a new header or the end of the file */
+static void end_section(grotop_data *data, parse_state_t *ps) {
+  if (ps->section == SECTION_ATOMTYPES) {
+    GROTOP_LOG(data, LOG_DEBUG, "grotopplugin)   Loaded %d atomtypes\n", ps->section_items);
+  }
+  ps->section = SECTION_NONE;
+  ps->section_items = 0;
+}
 
-    /* Parse: molname count */
-    char molname[32];
-    int count;
-    if (sscanf(line, "%31s %d", molname, &count) == 2) {
-      printf("grotopplugin)   Found molecule: %s x %d\n", molname, count);
-      if (data->num_molecules < MAX_MOLECULES) {
-        strncpy(data->molnames[data->num_molecules], molname, 31);
-        data->molnames[data->num_molecules][31] = '\0';
-        data->molcounts[data->num_molecules] = count;
-        data->num_molecules++;
-      }
-    }
+/* Switch to the section named by a header line */
+static int begin_section(grotop_data *data, parse_state_t *ps, const char *name) {
+  if (ps->need_molname) {
+    report_error(data, "[ moleculetype ] without a name in %s", ps->filepath);
+    return 0;
+  }
+
+  end_section(data, ps);
+  GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) Processing section: [%s]\n", name);
+
+  ps->section = lookup_section(name);
+
+  switch (ps->section) {
+    case SECTION_MOLECULETYPE:
+      ps->need_molname = 1;
+      break;
+    case SECTION_ATOMS:
+    case SECTION_BONDS:
+    case SECTION_CONSTRAINTS:
+    case SECTION_ANGLES:
+    case SECTION_DIHEDRALS:
+      /* Molecule-level sections are meaningless outside a moleculetype */
+      if (!ps->mt) ps->section = SECTION_IGNORED;
+      break;
+    case SECTION_MOLECULES:
+      GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) Parsing [molecules] section\n");
+      break;
+    default:
+      break;
   }
 
   return 1;
 }
 
+/* Hand a comment-stripped, non-empty data line to the current section */
+static int parse_data_line(grotop_data *data, parse_state_t *ps, const char *line) {
+  int rc = 1;
+
+  switch (ps->section) {
+    case SECTION_ATOMTYPES:
+      rc = parse_atomtype_line(data, line);
+      break;
+    case SECTION_MOLECULETYPE:
+      if (ps->need_molname) rc = parse_moleculetype_line(data, ps, line);
+      break;
+    case SECTION_ATOMS:
+      rc = parse_atom_line(data, ps->mt, line);
+      break;
+    case SECTION_MOLECULES:
+      rc = parse_molecule_line(data, line);
+      break;
+    default:
+      /* Skip these sections for now */
+      break;
+  }
+
+  ps->section_items++;
+  return rc;
+}
+
+/* Check if lines are currently being processed, given the conditional stack */
+static int conditions_active(const parse_state_t *ps) {
+  return ps->ifdef_false == 0;
+}
+
+/* Whether data lines of the current section are dropped unparsed */
+static int section_ignored(const parse_state_t *ps) {
+  return ps->section == SECTION_IGNORED || ps->section == SECTION_NONE ||
+         (ps->section == SECTION_MOLECULETYPE && !ps->need_molname);
+}
+
 /* Parse a topology file (recursively handles includes) */
 static int parse_topology_file(const char *filepath, grotop_data *data, int depth);
+static int parse_included_file(const char *filepath, grotop_data *data, int depth);
+static int prescan_include(grotop_data *data, const char *filepath);
 
-/* Process current section based on name */
-static int process_section(FILE *fp, const char *section, grotop_data *data, moltype_t **current_mt) {
-  printf("grotopplugin) Processing section: [%s]\n", section);
-
-  if (strcmp(section, "atomtypes") == 0) {
-    return parse_atomtypes_section(fp, data);
-  }
-  else if (strcmp(section, "moleculetype") == 0) {
-    moltype_t *mt = create_moltype();
-    if (!mt) return 0;
+/* Handle a preprocessor line; returns 0 on a fatal error */
+static int process_directive(grotop_data *data, parse_state_t *ps, const char *line) {
+  char symbol[64];
+  int is_ifndef;
 
-    if (!parse_moleculetype_header(fp, mt)) {
-      free_moltype(mt);
+  /* Check for #ifdef / #ifndef directive */
+  if (parse_ifdef(line, symbol, &is_ifndef)) {
+    if (ps->ifdef_depth >= MAX_IFDEF_DEPTH) {
+      report_error(data, "ERROR: Too many nested #ifdef directives (max %d)", MAX_IFDEF_DEPTH);
       return 0;
     }
 
-    if (data->num_moltypes < MAX_MOLTYPES) {
-      data->moltypes[data->num_moltypes++] = mt;
-      *current_mt = mt;
-      return 1;
+    int condition = is_defined(data, symbol);
+    if (is_ifndef) {
+      condition = !condition;  /* #ifndef is the inverse of #ifdef */
     }
 
-    fprintf(stderr, "grotopplugin) WARNING: Maximum number of molecule types (%d) exceeded\n", MAX_MOLTYPES);
-    free_moltype(mt);
-    return 0;
-  }
-  else if (strcmp(section, "atoms") == 0 && *current_mt) {
-    return parse_atoms_section(fp, *current_mt, data, current_mt);
-  }
-  else if (strcmp(section, "bonds") == 0 && *current_mt) {
-    return parse_bonds_section(fp, *current_mt, data, current_mt);
-  }
-  else if (strcmp(section, "constraints") == 0 && *current_mt) {
-    return parse_constraints_section(fp, *current_mt, data, current_mt);
-  }
-  else if (strcmp(section, "angles") == 0 && *current_mt) {
-    return parse_angles_section(fp, *current_mt, data, current_mt);
-  }
-  else if (strcmp(section, "dihedrals") == 0 && *current_mt) {
-    return parse_dihedrals_section(fp, *current_mt, data, current_mt);
-  }
-  else if (strcmp(section, "molecules") == 0) {
-    return parse_molecules_section(fp, data);
+    ps->ifdef_stack[ps->ifdef_depth++] = condition;
+    if (!condition) ps->ifdef_false++;
+
+    GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) %s %s -> %s\n",
+               is_ifndef ? "#ifndef" : "#ifdef",
+               symbol,
+               condition ? "true (processing)" : "false (skipping)");
+    return 1;
   }
-  else if (strcmp(section, "system") == 0 ||
-           strcmp(section, "defaults") == 0 ||
-           strcmp(section, "pairs") == 0 ||
-           strcmp(section, "exclusions") == 0 ||
-           strcmp(section, "settles") == 0 ||
-           strcmp(section, "position_restraints") == 0) {
-    /* Skip these sections for now */
-    char line[GROTOP_RECORD_LENGTH];
-    while (1) {
-      long pos_before = ftell(fp);  /* Save position BEFORE reading this line */
-      if (!fgets(line, sizeof(line), fp)) break;
-
-      /* Check for preprocessor directives BEFORE stripping comments */
-      if (is_preprocessor_directive(line)) {
-        fseek(fp, pos_before, SEEK_SET);
-        return 1;
-      }
 
-      strip_comments(line);
-      if (strlen(line) == 0) continue;
+  /* Check for #else directive */
+  if (is_else_directive(line)) {
+    if (ps->ifdef_depth == 0) {
+      report_error(data, "ERROR: #else without matching #ifdef");
+      return 0;
+    }
+
+    /* Flip the condition */
+    ps->ifdef_stack[ps->ifdef_depth - 1] = !ps->ifdef_stack[ps->ifdef_depth - 1];
+    ps->ifdef_false += ps->ifdef_stack[ps->ifdef_depth - 1] ? -1 : 1;
+    GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) #else -> %s\n",
+               ps->ifdef_stack[ps->ifdef_depth - 1] ? "true (processing)" : "false (skipping)");
+    return 1;
+  }
 
-      char next_section[64];
-      if (is_section_header(line, next_section)) {
-        /* Found next section - seek back and return so main parser can handle it */
-        fseek(fp, pos_before, SEEK_SET);
-        return 1;
-      }
+  /* Check for #endif directive */
+  if (is_endif_directive(line)) {
+    if (ps->ifdef_depth == 0) {
+      report_error(data, "ERROR: #endif without matching #ifdef");
+      return 0;
     }
+
+    if (!ps->ifdef_stack[--ps->ifdef_depth]) ps->ifdef_false--;
+    GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) #endif (depth now %d)\n", ps->ifdef_depth);
+    return 1;
+  }
+
+  /* Everything below only applies inside active conditional blocks */
+  if (!conditions_active(ps)) return 1;
+
+  /* Check for #define directive */
+  if (parse_define(line, data)) return 1;
+
+  /* Handle includes */
+  char include_path[512];
+  if (parse_include(line, ps->filepath, include_path, sizeof(include_path))) {
+    /* The included file starts and ends outside of any section */
+    end_section(data, ps);
+    ps->section = SECTION_IGNORED;
+    if (data->prescan) return prescan_include(data, include_path);
+    data->stats.includes++;
+    return parse_included_file(include_path, data, ps->depth + 1);
   }
 
+  /* Other directives (#undef, #error, ...) are ignored */
   return 1;
 }
 
 /* Parse a topology file (recursively handles includes) */
 static int parse_topology_file(const char *filepath, grotop_data *data, int depth) {
   if (depth > MAX_INCLUDES) {
-    fprintf(stderr, "grotopplugin) Too many nested includes (depth %d)\n", depth);
+    report_error(data, "Too many nested includes (depth %d)", depth);
     return 0;
   }
 
-  FILE *fp = fopen(filepath, "r");
-  if (!fp) {
-    fprintf(stderr, "grotopplugin) Cannot open file '%s': %s\n", filepath, strerror(errno));
+  lexer_t lx;
+  if (!lexer_open(&lx, filepath, &data->memory)) {
+    char reason[128];
+    report_error(data, "Cannot open file '%s': %s", filepath,
+                 lx.failure ? lx.failure : errno_string(errno, reason, sizeof(reason)));
+    return 0;
+  }
+
+  GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) Parsing file: %s (depth %d)\n", filepath, depth);
+
+  if (!add_file_record(data, filepath, lx.mtime, lx.size)) {
+    lexer_close(&lx);
     return 0;
   }
 
-  printf("grotopplugin) Parsing file: %s (depth %d)\n", filepath, depth);
+  /* Index, not pointer: includes may grow the file table */
+  int record = data->num_files - 1;
+  double start = wall_seconds();
+  long long lines = 0, skipped = 0;
 
+  parse_state_t ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.filepath = filepath;
+  ps.depth = depth;
+
+  const char *span;
+  size_t span_len;
   char line[GROTOP_RECORD_LENGTH];
-  moltype_t *current_mt = NULL;
-  char current_section[64] = "";  /* Track current section we're parsing */
+  int ok = 1;
+
+  /* Single forward pass: every line is classified and dispatched exactly once */
+  while (ok) {
+    /* Runs of lines that only a directive (or a header) can end are stepped over */
+    if (!conditions_active(&ps)) {
+      long long n = lexer_skip_lines(&lx, 0);
+      lines += n;
+      skipped += n;
+    } else if (data->prescan) {
+      lines += lexer_skip_lines(&lx, 0);
+    } else if (section_ignored(&ps)) {
+      lines += lexer_skip_lines(&lx, 1);
+    } else if (is_connectivity_section(ps.section)) {
+      ok = index_connectivity(data, &ps, &lx, record, &lines);
+      if (!ok) break;
+    }
 
-  /* Conditional compilation state stack */
-  int ifdef_stack[MAX_IFDEF_DEPTH];  /* 1 if condition is true, 0 if false */
-  int ifdef_depth = 0;
-
-  while (fgets(line, sizeof(line), fp)) {
-    /* Check for #define directive */
-    if (parse_define(line, data)) {
-      /* If we're in a section, re-enter it after processing the directive */
-      if (strlen(current_section) > 0) {
-        if (!process_section(fp, current_section, data, &current_mt)) {
-          fclose(fp);
-          return 0;
-        }
-      }
+    if (!lexer_next_line(&lx, &span, &span_len)) break;
+    size_t len = copy_line(line, span, span_len);
+    lines++;
+
+    /* Check for preprocessor directives BEFORE stripping comments */
+    if (is_preprocessor_directive(line)) {
+      ok = process_directive(data, &ps, line);
       continue;
     }
 
-    /* Check for #ifdef / #ifndef directive */
+    /* Skip lines in false conditional blocks, and all data in a prescan */
+    if (!conditions_active(&ps)) {
+      skipped++;
+      continue;
+    }
+    if (data->prescan) continue;
+
+    if (strip_comments(line, len) == 0) continue;
+
+    /* Check for section header */
+    char section[64];
+    if (is_section_header(line, section)) {
+      ok = begin_section(data, &ps, section);
+    } else {
+      ok = parse_data_line(data, &ps, line);
+    }
+  }
+
+  if (ok && ps.need_molname) {
+    report_error(data, "[ moleculetype ] without a name in %s", filepath);
+    ok = 0;
+  }
+  if (ok) end_section(data, &ps);
+
+  /* Check for unmatched #ifdef */
+  if (ok && ps.ifdef_depth != 0) {
+    report_warning(data, "WARNING: %d unmatched #ifdef directive(s) in file %s",
+            ps.ifdef_depth, filepath);
+  }
+
+  /* The prescan's pass over the top-level file is not counted */
+  if (!data->prescan) {
+    data->files[record].seconds = wall_seconds() - start;
+    data->stats.lines += lines;
+    data->stats.bytes += (long long)lx.len;
+    data->stats.skipped_lines += skipped;
+  }
+
+  lexer_close(&lx);
+  return ok;
+}
+
+/*
+ * Parsed-Include Cache
+ *
+ * When GROTOP_CACHE_DIR is set, the atomtypes, moltypes, [ molecules ]
+ * entries and #defines contributed by each included file (and the files
+ * it includes) are stored there after parsing.  An entry is keyed by the
+ * canonical path, mtime and size of the file and by the set of symbols
+ * defined at the point of inclusion; it is only used if every file it
+ * depends on is still unchanged.  Blocks are raw native-endian arrays, so
+ * entries written by a different build are rejected by the header check.
+ * A digest of the body is stored after the key; an entry that no longer
+ * matches it is removed and the file parsed again, so a damaged cache only
+ * costs time.
+ */
+
+#define GROTOP_CACHE_MAGIC "GTC1"
+#define GROTOP_CACHE_VERSION 6
+
+/* Growable output buffer for writing cache entries */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t allocated;
+  int failed;
+  grotop_memory_t *memory;   /* Charged for buf as input, NULL if not accounted */
+} outbuf_t;
+
+/* Bounds-checked cursor for reading cache entries */
+typedef struct {
+  const char *p;
+  const char *end;
+  int failed;
+} inbuf_t;
+
+static void out_bytes(outbuf_t *ob, const void *src, size_t n) {
+  if (ob->failed || n == 0) return;
+  if (ob->len + n > ob->allocated) {
+    size_t allocated = ob->allocated ? ob->allocated : 65536;
+    while (ob->len + n > allocated) allocated *= 2;
+    char *grown = (char *)mem_realloc(ob->memory, GROTOP_MEM_INPUT, ob->buf, ob->allocated, allocated);
+    if (!grown) {
+      ob->failed = 1;
+      return;
+    }
+    ob->buf = grown;
+    ob->allocated = allocated;
+  }
+  memcpy(ob->buf + ob->len, src, n);
+  ob->len += n;
+}
+
+static void out_free(outbuf_t *ob) {
+  mem_free(ob->memory, GROTOP_MEM_INPUT, ob->buf, ob->allocated);
+  ob->buf = NULL;
+  ob->len = ob->allocated = 0;
+}
+
+static void out_int(outbuf_t *ob, int v) { out_bytes(ob, &v, sizeof(v)); }
+static void out_i64(outbuf_t *ob, long long v) { out_bytes(ob, &v, sizeof(v)); }
+
+static void out_str(outbuf_t *ob, const char *str) {
+  int len = (int)strlen(str);
+  out_int(ob, len);
+  out_bytes(ob, str, len);
+}
+
+static const void *in_bytes(inbuf_t *ib, size_t n) {
+  if (ib->failed || (size_t)(ib->end - ib->p) < n) {
+    ib->failed = 1;
+    return NULL;
+  }
+  const void *ptr = ib->p;
+  ib->p += n;
+  return ptr;
+}
+
+static int in_int(inbuf_t *ib) {
+  int v = 0;
+  const void *ptr = in_bytes(ib, sizeof(v));
+  if (ptr) memcpy(&v, ptr, sizeof(v));
+  return v;
+}
+
+static long long in_i64(inbuf_t *ib) {
+  long long v = 0;
+  const void *ptr = in_bytes(ib, sizeof(v));
+  if (ptr) memcpy(&v, ptr, sizeof(v));
+  return v;
+}
+
+/* Read a string into a NUL-terminated buffer; overlong strings fail the read */
+static void in_str(inbuf_t *ib, char *dst, size_t dstsize) {
+  int len = in_int(ib);
+  if (len < 0 || (size_t)len >= dstsize) ib->failed = 1;
+  const void *ptr = in_bytes(ib, ib->failed ? 0 : (size_t)len);
+  if (ptr) {
+    memcpy(dst, ptr, len);
+    dst[len] = '\0';
+  } else {
+    dst[0] = '\0';
+  }
+}
+
+/* Copy a raw array block out of the entry into the arena */
+static void *in_array(inbuf_t *ib, grotop_data *data, int count, size_t elsize) {
+  if (count < 0) ib->failed = 1;
+  if (ib->failed || count == 0) return NULL;
+  const void *ptr = in_bytes(ib, (size_t)count * elsize);
+  if (!ptr) return NULL;
+  void *copy = arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (size_t)count * elsize);
+  if (!copy) {
+    ib->failed = 1;
+    return NULL;
+  }
+  memcpy(copy, ptr, (size_t)count * elsize);
+  return copy;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* The active defines in sorted order, independent of the order they were set in */
+static void defines_key(const grotop_data *data, outbuf_t *key) {
+  const char **names = (const char **)malloc((data->num_defines + 1) * sizeof(char *));
+  if (!names) {
+    key->failed = 1;
+    return;
+  }
+  for (int i = 0; i < data->num_defines; i++) {
+    names[i] = data->symtab.syms[data->defines[i]].name;
+  }
+  qsort(names, data->num_defines, sizeof(char *), compare_strings);
+
+  out_int(key, data->num_defines);
+  for (int i = 0; i < data->num_defines; i++) out_str(key, names[i]);
+  free(names);
+}
+
+/* Cache key of an include: its file state plus the sorted active defines */
+static void cache_key(grotop_data *data, const file_record_t *rec, outbuf_t *key) {
+  out_str(key, rec->path);
+  out_i64(key, rec->mtime);
+  out_i64(key, rec->size);
+  defines_key(data, key);
+}
+
+/* 64 bit FNV-1a digest of a key */
+static unsigned long long key_digest(const outbuf_t *key) {
+  return fnv1a64(FNV1A64_BASIS, key->buf, key->len);
+}
+
+/* Path of the cache entry for a key, named by its digest */
+static void cache_entry_path(const grotop_data *data, const outbuf_t *key, char *path, size_t pathsize) {
+  snprintf(path, pathsize, "%s/%016llx.gtc", data->cache_dir, key_digest(key));
+}
+
+/* Header shared by all entries: format version and the layout of raw blocks */
+static void cache_header(outbuf_t *ob) {
+  out_bytes(ob, GROTOP_CACHE_MAGIC, 4);
+  out_int(ob, GROTOP_CACHE_VERSION);
+  out_int(ob, ATOM_COLUMNS);
+  out_int(ob, (int)sizeof(bond_data_t));
+  out_int(ob, (int)sizeof(angle_data_t));
+  out_int(ob, (int)sizeof(dihedral_data_t));
+}
+
+static void mark_contributions(const grotop_data *data, contrib_mark_t *mark) {
+  mark->files = data->num_files;
+  mark->atomtypes = data->num_atomtypes;
+  mark->moltypes = data->num_moltypes;
+  mark->molecules = data->num_molecules;
+  mark->defines = data->num_defines;
+}
+
+/* Serialize what was parsed between two marks: dependencies, defines and data */
+static void contrib_serialize(const grotop_data *data, const contrib_mark_t *mark,
+                              const contrib_mark_t *end, outbuf_t *ob) {
+  /* Dependencies: the include itself and everything it pulled in */
+  out_int(ob, end->files - mark->files);
+  for (int i = mark->files; i < end->files; i++) {
+    out_str(ob, data->files[i].path);
+    out_i64(ob, data->files[i].mtime);
+    out_i64(ob, data->files[i].size);
+  }
+
+  out_int(ob, end->defines - mark->defines);
+  for (int i = mark->defines; i < end->defines; i++) {
+    out_str(ob, data->symtab.syms[data->defines[i]].name);
+  }
+
+  out_int(ob, end->atomtypes - mark->atomtypes);
+  for (int i = mark->atomtypes; i < end->atomtypes; i++) {
+    out_str(ob, data->atomtypes[i].name);
+    out_bytes(ob, &data->atomtypes[i].mass, sizeof(float));
+  }
+
+  /* Strings of the atom columns, numbered in order of first use */
+  int *local = (int *)malloc(((size_t)data->symtab.nsyms + 1) * sizeof(int));
+  int *order = (int *)malloc(((size_t)data->symtab.nsyms + 1) * sizeof(int));
+  int nlocal = 0;
+  if (!local || !order) {
+    ob->failed = 1;
+    free(local);
+    free(order);
+    return;
+  }
+  for (int i = 0; i < data->symtab.nsyms; i++) local[i] = -1;
+  for (int i = mark->moltypes; i < end->moltypes; i++) {
+    const atom_columns_t *a = &data->moltypes[i]->atoms;
+    for (int j = 0; j < data->moltypes[i]->natoms; j++) {
+      const int str[3] = { a->type[j], a->residue[j], a->name[j] };
+      for (int k = 0; k < 3; k++) {
+        if (local[str[k]] < 0) {
+          local[str[k]] = nlocal;
+          order[nlocal++] = str[k];
+        }
+      }
+    }
+  }
+  out_int(ob, nlocal);
+  for (int i = 0; i < nlocal; i++) out_str(ob, atom_string(data, order[i]));
+  free(order);
+
+  out_int(ob, end->moltypes - mark->moltypes);
+  for (int i = mark->moltypes; i < end->moltypes; i++) {
+    moltype_t *mt = data->moltypes[i];
+    out_str(ob, mt->name);
+    out_int(ob, mt->nrexcl);
+    out_int(ob, mt->natoms);
+
+    /* Columns in block order, strings as entry-local indices */
+    void *cols[ATOM_COLUMNS];
+    atom_column_list(&mt->atoms, cols);
+    for (int k = 0; k < ATOM_COLUMNS; k++) {
+      if (ATOM_STRING_COLUMN(k)) {
+        const int *str = (const int *)cols[k];
+        for (int j = 0; j < mt->natoms; j++) out_int(ob, local[str[j]]);
+      } else {
+        out_bytes(ob, cols[k], (size_t)mt->natoms * sizeof(int));
+      }
+    }
+    out_int(ob, mt->nbonds);
+    out_int(ob, mt->nangles);
+    out_int(ob, mt->ndihedrals);
+    out_int(ob, mt->nimpropers);
+
+    /* Spans name their file relative to the first dependency */
+    out_int(ob, mt->nspans);
+    for (int j = 0; j < mt->nspans; j++) {
+      out_int(ob, mt->spans[j].file - mark->files);
+      out_int(ob, mt->spans[j].section);
+      out_i64(ob, mt->spans[j].offset);
+      out_i64(ob, mt->spans[j].length);
+    }
+
+    /* Arrays already parsed (by a handle being reloaded) are carried over */
+    out_int(ob, !mt->pending);
+    if (!mt->pending) {
+      out_bytes(ob, mt->bonds, (size_t)mt->nbonds * sizeof(bond_data_t));
+      out_bytes(ob, mt->angles, (size_t)mt->nangles * sizeof(angle_data_t));
+      out_bytes(ob, mt->dihedrals, (size_t)mt->ndihedrals * sizeof(dihedral_data_t));
+      out_bytes(ob, mt->impropers, (size_t)mt->nimpropers * sizeof(dihedral_data_t));
+    }
+  }
+  free(local);
+
+  out_int(ob, end->molecules - mark->molecules);
+  for (int i = mark->molecules; i < end->molecules; i++) {
+    out_str(ob, data->molecules[i].name);
+    out_int(ob, data->molecules[i].count);
+  }
+}
+
+/* Apply serialized contributions exactly as the parser would have */
+static int contrib_replay(grotop_data *data, inbuf_t *ib) {
+  int first_file = data->num_files;
+  int n = in_int(ib);
+  for (int i = 0; i < n && !ib->failed; i++) {
+    char dep[1024];
+    in_str(ib, dep, sizeof(dep));
+    long long mtime = in_i64(ib);
+    long long size = in_i64(ib);
+    if (!ib->failed && !add_file_record(data, dep, mtime, size)) ib->failed = 1;
+  }
+
+  n = in_int(ib);
+  for (int i = 0; i < n && !ib->failed; i++) {
     char symbol[64];
-    int is_ifndef;
-    if (parse_ifdef(line, symbol, &is_ifndef)) {
-      if (ifdef_depth >= MAX_IFDEF_DEPTH) {
-        fprintf(stderr, "grotopplugin) ERROR: Too many nested #ifdef directives (max %d)\n", MAX_IFDEF_DEPTH);
-        fclose(fp);
-        return 0;
+    in_str(ib, symbol, sizeof(symbol));
+    if (!ib->failed) add_define(data, symbol);
+  }
+
+  n = in_int(ib);
+  for (int i = 0; i < n && !ib->failed; i++) {
+    char name[16];
+    float mass = 0.0f;
+    in_str(ib, name, sizeof(name));
+    const void *ptr = in_bytes(ib, sizeof(float));
+    if (ptr) memcpy(&mass, ptr, sizeof(float));
+    if (!ib->failed && !add_atomtype(data, name, mass)) ib->failed = 1;
+  }
+
+  /* Entry-local string indices map to this topology's pool */
+  int nlocal = in_int(ib);
+  int *pool = NULL;
+  if (nlocal < 0) ib->failed = 1;
+  if (!ib->failed && nlocal > 0) {
+    pool = (int *)malloc((size_t)nlocal * sizeof(int));
+    if (!pool) ib->failed = 1;
+  }
+  for (int i = 0; i < nlocal && !ib->failed; i++) {
+    char str[64];
+    in_str(ib, str, sizeof(str));
+    if (!ib->failed && (pool[i] = intern_string(data, str)) < 0) ib->failed = 1;
+  }
+
+  n = in_int(ib);
+  for (int i = 0; i < n && !ib->failed; i++) {
+    moltype_t *mt = create_moltype(data);
+    if (!mt) {
+      ib->failed = 1;
+      break;
+    }
+    in_str(ib, mt->name, sizeof(mt->name));
+    mt->nrexcl = in_int(ib);
+    mt->natoms = mt->atoms_allocated = in_int(ib);
+    if (mt->natoms > INT_MAX / ATOM_COLUMNS) ib->failed = 1;
+    void *block = ib->failed ? NULL : in_array(ib, data, mt->natoms * ATOM_COLUMNS, sizeof(int));
+    set_atom_columns(&mt->atoms, block, mt->natoms);
+    mt->nbonds = mt->bonds_allocated = in_int(ib);
+    mt->nangles = mt->angles_allocated = in_int(ib);
+    mt->ndihedrals = mt->dihedrals_allocated = in_int(ib);
+    mt->nimpropers = mt->impropers_allocated = in_int(ib);
+    if (mt->nbonds < 0 || mt->nangles < 0 || mt->ndihedrals < 0 || mt->nimpropers < 0) ib->failed = 1;
+
+    mt->nspans = mt->spans_allocated = in_int(ib);
+    if (mt->nspans < 0 || (size_t)mt->nspans > (size_t)(ib->end - ib->p) / sizeof(int)) ib->failed = 1;
+    if (!ib->failed && mt->nspans > 0) {
+      mt->spans = (conn_span_t *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (size_t)mt->nspans * sizeof(conn_span_t));
+      if (!mt->spans) ib->failed = 1;
+    }
+    for (int j = 0; j < mt->nspans && !ib->failed; j++) {
+      conn_span_t *sp = &mt->spans[j];
+      sp->file = first_file + in_int(ib);
+      sp->section = in_int(ib);
+      sp->offset = in_i64(ib);
+      sp->length = in_i64(ib);
+      if (sp->file < first_file || sp->file >= data->num_files ||
+          !is_connectivity_section((section_t)sp->section)) {
+        ib->failed = 1;
+      }
+    }
+
+    mt->pending = !in_int(ib);
+    if (!mt->pending) {
+      mt->bonds = (bond_data_t *)in_array(ib, data, mt->nbonds, sizeof(bond_data_t));
+      mt->angles = (angle_data_t *)in_array(ib, data, mt->nangles, sizeof(angle_data_t));
+      mt->dihedrals = (dihedral_data_t *)in_array(ib, data, mt->ndihedrals, sizeof(dihedral_data_t));
+      mt->impropers = (dihedral_data_t *)in_array(ib, data, mt->nimpropers, sizeof(dihedral_data_t));
+    }
+    if (ib->failed) break;
+
+    /* String and atom type indices refer to this topology, so map them again */
+    atom_columns_t *a = &mt->atoms;
+    for (int j = 0; j < mt->natoms; j++) {
+      if ((unsigned)a->type[j] >= (unsigned)nlocal || (unsigned)a->residue[j] >= (unsigned)nlocal ||
+          (unsigned)a->name[j] >= (unsigned)nlocal) {
+        ib->failed = 1;
+        break;
+      }
+      a->type[j] = pool[a->type[j]];
+      a->residue[j] = pool[a->residue[j]];
+      a->name[j] = pool[a->name[j]];
+      a->atomtype[j] = data->symtab.syms[a->type[j]].atomtype;
+    }
+    if (ib->failed) break;
+
+    if (!add_moltype(data, mt)) ib->failed = 1;
+  }
+  free(pool);
+
+  n = in_int(ib);
+  for (int i = 0; i < n && !ib->failed; i++) {
+    char name[32];
+    in_str(ib, name, sizeof(name));
+    int count = in_int(ib);
+    if (!ib->failed && !add_molecule(data, name, count)) ib->failed = 1;
+  }
+
+  return !ib->failed;
+}
+
+/*
+ * Shared Include Cache
+ *
+ * Batch conversions open many topologies that include the same force
+ * field, often on several threads at once. With grotop_share_include_cache()
+ * entries are also kept in memory for the rest of the process, in the
+ * layout of the cache files, and replayed into any handle opened later
+ * as a file would be; no cache directory is needed. Entries are never
+ * changed once added and go to the head of their bucket, so a newer entry
+ * for a key shadows a stale one and replays run without holding the lock.
+ */
+
+#define SHARED_CACHE_BUCKETS 1024
+
+typedef struct shared_entry_t {
+  struct shared_entry_t *next;
+  unsigned long long digest; /* key_digest() of the key it was stored under */
+  size_t len;
+  char buf[1];               /* The entry, as in a cache file */
+} shared_entry_t;
+
+static struct {
+  shared_entry_t *buckets[SHARED_CACHE_BUCKETS];
+  int enabled;
+  long long entries;
+  long long bytes;
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif
+} shared_cache = {
+  { NULL }, 0, 0, 0,
+#ifndef _WIN32
+  PTHREAD_MUTEX_INITIALIZER
+#endif
+};
+
+/* Without pthreads everything runs on the calling thread */
+static void shared_lock(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&shared_cache.lock);
+#endif
+}
+
+static void shared_unlock(void) {
+#ifndef _WIN32
+  pthread_mutex_unlock(&shared_cache.lock);
+#endif
+}
+
+/* Newest entry stored under a digest, NULL if none */
+static const shared_entry_t *shared_find(unsigned long long digest) {
+  shared_lock();
+  const shared_entry_t *e = shared_cache.buckets[digest % SHARED_CACHE_BUCKETS];
+  while (e && e->digest != digest) e = e->next;
+  shared_unlock();
+  return e;
+}
+
+static void shared_insert(unsigned long long digest, const void *buf, size_t len) {
+  shared_entry_t *e = (shared_entry_t *)malloc(sizeof(shared_entry_t) + len);
+  if (!e) return;
+  e->digest = digest;
+  e->len = len;
+  memcpy(e->buf, buf, len);
+
+  shared_lock();
+  shared_entry_t **bucket = &shared_cache.buckets[digest % SHARED_CACHE_BUCKETS];
+  e->next = *bucket;
+  *bucket = e;
+  shared_cache.entries++;
+  shared_cache.bytes += (long long)(sizeof(shared_entry_t) + len);
+  shared_unlock();
+}
+
+/*
+ * Keep parsed includes in memory and share them with every handle opened
+ * afterwards. Returns the previous setting.
+ */
+int grotop_share_include_cache(int enable) {
+  shared_lock();
+  int previous = shared_cache.enabled;
+  shared_cache.enabled = enable != 0;
+  shared_unlock();
+  return previous;
+}
+
+static int shared_cache_enabled(void) {
+  shared_lock();
+  int enabled = shared_cache.enabled;
+  shared_unlock();
+  return enabled;
+}
+
+void grotop_shared_cache_usage(long long *entries, long long *bytes) {
+  shared_lock();
+  if (entries) *entries = shared_cache.entries;
+  if (bytes) *bytes = shared_cache.bytes;
+  shared_unlock();
+}
+
+/* Drop every entry; no topology may be being opened meanwhile */
+void grotop_clear_shared_cache(void) {
+  shared_lock();
+  for (int b = 0; b < SHARED_CACHE_BUCKETS; b++) {
+    while (shared_cache.buckets[b]) {
+      shared_entry_t *e = shared_cache.buckets[b];
+      shared_cache.buckets[b] = e->next;
+      free(e);
+    }
+  }
+  shared_cache.entries = shared_cache.bytes = 0;
+  shared_unlock();
+}
+
+/* Write what was parsed since the mark as a cache entry for the key */
+static void cache_store(grotop_data *data, const outbuf_t *key, const contrib_mark_t *mark) {
+  outbuf_t ob;
+  memset(&ob, 0, sizeof(ob));
+  ob.memory = &data->memory;
+
+  contrib_mark_t end;
+  mark_contributions(data, &end);
+
+  cache_header(&ob);
+  out_int(&ob, (int)key->len);
+  out_bytes(&ob, key->buf, key->len);
+
+  /* Digest of the body, filled in once the body is written */
+  size_t digest_at = ob.len;
+  out_i64(&ob, 0);
+  contrib_serialize(data, mark, &end, &ob);
+  if (!ob.failed) {
+    size_t body = digest_at + sizeof(long long);
+    unsigned long long digest = fnv1a64(FNV1A64_BASIS, ob.buf + body, ob.len - body);
+    memcpy(ob.buf + digest_at, &digest, sizeof(digest));
+  }
+
+  if (!ob.failed && data->shared_cache) {
+    shared_insert(key_digest(key), ob.buf, ob.len);
+  }
+
+  if (!ob.failed && data->cache_dir) {
+    /*
+     * Write to a temporary name and rename so readers never see partial
+     * entries. The name is unique per process and per concurrent writer
+     * (the buffer address), as includes may be parsed on several threads.
+     */
+    char path[1024], tmppath[1100];
+    cache_entry_path(data, key, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.%ld.%lx.tmp", path, (long)getpid(),
+             (unsigned long)(size_t)&ob);
+
+    FILE *fp = fopen(tmppath, "wb");
+    if (fp) {
+      int written = fwrite(ob.buf, 1, ob.len, fp) == ob.len;
+      if (fclose(fp) == 0 && written && rename(tmppath, path) == 0) {
+        GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Cached %s\n", data->files[mark->files].path);
+      } else {
+        remove(tmppath);
+      }
+    }
+  }
+
+  out_free(&ob);
+}
+
+/*
+ * Replay a cache entry held in memory into the topology; returns 1 on a
+ * hit, 0 (changing nothing) if it is not for this key or out of date, -1
+ * (also changing nothing) if its body does not match the digest it was
+ * stored with and -2 if it could not be applied.
+ */
+static int cache_replay(grotop_data *data, const outbuf_t *key, const char *buf, size_t len,
+                        const char *name) {
+  inbuf_t ib;
+  ib.p = buf;
+  ib.end = buf + len;
+  ib.failed = 0;
+
+  /* Header and key must match exactly */
+  outbuf_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.memory = &data->memory;
+  cache_header(&hdr);
+  const void *stored_hdr = in_bytes(&ib, hdr.len);
+  int match = stored_hdr && !hdr.failed && memcmp(stored_hdr, hdr.buf, hdr.len) == 0;
+  out_free(&hdr);
+
+  if (match) {
+    int keylen = in_int(&ib);
+    const void *stored_key = in_bytes(&ib, keylen == (int)key->len ? key->len : 0);
+    match = !ib.failed && keylen == (int)key->len && memcmp(stored_key, key->buf, key->len) == 0;
+  }
+
+  /* The body must be what was written, or a damaged entry would be half applied */
+  if (match) {
+    unsigned long long stored = (unsigned long long)in_i64(&ib);
+    if (ib.failed) return 0;
+    if (fnv1a64(FNV1A64_BASIS, ib.p, (size_t)(ib.end - ib.p)) != stored) {
+      GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Ignoring corrupt cache entry %s\n", name);
+      return -1;
+    }
+  }
+
+  /* Every dependency must be unchanged since the entry was written */
+  const char *body = ib.p;
+  int ndeps = match ? in_int(&ib) : 0;
+  for (int i = 0; match && i < ndeps; i++) {
+    char dep[1024];
+    long long mtime, size;
+    in_str(&ib, dep, sizeof(dep));
+    long long cached_mtime = in_i64(&ib);
+    long long cached_size = in_i64(&ib);
+    match = !ib.failed && stat_file(dep, &mtime, &size) &&
+            mtime == cached_mtime && size == cached_size;
+  }
+
+  if (!match || ndeps < 1) return 0;
+
+  /* Hit: everything below is applied exactly as the parser would have */
+  ib.p = body;
+  contrib_replay(data, &ib);
+
+  if (ib.failed) {
+    /* The body is intact, so this is out of memory; what was applied cannot be undone */
+    report_error(data, "Failed to load cache entry %s", name);
+    return -2;
+  }
+
+  GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Loaded %s from cache\n",
+             data->files[data->num_files - ndeps].path);
+  return 1;
+}
+
+/*
+ * Replay the entry for a key from the shared cache or the cache directory;
+ * 0 on a miss, -1 if the handle is left unusable. A corrupt file entry is a
+ * miss and is removed, so the include is parsed and stored again.
+ */
+static int cache_load(grotop_data *data, const outbuf_t *key) {
+  unsigned long long digest = key_digest(key);
+  if (data->shared_cache) {
+    const shared_entry_t *e = shared_find(digest);
+    int rc = e ? cache_replay(data, key, e->buf, e->len, "in the shared cache") : 0;
+    if (rc > 0 || rc == -2) return rc > 0 ? 1 : -1;
+  }
+  if (!data->cache_dir) return 0;
+
+  char path[1024];
+  cache_entry_path(data, key, path, sizeof(path));
+
+  lexer_t lx;
+  if (!lexer_open(&lx, path, &data->memory)) return 0;
+
+  int rc = cache_replay(data, key, lx.buf, lx.len, path);
+  if (rc > 0 && data->shared_cache) shared_insert(digest, lx.buf, lx.len);
+
+  lexer_close(&lx);
+  if (rc == -1) {
+    remove(path);
+    return 0;
+  }
+  return rc == -2 ? -1 : rc;
+}
+
+/* Parse an included file, going through the include cache when it is enabled */
+static int merge_include_job(grotop_data *data, const char *filepath);
+
+static int load_include(const char *filepath, grotop_data *data, int depth) {
+  /* Includes of the top-level file may already have been parsed by a worker */
+  if (depth == 1 && data->num_include_jobs > 0) {
+    int merged = merge_include_job(data, filepath);
+    if (merged) return merged > 0;
+  }
+
+  if ((!data->cache_dir && !data->shared_cache) || depth > MAX_INCLUDES) {
+    return parse_topology_file(filepath, data, depth);
+  }
+
+  file_record_t rec;
+  char canonical[1024];
+  canonical_path(filepath, canonical, sizeof(canonical));
+  rec.path = canonical;
+  if (!stat_file(canonical, &rec.mtime, &rec.size)) {
+    return parse_topology_file(filepath, data, depth);
+  }
+
+  outbuf_t key;
+  memset(&key, 0, sizeof(key));
+  key.memory = &data->memory;
+  cache_key(data, &rec, &key);
+  if (key.failed) {
+    out_free(&key);
+    return parse_topology_file(filepath, data, depth);
+  }
+
+  int rc = cache_load(data, &key);
+  if (rc > 0) data->stats.cache_hits++;
+  if (rc == 0) {
+    data->stats.cache_misses++;
+    contrib_mark_t mark;
+    mark_contributions(data, &mark);
+    rc = parse_topology_file(filepath, data, depth);
+    if (rc) cache_store(data, &key, &mark);
+  }
+
+  out_free(&key);
+  return rc > 0;
+}
+
+/*
+ * Parallel Include Parsing
+ *
+ * With more than one thread, the includes of the top-level file are parsed
+ * ahead of the real pass. A prescan runs only the preprocessor over the
+ * top-level file and records every active include with the defines in
+ * effect at that point. Workers parse each include into a private
+ * topology and serialize what it contributed the same way as a cache
+ * entry. Includes that #define symbols change the state seen by later
+ * ones, so the prescan is repeated with the defines of the finished jobs
+ * applied until it finds no new (path, defines) pair. The real pass then
+ * merges the results in declaration order and parses in place any include
+ * without a matching result.
+ */
+
+#define MAX_PRESCAN_ROUNDS 8
+
+typedef struct include_job_t {
+  const char *path;          /* Include path as resolved by parse_include() */
+  int *snapshot;             /* Symbol indices defined at the include */
+  int num_snapshot;
+  const char *cache_dir;
+  int shared_cache;
+  outbuf_t result;           /* Contributions, in cache entry layout */
+  grotop_stats_t stats;      /* Counters of the worker's parse */
+  long long peak_memory;     /* High-water mark of the worker's handle */
+  int verbosity;
+  int ok;                    /* Parsed and serialized successfully */
+} include_job_t;
+
+/* Job prepared for an include with exactly the current defines, if any */
+static include_job_t *find_include_job(grotop_data *data, const char *filepath) {
+  for (int i = 0; i < data->num_include_jobs; i++) {
+    include_job_t *job = &data->include_jobs[i];
+    if (strcmp(job->path, filepath) != 0 || job->num_snapshot != data->num_defines) continue;
+
+    /* Defines are never removed, so equal counts and membership mean equal sets */
+    int match = 1;
+    for (int j = 0; match && j < job->num_snapshot; j++) {
+      match = data->symtab.syms[job->snapshot[j]].defined;
+    }
+    if (match) return job;
+  }
+
+  return NULL;
+}
+
+/* Position an inbuf on the defines block of a job result */
+static void job_defines(const include_job_t *job, inbuf_t *ib) {
+  ib->p = job->result.buf;
+  ib->end = job->result.buf + job->result.len;
+  ib->failed = 0;
+
+  int ndeps = in_int(ib);
+  for (int i = 0; i < ndeps && !ib->failed; i++) {
+    in_bytes(ib, (size_t)in_int(ib));
+    in_i64(ib);
+    in_i64(ib);
+  }
+}
+
+static const file_record_t *find_reusable(grotop_data *data, const char *filepath);
+
+/* Prescan handling of an include: apply a finished job's defines or add a job */
+static int prescan_include(grotop_data *data, const char *filepath) {
+  /* An include a reload copies from the previous handle only needs its defines */
+  const file_record_t *src = data->previous ? find_reusable(data, filepath) : NULL;
+  if (src) {
+    const grotop_data *old = data->previous;
+    for (int i = src->begin.defines; i < src->end.defines; i++) {
+      set_define(data, old->symtab.syms[old->defines[i]].name);
+    }
+    return 1;
+  }
+
+  include_job_t *job = find_include_job(data, filepath);
+  if (job) {
+    if (job->ok) {
+      inbuf_t ib;
+      job_defines(job, &ib);
+      int n = in_int(&ib);
+      for (int i = 0; i < n && !ib.failed; i++) {
+        char symbol[64];
+        in_str(&ib, symbol, sizeof(symbol));
+        if (!ib.failed) set_define(data, symbol);
+      }
+    }
+    return 1;
+  }
+
+  if (!arena_grow_array(&data->arena, GROTOP_MEM_PREPROCESSOR, (void **)&data->include_jobs, &data->include_jobs_allocated,
+                        data->num_include_jobs, sizeof(include_job_t))) {
+    return 0;
+  }
+
+  job = &data->include_jobs[data->num_include_jobs];
+  memset(job, 0, sizeof(*job));
+  job->path = arena_strdup(&data->arena, GROTOP_MEM_PREPROCESSOR, filepath);
+  job->snapshot = (int *)arena_alloc(&data->arena, GROTOP_MEM_PREPROCESSOR, (data->num_defines + 1) * sizeof(int));
+  if (!job->path || !job->snapshot) return 0;
+
+  if (data->num_defines > 0) memcpy(job->snapshot, data->defines, data->num_defines * sizeof(int));
+  job->num_snapshot = data->num_defines;
+  job->cache_dir = data->cache_dir;
+  job->shared_cache = data->shared_cache;
+  job->verbosity = data->verbosity;
+  data->num_include_jobs++;
+  return 1;
+}
+
+/* Parse one include into a private topology and serialize the result */
+static void run_include_job(include_job_t *job, const grotop_data *owner) {
+  grotop_data *priv = alloc_handle(job->path);
+  if (!priv) return;
+
+  priv->cache_dir = job->cache_dir;
+  priv->shared_cache = job->shared_cache;
+  priv->verbosity = job->verbosity;
+  priv->speculative = 1;
+  priv->nthreads = 1;
+
+  int ok = 1;
+  for (int i = 0; i < job->num_snapshot && ok; i++) {
+    ok = set_define(priv, owner->symtab.syms[job->snapshot[i]].name);
+  }
+
+  contrib_mark_t mark;
+  mark_contributions(priv, &mark);
+  if (ok && parse_included_file(job->path, priv, 1)) {
+    contrib_mark_t end;
+    mark_contributions(priv, &end);
+    contrib_serialize(priv, &mark, &end, &job->result);
+    job->ok = !job->result.failed;
+  }
+  job->stats = priv->stats;
+  job->peak_memory = priv->memory.peak_total;
+
+  arena_reset(&priv->arena);
+  free(priv);
+}
+
+typedef struct {
+  grotop_data *data;
+  int next;                  /* Next job to hand out */
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif
+} include_queue_t;
+
+static void *include_worker(void *arg) {
+  include_queue_t *queue = (include_queue_t *)arg;
+
+  for (;;) {
+#ifndef _WIN32
+    pthread_mutex_lock(&queue->lock);
+#endif
+    int idx = queue->next++;
+#ifndef _WIN32
+    pthread_mutex_unlock(&queue->lock);
+#endif
+    if (idx >= queue->data->num_include_jobs) break;
+    run_include_job(&queue->data->include_jobs[idx], queue->data);
+  }
+
+  return NULL;
+}
+
+/* Run the jobs from index first on worker threads */
+static void run_include_jobs(grotop_data *data, int first) {
+  include_queue_t queue;
+  queue.data = data;
+  queue.next = first;
+
+  int njobs = data->num_include_jobs - first;
+  int nthreads = data->nthreads < njobs ? data->nthreads : njobs;
+  GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Parsing %d includes on %d threads\n", njobs, nthreads);
+
+#ifndef _WIN32
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS];
+
+  pthread_mutex_init(&queue.lock, NULL);
+  for (int t = 1; t < nthreads; t++) {
+    started[t] = pthread_create(&threads[t], NULL, include_worker, &queue) == 0;
+  }
+  include_worker(&queue);
+  for (int t = 1; t < nthreads; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+  }
+  pthread_mutex_destroy(&queue.lock);
+#else
+  include_worker(&queue);
+#endif
+
+  /*
+   * Results are kept until merged. The workers' own handles are gone, but
+   * up to nthreads of them were alive at once: count the largest ones
+   * towards the peak of this handle.
+   */
+  long long largest[MAX_THREADS] = { 0 };
+  for (int i = first; i < data->num_include_jobs; i++) {
+    include_job_t *job = &data->include_jobs[i];
+    job->result.memory = &data->memory;
+    mem_charge(&data->memory, GROTOP_MEM_INPUT, (long long)job->result.allocated);
+
+    long long peak = job->peak_memory;
+    for (int t = 0; t < nthreads; t++) {
+      if (peak > largest[t]) {
+        long long smaller = largest[t];
+        largest[t] = peak;
+        peak = smaller;
+      }
+    }
+  }
+  long long concurrent = data->memory.total;
+  for (int t = 0; t < nthreads; t++) concurrent += largest[t];
+  if (concurrent > data->memory.peak_total) data->memory.peak_total = concurrent;
+}
+
+/* Prescan the top-level file and parse its includes on worker threads */
+static void prepare_include_jobs(grotop_data *data, const char *filepath) {
+  for (int round = 0; round < MAX_PRESCAN_ROUNDS; round++) {
+    int first = data->num_include_jobs;
+
+    data->prescan = 1;
+    int ok = parse_topology_file(filepath, data, 0);
+    data->prescan = 0;
+
+    /* Undo the prescan's defines and file record; the real pass redoes them */
+    for (int i = 0; i < data->num_defines; i++) {
+      data->symtab.syms[data->defines[i]].defined = 0;
+    }
+    data->num_defines = 0;
+    data->num_files = 0;
+
+    /* A single include gains nothing from a worker */
+    if (!ok || (round == 0 && data->num_include_jobs < 2)) {
+      data->num_include_jobs = 0;
+      return;
+    }
+    if (data->num_include_jobs == first) return;
+
+    run_include_jobs(data, first);
+  }
+}
+
+/* Merge the prepared result for an include, if one matches; returns 1 if merged */
+static int merge_include_job(grotop_data *data, const char *filepath) {
+  include_job_t *job = find_include_job(data, filepath);
+  if (!job || !job->ok) return 0;
+
+  /* Counters of the worker's parse count as parsed here */
+  data->stats.lines += job->stats.lines;
+  data->stats.bytes += job->stats.bytes;
+  data->stats.includes += job->stats.includes;
+  data->stats.skipped_lines += job->stats.skipped_lines;
+  data->stats.cache_hits += job->stats.cache_hits;
+  data->stats.cache_misses += job->stats.cache_misses;
+
+  inbuf_t ib;
+  ib.p = job->result.buf;
+  ib.end = job->result.buf + job->result.len;
+  ib.failed = 0;
+  return contrib_replay(data, &ib) ? 1 : -1;
+}
+
+static void free_include_jobs(grotop_data *data) {
+  for (int i = 0; i < data->num_include_jobs; i++) {
+    out_free(&data->include_jobs[i].result);
+  }
+  data->num_include_jobs = 0;
+}
+
+/*
+ * Incremental Reload
+ *
+ * Every include records what it and the files it pulled in contributed,
+ * as ranges of the topology arrays, and the sorted defines in effect
+ * where it was included; nested ranges give the include tree. A reload
+ * parses the topology into a fresh handle, but an include reached with
+ * the same defines whose files are all unchanged on disk is copied from
+ * the previous handle instead of being read. Moltypes left identical keep
+ * their atom templates, and the connectivity arrays are kept and only
+ * rewritten for [ molecules ] entries whose moltype or offsets changed.
+ * Records replayed from the cache or a worker have no nested ranges, so
+ * their own includes are only reusable together with them.
+ */
+
+/* Keep a copy of a defines key in the record, in the arena of the handle; 0 if out of memory */
+static int keep_defines_key(grotop_data *data, file_record_t *rec, const char *key, size_t len) {
+  char *copy = (char *)arena_alloc(&data->arena, GROTOP_MEM_OTHER, len);
+  if (!copy) return 0;
+  memcpy(copy, key, len);
+  rec->defines_key = copy;
+  rec->defines_key_len = len;
+  return 1;
+}
+
+/* Record of the previous handle for an include that can be copied as is */
+static const file_record_t *find_reusable(grotop_data *data, const char *filepath) {
+  const grotop_data *old = data->previous;
+  char canonical[1024];
+  canonical_path(filepath, canonical, sizeof(canonical));
+
+  outbuf_t key;
+  memset(&key, 0, sizeof(key));
+  key.memory = &data->memory;
+  defines_key(data, &key);
+  if (key.failed) {
+    out_free(&key);
+    return NULL;
+  }
+
+  const file_record_t *found = NULL;
+  for (int i = 0; i < old->num_files && !found; i++) {
+    const file_record_t *rec = &old->files[i];
+    if (rec->end.files <= i || !rec->defines_key || rec->defines_key_len != key.len ||
+        memcmp(rec->defines_key, key.buf, key.len) != 0 || strcmp(rec->path, canonical) != 0) {
+      continue;
+    }
+
+    int unchanged = 1;
+    for (int j = rec->begin.files; unchanged && j < rec->end.files; j++) {
+      unchanged = !old->files[j].changed;
+    }
+    if (unchanged) found = rec;
+  }
+
+  out_free(&key);
+  return found;
+}
+
+static void shift_mark(contrib_mark_t *m, const contrib_mark_t *from, const contrib_mark_t *to) {
+  m->files += to->files - from->files;
+  m->atomtypes += to->atomtypes - from->atomtypes;
+  m->moltypes += to->moltypes - from->moltypes;
+  m->molecules += to->molecules - from->molecules;
+  m->defines += to->defines - from->defines;
+}
+
+/* Copy an unchanged include from the previous handle; 1 if copied, 0 if not reusable, -1 on error */
+static int reload_include(grotop_data *data, const char *filepath) {
+  const file_record_t *src = find_reusable(data, filepath);
+  if (!src) return 0;
+
+  const grotop_data *old = data->previous;
+  contrib_mark_t here;
+  mark_contributions(data, &here);
+
+  outbuf_t ob;
+  memset(&ob, 0, sizeof(ob));
+  ob.memory = &data->memory;
+  contrib_serialize(old, &src->begin, &src->end, &ob);
+
+  inbuf_t ib;
+  ib.p = ob.buf;
+  ib.end = ob.buf + ob.len;
+  ib.failed = ob.failed;
+  int ok = !ob.failed && contrib_replay(data, &ib);
+  out_free(&ob);
+  if (!ok) {
+    report_error(data, "Out of memory reusing %s", src->path);
+    return -1;
+  }
+
+  /* Same defines and files give the same contributions, so nested ranges just move */
+  for (int i = src->begin.files; i < src->end.files; i++) {
+    const file_record_t *from = &old->files[i];
+    file_record_t *to = &data->files[here.files + i - src->begin.files];
+    if (from->defines_key && !keep_defines_key(data, to, from->defines_key, from->defines_key_len)) {
+      report_error(data, "Out of memory reusing %s", src->path);
+      return -1;
+    }
+    if (from->end.files > 0) {
+      to->begin = from->begin;
+      to->end = from->end;
+      shift_mark(&to->begin, &src->begin, &here);
+      shift_mark(&to->end, &src->begin, &here);
+    }
+  }
+
+  data->stats.reused++;
+  GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) Reused %s\n", src->path);
+  return 1;
+}
+
+/* Parse or reuse an include and record what it contributed */
+static int parse_included_file(const char *filepath, grotop_data *data, int depth) {
+  contrib_mark_t begin;
+  mark_contributions(data, &begin);
+
+  outbuf_t key;
+  memset(&key, 0, sizeof(key));
+  key.memory = &data->memory;
+  defines_key(data, &key);
+  if (key.failed) {
+    out_free(&key);
+    report_error(data, "Out of memory including %s", filepath);
+    return 0;
+  }
+
+  int rc = data->previous ? reload_include(data, filepath) : 0;
+  if (rc == 0) rc = load_include(filepath, data, depth) ? 1 : -1;
+
+  /* The include's own record comes first, followed by those of its includes */
+  if (rc > 0 && data->num_files > begin.files) {
+    file_record_t *rec = &data->files[begin.files];
+    if (!keep_defines_key(data, rec, key.buf, key.len)) {
+      report_error(data, "Out of memory including %s", filepath);
+      rc = -1;
+    }
+    rec->begin = begin;
+    mark_contributions(data, &rec->end);
+  }
+  out_free(&key);
+  return rc > 0;
+}
+
+/* Same definition, masses resolved through the atom types included */
+static int same_block(const void *a, const void *b, size_t n) {
+  return n == 0 || memcmp(a, b, n) == 0;
+}
+
+/* Whether two moltypes have the same name and atoms, which is all their templates depend on */
+static int same_atoms(const grotop_data *a, const moltype_t *x, const grotop_data *b, const moltype_t *y) {
+  if (strcmp(x->name, y->name) != 0 || x->nrexcl != y->nrexcl || x->natoms != y->natoms) {
+    return 0;
+  }
+
+  size_t column = (size_t)x->natoms * sizeof(int);
+  if (!same_block(x->atoms.id, y->atoms.id, column) ||
+      !same_block(x->atoms.resnr, y->atoms.resnr, column) ||
+      !same_block(x->atoms.cgnr, y->atoms.cgnr, column) ||
+      !same_block(x->atoms.charge, y->atoms.charge, column)) {
+    return 0;
+  }
+
+  /* String indices belong to each handle's pool, so compare the strings */
+  for (int i = 0; i < x->natoms; i++) {
+    if (strcmp(atom_string(a, x->atoms.type[i]), atom_string(b, y->atoms.type[i])) != 0 ||
+        strcmp(atom_string(a, x->atoms.residue[i]), atom_string(b, y->atoms.residue[i])) != 0 ||
+        strcmp(atom_string(a, x->atoms.name[i]), atom_string(b, y->atoms.name[i])) != 0 ||
+        atom_mass(a, x, i) != atom_mass(b, y, i)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Whether two moltypes have the same parsed connectivity; never if either is still pending */
+static int same_connectivity(const moltype_t *x, const moltype_t *y) {
+  if (x->pending || y->pending ||
+      x->nbonds != y->nbonds || x->nangles != y->nangles ||
+      x->ndihedrals != y->ndihedrals || x->nimpropers != y->nimpropers) {
+    return 0;
+  }
+
+  return same_block(x->bonds, y->bonds, (size_t)x->nbonds * sizeof(bond_data_t)) &&
+         same_block(x->angles, y->angles, (size_t)x->nangles * sizeof(angle_data_t)) &&
+         same_block(x->dihedrals, y->dihedrals, (size_t)x->ndihedrals * sizeof(dihedral_data_t)) &&
+         same_block(x->impropers, y->impropers, (size_t)x->nimpropers * sizeof(dihedral_data_t));
+}
+
+/*
+ * Take over what a reloaded topology shares with the previous handle:
+ * templates of identical moltypes, and output arrays whose counts did not
+ * change. Returns the number of [ molecules ] entries left to rewrite.
+ */
+static int reuse_previous(grotop_data *data, grotop_data *old) {
+  /*
+   * Kept output arrays are only patched where the moltypes differ, which
+   * takes their connectivity. A failure here leaves the moltypes pending,
+   * so nothing is kept and the next read reports the error.
+   */
+  if (old->slab.base) {
+    load_connectivity(data, 0);
+  }
+
+  for (int i = 0; i < data->num_moltypes; i++) {
+    moltype_t *mt = data->moltypes[i];
+    if (find_moltype(data, mt->name) != mt) continue;  /* Shadowed by an earlier definition */
+
+    moltype_t *prev = find_moltype(old, mt->name);
+    int atoms = prev && same_atoms(data, mt, old, prev);
+    mt->reused = atoms && same_connectivity(mt, prev);
+    if (atoms && prev->atom_template) {
+      size_t bytes = (size_t)mt->natoms * sizeof(molfile_atom_t);
+      mt->atom_template = (molfile_atom_t *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, bytes);
+      if (mt->atom_template) memcpy(mt->atom_template, prev->atom_template, bytes);
+    }
+  }
+
+  int dirty = 0;
+  for (int i = 0; i < data->num_molecules; i++) {
+    instance_range_t *r = &data->ranges[i];
+    const instance_range_t *o = i < old->num_molecules ? &old->ranges[i] : NULL;
+    r->dirty = !(o && r->mt->reused && strcmp(r->mt->name, o->mt->name) == 0 &&
+                 r->count == o->count && r->atom_offset == o->atom_offset &&
+                 r->residue_offset == o->residue_offset && r->bond_offset == o->bond_offset &&
+                 r->angle_offset == o->angle_offset && r->dihedral_offset == o->dihedral_offset &&
+                 r->improper_offset == o->improper_offset);
+    dirty += r->dirty;
+  }
+
+  /* The slab is laid out from the totals, so it is kept whole or not at all */
+  if (old->slab.base && data->total_bonds == old->total_bonds &&
+      data->total_angles == old->total_angles &&
+      data->total_dihedrals == old->total_dihedrals &&
+      data->total_impropers == old->total_impropers) {
+    data->slab = old->slab;
+    data->slab_filled = old->slab_filled;
+    data->bond_from = old->bond_from;
+    data->bond_to = old->bond_to;
+    data->angles = old->angles;
+    data->dihedrals = old->dihedrals;
+    data->impropers = old->impropers;
+
+    memset(&old->slab, 0, sizeof(old->slab));
+    old->slab_filled = 0;
+    old->bond_from = old->bond_to = NULL;
+    old->angles = old->dihedrals = old->impropers = NULL;
+
+    mem_charge(&old->memory, GROTOP_MEM_CONNECTIVITY, -(long long)data->slab.bytes);
+    mem_charge(&data->memory, GROTOP_MEM_CONNECTIVITY, (long long)data->slab.bytes);
+  }
+
+  return dirty;
+}
+
+/* Resolve atom types for atoms whose type was not yet known at parse time */
+static void resolve_atomtypes(grotop_data *data) {
+  for (int i = 0; i < data->num_moltypes; i++) {
+    moltype_t *mt = data->moltypes[i];
+    atom_columns_t *a = &mt->atoms;
+    for (int j = 0; j < mt->natoms; j++) {
+      if (a->atomtype[j] < 0) a->atomtype[j] = data->symtab.syms[a->type[j]].atomtype;
+    }
+  }
+}
+
+/* Look up the molecule type of every [ molecules ] entry once */
+static int resolve_molecules(grotop_data *data) {
+  for (int i = 0; i < data->num_molecules; i++) {
+    data->molecules[i].mt = find_moltype(data, data->molecules[i].name);
+    if (!data->molecules[i].mt) {
+      report_error(data, "Unknown molecule type '%s' in [molecules] section",
+              data->molecules[i].name);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Whether a name appears in a comma- or space-separated list */
+static int name_in_list(const char *list, const char *name) {
+  size_t len = strlen(name);
+  const char *p = list;
+  while (*p) {
+    while (*p == ',' || IS_BLANK(*p)) p++;
+    const char *start = p;
+    while (*p && *p != ',' && !IS_BLANK(*p)) p++;
+    if ((size_t)(p - start) == len && len > 0 && strncmp(start, name, len) == 0) return 1;
+  }
+  return 0;
+}
+
+/* Whether entries of a moltype pass the molecule filter */
+static int molecule_selected(const grotop_data *data, const char *name) {
+  if (data->include_molecules && !name_in_list(data->include_molecules, name)) return 0;
+  if (data->exclude_molecules && name_in_list(data->exclude_molecules, name)) return 0;
+  return 1;
+}
+
+/* Lowest and highest residue number used by a moltype */
+static void moltype_residue_range(const moltype_t *mt, int *min_resid, int *max_resid) {
+  const int *resnr = mt->atoms.resnr;
+  int lo = mt->natoms > 0 ? resnr[0] : 1, hi = lo;
+  for (int i = 1; i < mt->natoms; i++) {
+    lo = resnr[i] < lo ? resnr[i] : lo;
+    hi = resnr[i] > hi ? resnr[i] : hi;
+  }
+  *min_resid = lo;
+  *max_resid = hi;
+}
+
+/* Add count copies of per_copy items to a running total, failing on overflow */
+static int add_count(long long *total, int count, int per_copy) {
+  long long n = (long long)count * per_copy;  /* Cannot overflow 64 bits */
+  if (n > LLONG_MAX - *total) return 0;
+  *total += n;
+  return 1;
+}
+
+/*
+ * Compute where every [ molecules ] entry starts in the output arrays and
+ * the system totals. Each copy's output position then depends only on its
+ * entry and its index within the entry, so copies can be instantiated in
+ * any order.
+ */
+static int plan_instances(grotop_data *data) {
+  instance_range_t *ranges = (instance_range_t *)arena_alloc(&data->arena, GROTOP_MEM_SYSTEM,
+                                                             (data->num_molecules + 1) * sizeof(instance_range_t));
+  long long *runs = (long long *)arena_alloc(&data->arena, GROTOP_MEM_SYSTEM, (data->num_molecules + 1) * 2 * sizeof(long long));
+  if (!ranges || !runs) return 0;
+
+  instance_range_t sum;
+  memset(&sum, 0, sizeof(sum));
+  long long system_atoms = 0;
+  int nruns = 0;
+
+  for (int i = 0; i < data->num_molecules; i++) {
+    moltype_t *mt = data->molecules[i].mt;
+    instance_range_t *r = &ranges[i];
+
+    int min_resid, max_resid;
+    moltype_residue_range(mt, &min_resid, &max_resid);
+    mt->nresidues = max_resid - min_resid + 1;
+
+    *r = sum;
+    r->mt = mt;
+    r->count = data->molecules[i].count > 0 ? data->molecules[i].count : 0;
+    r->dirty = 1;
+
+    /* Filtered entries keep their place in the whole system but get no copies */
+    long long first_atom = system_atoms;
+    if (!add_count(&system_atoms, r->count, mt->natoms)) {
+      report_error(data, "System size overflows 64-bit counts at molecule '%s'", mt->name);
+      return 0;
+    }
+    if (!molecule_selected(data, mt->name)) {
+      r->count = 0;
+    } else if (system_atoms > first_atom) {
+      if (nruns > 0 && runs[2 * nruns - 2] + runs[2 * nruns - 1] == first_atom) {
+        runs[2 * nruns - 1] += system_atoms - first_atom;
+      } else {
+        runs[2 * nruns] = first_atom;
+        runs[2 * nruns + 1] = system_atoms - first_atom;
+        nruns++;
       }
+    }
 
-      int condition = is_defined(data, symbol);
-      if (is_ifndef) {
-        condition = !condition;  /* #ifndef is the inverse of #ifdef */
-      }
+    if (!add_count(&sum.first_copy, r->count, 1) ||
+        !add_count(&sum.atom_offset, r->count, mt->natoms) ||
+        !add_count(&sum.residue_offset, r->count, mt->nresidues) ||
+        !add_count(&sum.bond_offset, r->count, mt->nbonds) ||
+        !add_count(&sum.angle_offset, r->count, mt->nangles) ||
+        !add_count(&sum.dihedral_offset, r->count, mt->ndihedrals) ||
+        !add_count(&sum.improper_offset, r->count, mt->nimpropers)) {
+      report_error(data, "System size overflows 64-bit counts at molecule '%s'",
+              mt->name);
+      return 0;
+    }
+  }
+  ranges[data->num_molecules] = sum;
+
+  /* Atom and residue numbers are int in the molfile API */
+  if (sum.atom_offset > INT_MAX || sum.residue_offset > INT_MAX) {
+    report_error(data, "System has %lld atoms in %lld residues; at most %d of each are supported",
+            sum.atom_offset, sum.residue_offset, INT_MAX);
+    return 0;
+  }
 
-      ifdef_stack[ifdef_depth] = condition;
-      ifdef_depth++;
+  data->ranges = ranges;
+  data->graph_offsets = NULL;
+  data->system_atoms = system_atoms;
+  data->atom_runs = runs;
+  data->num_atom_runs = nruns;
+  data->total_copies = sum.first_copy;
+  data->total_atoms = sum.atom_offset;
+  data->total_bonds = sum.bond_offset;
+  data->total_angles = sum.angle_offset;
+  data->total_dihedrals = sum.dihedral_offset;
+  data->total_impropers = sum.improper_offset;
 
-      printf("grotopplugin) %s %s -> %s\n",
-             is_ifndef ? "#ifndef" : "#ifdef",
-             symbol,
-             condition ? "true (processing)" : "false (skipping)");
+  return 1;
+}
 
-      /* If we're in a section, re-enter it after processing the directive */
-      if (strlen(current_section) > 0) {
-        if (!process_section(fp, current_section, data, &current_mt)) {
-          fclose(fp);
-          return 0;
-        }
-      }
-      continue;
+/* Thread count from GROTOP_THREADS */
+static int configured_threads(void) {
+  const char *env = getenv("GROTOP_THREADS");
+  if (!env || !env[0]) return 1;
+
+  int n = atoi(env);
+#ifndef _WIN32
+  if (n == 0) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1) n = 1;
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  return n;
+}
+
+/*
+ * Molecule Filter
+ *
+ * Solvent and ions often dominate a system whose connectivity is wanted
+ * without them. A filter of moltype names drops [ molecules ] entries
+ * from the instantiated system: they get no copies, so every
+ * instantiation loop skips them and the offsets of later entries close
+ * up. The kept atoms, as runs of the whole system, let callers pick the
+ * matching coordinates out of files written for all atoms.
+ */
+
+/* Keep copies of the lists; empty lists are no filter */
+static int set_molecule_filter(grotop_data *data, const char *include, const char *exclude) {
+  data->include_molecules = include && include[0] ? arena_strdup(&data->arena, GROTOP_MEM_SYSTEM, include) : NULL;
+  data->exclude_molecules = exclude && exclude[0] ? arena_strdup(&data->arena, GROTOP_MEM_SYSTEM, exclude) : NULL;
+  return (!include || !include[0] || data->include_molecules) &&
+         (!exclude || !exclude[0] || data->exclude_molecules);
+}
+
+static void log_filter(grotop_data *data) {
+  if (data->system_atoms != data->total_atoms) {
+    GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Molecule filter keeps %lld of %lld atoms in %d runs\n",
+               data->total_atoms, data->system_atoms, data->num_atom_runs);
+  }
+}
+
+/*
+ * Change the molecule filter of an open handle (NULL or "" for no list)
+ * and recompute the system; *natoms gets the new atom count. Anything read
+ * from the handle before must be read again.
+ */
+int grotop_select_molecules(void *handle, const char *include, const char *exclude, int *natoms) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!set_molecule_filter(data, include, exclude)) {
+    report_error(data, "Out of memory setting the molecule filter");
+    return MOLFILE_ERROR;
+  }
+
+  /* Counts change, so arrays read with the previous filter cannot be patched */
+  free_connectivity(data);
+
+  if (!plan_instances(data)) return MOLFILE_ERROR;
+  log_filter(data);
+
+  *natoms = (int)data->total_atoms;
+  return MOLFILE_SUCCESS;
+}
+
+/* Atoms of the whole system, before the molecule filter */
+long long grotop_system_atoms(void *handle) {
+  return ((grotop_data *)handle)->system_atoms;
+}
+
+/*
+ * The index'th run of kept atoms: *first (0-based, in the whole system)
+ * and *count. Returns 0 past the last run; unfiltered systems have one.
+ */
+int grotop_selected_atoms(void *handle, int index, long long *first, long long *count) {
+  grotop_data *data = (grotop_data *)handle;
+  if (index < 0 || index >= data->num_atom_runs) return 0;
+
+  *first = data->atom_runs[2 * index];
+  *count = data->atom_runs[2 * index + 1];
+  return 1;
+}
+
+/*
+ * Main Plugin API Functions
+ */
+
+static void close_grotop_read(void *mydata);
+
+/* Parse a topology into a fresh handle; 0 with data->error set on failure */
+static int load_topology(grotop_data *data, const char *filepath) {
+  /* Optional persistent cache of parsed include files */
+  const char *cache_dir = getenv("GROTOP_CACHE_DIR");
+  if (cache_dir && cache_dir[0]) data->cache_dir = cache_dir;
+  data->shared_cache = shared_cache_enabled();
+
+  data->nthreads = configured_threads();
+
+  /* Parse includes of the top-level file ahead on worker threads */
+  double t0 = wall_seconds();
+  if (data->nthreads > 1) prepare_include_jobs(data, filepath);
+  double t1 = wall_seconds();
+  data->stats.preprocess_seconds = t1 - t0;
+
+  /* Parse the topology file */
+  int parsed = parse_topology_file(filepath, data, 0);
+  free_include_jobs(data);
+  double t2 = wall_seconds();
+  data->stats.parse_seconds = t2 - t1;
+  if (!parsed) {
+    report_error(data, "Failed to parse topology file");
+    return 0;
+  }
+
+  resolve_atomtypes(data);
+
+  /* Calculate total atoms */
+  if (!resolve_molecules(data)) {
+    report_error(data, "Failed to calculate total atoms");
+    return 0;
+  }
+  if (!plan_instances(data)) {
+    return 0;
+  }
+  data->stats.totals_seconds = wall_seconds() - t2;
+  log_filter(data);
+
+  GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Parsed %d molecule types, %lld atoms total, %lld bonds, %lld angles, %lld dihedrals, %lld impropers\n",
+             data->num_moltypes, data->total_atoms, data->total_bonds,
+             data->total_angles, data->total_dihedrals, data->total_impropers);
+
+  return 1;
+}
+
+/* Build the molfile_atom_t block that every copy of a moltype starts from */
+static int build_atom_template(grotop_data *data, moltype_t *mt) {
+  molfile_atom_t *tmpl = (molfile_atom_t *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES,
+                                                       (size_t)mt->natoms * sizeof(molfile_atom_t));
+  if (!tmpl) return 0;
+
+  /* Generate segment ID - same for all copies of this molecule type */
+  /* Truncate to 4 characters and convert to uppercase (match Python behavior) */
+  char segid[8] = "";
+  snprintf(segid, sizeof(segid), "%.4s", mt->name);
+  for (int j = 0; segid[j]; j++) {
+    segid[j] = toupper(segid[j]);
+  }
+
+  /* Residue IDs are numbered from the lowest one in this molecule type */
+  int min_resid, max_resid;
+  moltype_residue_range(mt, &min_resid, &max_resid);
+
+  const atom_columns_t *src = &mt->atoms;
+  for (int i = 0; i < mt->natoms; i++) {
+    molfile_atom_t *dst = &tmpl[i];
+
+    strncpy(dst->name, atom_string(data, src->name[i]), sizeof(dst->name) - 1);
+    strncpy(dst->type, atom_string(data, src->type[i]), sizeof(dst->type) - 1);
+    strncpy(dst->resname, atom_string(data, src->residue[i]), sizeof(dst->resname) - 1);
+    memcpy(dst->segid, segid, sizeof(segid));
+
+    /* Residue IDs start at 1 within each copy; copies add their offset */
+    dst->resid = src->resnr[i] - min_resid + 1;
+
+    dst->charge = src->charge[i];
+
+    /* Use mass from atom or its pre-resolved atom type */
+    dst->mass = atom_mass(data, mt, i);
+  }
+
+  mt->atom_template = tmpl;
+  return 1;
+}
+
+/*
+ * Instantiation
+ *
+ * Output is produced by kernels that fill a range of copies of one
+ * [ molecules ] entry at the offsets computed by plan_instances(). The
+ * global copy range is split evenly across worker threads; each kernel
+ * writes only its own slice of the preallocated output arrays.
+ */
+
+typedef struct instance_job_t instance_job_t;
+typedef void (*instance_kernel_t)(const instance_job_t *job, const instance_range_t *r,
+                                  int first, int last);
+
+struct instance_job_t {
+  grotop_data *data;
+  instance_kernel_t kernel;
+  molfile_atom_t *atoms;     /* Output of read_grotop_structure() */
+  long long begin, end;      /* Global copy range of this job */
+  int dirty_only;            /* Skip entries the output arrays already hold */
+};
+
+static void instantiate_atoms(const instance_job_t *job, const instance_range_t *r,
+                              int first, int last) {
+  const moltype_t *mt = r->mt;
+
+  for (int copy = first; copy < last; copy++) {
+    molfile_atom_t *dst = &job->atoms[r->atom_offset + (long long)copy * mt->natoms];
+    int residue_offset = (int)(r->residue_offset + (long long)copy * mt->nresidues);
+
+    memcpy(dst, mt->atom_template, (size_t)mt->natoms * sizeof(molfile_atom_t));
+    for (int i = 0; i < mt->natoms; i++) {
+      dst[i].resid += residue_offset;
     }
+  }
+}
 
-    /* Check for #else directive */
-    if (is_else_directive(line)) {
-      if (ifdef_depth == 0) {
-        fprintf(stderr, "grotopplugin) ERROR: #else without matching #ifdef\n");
-        fclose(fp);
-        return 0;
+static void instantiate_bonds(const instance_job_t *job, const instance_range_t *r,
+                              int first, int last) {
+  const moltype_t *mt = r->mt;
+  grotop_data *data = job->data;
+
+  for (int copy = first; copy < last; copy++) {
+    long long bond_idx = r->bond_offset + (long long)copy * mt->nbonds;
+    int atom_offset = (int)(r->atom_offset + (long long)copy * mt->natoms);
+
+    for (int i = 0; i < mt->nbonds; i++) {
+      /* Convert to 1-based global indices */
+      data->bond_from[bond_idx] = atom_offset + mt->bonds[i].ai;
+      data->bond_to[bond_idx] = atom_offset + mt->bonds[i].aj;
+      bond_idx++;
+    }
+  }
+}
+
+/* Angles, proper dihedrals and impropers of each copy, in one pass */
+static void instantiate_connectivity(const instance_job_t *job, const instance_range_t *r,
+                                     int first, int last) {
+  const moltype_t *mt = r->mt;
+  grotop_data *data = job->data;
+
+  for (int copy = first; copy < last; copy++) {
+    int atom_offset = (int)(r->atom_offset + (long long)copy * mt->natoms);
+
+    if (data->angles) {
+      int *dst = &data->angles[(r->angle_offset + (long long)copy * mt->nangles) * 3];
+      for (int i = 0; i < mt->nangles; i++) {
+        *dst++ = atom_offset + mt->angles[i].ai;
+        *dst++ = atom_offset + mt->angles[i].aj;
+        *dst++ = atom_offset + mt->angles[i].ak;
       }
+    }
 
-      /* Flip the condition */
-      ifdef_stack[ifdef_depth - 1] = !ifdef_stack[ifdef_depth - 1];
-      printf("grotopplugin) #else -> %s\n",
-             ifdef_stack[ifdef_depth - 1] ? "true (processing)" : "false (skipping)");
+    if (data->dihedrals) {
+      int *dst = &data->dihedrals[(r->dihedral_offset + (long long)copy * mt->ndihedrals) * 4];
+      for (int i = 0; i < mt->ndihedrals; i++) {
+        *dst++ = atom_offset + mt->dihedrals[i].ai;
+        *dst++ = atom_offset + mt->dihedrals[i].aj;
+        *dst++ = atom_offset + mt->dihedrals[i].ak;
+        *dst++ = atom_offset + mt->dihedrals[i].al;
+      }
+    }
 
-      /* If we're in a section, re-enter it after processing the directive */
-      if (strlen(current_section) > 0) {
-        if (!process_section(fp, current_section, data, &current_mt)) {
-          fclose(fp);
-          return 0;
-        }
+    if (data->impropers) {
+      int *dst = &data->impropers[(r->improper_offset + (long long)copy * mt->nimpropers) * 4];
+      for (int i = 0; i < mt->nimpropers; i++) {
+        *dst++ = atom_offset + mt->impropers[i].ai;
+        *dst++ = atom_offset + mt->impropers[i].aj;
+        *dst++ = atom_offset + mt->impropers[i].ak;
+        *dst++ = atom_offset + mt->impropers[i].al;
       }
-      continue;
     }
+  }
+}
 
-    /* Check for #endif directive */
-    if (is_endif_directive(line)) {
-      if (ifdef_depth == 0) {
-        fprintf(stderr, "grotopplugin) ERROR: #endif without matching #ifdef\n");
-        fclose(fp);
-        return 0;
+/* Run a job's kernel over every entry overlapping its copy range */
+static void *instance_worker(void *arg) {
+  const instance_job_t *job = (const instance_job_t *)arg;
+  const instance_range_t *ranges = job->data->ranges;
+
+  /* Last entry starting at or before the first copy; it is never empty */
+  int lo = 0, hi = job->data->num_molecules;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (ranges[mid].first_copy <= job->begin) lo = mid;
+    else hi = mid;
+  }
+
+  long long copy = job->begin;
+  for (int e = lo; e < job->data->num_molecules && copy < job->end; e++) {
+    long long last = ranges[e + 1].first_copy < job->end ? ranges[e + 1].first_copy : job->end;
+    if (last > copy) {
+      if (!job->dirty_only || ranges[e].dirty) {
+        job->kernel(job, &ranges[e], (int)(copy - ranges[e].first_copy),
+                    (int)(last - ranges[e].first_copy));
       }
+      copy = last;
+    }
+  }
+
+  return NULL;
+}
+
+/* Instantiate every copy (or those of dirty entries) with a kernel, in parallel when configured */
+static void run_instances(grotop_data *data, instance_kernel_t kernel, molfile_atom_t *atoms,
+                          int dirty_only) {
+  instance_job_t jobs[MAX_THREADS];
+  int njobs = data->nthreads;
+
+  if (njobs > data->total_copies / MIN_COPIES_PER_THREAD) {
+    njobs = (int)(data->total_copies / MIN_COPIES_PER_THREAD);
+  }
+  if (njobs < 1) njobs = 1;
+
+  for (int t = 0; t < njobs; t++) {
+    jobs[t].data = data;
+    jobs[t].kernel = kernel;
+    jobs[t].atoms = atoms;
+    jobs[t].dirty_only = dirty_only;
+    jobs[t].begin = data->total_copies / njobs * t + data->total_copies % njobs * t / njobs;
+    jobs[t].end = data->total_copies / njobs * (t + 1) + data->total_copies % njobs * (t + 1) / njobs;
+  }
+
+#ifndef _WIN32
+  if (njobs > 1) {
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    /* Job 0 runs on the calling thread; jobs that fail to start run inline */
+    for (int t = 1; t < njobs; t++) {
+      started[t] = pthread_create(&threads[t], NULL, instance_worker, &jobs[t]) == 0;
+    }
+    instance_worker(&jobs[0]);
+    for (int t = 1; t < njobs; t++) {
+      if (started[t]) pthread_join(threads[t], NULL);
+      else instance_worker(&jobs[t]);
+    }
+    return;
+  }
+#endif
+
+  for (int t = 0; t < njobs; t++) {
+    instance_worker(&jobs[t]);
+  }
+}
 
-      ifdef_depth--;
-      printf("grotopplugin) #endif (depth now %d)\n", ifdef_depth);
+/*
+ * The molfile API returns counts as int, so larger systems must use the
+ * chunked API or grotop_borrow_connectivity() below.
+ */
+static int molfile_count(grotop_data *data, const char *what, long long count) {
+  if (count > INT_MAX) {
+    report_error(data, "%lld %s exceed what the molfile API can return; "
+                 "use grotop_read_connectivity()", count, what);
+    return 0;
+  }
+  return 1;
+}
+
+/* Write the bonds into the slab, or only those of changed entries if already written */
+static int fill_bonds(grotop_data *data) {
+  if (!load_connectivity(data, 0) || !alloc_slab(data)) return 0;
+  if (!data->bond_from) return 1;
+
+  double start = wall_seconds();
+  run_instances(data, instantiate_bonds, NULL, data->slab_filled & SLAB_BONDS);
+  data->slab_filled |= SLAB_BONDS;
+  data->stats.bonds_seconds = wall_seconds() - start;
+  return 1;
+}
+
+/* Angles, dihedrals and impropers in one pass, likewise */
+static int fill_angles(grotop_data *data) {
+  if (!load_connectivity(data, 0) || !alloc_slab(data)) return 0;
+  if (!data->angles && !data->dihedrals && !data->impropers) return 1;
+
+  double start = wall_seconds();
+  run_instances(data, instantiate_connectivity, NULL, data->slab_filled & SLAB_ANGLES);
+  data->slab_filled |= SLAB_ANGLES;
+  data->stats.angles_seconds = wall_seconds() - start;
+  return 1;
+}
+
+static int read_grotop_structure(void *mydata, int *optflags, molfile_atom_t *atoms) {
+  grotop_data *data = (grotop_data *)mydata;
+
+  *optflags = MOLFILE_CHARGE | MOLFILE_MASS;
+
+  double start = wall_seconds();
+
+  /* Templates come from the arena, so build them before going parallel */
+  for (int mol_idx = 0; mol_idx < data->num_molecules; mol_idx++) {
+    moltype_t *mt = data->molecules[mol_idx].mt;
+    if (data->ranges[mol_idx].count == 0) continue;  /* Filtered out */
+    if (!mt->atom_template && !build_atom_template(data, mt)) return MOLFILE_ERROR;
+  }
+
+  /* Instantiate molecules: block copy of the template, then renumber residues */
+  run_instances(data, instantiate_atoms, atoms, 0);
+
+  data->stats.structure_seconds = wall_seconds() - start;
+  return MOLFILE_SUCCESS;
+}
+
+static int read_grotop_bonds(void *mydata, int *nbonds, int **fromptr, int **toptr,
+                             float **bondorderptr, int **bondtype,
+                             int *nbondtypes, char ***bondtypename) {
+  grotop_data *data = (grotop_data *)mydata;
+
+  if (data->total_bonds == 0) {
+    *nbonds = 0;
+    *fromptr = NULL;
+    *toptr = NULL;
+    *bondorderptr = NULL;
+    *bondtype = NULL;
+    *nbondtypes = 0;
+    *bondtypename = NULL;
+    return MOLFILE_SUCCESS;
+  }
+
+  /* Arrays kept by a reload (or an earlier call) only need the entries that changed */
+  if (!molfile_count(data, "bonds", data->total_bonds) || !fill_bonds(data)) return MOLFILE_ERROR;
+
+  *nbonds = (int)data->total_bonds;
+  *fromptr = data->bond_from;
+  *toptr = data->bond_to;
+  *bondorderptr = NULL;
+  *bondtype = NULL;
+  *nbondtypes = 0;
+  *bondtypename = NULL;
+
+  return MOLFILE_SUCCESS;
+}
+
+static int read_grotop_angles(void *handle, int *numangles, int **angles, int **angletypes,
+                               int *numangletypes, char ***angletypenames, int *numdihedrals,
+                               int **dihedrals, int **dihedraltypes, int *numdihedraltypes,
+                               char ***dihedraltypenames, int *numimpropers, int **impropers,
+                               int **impropertypes, int *numimpropertypes, char ***impropertypenames,
+                               int *numcterms, int **cterms, int *ctermcols, int *ctermrows) {
+  grotop_data *data = (grotop_data *)handle;
+
+  /* Initialize all pointers to NULL/0 */
+  *numangles = 0;
+  *angles = NULL;
+  *angletypes = NULL;
+  *numangletypes = 0;
+  *angletypenames = NULL;
+
+  *numdihedrals = 0;
+  *dihedrals = NULL;
+  *dihedraltypes = NULL;
+  *numdihedraltypes = 0;
+  *dihedraltypenames = NULL;
+
+  *numimpropers = 0;
+  *impropers = NULL;
+  *impropertypes = NULL;
+  *numimpropertypes = 0;
+  *impropertypenames = NULL;
+
+  *numcterms = 0;
+  *cterms = NULL;
+  *ctermcols = 0;
+  *ctermrows = 0;
+
+  if (!molfile_count(data, "angles", data->total_angles) ||
+      !molfile_count(data, "dihedrals", data->total_dihedrals) ||
+      !molfile_count(data, "impropers", data->total_impropers) ||
+      !fill_angles(data)) {
+    return MOLFILE_ERROR;
+  }
+
+  *numangles = (int)data->total_angles;
+  *angles = data->angles;
+  *numdihedrals = (int)data->total_dihedrals;
+  *dihedrals = data->dihedrals;
+  *numimpropers = (int)data->total_impropers;
+  *impropers = data->impropers;
+
+  return MOLFILE_SUCCESS;
+}
+
+/*
+ * Chunked Access
+ *
+ * Converters that cannot hold the whole system in memory read atoms and
+ * connectivity in bounded chunks instead: any range of atoms, or of items
+ * of one connectivity kind, can be produced directly from the moltype
+ * templates and the instance offsets. Items come out in the same order as
+ * from read_grotop_bonds() and read_grotop_angles(), as 1-based global atom
+ * indices.
+ */
+
+/* Item offset of an entry and per-copy item count for one kind */
+static long long kind_offset(const instance_range_t *r, int kind) {
+  switch (kind) {
+    case GROTOP_BONDS:     return r->bond_offset;
+    case GROTOP_ANGLES:    return r->angle_offset;
+    case GROTOP_DIHEDRALS: return r->dihedral_offset;
+    default:               return r->improper_offset;
+  }
+}
+
+static int kind_items(const moltype_t *mt, int kind) {
+  switch (kind) {
+    case GROTOP_BONDS:     return mt->nbonds;
+    case GROTOP_ANGLES:    return mt->nangles;
+    case GROTOP_DIHEDRALS: return mt->ndihedrals;
+    default:               return mt->nimpropers;
+  }
+}
+
+/* Number of atom indices per item of a connectivity kind, 0 if unknown */
+int grotop_connectivity_width(int kind) {
+  switch (kind) {
+    case GROTOP_BONDS:     return 2;
+    case GROTOP_ANGLES:    return 3;
+    case GROTOP_DIHEDRALS: return 4;
+    case GROTOP_IMPROPERS: return 4;
+    default:               return 0;
+  }
+}
+
+/* Total number of items of a connectivity kind, -1 if unknown */
+long long grotop_connectivity_count(void *handle, int kind) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!grotop_connectivity_width(kind)) return -1;
+  return kind_offset(&data->ranges[data->num_molecules], kind);
+}
+
+/*
+ * Write up to max items of a kind starting at item index first into out
+ * (width ints per item). Returns the number of items written, 0 past the
+ * end, or -1 for an unknown kind or connectivity that cannot be parsed.
+ */
+int grotop_read_connectivity(void *handle, int kind, long long first, int max, int *out) {
+  grotop_data *data = (grotop_data *)handle;
+  const instance_range_t *ranges = data->ranges;
+  int width = grotop_connectivity_width(kind);
+  if (!width || !load_connectivity(data, 0)) return -1;
+
+  long long total = kind_offset(&ranges[data->num_molecules], kind);
+  if (first < 0 || first >= total || max <= 0) return 0;
+  if (max > total - first) max = (int)(total - first);
+  double start = wall_seconds();
+
+  /* Last entry whose items start at or before first; it is never empty */
+  int lo = 0, hi = data->num_molecules;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (kind_offset(&ranges[mid], kind) <= first) lo = mid;
+    else hi = mid;
+  }
 
-      /* If we're in a section, re-enter it after processing the directive */
-      if (strlen(current_section) > 0) {
-        if (!process_section(fp, current_section, data, &current_mt)) {
-          fclose(fp);
-          return 0;
+  int written = 0;
+  for (int e = lo; written < max; e++) {
+    const moltype_t *mt = ranges[e].mt;
+    int n = kind_items(mt, kind);
+    if (n == 0 || ranges[e].count == 0) continue;
+
+    long long rel = first + written - kind_offset(&ranges[e], kind);
+    long long copy = rel / n;
+    int i = (int)(rel % n);
+
+    for (; copy < ranges[e].count && written < max; copy++, i = 0) {
+      int atom_offset = (int)(ranges[e].atom_offset + copy * mt->natoms);
+
+      for (; i < n && written < max; i++, written++) {
+        int *dst = &out[(size_t)written * width];
+        switch (kind) {
+          case GROTOP_BONDS:
+            dst[0] = atom_offset + mt->bonds[i].ai;
+            dst[1] = atom_offset + mt->bonds[i].aj;
+            break;
+          case GROTOP_ANGLES:
+            dst[0] = atom_offset + mt->angles[i].ai;
+            dst[1] = atom_offset + mt->angles[i].aj;
+            dst[2] = atom_offset + mt->angles[i].ak;
+            break;
+          default: {
+            const dihedral_data_t *d = (kind == GROTOP_DIHEDRALS) ? &mt->dihedrals[i] : &mt->impropers[i];
+            dst[0] = atom_offset + d->ai;
+            dst[1] = atom_offset + d->aj;
+            dst[2] = atom_offset + d->ak;
+            dst[3] = atom_offset + d->al;
+            break;
+          }
         }
       }
-      continue;
     }
+  }
 
-    /* Check if we should process this line based on conditional compilation state */
-    int should_process = 1;
-    for (int i = 0; i < ifdef_depth; i++) {
-      if (!ifdef_stack[i]) {
-        should_process = 0;
-        break;
-      }
+  double elapsed = wall_seconds() - start;
+  if (kind == GROTOP_BONDS) data->stats.bonds_seconds += elapsed;
+  else data->stats.angles_seconds += elapsed;
+  return written;
+}
+
+/* Last entry whose atoms start at or before atom index first */
+static int atom_entry(const grotop_data *data, long long first) {
+  int lo = 0, hi = data->num_molecules;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (data->ranges[mid].atom_offset <= first) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Write up to max atoms starting at atom index first into out, as
+ * read_grotop_structure() would fill them. Returns the number of atoms
+ * written, 0 past the end, or -1 if a template cannot be built.
+ */
+int grotop_read_atoms(void *handle, int first, int max, molfile_atom_t *out) {
+  grotop_data *data = (grotop_data *)handle;
+  const instance_range_t *ranges = data->ranges;
+
+  long long total = ranges[data->num_molecules].atom_offset;
+  if (first < 0 || first >= total || max <= 0) return 0;
+  if (max > total - first) max = (int)(total - first);
+  double start = wall_seconds();
+
+  int written = 0;
+  for (int e = atom_entry(data, first); written < max; e++) {
+    moltype_t *mt = ranges[e].mt;
+    if (mt->natoms == 0 || ranges[e].count == 0) continue;
+    if (!mt->atom_template && !build_atom_template(data, mt)) return -1;
+
+    long long rel = first + written - ranges[e].atom_offset;
+    long long copy = rel / mt->natoms;
+    int i = (int)(rel % mt->natoms);
+
+    for (; copy < ranges[e].count && written < max; copy++, i = 0) {
+      int residue_offset = (int)(ranges[e].residue_offset + copy * mt->nresidues);
+      int n = mt->natoms - i;
+      if (n > max - written) n = max - written;
+
+      memcpy(&out[written], &mt->atom_template[i], (size_t)n * sizeof(molfile_atom_t));
+      for (int k = 0; k < n; k++) out[written + k].resid += residue_offset;
+      written += n;
     }
+  }
+
+  data->stats.structure_seconds += wall_seconds() - start;
+  return written;
+}
 
-    if (!should_process) {
-      /* Skip this line - we're in a false conditional block */
-      continue;
-    }
+/*
+ * Bond Graph
+ *
+ * Every copy of a moltype has the same bond graph, so adjacency and
+ * connected fragments are worked out once per moltype from its bonds, as
+ * a CSR graph and a fragment label per atom, and produced for any range of
+ * the system by offsetting the templates. Setting up fragments or bonded
+ * selections then costs a copy per atom rather than a traversal of every
+ * bond. Atom indices are 0-based; neighbors are in bond order, both ends of
+ * a bond listing the other, and bonds to atoms outside the moltype are
+ * left out. Fragments are numbered in order of their first atom.
+ */
 
-    /* Handle includes */
-    char include_path[512];
-    if (parse_include(line, filepath, include_path)) {
-      /* Parse included file without closing this one */
-      if (!parse_topology_file(include_path, data, depth + 1)) {
-        fclose(fp);
-        return 0;
-      }
-      /* Continue reading current file */
-      continue;
-    }
+/* Find with path halving; parents always have lower indices than children */
+static int fragment_root(int *parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
 
-    strip_comments(line);
-    if (strlen(line) == 0) continue;
+static int build_bond_graph(grotop_data *data, moltype_t *mt) {
+  int n = mt->natoms;
+  int *start = (int *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (size_t)(n + 1) * sizeof(int));
+  int *fragment = (int *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (size_t)(n > 0 ? n : 1) * sizeof(int));
+  if (!start || !fragment) return 0;
+
+  /* Degrees, then their prefix sums */
+  for (int b = 0; b < mt->nbonds; b++) {
+    int i = mt->bonds[b].ai - 1, j = mt->bonds[b].aj - 1;
+    if (i < 0 || i >= n || j < 0 || j >= n) continue;
+    start[i + 1]++;
+    start[j + 1]++;
+  }
+  for (int i = 0; i < n; i++) start[i + 1] += start[i];
+
+  int *neighbors = (int *)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES,
+                                      (size_t)(start[n] > 0 ? start[n] : 1) * sizeof(int));
+  if (!neighbors) return 0;
+
+  /* fragment holds the fill position of each row, then the union-find parents */
+  for (int i = 0; i < n; i++) fragment[i] = start[i];
+  for (int b = 0; b < mt->nbonds; b++) {
+    int i = mt->bonds[b].ai - 1, j = mt->bonds[b].aj - 1;
+    if (i < 0 || i >= n || j < 0 || j >= n) continue;
+    neighbors[fragment[i]++] = j;
+    neighbors[fragment[j]++] = i;
+  }
 
-    /* Check for section header */
-    char section[64];
-    if (is_section_header(line, section)) {
-      /* New section encountered - clear previous section and enter new one */
-      strncpy(current_section, section, 63);
-      current_section[63] = '\0';
-      if (!process_section(fp, section, data, &current_mt)) {
-        fclose(fp);
-        return 0;
-      }
-      /* Keep current_section set - it will be cleared when we encounter the next section */
-    }
-    else if (strlen(current_section) > 0) {
-      /* We have a current section but this line is not a section header
-       * This shouldn't happen in normal flow - this line was already processed
-       * Skip it */
-    }
+  for (int i = 0; i < n; i++) fragment[i] = i;
+  for (int b = 0; b < mt->nbonds; b++) {
+    int i = mt->bonds[b].ai - 1, j = mt->bonds[b].aj - 1;
+    if (i < 0 || i >= n || j < 0 || j >= n) continue;
+    int ri = fragment_root(fragment, i), rj = fragment_root(fragment, j);
+    if (ri < rj) fragment[rj] = ri;
+    else if (rj < ri) fragment[ri] = rj;
   }
 
-  /* Check for unmatched #ifdef */
-  if (ifdef_depth != 0) {
-    fprintf(stderr, "grotopplugin) WARNING: %d unmatched #ifdef directive(s) in file %s\n",
-            ifdef_depth, filepath);
+  /* Roots are the first atom of their fragment, so one ascending pass labels every atom */
+  int nfragments = 0;
+  for (int i = 0; i < n; i++) {
+    int p = fragment[i];
+    fragment[i] = (p == i) ? nfragments++ : fragment[fragment_root(fragment, p)];
   }
 
-  fclose(fp);
+  mt->graph_start = start;
+  mt->graph_neighbors = neighbors;
+  mt->fragment = fragment;
+  mt->nfragments = nfragments;
   return 1;
 }
 
-/* Calculate total atoms from molecules section */
-static int calculate_total_atoms(grotop_data *data) {
-  int total = 0;
+/* Graphs of the instantiated moltypes and the offsets of every entry */
+static int plan_bond_graph(grotop_data *data) {
+  if (data->graph_offsets) return 1;
+  if (!load_connectivity(data, 0)) return 0;
 
-  for (int i = 0; i < data->num_molecules; i++) {
-    moltype_t *mt = find_moltype(data, data->molnames[i]);
-    if (!mt) {
-      fprintf(stderr, "grotopplugin) Unknown molecule type '%s' in [molecules] section\n",
-              data->molnames[i]);
-      return -1;
-    }
-    total += mt->natoms * data->molcounts[i];
+  long long *offsets = (long long *)arena_alloc(&data->arena, GROTOP_MEM_SYSTEM,
+                                                (size_t)(data->num_molecules + 1) * 2 * sizeof(long long));
+  if (!offsets) {
+    report_error(data, "Out of memory building the bond graph");
+    return 0;
   }
 
-  return total;
-}
-
-/* Calculate total bonds from molecules section */
-static int calculate_total_bonds(grotop_data *data) {
-  int total = 0;
+  long long neighbors = 0, fragments = 0;
+  for (int e = 0; e < data->num_molecules; e++) {
+    const instance_range_t *r = &data->ranges[e];
+    moltype_t *mt = r->mt;
+    if (r->count > 0 && !mt->graph_start && !build_bond_graph(data, mt)) {
+      report_error(data, "Out of memory building the bond graph of %s", mt->name);
+      return 0;
+    }
 
-  for (int i = 0; i < data->num_molecules; i++) {
-    moltype_t *mt = find_moltype(data, data->molnames[i]);
-    if (mt) {
-      total += mt->nbonds * data->molcounts[i];
+    offsets[2 * e] = neighbors;
+    offsets[2 * e + 1] = fragments;
+    if (r->count > 0) {
+      neighbors += (long long)r->count * mt->graph_start[mt->natoms];
+      fragments += (long long)r->count * mt->nfragments;
     }
   }
+  offsets[2 * data->num_molecules] = neighbors;
+  offsets[2 * data->num_molecules + 1] = fragments;
 
-  return total;
+  data->graph_offsets = offsets;
+  return 1;
 }
 
-/* Calculate total angles from molecules section */
-static int calculate_total_angles(grotop_data *data) {
-  int total = 0;
+/* Number of bonded fragments in the system, -1 if the bonds cannot be read */
+long long grotop_fragment_count(void *handle) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!plan_bond_graph(data)) return -1;
+  return data->graph_offsets[2 * data->num_molecules + 1];
+}
 
-  for (int i = 0; i < data->num_molecules; i++) {
-    moltype_t *mt = find_moltype(data, data->molnames[i]);
-    if (mt) {
-      total += mt->nangles * data->molcounts[i];
-    }
-  }
+/*
+ * Write the fragment of up to max atoms starting at atom index first into
+ * out. Returns the number of atoms written, 0 past the end, -1 on failure.
+ */
+int grotop_read_fragments(void *handle, int first, int max, int *out) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!plan_bond_graph(data)) return -1;
 
-  return total;
-}
+  const instance_range_t *ranges = data->ranges;
+  long long total = ranges[data->num_molecules].atom_offset;
+  if (first < 0 || first >= total || max <= 0) return 0;
+  if (max > total - first) max = (int)(total - first);
 
-/* Calculate total dihedrals from molecules section */
-static int calculate_total_dihedrals(grotop_data *data) {
-  int total = 0;
+  int written = 0;
+  for (int e = atom_entry(data, first); written < max; e++) {
+    const moltype_t *mt = ranges[e].mt;
+    if (mt->natoms == 0 || ranges[e].count == 0) continue;
 
-  for (int i = 0; i < data->num_molecules; i++) {
-    moltype_t *mt = find_moltype(data, data->molnames[i]);
-    if (mt) {
-      total += mt->ndihedrals * data->molcounts[i];
+    long long rel = first + written - ranges[e].atom_offset;
+    long long copy = rel / mt->natoms;
+    int i = (int)(rel % mt->natoms);
+
+    for (; copy < ranges[e].count && written < max; copy++, i = 0) {
+      int base = (int)(data->graph_offsets[2 * e + 1] + copy * mt->nfragments);
+      for (; i < mt->natoms && written < max; i++) out[written++] = base + mt->fragment[i];
     }
   }
 
-  return total;
+  return written;
 }
 
-/* Calculate total impropers from molecules section (counted from dihedrals with funct type 2 or 4) */
-static int calculate_total_impropers(grotop_data *data) {
-  int total = 0;
-
-  for (int i = 0; i < data->num_molecules; i++) {
-    moltype_t *mt = find_moltype(data, data->molnames[i]);
-    if (mt) {
-      /* Count improper dihedrals (function types 2 and 4) */
-      for (int j = 0; j < mt->ndihedrals; j++) {
-        if (mt->dihedrals[j].funct == 2 || mt->dihedrals[j].funct == 4) {
-          total += data->molcounts[i];
-        }
+/*
+ * CSR rows of up to max atoms starting at atom index first: start gets
+ * n + 1 offsets into the neighbor array of the whole system, and neighbors
+ * (if not NULL) the start[n] - start[0] neighbors of those atoms. Returns
+ * the number of atoms n, 0 past the end, -1 on failure.
+ */
+int grotop_read_bond_graph(void *handle, int first, int max, long long *start, int *neighbors) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!plan_bond_graph(data)) return -1;
+
+  const instance_range_t *ranges = data->ranges;
+  long long total = ranges[data->num_molecules].atom_offset;
+  if (first < 0 || first >= total || max <= 0) return 0;
+  if (max > total - first) max = (int)(total - first);
+
+  int written = 0;
+  long long base = -1;
+  for (int e = atom_entry(data, first); written < max; e++) {
+    const moltype_t *mt = ranges[e].mt;
+    if (mt->natoms == 0 || ranges[e].count == 0) continue;
+
+    long long rel = first + written - ranges[e].atom_offset;
+    long long copy = rel / mt->natoms;
+    int i = (int)(rel % mt->natoms);
+
+    for (; copy < ranges[e].count && written < max; copy++, i = 0) {
+      long long row = data->graph_offsets[2 * e] + copy * mt->graph_start[mt->natoms];
+      int atom_offset = (int)(ranges[e].atom_offset + copy * mt->natoms);
+      if (base < 0) base = row + mt->graph_start[i];
+
+      for (; i < mt->natoms && written < max; i++) {
+        start[written++] = row + mt->graph_start[i];
+        start[written] = row + mt->graph_start[i + 1];
+        if (!neighbors) continue;
+        int *dst = &neighbors[start[written - 1] - base];
+        for (int k = mt->graph_start[i]; k < mt->graph_start[i + 1]; k++)
+          *dst++ = atom_offset + mt->graph_neighbors[k];
       }
     }
   }
 
-  return total;
+  return written;
 }
 
 
 /*
- * Main Plugin API Functions
+ * Statistics
  */
 
-static void *open_grotop_read(const char *filepath, const char *filetype, int *natoms) {
-  grotop_data *data = (grotop_data *)calloc(1, sizeof(grotop_data));
-  if (!data) return NULL;
+/* Copy the timings and counters of an open handle */
+int grotop_get_stats(void *handle, grotop_stats_t *stats) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!data || !stats) return MOLFILE_ERROR;
 
-  strncpy(data->filepath, filepath, sizeof(data->filepath) - 1);
+  *stats = data->stats;
+  if (!data->image.buf) stats->files = data->num_files;
+  return MOLFILE_SUCCESS;
+}
 
-  /* Parse the topology file */
-  if (!parse_topology_file(filepath, data, 0)) {
-    fprintf(stderr, "grotopplugin) Failed to parse topology file\n");
-    free(data);
-    return NULL;
-  }
+/* Path and parse time of the index'th file read; returns 0 past the last one */
+int grotop_get_file_stats(void *handle, int index, const char **path, double *seconds) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!data || index < 0 || index >= data->num_files) return 0;
 
-  /* Calculate total atoms */
-  data->total_atoms = calculate_total_atoms(data);
-  if (data->total_atoms < 0) {
-    fprintf(stderr, "grotopplugin) Failed to calculate total atoms\n");
-    free(data);
-    return NULL;
+  if (path) *path = data->files[index].path;
+  if (seconds) *seconds = data->files[index].seconds;
+  return 1;
+}
+
+/* Print the statistics of a handle in the format used by the test programs */
+void grotop_print_stats(void *handle, FILE *fp) {
+  grotop_stats_t st;
+  if (grotop_get_stats(handle, &st) != MOLFILE_SUCCESS) return;
+
+  fprintf(fp, "Timing (seconds):\n");
+  fprintf(fp, "  Preprocess:  %.6f\n", st.preprocess_seconds);
+  fprintf(fp, "  Parse:       %.6f\n", st.parse_seconds);
+  fprintf(fp, "  Totals:      %.6f\n", st.totals_seconds);
+  fprintf(fp, "  Structure:   %.6f\n", st.structure_seconds);
+  fprintf(fp, "  Bonds:       %.6f\n", st.bonds_seconds);
+  fprintf(fp, "  Angles:      %.6f\n", st.angles_seconds);
+  fprintf(fp, "  Connectivity: %.6f\n", st.connectivity_seconds);
+  fprintf(fp, "Counters:\n");
+  fprintf(fp, "  Files:         %lld\n", st.files);
+  fprintf(fp, "  Lines:         %lld\n", st.lines);
+  fprintf(fp, "  Bytes:         %lld\n", st.bytes);
+  fprintf(fp, "  Includes:      %lld\n", st.includes);
+  fprintf(fp, "  Skipped lines: %lld\n", st.skipped_lines);
+  fprintf(fp, "  Cache hits:    %lld\n", st.cache_hits);
+  fprintf(fp, "  Cache misses:  %lld\n", st.cache_misses);
+  fprintf(fp, "  Reused:        %lld\n", st.reused);
+
+  const char *path;
+  double seconds;
+  for (int i = 0; grotop_get_file_stats(handle, i, &path, &seconds); i++) {
+    if (seconds > 0.0) fprintf(fp, "  %.6f  %s\n", seconds, path);
   }
+}
 
-  data->total_bonds = calculate_total_bonds(data);
-  data->total_angles = calculate_total_angles(data);
-  data->total_dihedrals = calculate_total_dihedrals(data);
-  data->total_impropers = calculate_total_impropers(data);
+/* Copy the memory account of an open handle, see "Memory Accounting" */
+int grotop_get_memory(void *handle, grotop_memory_t *memory) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!data || !memory) return MOLFILE_ERROR;
 
-  *natoms = data->total_atoms;
+  *memory = data->memory;
+  return MOLFILE_SUCCESS;
+}
 
-  printf("grotopplugin) Parsed %d molecule types, %d atoms total, %d bonds, %d angles, %d dihedrals, %d impropers\n",
-         data->num_moltypes, data->total_atoms, data->total_bonds,
-         data->total_angles, data->total_dihedrals, data->total_impropers);
+/* Print the bytes held per category and their high-water marks */
+void grotop_print_memory(void *handle, FILE *fp) {
+  grotop_memory_t m;
+  if (grotop_get_memory(handle, &m) != MOLFILE_SUCCESS) return;
 
-  return data;
+  fprintf(fp, "Memory (bytes):       current          peak\n");
+  for (int c = 0; c < GROTOP_MEM_CATEGORIES; c++) {
+    char label[32];
+    snprintf(label, sizeof(label), "%s:", memory_category_names[c]);
+    fprintf(fp, "  %-14s %13lld %13lld\n", label, m.current[c], m.peak[c]);
+  }
+  fprintf(fp, "  %-14s %13lld %13lld\n", "Total:", m.total, m.peak_total);
 }
 
-static int read_grotop_structure(void *mydata, int *optflags, molfile_atom_t *atoms) {
+static void close_grotop_read(void *mydata) {
   grotop_data *data = (grotop_data *)mydata;
+  if (!data) return;
 
-  *optflags = MOLFILE_CHARGE | MOLFILE_MASS;
+  /* Free bond, angle, dihedral and improper arrays */
+  free_connectivity(data);
 
-  int global_atom_idx = 0;
-  int residue_offset = 0;  /* Track residue numbering across all molecules */
+  /* Molecule types, atom types, molecules and symbols all live in the arena */
+  arena_reset(&data->arena);
 
-  /* Instantiate molecules */
-  for (int mol_idx = 0; mol_idx < data->num_molecules; mol_idx++) {
-    moltype_t *mt = find_moltype(data, data->molnames[mol_idx]);
-    if (!mt) continue;
+  if (data->image.buf) lexer_close(&data->image);
 
-    int count = data->molcounts[mol_idx];
+  free(data);
+}
 
-    /* Generate segment ID - same for all copies of this molecule type */
-    /* Truncate to 4 characters and convert to uppercase (match Python behavior) */
-    char segid[8];
-    snprintf(segid, sizeof(segid), "%.4s", mt->name);
-    for (int j = 0; segid[j]; j++) {
-      segid[j] = toupper(segid[j]);
-    }
 
-    /* Find min and max residue numbers in this molecule type */
-    int min_resid = mt->natoms > 0 ? mt->atoms[0].resnr : 1;
-    int max_resid = min_resid;
-    for (int i = 0; i < mt->natoms; i++) {
-      if (mt->atoms[i].resnr < min_resid) min_resid = mt->atoms[i].resnr;
-      if (mt->atoms[i].resnr > max_resid) max_resid = mt->atoms[i].resnr;
-    }
-    int num_residues = max_resid - min_resid + 1;
+/*
+ * Compiled Binary Topology (.tpb)
+ *
+ * A .tpb file is a snapshot of a fully resolved topology: moltype
+ * templates, atom types, the [ molecules ] list, the system totals and the
+ * string pool that the atom columns index, in symbol table order.
+ * All blocks are native-endian and 8-byte aligned so the reader can map
+ * the file and instantiate directly from the mapped templates.
+ */
 
-    /* Create multiple copies */
-    for (int copy = 0; copy < count; copy++) {
-      /* Calculate residue offset for this molecule instance */
-      int resid_offset = residue_offset - min_resid + 1;
+#define GROTOP_TPB_MAGIC "GROTPB\0"
+#define GROTOP_TPB_VERSION 5
+#define GROTOP_TPB_BYTEORDER 0x01020304
 
-      /* Copy atoms */
-      for (int i = 0; i < mt->natoms; i++) {
-        atom_data_t *src = &mt->atoms[i];
-        molfile_atom_t *dst = &atoms[global_atom_idx];
+typedef struct {
+  char magic[8];
+  int version;
+  int byteorder;             /* GROTOP_TPB_BYTEORDER as written */
+  int atom_size;             /* Layout checks for the raw template blocks (columns per atom) */
+  int bond_size;
+  int angle_size;
+  int dihedral_size;
+  int num_moltypes;
+  int num_atomtypes;
+  int num_molecules;
+  int num_strings;
+  long long total_atoms;
+  long long total_bonds;
+  long long total_angles;
+  long long total_dihedrals;
+  long long total_impropers;
+  long long moltypes_offset;   /* tpb_moltype_t[num_moltypes] */
+  long long atomtypes_offset;  /* atomtype_t[num_atomtypes] */
+  long long molecules_offset;  /* tpb_molecule_t[num_molecules] */
+  long long strings_offset;    /* num_strings NUL-terminated strings */
+  long long strings_size;      /* Bytes in the string block */
+} tpb_header_t;
 
-        strncpy(dst->name, src->atom_name, sizeof(dst->name) - 1);
-        dst->name[sizeof(dst->name) - 1] = '\0';
+typedef struct {
+  char name[32];
+  int nrexcl;
+  int natoms;
+  int nbonds;
+  int nangles;
+  int ndihedrals;
+  int nimpropers;
+  long long atoms_offset;      /* ATOM_COLUMNS columns of natoms 4-byte elements */
+  long long bonds_offset;      /* bond_data_t[nbonds] */
+  long long angles_offset;     /* angle_data_t[nangles] */
+  long long dihedrals_offset;  /* dihedral_data_t[ndihedrals] */
+  long long impropers_offset;  /* dihedral_data_t[nimpropers] */
+} tpb_moltype_t;
 
-        strncpy(dst->type, src->atom_type, sizeof(dst->type) - 1);
-        dst->type[sizeof(dst->type) - 1] = '\0';
+typedef struct {
+  int moltype;                 /* Index into the moltype table */
+  int count;
+} tpb_molecule_t;
+
+/* Pad the output to the next 8-byte boundary and return the offset */
+static long long out_align(outbuf_t *ob) {
+  static const char zeros[8] = { 0 };
+  if (ob->len % 8) out_bytes(ob, zeros, 8 - ob->len % 8);
+  return (long long)ob->len;
+}
 
-        strncpy(dst->resname, src->residue, sizeof(dst->resname) - 1);
-        dst->resname[sizeof(dst->resname) - 1] = '\0';
+/* Write an open topology handle as a .tpb file (used by test_grotop_to_tpb) */
+int grotop_write_tpb(void *handle, const char *filepath) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!load_connectivity(data, 1)) return MOLFILE_ERROR;
 
-        /* Adjust residue ID to be continuous across all molecule copies */
-        dst->resid = src->resnr + resid_offset;
+  outbuf_t ob;
+  memset(&ob, 0, sizeof(ob));
+  ob.memory = &data->memory;
 
-        strncpy(dst->segid, segid, sizeof(dst->segid) - 1);
-        dst->segid[sizeof(dst->segid) - 1] = '\0';
+  tpb_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  out_bytes(&ob, &hdr, sizeof(hdr));  /* Filled in once offsets are known */
 
-        dst->chain[0] = '\0';
+  tpb_moltype_t *mts = (tpb_moltype_t *)calloc(data->num_moltypes + 1, sizeof(tpb_moltype_t));
+  if (!mts) {
+    out_free(&ob);
+    return MOLFILE_ERROR;
+  }
 
-        dst->charge = src->charge;
+  /* Template blocks first, then the tables that point at them */
+  for (int i = 0; i < data->num_moltypes; i++) {
+    moltype_t *mt = data->moltypes[i];
+    memcpy(mts[i].name, mt->name, sizeof(mts[i].name));
+    mts[i].nrexcl = mt->nrexcl;
+    mts[i].natoms = mt->natoms;
+    mts[i].nbonds = mt->nbonds;
+    mts[i].nangles = mt->nangles;
+    mts[i].ndihedrals = mt->ndihedrals;
+    mts[i].nimpropers = mt->nimpropers;
+
+    void *cols[ATOM_COLUMNS];
+    atom_column_list(&mt->atoms, cols);
+    mts[i].atoms_offset = out_align(&ob);
+    for (int k = 0; k < ATOM_COLUMNS; k++) out_bytes(&ob, cols[k], (size_t)mt->natoms * sizeof(int));
+    mts[i].bonds_offset = out_align(&ob);
+    out_bytes(&ob, mt->bonds, (size_t)mt->nbonds * sizeof(bond_data_t));
+    mts[i].angles_offset = out_align(&ob);
+    out_bytes(&ob, mt->angles, (size_t)mt->nangles * sizeof(angle_data_t));
+    mts[i].dihedrals_offset = out_align(&ob);
+    out_bytes(&ob, mt->dihedrals, (size_t)mt->ndihedrals * sizeof(dihedral_data_t));
+    mts[i].impropers_offset = out_align(&ob);
+    out_bytes(&ob, mt->impropers, (size_t)mt->nimpropers * sizeof(dihedral_data_t));
+  }
 
-        /* Use mass from atom or lookup from atomtypes */
-        if (src->mass > 0.0f) {
-          dst->mass = src->mass;
-        } else {
-          dst->mass = find_atomtype_mass(data, src->atom_type);
-        }
+  hdr.moltypes_offset = out_align(&ob);
+  out_bytes(&ob, mts, (size_t)data->num_moltypes * sizeof(tpb_moltype_t));
+  free(mts);
 
-        global_atom_idx++;
-      }
+  hdr.atomtypes_offset = out_align(&ob);
+  out_bytes(&ob, data->atomtypes, (size_t)data->num_atomtypes * sizeof(atomtype_t));
 
-      /* Update residue offset for next molecule copy */
-      residue_offset += num_residues;
-    }
+  hdr.molecules_offset = out_align(&ob);
+  for (int i = 0; i < data->num_molecules; i++) {
+    tpb_molecule_t mol;
+    mol.moltype = symtab_find(&data->symtab, data->molecules[i].name)->moltype;
+    mol.count = data->ranges[i].count;   /* The system as filtered */
+    out_bytes(&ob, &mol, sizeof(mol));
   }
 
-  return MOLFILE_SUCCESS;
-}
-
-static int read_grotop_bonds(void *mydata, int *nbonds, int **fromptr, int **toptr,
-                             float **bondorderptr, int **bondtype,
-                             int *nbondtypes, char ***bondtypename) {
-  grotop_data *data = (grotop_data *)mydata;
+  hdr.strings_offset = out_align(&ob);
+  for (int i = 0; i < data->symtab.nsyms; i++) {
+    out_bytes(&ob, data->symtab.syms[i].name, strlen(data->symtab.syms[i].name) + 1);
+  }
+  hdr.strings_size = (long long)ob.len - hdr.strings_offset;
+
+  memcpy(hdr.magic, GROTOP_TPB_MAGIC, sizeof(hdr.magic));
+  hdr.version = GROTOP_TPB_VERSION;
+  hdr.byteorder = GROTOP_TPB_BYTEORDER;
+  hdr.atom_size = ATOM_COLUMNS;
+  hdr.bond_size = (int)sizeof(bond_data_t);
+  hdr.angle_size = (int)sizeof(angle_data_t);
+  hdr.dihedral_size = (int)sizeof(dihedral_data_t);
+  hdr.num_moltypes = data->num_moltypes;
+  hdr.num_atomtypes = data->num_atomtypes;
+  hdr.num_molecules = data->num_molecules;
+  hdr.num_strings = data->symtab.nsyms;
+  hdr.total_atoms = data->total_atoms;
+  hdr.total_bonds = data->total_bonds;
+  hdr.total_angles = data->total_angles;
+  hdr.total_dihedrals = data->total_dihedrals;
+  hdr.total_impropers = data->total_impropers;
+
+  if (ob.failed) {
+    out_free(&ob);
+    return MOLFILE_ERROR;
+  }
+  memcpy(ob.buf, &hdr, sizeof(hdr));
 
-  if (data->total_bonds == 0) {
-    *nbonds = 0;
-    *fromptr = NULL;
-    *toptr = NULL;
-    *bondorderptr = NULL;
-    *bondtype = NULL;
-    *nbondtypes = 0;
-    *bondtypename = NULL;
-    return MOLFILE_SUCCESS;
+  FILE *fp = fopen(filepath, "wb");
+  if (!fp) {
+    char reason[128];
+    report_error(data, "Cannot create file '%s': %s", filepath, errno_string(errno, reason, sizeof(reason)));
+    out_free(&ob);
+    return MOLFILE_ERROR;
   }
 
-  /* Allocate bond arrays */
-  data->bond_from = (int *)malloc(data->total_bonds * sizeof(int));
-  data->bond_to = (int *)malloc(data->total_bonds * sizeof(int));
+  int written = fwrite(ob.buf, 1, ob.len, fp) == ob.len;
+  if (fclose(fp) != 0) written = 0;
+  out_free(&ob);
 
-  if (!data->bond_from || !data->bond_to) {
-    if (data->bond_from) free(data->bond_from);
-    if (data->bond_to) free(data->bond_to);
+  if (!written) {
+    report_error(data, "Error writing '%s'", filepath);
     return MOLFILE_ERROR;
   }
 
-  int bond_idx = 0;
-  int global_atom_offset = 0;
+  return MOLFILE_SUCCESS;
+}
+
+/* Check that a block of count elements at offset lies inside the image */
+static int tpb_block_ok(const lexer_t *img, long long offset, long long count, size_t elsize) {
+  if (offset < 0 || count < 0 || offset % 8) return 0;
+  if ((unsigned long long)offset > img->len) return 0;
+  return (unsigned long long)count <= (img->len - (size_t)offset) / elsize;
+}
 
-  /* Instantiate bonds */
-  for (int mol_idx = 0; mol_idx < data->num_molecules; mol_idx++) {
-    moltype_t *mt = find_moltype(data, data->molnames[mol_idx]);
-    if (!mt) continue;
+/* Map a compiled topology into a fresh handle; 0 with data->error set on failure */
+static int load_tpb(grotop_data *data, const char *filepath) {
+  double t0 = wall_seconds();
+  if (!lexer_open(&data->image, filepath, &data->memory)) {
+    char reason[128];
+    report_error(data, "Cannot open file '%s': %s", filepath, errno_string(errno, reason, sizeof(reason)));
+    return 0;
+  }
 
-    int count = data->molcounts[mol_idx];
+  const lexer_t *img = &data->image;
+  const tpb_header_t *hdr = (const tpb_header_t *)img->buf;
+  if (img->len < sizeof(tpb_header_t) ||
+      memcmp(hdr->magic, GROTOP_TPB_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != GROTOP_TPB_VERSION ||
+      hdr->byteorder != GROTOP_TPB_BYTEORDER ||
+      hdr->atom_size != ATOM_COLUMNS ||
+      hdr->bond_size != (int)sizeof(bond_data_t) ||
+      hdr->angle_size != (int)sizeof(angle_data_t) ||
+      hdr->dihedral_size != (int)sizeof(dihedral_data_t)) {
+    report_error(data, "'%s' is not a compatible .tpb file", filepath);
+    return 0;
+  }
 
-    for (int copy = 0; copy < count; copy++) {
-      for (int i = 0; i < mt->nbonds; i++) {
-        /* Convert to 1-based global indices */
-        data->bond_from[bond_idx] = global_atom_offset + mt->bonds[i].ai;
-        data->bond_to[bond_idx] = global_atom_offset + mt->bonds[i].aj;
-        bond_idx++;
-      }
+  if (!tpb_block_ok(img, hdr->moltypes_offset, hdr->num_moltypes, sizeof(tpb_moltype_t)) ||
+      !tpb_block_ok(img, hdr->atomtypes_offset, hdr->num_atomtypes, sizeof(atomtype_t)) ||
+      !tpb_block_ok(img, hdr->molecules_offset, hdr->num_molecules, sizeof(tpb_molecule_t)) ||
+      !tpb_block_ok(img, hdr->strings_offset, hdr->strings_size, 1) ||
+      hdr->num_strings < 0 || (hdr->num_strings > 0 && hdr->strings_size < 1) ||
+      (hdr->strings_size > 0 && img->buf[hdr->strings_offset + hdr->strings_size - 1] != '\0')) {
+    report_error(data, "Corrupt .tpb file '%s'", filepath);
+    return 0;
+  }
 
-      global_atom_offset += mt->natoms;
+  /* The pool is interned in order, so string indices keep their meaning */
+  const char *str = img->buf + hdr->strings_offset, *str_end = str + hdr->strings_size;
+  for (int i = 0; i < hdr->num_strings; i++) {
+    if (str >= str_end || intern_string(data, str) != i) {
+      report_error(data, "Corrupt .tpb file '%s'", filepath);
+      return 0;
     }
+    str += strlen(str) + 1;
   }
 
-  *nbonds = data->total_bonds;
-  *fromptr = data->bond_from;
-  *toptr = data->bond_to;
-  *bondorderptr = NULL;
-  *bondtype = NULL;
-  *nbondtypes = 0;
-  *bondtypename = NULL;
+  /* Atom types and templates are used in place from the mapped image */
+  data->atomtypes = (atomtype_t *)(img->buf + hdr->atomtypes_offset);
+  data->num_atomtypes = hdr->num_atomtypes;
 
-  return MOLFILE_SUCCESS;
-}
+  const tpb_moltype_t *mts = (const tpb_moltype_t *)(img->buf + hdr->moltypes_offset);
+  data->moltypes = (moltype_t **)arena_alloc(&data->arena, GROTOP_MEM_TEMPLATES, (hdr->num_moltypes + 1) * sizeof(moltype_t *));
+  if (!data->moltypes) {
+    return 0;
+  }
 
-static int read_grotop_angles(void *handle, int *numangles, int **angles, int **angletypes,
-                               int *numangletypes, char ***angletypenames, int *numdihedrals,
-                               int **dihedrals, int **dihedraltypes, int *numdihedraltypes,
-                               char ***dihedraltypenames, int *numimpropers, int **impropers,
-                               int **impropertypes, int *numimpropertypes, char ***impropertypenames,
-                               int *numcterms, int **cterms, int *ctermcols, int *ctermrows) {
-  grotop_data *data = (grotop_data *)handle;
+  for (int i = 0; i < hdr->num_moltypes; i++) {
+    const tpb_moltype_t *src = &mts[i];
+    if (!tpb_block_ok(img, src->atoms_offset, src->natoms, ATOM_COLUMNS * sizeof(int)) ||
+        !tpb_block_ok(img, src->bonds_offset, src->nbonds, sizeof(bond_data_t)) ||
+        !tpb_block_ok(img, src->angles_offset, src->nangles, sizeof(angle_data_t)) ||
+        !tpb_block_ok(img, src->dihedrals_offset, src->ndihedrals, sizeof(dihedral_data_t)) ||
+        !tpb_block_ok(img, src->impropers_offset, src->nimpropers, sizeof(dihedral_data_t))) {
+      report_error(data, "Corrupt .tpb file '%s'", filepath);
+      return 0;
+    }
 
-  /* Initialize all pointers to NULL/0 */
-  *numangles = 0;
-  *angles = NULL;
-  *angletypes = NULL;
-  *numangletypes = 0;
-  *angletypenames = NULL;
+    moltype_t *mt = create_moltype(data);
+    if (!mt) {
+      return 0;
+    }
+    memcpy(mt->name, src->name, sizeof(mt->name));
+    mt->name[sizeof(mt->name) - 1] = '\0';
+    mt->nrexcl = src->nrexcl;
+    mt->natoms = mt->atoms_allocated = src->natoms;
+    set_atom_columns(&mt->atoms, mt->natoms > 0 ? (void *)(img->buf + src->atoms_offset) : NULL, mt->natoms);
+    mt->nbonds = mt->bonds_allocated = src->nbonds;
+    mt->bonds = (bond_data_t *)(img->buf + src->bonds_offset);
+    mt->nangles = mt->angles_allocated = src->nangles;
+    mt->angles = (angle_data_t *)(img->buf + src->angles_offset);
+    mt->ndihedrals = mt->dihedrals_allocated = src->ndihedrals;
+    mt->dihedrals = (dihedral_data_t *)(img->buf + src->dihedrals_offset);
+    mt->nimpropers = mt->impropers_allocated = src->nimpropers;
+    mt->impropers = (dihedral_data_t *)(img->buf + src->impropers_offset);
+
+    const atom_columns_t *a = &mt->atoms;
+    for (int j = 0; j < mt->natoms; j++) {
+      if (a->atomtype[j] < -1 || a->atomtype[j] >= data->num_atomtypes ||
+          (unsigned)a->type[j] >= (unsigned)hdr->num_strings ||
+          (unsigned)a->residue[j] >= (unsigned)hdr->num_strings ||
+          (unsigned)a->name[j] >= (unsigned)hdr->num_strings) {
+        report_error(data, "Corrupt .tpb file '%s'", filepath);
+        return 0;
+      }
+    }
 
-  *numdihedrals = 0;
-  *dihedrals = NULL;
-  *dihedraltypes = NULL;
-  *numdihedraltypes = 0;
-  *dihedraltypenames = NULL;
+    /* Names resolve as in the parsed topology (the first definition wins) */
+    symbol_t *sym = symtab_intern(&data->symtab, mt->name);
+    if (!sym) return 0;
+    if (sym->moltype < 0) sym->moltype = i;
 
-  *numimpropers = 0;
-  *impropers = NULL;
-  *impropertypes = NULL;
-  *numimpropertypes = 0;
-  *impropertypenames = NULL;
+    data->moltypes[i] = mt;
+    data->num_moltypes++;
+  }
 
-  *numcterms = 0;
-  *cterms = NULL;
-  *ctermcols = 0;
-  *ctermrows = 0;
+  const tpb_molecule_t *mols = (const tpb_molecule_t *)(img->buf + hdr->molecules_offset);
+  data->molecules = (molecule_t *)arena_alloc(&data->arena, GROTOP_MEM_SYSTEM, (hdr->num_molecules + 1) * sizeof(molecule_t));
+  if (!data->molecules) {
+    return 0;
+  }
 
-  /* Allocate angle arrays if needed */
-  if (data->total_angles > 0) {
-    data->angles = (int *)malloc(data->total_angles * 3 * sizeof(int));
-    if (!data->angles) return MOLFILE_ERROR;
+  for (int i = 0; i < hdr->num_molecules; i++) {
+    if (mols[i].moltype < 0 || mols[i].moltype >= data->num_moltypes) {
+      report_error(data, "Corrupt .tpb file '%s'", filepath);
+      return 0;
+    }
+    data->molecules[i].mt = data->moltypes[mols[i].moltype];
+    data->molecules[i].name = data->molecules[i].mt->name;
+    data->molecules[i].count = mols[i].count;
+    data->num_molecules++;
+  }
 
-    int angle_idx = 0;
-    int global_atom_offset = 0;
+  double t1 = wall_seconds();
+  data->stats.parse_seconds = t1 - t0;
+  data->stats.files = 1;
+  data->stats.bytes = (long long)img->len;
 
-    /* Instantiate angles */
-    for (int mol_idx = 0; mol_idx < data->num_molecules; mol_idx++) {
-      moltype_t *mt = find_moltype(data, data->molnames[mol_idx]);
-      if (!mt) continue;
+  /* Totals are checked for the system as stored, then the filter is applied */
+  const char *include = data->include_molecules, *exclude = data->exclude_molecules;
+  data->include_molecules = data->exclude_molecules = NULL;
+  if (!plan_instances(data)) {
+    return 0;
+  }
 
-      int count = data->molcounts[mol_idx];
+  if (data->total_atoms != hdr->total_atoms || data->total_bonds != hdr->total_bonds ||
+      data->total_angles != hdr->total_angles || data->total_dihedrals != hdr->total_dihedrals ||
+      data->total_impropers != hdr->total_impropers) {
+    report_error(data, "Corrupt .tpb file '%s'", filepath);
+    return 0;
+  }
 
-      for (int copy = 0; copy < count; copy++) {
-        for (int i = 0; i < mt->nangles; i++) {
-          data->angles[angle_idx * 3 + 0] = global_atom_offset + mt->angles[i].ai;
-          data->angles[angle_idx * 3 + 1] = global_atom_offset + mt->angles[i].aj;
-          data->angles[angle_idx * 3 + 2] = global_atom_offset + mt->angles[i].ak;
-          angle_idx++;
-        }
+  data->include_molecules = include;
+  data->exclude_molecules = exclude;
+  if ((include || exclude) && !plan_instances(data)) {
+    return 0;
+  }
+  data->stats.totals_seconds = wall_seconds() - t1;
 
-        global_atom_offset += mt->natoms;
-      }
-    }
+  data->nthreads = configured_threads();
+
+  GROTOP_LOG(data, LOG_SUMMARY, "grotopplugin) Mapped %d molecule types, %lld atoms total, %lld bonds, %lld angles, %lld dihedrals, %lld impropers\n",
+             data->num_moltypes, data->total_atoms, data->total_bonds,
+             data->total_angles, data->total_dihedrals, data->total_impropers);
+
+  return 1;
+}
 
-    *numangles = data->total_angles;
-    *angles = data->angles;
+/*
+ * Open a topology (a compiled one if tpb is set) with an explicit
+ * verbosity. On failure the handle's last error is copied to error.
+ */
+static void *open_handle(const char *filepath, int tpb, int verbosity, int *natoms,
+                         char *error, size_t error_size) {
+  grotop_data *data = alloc_handle(filepath);
+  if (!data) {
+    if (error && error_size) snprintf(error, error_size, "Out of memory");
+    return NULL;
   }
 
-  /* Allocate dihedral arrays if needed */
-  if (data->total_dihedrals > 0) {
-    data->dihedrals = (int *)malloc(data->total_dihedrals * 4 * sizeof(int));
-    if (!data->dihedrals) {
-      if (data->angles) free(data->angles);
-      return MOLFILE_ERROR;
-    }
+  data->verbosity = clamp_verbosity(verbosity);
 
-    int dihedral_idx = 0;
-    int global_atom_offset = 0;
+  if (!set_molecule_filter(data, getenv("GROTOP_INCLUDE_MOLECULES"), getenv("GROTOP_EXCLUDE_MOLECULES")) ||
+      !(tpb ? load_tpb(data, filepath) : load_topology(data, filepath))) {
+    if (error && error_size) snprintf(error, error_size, "%s", data->error);
+    close_grotop_read(data);
+    return NULL;
+  }
 
-    /* Instantiate dihedrals (only proper dihedrals, not impropers) */
-    for (int mol_idx = 0; mol_idx < data->num_molecules; mol_idx++) {
-      moltype_t *mt = find_moltype(data, data->molnames[mol_idx]);
-      if (!mt) continue;
+  *natoms = (int)data->total_atoms;
+  return data;
+}
 
-      int count = data->molcounts[mol_idx];
+static void *open_grotop_read(const char *filepath, const char *filetype, int *natoms) {
+  return open_handle(filepath, 0, configured_verbosity(), natoms, NULL, 0);
+}
 
-      for (int copy = 0; copy < count; copy++) {
-        for (int i = 0; i < mt->ndihedrals; i++) {
-          /* Skip improper dihedrals (function types 2 and 4) */
-          if (mt->dihedrals[i].funct == 2 || mt->dihedrals[i].funct == 4) continue;
+static void *open_tpb_read(const char *filepath, const char *filetype, int *natoms) {
+  return open_handle(filepath, 1, configured_verbosity(), natoms, NULL, 0);
+}
 
-          data->dihedrals[dihedral_idx * 4 + 0] = global_atom_offset + mt->dihedrals[i].ai;
-          data->dihedrals[dihedral_idx * 4 + 1] = global_atom_offset + mt->dihedrals[i].aj;
-          data->dihedrals[dihedral_idx * 4 + 2] = global_atom_offset + mt->dihedrals[i].ak;
-          data->dihedrals[dihedral_idx * 4 + 3] = global_atom_offset + mt->dihedrals[i].al;
-          dihedral_idx++;
-        }
+/*
+ * Reentrant open for concurrent callers: the verbosity is given rather than
+ * taken from the process-wide default, and the reason for a failure is
+ * returned in error (if not NULL). Files ending in .tpb are opened as
+ * compiled topologies.
+ */
+void *grotop_open(const char *filepath, int verbosity, int *natoms, char *error, size_t error_size) {
+  const char *ext = strrchr(filepath, '.');
+  int tpb = ext && strcmp(ext, ".tpb") == 0;
+  return open_handle(filepath, tpb, verbosity, natoms, error, error_size);
+}
 
-        global_atom_offset += mt->natoms;
-      }
-    }
+/*
+ * Bring an open handle up to date with the files it was read from. Only
+ * changed includes are parsed again; see "Incremental Reload" above.
+ * Returns 1 if the topology was reloaded, 0 if no file changed and -1 if
+ * the reload failed, leaving the handle as it was. After a reload atoms,
+ * bonds and angles must be read again: arrays returned earlier are kept
+ * and patched while their counts are unchanged, and replaced otherwise.
+ */
+int grotop_reload(void *handle, int *natoms) {
+  grotop_data *data = (grotop_data *)handle;
+  *natoms = (int)data->total_atoms;
 
-    *numdihedrals = dihedral_idx;
-    *dihedrals = data->dihedrals;
+  if (data->image.buf) {
+    report_error(data, "Compiled topology %s cannot be reloaded; open it again", data->filepath);
+    return -1;
   }
 
-  /* Allocate improper arrays if needed */
-  if (data->total_impropers > 0) {
-    data->impropers = (int *)malloc(data->total_impropers * 4 * sizeof(int));
-    if (!data->impropers) {
-      if (data->angles) free(data->angles);
-      if (data->dihedrals) free(data->dihedrals);
-      return MOLFILE_ERROR;
+  int changed = 0;
+  for (int i = 0; i < data->num_files; i++) {
+    file_record_t *rec = &data->files[i];
+    long long mtime, size;
+    rec->changed = !stat_file(rec->path, &mtime, &size) || mtime != rec->mtime || size != rec->size;
+    if (rec->changed) {
+      GROTOP_LOG(data, LOG_DEBUG, "grotopplugin) Changed: %s\n", rec->path);
+      changed++;
     }
+  }
+  if (!changed) return 0;
+
+  grotop_data *fresh = alloc_handle(data->filepath);
+  if (!fresh) {
+    report_error(data, "Out of memory reloading %s", data->filepath);
+    return -1;
+  }
+  fresh->verbosity = data->verbosity;
+  fresh->previous = data;
+
+  if (!set_molecule_filter(fresh, data->include_molecules, data->exclude_molecules) ||
+      !load_topology(fresh, data->filepath)) {
+    snprintf(data->error, sizeof(data->error), "%s", fresh->error);
+    close_grotop_read(fresh);
+    return -1;
+  }
 
-    int improper_idx = 0;
-    int global_atom_offset = 0;
+  int dirty = reuse_previous(fresh, data);
+  fresh->previous = NULL;
+  GROTOP_LOG(fresh, LOG_SUMMARY, "grotopplugin) Reloaded %s: %d changed files, %lld includes reused, "
+             "%d of %d [ molecules ] entries changed\n", data->filepath, changed,
+             fresh->stats.reused, dirty, fresh->num_molecules);
+
+  /* The caller keeps its handle: swap the contents and release the old ones */
+  grotop_data old = *data;
+  *data = *fresh;
+  *fresh = old;
+  bind_handle(data);
+  bind_handle(fresh);
+  close_grotop_read(fresh);
+
+  *natoms = (int)data->total_atoms;
+  return 1;
+}
 
-    /* Instantiate impropers (function types 2 and 4) */
-    for (int mol_idx = 0; mol_idx < data->num_molecules; mol_idx++) {
-      moltype_t *mt = find_moltype(data, data->molnames[mol_idx]);
-      if (!mt) continue;
+/* Error that made the last call on a handle fail, "" if none */
+const char *grotop_last_error(void *handle) {
+  return ((grotop_data *)handle)->error;
+}
 
-      int count = data->molcounts[mol_idx];
 
-      for (int copy = 0; copy < count; copy++) {
-        for (int i = 0; i < mt->ndihedrals; i++) {
-          /* Only process improper dihedrals (function types 2 and 4) */
-          if (mt->dihedrals[i].funct != 2 && mt->dihedrals[i].funct != 4) continue;
+/*
+ * Library API
+ *
+ * The rest of grotop.h: flat copies of what the molfile entry points
+ * return, for callers that are not VMD and cannot use molfile_atom_t.
+ */
 
-          data->impropers[improper_idx * 4 + 0] = global_atom_offset + mt->dihedrals[i].ai;
-          data->impropers[improper_idx * 4 + 1] = global_atom_offset + mt->dihedrals[i].aj;
-          data->impropers[improper_idx * 4 + 2] = global_atom_offset + mt->dihedrals[i].ak;
-          data->impropers[improper_idx * 4 + 3] = global_atom_offset + mt->dihedrals[i].al;
-          improper_idx++;
-        }
+int grotop_api_version(void) {
+  return GROTOP_API_VERSION;
+}
 
-        global_atom_offset += mt->natoms;
-      }
-    }
+int grotop_get_totals(void *handle, long long *natoms, long long *counts) {
+  grotop_data *data = (grotop_data *)handle;
+  if (!data) return MOLFILE_ERROR;
 
-    *numimpropers = improper_idx;
-    *impropers = data->impropers;
+  if (natoms) *natoms = data->ranges[data->num_molecules].atom_offset;
+  if (counts) {
+    for (int kind = 0; kind < GROTOP_NUM_KINDS; kind++)
+      counts[kind] = grotop_connectivity_count(handle, kind);
   }
-
   return MOLFILE_SUCCESS;
 }
 
-static void close_grotop_read(void *mydata) {
-  grotop_data *data = (grotop_data *)mydata;
-  if (!data) return;
+/* Copy a NUL-terminated field into a fixed-size, NUL-padded record */
+static void copy_field(char *dst, size_t size, const char *src) {
+  size_t n = strlen(src);
+  if (n > size - 1) n = size - 1;
+  memcpy(dst, src, n);
+  memset(dst + n, 0, size - n);
+}
 
-  /* Free molecule types */
-  for (int i = 0; i < data->num_moltypes; i++) {
-    free_moltype(data->moltypes[i]);
+int grotop_read_atom_fields(void *handle, int first, int max, char *names, char *types,
+                            char *resnames, char *segids, int *resids, float *charges,
+                            float *masses) {
+  molfile_atom_t chunk[256];
+  int written = 0;
+
+  while (written < max) {
+    int want = max - written < 256 ? max - written : 256;
+    int n = grotop_read_atoms(handle, first + written, want, chunk);
+    if (n < 0) return -1;
+    if (n == 0) break;
+
+    for (int k = 0; k < n; k++) {
+      size_t i = (size_t)written + k;
+      if (names) copy_field(&names[i * GROTOP_NAME_SIZE], GROTOP_NAME_SIZE, chunk[k].name);
+      if (types) copy_field(&types[i * GROTOP_NAME_SIZE], GROTOP_NAME_SIZE, chunk[k].type);
+      if (resnames) copy_field(&resnames[i * GROTOP_RESNAME_SIZE], GROTOP_RESNAME_SIZE, chunk[k].resname);
+      if (segids) copy_field(&segids[i * GROTOP_RESNAME_SIZE], GROTOP_RESNAME_SIZE, chunk[k].segid);
+      if (resids) resids[i] = chunk[k].resid;
+      if (charges) charges[i] = chunk[k].charge;
+      if (masses) masses[i] = chunk[k].mass;
+    }
+    written += n;
   }
 
-  /* Free bond arrays */
-  if (data->bond_from) free(data->bond_from);
-  if (data->bond_to) free(data->bond_to);
+  return written;
+}
 
-  /* Free angle/dihedral/improper arrays */
-  if (data->angles) free(data->angles);
-  if (data->dihedrals) free(data->dihedrals);
-  if (data->impropers) free(data->impropers);
+int grotop_borrow_connectivity(void *handle, grotop_connectivity_t *view) {
+  grotop_data *data = (grotop_data *)handle;
+  memset(view, 0, sizeof(*view));
+  if (!fill_bonds(data) || !fill_angles(data)) return -1;
+
+  view->counts[GROTOP_BONDS] = data->total_bonds;
+  view->counts[GROTOP_ANGLES] = data->total_angles;
+  view->counts[GROTOP_DIHEDRALS] = data->total_dihedrals;
+  view->counts[GROTOP_IMPROPERS] = data->total_impropers;
+  view->bond_from = data->bond_from;
+  view->bond_to = data->bond_to;
+  view->angles = data->angles;
+  view->dihedrals = data->dihedrals;
+  view->impropers = data->impropers;
+  return 0;
+}
 
-  free(data);
+int grotop_take_connectivity(void *handle, grotop_connectivity_t *conn) {
+  grotop_data *data = (grotop_data *)handle;
+  if (grotop_borrow_connectivity(handle, conn) != 0) return -1;
+
+  conn->slab = data->slab.base;
+  conn->slab_bytes = data->slab.bytes;
+  conn->slab_mapped = data->slab.mapped;
+
+  /* No longer the handle's to free or to account for */
+  memset(&data->slab, 0, sizeof(data->slab));
+  free_connectivity(data);
+  mem_charge(&data->memory, GROTOP_MEM_CONNECTIVITY, -(long long)conn->slab_bytes);
+  return 0;
+}
+
+void grotop_free_connectivity(grotop_connectivity_t *conn) {
+  connectivity_slab_t slab = { conn->slab, conn->slab_bytes, conn->slab_mapped };
+  slab_free(&slab);
+  memset(conn, 0, sizeof(*conn));
+}
+
+void grotop_close(void *handle) {
+  close_grotop_read(handle);
 }
 
 
@@ -1488,6 +5273,7 @@ static void close_grotop_read(void *mydata) {
  */
 
 static molfile_plugin_t plugin;
+static molfile_plugin_t tpb_plugin;
 
 VMDPLUGIN_API int VMDPLUGIN_init(void) {
   memset(&plugin, 0, sizeof(molfile_plugin_t));
@@ -1498,18 +5284,36 @@ VMDPLUGIN_API int VMDPLUGIN_init(void) {
   plugin.author = "Generated with Claude Code";
   plugin.majorv = 0;
   plugin.minorv = 1;
-  plugin.is_reentrant = VMDPLUGIN_THREADUNSAFE;
+  plugin.is_reentrant = VMDPLUGIN_THREADSAFE;
   plugin.filename_extension = "top,itp";
   plugin.open_file_read = open_grotop_read;
   plugin.read_structure = read_grotop_structure;
   plugin.read_bonds = read_grotop_bonds;
   plugin.read_angles = read_grotop_angles;
   plugin.close_file_read = close_grotop_read;
+
+  /* Compiled topologies share the readers; only opening differs */
+  memset(&tpb_plugin, 0, sizeof(molfile_plugin_t));
+  tpb_plugin.abiversion = vmdplugin_ABIVERSION;
+  tpb_plugin.type = MOLFILE_PLUGIN_TYPE;
+  tpb_plugin.name = "grotpb";
+  tpb_plugin.prettyname = "GROMACS Compiled Topology";
+  tpb_plugin.author = "Generated with Claude Code";
+  tpb_plugin.majorv = 0;
+  tpb_plugin.minorv = 1;
+  tpb_plugin.is_reentrant = VMDPLUGIN_THREADSAFE;
+  tpb_plugin.filename_extension = "tpb";
+  tpb_plugin.open_file_read = open_tpb_read;
+  tpb_plugin.read_structure = read_grotop_structure;
+  tpb_plugin.read_bonds = read_grotop_bonds;
+  tpb_plugin.read_angles = read_grotop_angles;
+  tpb_plugin.close_file_read = close_grotop_read;
   return VMDPLUGIN_SUCCESS;
 }
 
 VMDPLUGIN_API int VMDPLUGIN_register(void *v, vmdplugin_register_cb cb) {
   (*cb)(v, (vmdplugin_t *)&plugin);
+  (*cb)(v, (vmdplugin_t *)&tpb_plugin);
   return VMDPLUGIN_SUCCESS;
 }
 
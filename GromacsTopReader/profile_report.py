@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""
+Where the reader spends its time, from the phase timers of the test drivers
+
+Runs test_grotop and the converters on the given workloads, reads the
+"Timing (seconds)" block that grotop_print_stats() writes and prints, per
+workload, the median of each phase over the runs, split into the time in
+parse_topology_file (preprocessing, the parse itself and the deferred parse
+of connectivity sections) and the time in instantiation (totals, atoms,
+bonds, angles). What the process spent outside the reader (startup, reading
+coordinates, formatting and writing output) is the rest of the wall time.
+
+Results can be saved with --json and an earlier run given as --baseline, so
+the same workloads can be compared across builds, e.g. `make PROFILE=release`
+against `make pgo`, or across settings such as GROTOP_THREADS.
+
+Author: Diego E.B. Gomes
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+
+PARSE_PHASES = ["Preprocess", "Parse", "Connectivity"]
+INSTANCE_PHASES = ["Totals", "Structure", "Bonds", "Angles"]
+COUNTERS = ["Files", "Lines", "Bytes"]
+
+PHASE_RE = re.compile(r"^\s+(\w+):\s+([0-9.]+)\s*$")
+COUNTER_RE = re.compile(r"^\s+(\w[\w ]*):\s+(-?\d+)\s*$")
+FILE_RE = re.compile(r"^\s+([0-9]+\.[0-9]+)  (\S.*)$")
+
+
+def parse_stats(text):
+    """Phases, counters and per-file parse times of the first statistics block"""
+    phases, counters, files = {}, {}, {}
+    section = None
+    for line in text.splitlines():
+        if line.startswith("Timing (seconds):"):
+            if phases:
+                break
+            section = "timing"
+        elif line.startswith("Counters:"):
+            section = "counters"
+        elif section == "timing" and PHASE_RE.match(line):
+            name, value = PHASE_RE.match(line).groups()
+            phases[name] = float(value)
+        elif section == "counters" and COUNTER_RE.match(line):
+            name, value = COUNTER_RE.match(line).groups()
+            counters[name] = int(value)
+        elif section == "counters" and FILE_RE.match(line):
+            seconds, path = FILE_RE.match(line).groups()
+            files[path] = float(seconds)
+        elif section:
+            section = None
+    return phases, counters, files
+
+
+def run_workload(command, runs):
+    """Median phase times, counters and slowest files over runs of a command"""
+    samples, walls = [], []
+    counters, files = {}, {}
+    for _ in range(runs):
+        start = time.perf_counter()
+        proc = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+        wall = time.perf_counter() - start
+        if proc.returncode != 0:
+            sys.stderr.write(proc.stderr[-2000:])
+            raise RuntimeError(f"{' '.join(command)} exited with status {proc.returncode}")
+        phases, counters, files = parse_stats(proc.stdout)
+        if not phases:
+            raise RuntimeError(f"{' '.join(command)} printed no reader statistics")
+        samples.append(phases)
+        walls.append(wall)
+
+    names = samples[0].keys()
+    median = {name: statistics.median(s.get(name, 0.0) for s in samples) for name in names}
+    return {
+        "phases": median,
+        "parse_s": sum(median.get(p, 0.0) for p in PARSE_PHASES),
+        "instantiation_s": sum(median.get(p, 0.0) for p in INSTANCE_PHASES),
+        "wall_s": statistics.median(walls),
+        "counters": {c: counters.get(c, 0) for c in COUNTERS},
+        "files": sorted(files.items(), key=lambda f: -f[1])[:5],
+    }
+
+
+def row(label, seconds, wall, baseline=None):
+    share = 100.0 * seconds / wall if wall > 0 else 0.0
+    line = f"  {label:<24s} {seconds:10.4f} {share:6.1f}%"
+    if baseline is not None:
+        speedup = f"{baseline / seconds:7.2f}x" if seconds > 0 and baseline > 0 else f"{'-':>8s}"
+        line += f" {baseline:10.4f} {speedup}"
+    return line
+
+
+def print_result(name, result, runs, base=None):
+    wall = result["wall_s"]
+    print("=======================================================")
+    print(f"{name}  ({runs} runs, median)")
+    header = f"  {'Phase':<24s} {'Seconds':>10s} {'Share':>7s}"
+    if base:
+        header += f" {'Baseline':>10s} {'Speedup':>8s}"
+    print(header)
+
+    def basevalue(key, phase=None):
+        if not base:
+            return None
+        return base["phases"].get(phase, 0.0) if phase else base[key]
+
+    for phase in PARSE_PHASES:
+        print(row(phase, result["phases"].get(phase, 0.0), wall, basevalue(None, phase)))
+    print(row("parse_topology_file", result["parse_s"], wall, basevalue("parse_s")))
+    for phase in INSTANCE_PHASES:
+        print(row(phase, result["phases"].get(phase, 0.0), wall, basevalue(None, phase)))
+    print(row("instantiation", result["instantiation_s"], wall, basevalue("instantiation_s")))
+    other = max(wall - result["parse_s"] - result["instantiation_s"], 0.0)
+    base_other = None
+    if base:
+        base_other = max(base["wall_s"] - base["parse_s"] - base["instantiation_s"], 0.0)
+    print(row("outside the reader", other, wall, base_other))
+    print(row("wall", wall, wall, basevalue("wall_s")))
+
+    c = result["counters"]
+    parse = result["parse_s"]
+    rate = c["Bytes"] / parse / 1e6 if parse > 0 else 0.0
+    print(f"  {c['Files']} files, {c['Lines']} lines, {c['Bytes']} bytes ({rate:.1f} MB/s parsed)")
+    for path, seconds in result["files"]:
+        print(f"  {seconds:10.4f}  {path}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Summarize parse and instantiation time of the reader")
+    parser.add_argument("--top", action="append", default=[], metavar="TOP",
+                        help="Read a topology with test_grotop (repeatable)")
+    parser.add_argument("--js", action="append", nargs=2, default=[], metavar=("TOP", "GRO"),
+                        help="Convert a topology and coordinates with test_grotop_to_js (repeatable)")
+    parser.add_argument("--psf", action="append", default=[], metavar="TOP",
+                        help="Stream a topology to PSF with test_grotop_to_psf (repeatable)")
+    parser.add_argument("-r", "--runs", type=int, default=3, help="Runs per workload")
+    parser.add_argument("--bin", default=".", help="Directory of the test drivers")
+    parser.add_argument("--json", help="Also write the results to this file")
+    parser.add_argument("--baseline", help="Results of an earlier --json run to compare with")
+    args = parser.parse_args()
+
+    if args.runs < 1 or not (args.top or args.js or args.psf):
+        parser.error("give at least one --top, --js or --psf workload and --runs >= 1")
+
+    baseline = {}
+    if args.baseline:
+        try:
+            baseline = json.loads(Path(args.baseline).read_text())
+        except (OSError, ValueError) as err:
+            print(f"ERROR: Failed to read baseline {args.baseline}: {err}", file=sys.stderr)
+            return 1
+
+    with tempfile.TemporaryDirectory(prefix="grotop_report_") as tmp:
+        workloads = [(f"test_grotop {top}", [os.path.join(args.bin, "test_grotop"), top]) for top in args.top]
+        workloads += [(f"test_grotop_to_js {top} {gro}",
+                       [os.path.join(args.bin, "test_grotop_to_js"), top, gro, os.path.join(tmp, "out.js")])
+                      for top, gro in args.js]
+        workloads += [(f"test_grotop_to_psf --stream {top}",
+                       [os.path.join(args.bin, "test_grotop_to_psf"), "--stream", top, os.path.join(tmp, "out.psf")])
+                      for top in args.psf]
+
+        results = {}
+        for name, command in workloads:
+            try:
+                results[name] = run_workload(command, args.runs)
+            except (OSError, RuntimeError) as err:
+                print(f"ERROR: {err}", file=sys.stderr)
+                return 1
+            print_result(name, results[name], args.runs, baseline.get(name))
+        print("=======================================================")
+
+    if args.json:
+        Path(args.json).write_text(json.dumps(results, indent=2) + "\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,69 @@
+/*
+ * Checksum of what a topology handle instantiates, for the test programs
+ *
+ * Reads the atoms, bonds, angles, dihedrals and impropers of an open
+ * handle into one FNV-1a digest, so the results of two handles can be
+ * compared without keeping their arrays around.
+ *
+ * Include after grotopplugin.c.
+ */
+
+#ifndef TEST_CHECKSUM_H
+#define TEST_CHECKSUM_H
+
+/* Read everything of an open handle with natoms atoms; 0 and a checksum on success */
+static int checksum_handle(void *handle, int natoms, unsigned long long *sum) {
+  molfile_atom_t *atoms = (molfile_atom_t *)calloc(natoms > 0 ? natoms : 1, sizeof(molfile_atom_t));
+  int optflags = 0;
+  if (!atoms || read_grotop_structure(handle, &optflags, atoms) != MOLFILE_SUCCESS) {
+    free(atoms);
+    return -1;
+  }
+
+  unsigned long long h = FNV1A64_BASIS;
+  h = fnv1a64(h, &natoms, sizeof(int));
+  for (int i = 0; i < natoms; i++) {
+    h = fnv1a64(h, atoms[i].name, strlen(atoms[i].name));
+    h = fnv1a64(h, atoms[i].type, strlen(atoms[i].type));
+    h = fnv1a64(h, atoms[i].resname, strlen(atoms[i].resname));
+    h = fnv1a64(h, atoms[i].segid, strlen(atoms[i].segid));
+    h = fnv1a64(h, &atoms[i].resid, sizeof(int));
+    h = fnv1a64(h, &atoms[i].charge, sizeof(float));
+    h = fnv1a64(h, &atoms[i].mass, sizeof(float));
+  }
+  free(atoms);
+
+  int nbonds = 0, nbondtypes = 0;
+  int *from = NULL, *to = NULL, *bondtype = NULL;
+  float *bondorder = NULL;
+  char **bondtypename = NULL;
+  int nangles = 0, ndihedrals = 0, nimpropers = 0, ncterms = 0, ctermcols = 0, ctermrows = 0;
+  int *angles = NULL, *angletypes = NULL, *dihedrals = NULL, *dihedraltypes = NULL;
+  int *impropers = NULL, *impropertypes = NULL, *cterms = NULL;
+  int nangletypes = 0, ndihedraltypes = 0, nimpropertypes = 0;
+  char **angletypenames = NULL, **dihedraltypenames = NULL, **impropertypenames = NULL;
+
+  if (read_grotop_bonds(handle, &nbonds, &from, &to, &bondorder,
+                        &bondtype, &nbondtypes, &bondtypename) != MOLFILE_SUCCESS ||
+      read_grotop_angles(handle, &nangles, &angles, &angletypes, &nangletypes, &angletypenames,
+                         &ndihedrals, &dihedrals, &dihedraltypes, &ndihedraltypes, &dihedraltypenames,
+                         &nimpropers, &impropers, &impropertypes, &nimpropertypes, &impropertypenames,
+                         &ncterms, &cterms, &ctermcols, &ctermrows) != MOLFILE_SUCCESS) {
+    return -1;
+  }
+
+  h = fnv1a64(h, &nbonds, sizeof(int));
+  h = fnv1a64(h, from, (size_t)nbonds * sizeof(int));
+  h = fnv1a64(h, to, (size_t)nbonds * sizeof(int));
+  h = fnv1a64(h, &nangles, sizeof(int));
+  h = fnv1a64(h, angles, (size_t)nangles * 3 * sizeof(int));
+  h = fnv1a64(h, &ndihedrals, sizeof(int));
+  h = fnv1a64(h, dihedrals, (size_t)ndihedrals * 4 * sizeof(int));
+  h = fnv1a64(h, &nimpropers, sizeof(int));
+  h = fnv1a64(h, impropers, (size_t)nimpropers * 4 * sizeof(int));
+
+  *sum = h;
+  return 0;
+}
+
+#endif /* TEST_CHECKSUM_H */
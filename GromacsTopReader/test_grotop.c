@@ -1,5 +1,7 @@
 /*
  * Test program for GROMACS topology plugin
+ *
+ * Usage: test_grotop [--memory] <topology_file.top>
  */
 
 #include <stdio.h>
@@ -39,13 +41,170 @@ void print_bond_info(int *from, int *to, int nbonds, int max_print) {
   }
 }
 
+/* Re-read one connectivity kind in small chunks and compare with the full array */
+int check_chunked(void *handle, int kind, const char *label, const int *full, int nfull) {
+  int width = grotop_connectivity_width(kind);
+  int chunk[7 * 4];
+  long long first = 0;
+  int n;
+
+  if (grotop_connectivity_count(handle, kind) != nfull) {
+    printf("  %s: count mismatch (%lld vs %d)\n", label, grotop_connectivity_count(handle, kind), nfull);
+    return 0;
+  }
+
+  while ((n = grotop_read_connectivity(handle, kind, first, 7, chunk)) > 0) {
+    if (memcmp(chunk, &full[first * width], (size_t)n * width * sizeof(int)) != 0) {
+      printf("  %s: mismatch in chunk at item %lld\n", label, first);
+      return 0;
+    }
+    first += n;
+  }
+
+  printf("  %s: %lld items match\n", label, first);
+  return first == nfull;
+}
+
+/* Find with path halving in a forest whose roots are the lowest index of each tree */
+static int find_root(int *parent, int i) {
+  while (parent[i] != i) i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+/*
+ * Take the connectivity slab, which must hold the arrays returned above,
+ * then check that the handle rebuilds the same arrays without it.
+ */
+int check_taken(void *handle) {
+  grotop_connectivity_t conn;
+  if (grotop_take_connectivity(handle, &conn) != 0) {
+    printf("  Taken slab: %s\n", grotop_last_error(handle));
+    return 0;
+  }
+
+  int nbonds = 0, nbondtypes = 0;
+  int *from = NULL, *to = NULL, *bondtype = NULL;
+  float *bondorder = NULL;
+  char **bondtypename = NULL;
+  int nangles = 0, ndihedrals = 0, nimpropers = 0, ncterms = 0, ctermcols = 0, ctermrows = 0;
+  int *angles = NULL, *angletypes = NULL, *dihedrals = NULL, *dihedraltypes = NULL;
+  int *impropers = NULL, *impropertypes = NULL, *cterms = NULL;
+  int nangletypes = 0, ndihedraltypes = 0, nimpropertypes = 0;
+  char **angletypenames = NULL, **dihedraltypenames = NULL, **impropertypenames = NULL;
+
+  int ok = read_grotop_bonds(handle, &nbonds, &from, &to, &bondorder,
+                             &bondtype, &nbondtypes, &bondtypename) == MOLFILE_SUCCESS &&
+           read_grotop_angles(handle, &nangles, &angles, &angletypes, &nangletypes, &angletypenames,
+                              &ndihedrals, &dihedrals, &dihedraltypes, &ndihedraltypes, &dihedraltypenames,
+                              &nimpropers, &impropers, &impropertypes, &nimpropertypes, &impropertypenames,
+                              &ncterms, &cterms, &ctermcols, &ctermrows) == MOLFILE_SUCCESS;
+
+  ok = ok && nbonds == conn.counts[GROTOP_BONDS] && nangles == conn.counts[GROTOP_ANGLES] &&
+       ndihedrals == conn.counts[GROTOP_DIHEDRALS] && nimpropers == conn.counts[GROTOP_IMPROPERS] &&
+       (nbonds == 0 || (from != conn.bond_from &&
+                        memcmp(from, conn.bond_from, (size_t)nbonds * sizeof(int)) == 0 &&
+                        memcmp(to, conn.bond_to, (size_t)nbonds * sizeof(int)) == 0)) &&
+       (nangles == 0 || memcmp(angles, conn.angles, (size_t)nangles * 3 * sizeof(int)) == 0) &&
+       (ndihedrals == 0 || memcmp(dihedrals, conn.dihedrals, (size_t)ndihedrals * 4 * sizeof(int)) == 0) &&
+       (nimpropers == 0 || memcmp(impropers, conn.impropers, (size_t)nimpropers * 4 * sizeof(int)) == 0);
+
+  printf("  Taken slab: %zu bytes, %s\n", conn.slab_bytes, ok ? "rebuilt identically" : "MISMATCH");
+  grotop_free_connectivity(&conn);
+  return ok;
+}
+
+/* Whether a 1-based bond joins two atoms of the same molecule copy */
+static int same_molecule(const int *molecule, int natoms, int from, int to) {
+  return from >= 1 && from <= natoms && to >= 1 && to <= natoms &&
+         molecule[from - 1] == molecule[to - 1];
+}
+
+/* Re-read the bond graph and fragments in small chunks and compare with the flat bonds */
+int check_bond_graph(void *handle, int natoms, const int *from, const int *to, int nbonds) {
+  int n = natoms > 0 ? natoms : 1;
+  long long *start = (long long *)calloc(n + 1, sizeof(long long));
+  int *fill = (int *)calloc(n, sizeof(int));
+  int *neighbors = (int *)malloc((nbonds > 0 ? 2 * nbonds : 1) * sizeof(int));
+  int *parent = (int *)malloc(n * sizeof(int));
+  int *label = (int *)malloc(n * sizeof(int));
+  int ok = start && fill && neighbors && parent && label;
+
+  /* Molecule copy of each atom: the graph leaves out bonds that leave their molecule */
+  const grotop_data *data = (const grotop_data *)handle;
+  for (int e = 0, i = 0; ok && e < data->num_molecules; e++) {
+    const instance_range_t *r = &data->ranges[e];
+    for (long long k = 0; k < (long long)r->count * r->mt->natoms; k++, i++)
+      label[i] = i - (int)(k % r->mt->natoms);
+  }
+  for (int b = 0; ok && b < nbonds; b++) {
+    if (!same_molecule(label, natoms, from[b], to[b])) continue;
+    start[from[b]]++;
+    start[to[b]]++;
+  }
+  for (int i = 0; ok && i < natoms; i++) {
+    start[i + 1] += start[i];
+    fill[i] = (int)start[i];
+    parent[i] = i;
+  }
+  long long nfragments = 0;
+  for (int b = 0; ok && b < nbonds; b++) {
+    if (!same_molecule(label, natoms, from[b], to[b])) continue;
+    int i = from[b] - 1, j = to[b] - 1;
+    neighbors[fill[i]++] = j;
+    neighbors[fill[j]++] = i;
+    int ri = find_root(parent, i), rj = find_root(parent, j);
+    if (ri < rj) parent[rj] = ri;
+    else if (rj < ri) parent[ri] = rj;
+  }
+  for (int i = 0; ok && i < natoms; i++) {
+    label[i] = (find_root(parent, i) == i) ? (int)nfragments++ : label[find_root(parent, i)];
+  }
+
+  if (ok && grotop_fragment_count(handle) != nfragments) {
+    printf("  Fragments: count mismatch (%lld vs %lld)\n", grotop_fragment_count(handle), nfragments);
+    ok = 0;
+  }
+
+  long long chunk_start[8];
+  int chunk_neighbors[7 * 64], chunk_fragments[7];
+  int first = 0, count;
+  while (ok && first < natoms) {
+    /* Keep the neighbors of a chunk within the buffer */
+    int max = natoms - first < 7 ? natoms - first : 7;
+    while (max > 1 && start[first + max] - start[first] > 7 * 64) max--;
+
+    count = grotop_read_bond_graph(handle, first, max, chunk_start, NULL);
+    if (count <= 0 || count > max || start[first + count] - start[first] > 7 * 64 ||
+        grotop_read_bond_graph(handle, first, count, chunk_start, chunk_neighbors) != count ||
+        grotop_read_fragments(handle, first, count, chunk_fragments) != count ||
+        memcmp(chunk_start, &start[first], (size_t)(count + 1) * sizeof(long long)) != 0 ||
+        memcmp(chunk_neighbors, &neighbors[start[first]],
+               (size_t)(start[first + count] - start[first]) * sizeof(int)) != 0 ||
+        memcmp(chunk_fragments, &label[first], (size_t)count * sizeof(int)) != 0) {
+      printf("  Bond graph: mismatch in chunk at atom %d\n", first);
+      ok = 0;
+      break;
+    }
+    first += count;
+  }
+
+  if (ok) printf("  Bond graph: %d atoms, %lld fragments match\n", first, nfragments);
+  free(start);
+  free(fill);
+  free(neighbors);
+  free(parent);
+  free(label);
+  return ok;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <topology_file.top>\n", argv[0]);
+  int memory = (argc > 1 && strcmp(argv[1], "--memory") == 0);
+  if (argc < 2 + memory) {
+    fprintf(stderr, "Usage: %s [--memory] <topology_file.top>\n", argv[0]);
     return 1;
   }
 
-  const char *filename = argv[1];
+  const char *filename = argv[1 + memory];
 
   /* Initialize the plugin */
   VMDPLUGIN_init();
@@ -56,9 +215,12 @@ int main(int argc, char *argv[]) {
   printf("Reading file: %s\n", filename);
   printf("=======================================================\n");
 
-  /* Open the file */
+  /* Open the file; compiled topologies go through the grotpb reader */
   int natoms = 0;
-  void *handle = open_grotop_read(filename, "grotop", &natoms);
+  const char *ext = strrchr(filename, '.');
+  void *handle = (ext && strcmp(ext, ".tpb") == 0)
+                 ? open_tpb_read(filename, "grotpb", &natoms)
+                 : open_grotop_read(filename, "grotop", &natoms);
 
   if (!handle) {
     fprintf(stderr, "ERROR: Failed to open topology file\n");
@@ -162,6 +324,32 @@ int main(int argc, char *argv[]) {
     printf("Plugin does not have read_angles function\n");
   }
 
+  /* The chunked API must reproduce the arrays returned above */
+  if (p->read_angles && rc == MOLFILE_SUCCESS) {
+    printf("\nChecking chunked connectivity access\n");
+    int *pairs = (int *)malloc((nbonds > 0 ? nbonds : 1) * 2 * sizeof(int));
+    for (int i = 0; i < nbonds; i++) {
+      pairs[2 * i] = from[i];
+      pairs[2 * i + 1] = to[i];
+    }
+    int ok = check_chunked(handle, GROTOP_BONDS, "Bonds", pairs, nbonds) &
+             check_chunked(handle, GROTOP_ANGLES, "Angles", angles, numangles) &
+             check_chunked(handle, GROTOP_DIHEDRALS, "Dihedrals", dihedrals, numdihedrals) &
+             check_chunked(handle, GROTOP_IMPROPERS, "Impropers", impropers, numimpropers) &
+             check_bond_graph(handle, natoms, from, to, nbonds);
+    free(pairs);
+
+    /* Last: the arrays above belong to the caller once taken */
+    ok &= check_taken(handle);
+
+    if (!ok) {
+      fprintf(stderr, "ERROR: Chunked connectivity does not match\n");
+      free(atoms);
+      close_grotop_read(handle);
+      return 1;
+    }
+  }
+
   /* Summary statistics */
   printf("\n=======================================================\n");
   printf("Summary:\n");
@@ -197,6 +385,9 @@ int main(int argc, char *argv[]) {
   }
   printf("  Unique segments: %d\n", unique_segments);
 
+  printf("=======================================================\n");
+  grotop_print_stats(handle, stdout);
+  if (memory) grotop_print_memory(handle, stdout);
   printf("=======================================================\n");
 
   /* Clean up */
@@ -0,0 +1,163 @@
+/*
+ * Test program for incremental reloads of GROMACS topologies
+ *
+ * Writes a small topology tree to a temporary directory, opens it, then
+ * edits one file at a time and checks that grotop_reload() reuses the
+ * unchanged includes and returns the same atoms and connectivity as a
+ * fresh open of the edited files.
+ *
+ * Usage: test_grotop_reload
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* We'll compile the plugin directly into this test */
+#define STATIC_PLUGIN
+#include "grotopplugin.c"
+#include "test_checksum.h"
+
+static char dir[256];
+
+static int write_file(const char *name, const char *text) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *fp = fopen(path, "w");
+  if (!fp) return 0;
+  fputs(text, fp);
+  return fclose(fp) == 0;
+}
+
+static void remove_file(const char *name) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  remove(path);
+}
+
+/* Reload after an edit and compare with a fresh open of the same files */
+static int check_reload(void *handle, const char *what, int expect_rc, long long expect_reused,
+                        int expect_kept_bonds) {
+  char path[512], error[GROTOP_ERROR_LENGTH];
+  snprintf(path, sizeof(path), "%s/topol.top", dir);
+
+  unsigned long long sum;
+  int natoms = 0;
+  /* Kept connectivity is still in the handle's slab before anything is read again */
+  int rc = grotop_reload(handle, &natoms);
+  int kept = ((grotop_data *)handle)->slab_filled != 0;
+  if (rc < 0 || checksum_handle(handle, natoms, &sum) != 0) {
+    printf("  %-34s FAILED: %s\n", what, grotop_last_error(handle));
+    return 0;
+  }
+
+  grotop_stats_t stats;
+  grotop_get_stats(handle, &stats);
+
+  int fresh_natoms = 0;
+  unsigned long long fresh_sum = 0;
+  void *fresh = grotop_open(path, LOG_QUIET, &fresh_natoms, error, sizeof(error));
+  if (!fresh || checksum_handle(fresh, fresh_natoms, &fresh_sum) != 0) {
+    printf("  %-34s FAILED: fresh open: %s\n", what, error);
+    if (fresh) close_grotop_read(fresh);
+    return 0;
+  }
+  close_grotop_read(fresh);
+
+  long long reused = rc > 0 ? stats.reused : 0;
+  int ok = rc == expect_rc && natoms == fresh_natoms && sum == fresh_sum &&
+           reused == expect_reused && kept == expect_kept_bonds;
+  printf("  %-34s %s (reload %d, %d atoms, %lld includes reused, bonds %s)\n", what,
+         ok ? "OK" : "FAILED", rc, natoms, reused, kept ? "kept" : "rebuilt");
+  return ok;
+}
+
+static const char *topol =
+  "[ defaults ]\n1 1\n\n"
+  "#include \"ff.itp\"\n#include \"a.itp\"\n#include \"b.itp\"\n\n"
+  "[ system ]\nReload test\n\n"
+  "[ molecules ]\nAAA 3\nBBB 2\nAAA 1\n";
+
+static const char *ff =
+  "[ atomtypes ]\nC1 72.0 0.000 A 0.47 3.5\n\n#include \"ff_nb.itp\"\n";
+
+static const char *ff_nb = "[ atomtypes ]\nQ0 72.0 0.000 A 0.47 3.5\n";
+
+static const char *ff_nb_edited =
+  "[ atomtypes ]\nQ0 72.0 0.000 A 0.47 3.5\nP4 72.0 0.000 A 0.47 5.0\n";
+
+static const char *mol_a =
+  "[ moleculetype ]\nAAA 1\n\n[ atoms ]\n"
+  "1 C1 1 AAA C1 1 0.0\n2 C1 1 AAA C2 2 0.0\n3 Q0 1 AAA Q1 3 1.0\n\n"
+  "[ bonds ]\n1 2 1\n2 3 1\n\n[ angles ]\n1 2 3 2\n";
+
+static const char *mol_a_grown =
+  "[ moleculetype ]\nAAA 1\n\n[ atoms ]\n"
+  "1 C1 1 AAA C1 1 0.0\n2 C1 1 AAA C2 2 0.0\n3 Q0 1 AAA Q1 3 1.0\n4 C1 2 AAA C3 4 0.0\n\n"
+  "[ bonds ]\n1 2 1\n2 3 1\n3 4 1\n\n[ angles ]\n1 2 3 2\n2 3 4 2\n";
+
+static const char *mol_b =
+  "[ moleculetype ]\nBBB 1\n\n[ atoms ]\n1 Q0 1 BBB Q1 1 1.0\n2 Q0 1 BBB Q2 2 -1.0\n\n"
+  "[ bonds ]\n1 2 1\n";
+
+static const char *mol_b_charged =
+  "; charges edited\n"
+  "[ moleculetype ]\nBBB 1\n\n[ atoms ]\n1 Q0 1 BBB Q1 1 0.5\n2 Q0 1 BBB Q2 2 -0.5\n\n"
+  "[ bonds ]\n1 2 1\n";
+
+int main(void) {
+  snprintf(dir, sizeof(dir), "/tmp/grotop_reload_XXXXXX");
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "ERROR: Failed to create a temporary directory\n");
+    return 1;
+  }
+
+  printf("=======================================================\n");
+  printf("GROMACS Topology Plugin Incremental Reload Test\n");
+  printf("=======================================================\n");
+
+  int ok = write_file("topol.top", topol) && write_file("ff.itp", ff) &&
+           write_file("ff_nb.itp", ff_nb) && write_file("a.itp", mol_a) &&
+           write_file("b.itp", mol_b);
+
+  char path[512], error[GROTOP_ERROR_LENGTH];
+  snprintf(path, sizeof(path), "%s/topol.top", dir);
+  int natoms = 0;
+  unsigned long long sum;
+  void *handle = ok ? grotop_open(path, LOG_QUIET, &natoms, error, sizeof(error)) : NULL;
+  if (!handle || checksum_handle(handle, natoms, &sum) != 0) {
+    fprintf(stderr, "ERROR: Failed to open %s: %s\n", path, handle ? grotop_last_error(handle) : error);
+    ok = 0;
+  }
+
+  if (ok) {
+    /* Nothing changed: nothing to do */
+    ok &= check_reload(handle, "unchanged", 0, 0, 1);
+
+    /* Charges only: ff.itp and a.itp are reused, the bond array is patched in place */
+    ok &= write_file("b.itp", mol_b_charged);
+    ok &= check_reload(handle, "edited charges in b.itp", 1, 2, 1);
+
+    /* A nested include: ff.itp is parsed again, both molecules are reused */
+    ok &= write_file("ff_nb.itp", ff_nb_edited);
+    ok &= check_reload(handle, "added an atom type in ff_nb.itp", 1, 2, 1);
+
+    /* A moltype that grows moves every later entry and changes the counts */
+    ok &= write_file("a.itp", mol_a_grown);
+    ok &= check_reload(handle, "added an atom to a.itp", 1, 2, 0);
+  }
+
+  if (handle) close_grotop_read(handle);
+
+  const char *names[] = { "topol.top", "ff.itp", "ff_nb.itp", "a.itp", "b.itp" };
+  for (int i = 0; i < 5; i++) remove_file(names[i]);
+  remove(dir);
+
+  printf("=======================================================\n");
+  if (!ok) {
+    printf("\nTest FAILED\n");
+    return 1;
+  }
+  printf("\nTest completed successfully!\n");
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Stress test: many GROMACS topology handles opened in parallel threads
+ *
+ * Every topology on the command line is first read once to get a reference
+ * checksum of its atoms and connectivity. Worker threads then open, read
+ * and close the topologies over and over, through both grotop_open() and
+ * the molfile entry points, and compare each result with the reference.
+ * Each worker also opens a missing file to exercise the per-handle errors.
+ *
+ * Usage: test_grotop_threads [-t threads] [-n iterations] <topology.top> [...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* We'll compile the plugin directly into this test */
+#define STATIC_PLUGIN
+#include "grotopplugin.c"
+#include "test_checksum.h"
+
+typedef struct {
+  const char **files;
+  const unsigned long long *reference;
+  int nfiles;
+  int iterations;
+  int id;
+  int loads;                 /* Successful loads */
+  int failures;              /* Failed opens/reads or checksum mismatches */
+} worker_t;
+
+/* Open, read everything and close; 0 and a checksum on success */
+static int load_checksum(const char *filename, int use_molfile, unsigned long long *sum) {
+  int natoms = 0;
+  char error[GROTOP_ERROR_LENGTH];
+  void *handle = use_molfile ? open_grotop_read(filename, "grotop", &natoms)
+                             : grotop_open(filename, LOG_SILENT, &natoms, error, sizeof(error));
+  if (!handle) return -1;
+
+  int rc = checksum_handle(handle, natoms, sum);
+  close_grotop_read(handle);
+  return rc;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *w = (worker_t *)arg;
+
+  for (int it = 0; it < w->iterations; it++) {
+    int f = (w->id + it) % w->nfiles;
+    unsigned long long sum = 0;
+
+    if (load_checksum(w->files[f], it % 2, &sum) != 0 || sum != w->reference[f]) {
+      w->failures++;
+      continue;
+    }
+    w->loads++;
+  }
+
+  /* A failed open must report its own reason, not another thread's */
+  char missing[64], error[GROTOP_ERROR_LENGTH];
+  int natoms = 0;
+  snprintf(missing, sizeof(missing), "/nonexistent/grotop_thread_%d.top", w->id);
+  void *handle = grotop_open(missing, LOG_SILENT, &natoms, error, sizeof(error));
+  if (handle || !strstr(error, missing)) w->failures++;
+  if (handle) close_grotop_read(handle);
+
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int nthreads = 8, iterations = 20;
+  int first = 1;
+
+  while (first + 1 < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-t") == 0) nthreads = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-n") == 0) iterations = atoi(argv[first + 1]);
+    else break;
+    first += 2;
+  }
+
+  if (first >= argc || nthreads < 1 || nthreads > MAX_THREADS || iterations < 1) {
+    fprintf(stderr, "Usage: %s [-t threads] [-n iterations] <topology_file.top> [...]\n", argv[0]);
+    return 1;
+  }
+
+  VMDPLUGIN_init();
+
+  int nfiles = argc - first;
+  const char **files = (const char **)&argv[first];
+  unsigned long long *reference = (unsigned long long *)calloc(nfiles, sizeof(unsigned long long));
+  if (!reference) return 1;
+
+  printf("=======================================================\n");
+  printf("GROMACS Topology Plugin Thread Stress Test\n");
+  printf("=======================================================\n");
+  printf("Plugin reentrancy: %s\n", plugin.is_reentrant == VMDPLUGIN_THREADSAFE ? "thread-safe" : "thread-unsafe");
+
+  for (int f = 0; f < nfiles; f++) {
+    if (load_checksum(files[f], 0, &reference[f]) != 0) {
+      fprintf(stderr, "ERROR: Failed to read reference %s\n", files[f]);
+      free(reference);
+      return 1;
+    }
+    printf("  %-40s %016llx\n", files[f], reference[f]);
+  }
+
+  worker_t workers[MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    workers[t].files = files;
+    workers[t].reference = reference;
+    workers[t].nfiles = nfiles;
+    workers[t].iterations = iterations;
+    workers[t].id = t;
+    workers[t].loads = 0;
+    workers[t].failures = 0;
+  }
+
+  double start = wall_seconds();
+#ifndef _WIN32
+  pthread_t threads[MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, worker_main, &workers[t]) != 0) {
+      fprintf(stderr, "ERROR: Failed to start thread %d\n", t);
+      for (int j = 0; j < t; j++) pthread_join(threads[j], NULL);
+      free(reference);
+      return 1;
+    }
+  }
+  for (int t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+#else
+  for (int t = 0; t < nthreads; t++) worker_main(&workers[t]);
+#endif
+  double elapsed = wall_seconds() - start;
+
+  int loads = 0, failures = 0;
+  for (int t = 0; t < nthreads; t++) {
+    loads += workers[t].loads;
+    failures += workers[t].failures;
+  }
+
+  printf("\n%d threads x %d iterations: %d loads, %d failures in %.3f s\n",
+         nthreads, iterations, loads, failures, elapsed);
+  printf("=======================================================\n");
+
+  free(reference);
+  if (failures) {
+    printf("\nTest FAILED\n");
+    return 1;
+  }
+  printf("\nTest completed successfully!\n");
+  return 0;
+}
@@ -4,11 +4,38 @@
  * This validates the grotopplugin by using it to read .top files,
  * reads coordinates from .gro file using gromacsplugin,
  * and writes the complete result to .js using the jsplugin.
+ *
+ * Atom metadata comes from the topology, so only the coordinates are read
+ * from the .gro file: it is mapped and its fixed-width atom lines are parsed
+ * in parallel chunks (GROTOP_THREADS) straight into the timestep.
+ * gromacsplugin is kept as the fallback for files the fast path rejects.
+ *
+ * With --all-frames every frame of a multi-frame .gro is written after the
+ * topology, decoding the next frame while the current one is written.
+ *
+ * With a molecule filter (GROTOP_INCLUDE_MOLECULES, GROTOP_EXCLUDE_MOLECULES)
+ * the .gro still holds every atom; only the lines of kept atoms are parsed.
+ *
+ * The connectivity slab is taken from the reader and released once the JS
+ * writer has its copy, so only one copy is held while frames are written.
+ * The structure and connectivity sections are written on a thread of their
+ * own while the first frame is decoded.
+ *
+ * With --memory the memory held by the reader is printed with its statistics.
+ *
+ * With --batch every "<input.top> <input.gro> <output.js>" line of a
+ * manifest is converted on a pool of -j worker threads (default one per
+ * CPU) that share parsed includes, see grotop_batch.h.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 /* We'll compile both plugins directly into this test */
 #define STATIC_PLUGIN
@@ -54,6 +81,8 @@ static int (*js_write_angles)(void *, int, const int *, const int *, int, const
 static int (*js_write_timestep)(void *, const molfile_timestep_t *);
 static void (*js_close_write)(void *);
 
+#include "grotop_batch.h"
+
 static void init_js_plugin(void) {
   VMDPLUGIN_js_init();
   js_open_write = plugin.open_file_write;
@@ -64,16 +93,711 @@ static void init_js_plugin(void) {
   js_close_write = plugin.close_file_write;
 }
 
+/*
+ * GRO Coordinate Fast Path
+ *
+ * GRO atom lines are fixed width: 20 columns of names and numbers, then
+ * x, y and z in fields as wide as the distance between their decimal
+ * points (8 by default), then optional velocities. When every atom line of
+ * a frame has the length of the first, line i starts at a computable
+ * offset and the frame can be split across threads. Otherwise the frame is
+ * parsed line by line.
+ */
+
+#define GRO_MIN_ATOMS_PER_THREAD 65536
+#define GRO_MAX_FIELD 31
+
+typedef struct {
+  const char *base;          /* First atom line of the frame */
+  size_t line_len;           /* Bytes per atom line, newline included */
+  int width;                 /* Width of one coordinate field */
+  int begin, end;            /* Atom range of this job */
+  float *coords;             /* Timestep coordinates, in Angstrom */
+  int ok;                    /* Cleared if a line is not fixed width or malformed */
+} gro_job_t;
+
+/* Atoms of the file that are kept, in runs; all of them without a filter */
+typedef struct {
+  int first, count;          /* 0-based atom index in the file, and run length */
+} atom_run_t;
+
+typedef struct {
+  int file_natoms;           /* Atoms per frame in the file */
+  atom_run_t *runs;
+  int nruns;
+} atom_mask_t;
+
+/* x, y and z of one atom line, converted from nm to Angstrom */
+static int gro_parse_atom(const char *line, size_t len, int width, float *xyz) {
+  if (len < (size_t)(20 + 3 * width)) return 0;
+
+  for (int k = 0; k < 3; k++) {
+    char field[GRO_MAX_FIELD + 1];
+    memcpy(field, line + 20 + k * width, width);
+    field[width] = '\0';
+
+    const char *p = field;
+    float v;
+    if (!scan_float(&p, &v)) return 0;
+    xyz[k] = 10 * v;
+  }
+  return 1;
+}
+
+static void *gro_worker(void *arg) {
+  gro_job_t *job = (gro_job_t *)arg;
+
+  for (int i = job->begin; i < job->end; i++) {
+    const char *line = job->base + (size_t)i * job->line_len;
+    if (line[job->line_len - 1] != '\n' ||
+        !gro_parse_atom(line, job->line_len - 1, job->width, &job->coords[3 * (size_t)i])) {
+      job->ok = 0;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* Field width from the distance between the first two decimal points */
+static int gro_field_width(const char *line, size_t len) {
+  const char *p1 = (len > 20) ? (const char *)memchr(line + 20, '.', len - 20) : NULL;
+  const char *p2 = p1 ? (const char *)memchr(p1 + 1, '.', len - (p1 + 1 - line)) : NULL;
+  int width = p2 ? (int)(p2 - p1) : 8;
+  return (width < 1 || width > GRO_MAX_FIELD) ? 8 : width;
+}
+
+/* Box line: v1(x) v2(y) v3(z) [v1(y) v1(z) v2(x) v2(z) v3(x) v3(y)] in nm */
+static void gro_set_box(const char *line, size_t len, molfile_timestep_t *ts) {
+  char record[GROTOP_RECORD_LENGTH];
+  float v[9] = { 0 };
+  const char *p = record;
+  copy_line(record, line, len);
+  for (int k = 0; k < 9 && scan_float(&p, &v[k]); k++) ;
+
+  const double a[3] = { v[0], v[3], v[4] };
+  const double b[3] = { v[5], v[1], v[6] };
+  const double c[3] = { v[7], v[8], v[2] };
+  double la = sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+  double lb = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+  double lc = sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+
+  ts->A = (float)(10 * la);
+  ts->B = (float)(10 * lb);
+  ts->C = (float)(10 * lc);
+  ts->alpha = ts->beta = ts->gamma = 90.0f;
+  if (lb > 0 && lc > 0)
+    ts->alpha = (float)(acos((b[0] * c[0] + b[1] * c[1] + b[2] * c[2]) / (lb * lc)) * 180.0 / M_PI);
+  if (la > 0 && lc > 0)
+    ts->beta = (float)(acos((a[0] * c[0] + a[1] * c[1] + a[2] * c[2]) / (la * lc)) * 180.0 / M_PI);
+  if (la > 0 && lb > 0)
+    ts->gamma = (float)(acos((a[0] * b[0] + a[1] * b[1] + a[2] * b[2]) / (la * lb)) * 180.0 / M_PI);
+}
+
+/* Split a fixed-width frame into jobs; returns 0 if any line broke the pattern */
+static int gro_parse_fixed(const char *base, size_t line_len, int width, int natoms, float *coords) {
+  int nthreads = configured_threads();
+  if (nthreads > natoms / GRO_MIN_ATOMS_PER_THREAD) nthreads = natoms / GRO_MIN_ATOMS_PER_THREAD;
+  if (nthreads < 1) nthreads = 1;
+
+  gro_job_t jobs[MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].base = base;
+    jobs[t].line_len = line_len;
+    jobs[t].width = width;
+    jobs[t].begin = (int)((long long)natoms * t / nthreads);
+    jobs[t].end = (int)((long long)natoms * (t + 1) / nthreads);
+    jobs[t].coords = coords;
+    jobs[t].ok = 1;
+  }
+
+#ifndef _WIN32
+  pthread_t threads[MAX_THREADS];
+  int started = 0;
+  for (int t = 1; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, gro_worker, &jobs[t]) != 0) break;
+    started = t;
+  }
+  gro_worker(&jobs[0]);
+  for (int t = started + 1; t < nthreads; t++) gro_worker(&jobs[t]);
+  for (int t = 1; t <= started; t++) pthread_join(threads[t], NULL);
+#else
+  for (int t = 0; t < nthreads; t++) gro_worker(&jobs[t]);
+#endif
+
+  for (int t = 0; t < nthreads; t++) {
+    if (!jobs[t].ok) return 0;
+  }
+  return 1;
+}
+
+/* Frame results; molfile's MOLFILE_EOF and MOLFILE_ERROR share one value */
+enum { FRAME_OK, FRAME_END, FRAME_ERROR };
+
+/* Parse the kept runs of a fixed-width frame; skipped lines are only checked for width */
+static int gro_parse_masked(const char *base, size_t line_len, int width, const atom_mask_t *mask,
+                            float *coords) {
+  int next = 0, out = 0;
+  for (int k = 0; k <= mask->nruns; k++) {
+    int first = k < mask->nruns ? mask->runs[k].first : mask->file_natoms;
+    for (int i = next; i < first; i++) {
+      if (base[(size_t)i * line_len + line_len - 1] != '\n') return 0;
+    }
+    if (k == mask->nruns) break;
+
+    int count = mask->runs[k].count;
+    if (!gro_parse_fixed(base + (size_t)first * line_len, line_len, width, count, &coords[3 * (size_t)out]))
+      return 0;
+    out += count;
+    next = first + count;
+  }
+  return 1;
+}
+
+/*
+ * Read the next frame of a mapped GRO file into ts->coords and the box,
+ * keeping the atoms of the mask. Returns FRAME_OK, FRAME_END at the end of
+ * the file, or FRAME_ERROR; *frame_natoms is set to the atom count of the frame.
+ */
+static int gro_read_frame(lexer_t *lx, const atom_mask_t *mask, molfile_timestep_t *ts, int *frame_natoms) {
+  int natoms = mask->file_natoms;
+  const char *line;
+  size_t len;
+  char record[GROTOP_RECORD_LENGTH];
+
+  /* Trailing blank lines are not another frame */
+  *frame_natoms = 0;
+  size_t rest = lx->pos;
+  while (rest < lx->len && isspace((unsigned char)lx->buf[rest])) rest++;
+  if (rest == lx->len || !lexer_next_line(lx, &line, &len)) return FRAME_END;
+  if (!lexer_next_line(lx, &line, &len)) return FRAME_ERROR;
+
+  const char *p = record;
+  copy_line(record, line, len);
+  if (!scan_int(&p, frame_natoms) || *frame_natoms != natoms) return FRAME_ERROR;
+
+  const char *first = lx->buf + lx->pos;
+  const char *nl = natoms > 0 ? (const char *)memchr(first, '\n', lx->len - lx->pos) : NULL;
+  size_t line_len = nl ? (size_t)(nl - first) + 1 : 0;
+  int width = nl ? gro_field_width(first, line_len - 1) : 8;
+
+  if (nl && (size_t)natoms * line_len <= lx->len - lx->pos &&
+      gro_parse_masked(first, line_len, width, mask, ts->coords)) {
+    lx->pos += (size_t)natoms * line_len;
+  } else {
+    int k = 0, out = 0;
+    for (int i = 0; i < natoms; i++) {
+      if (!lexer_next_line(lx, &line, &len)) return FRAME_ERROR;
+      while (k < mask->nruns && i >= mask->runs[k].first + mask->runs[k].count) k++;
+      if (k < mask->nruns && i >= mask->runs[k].first &&
+          !gro_parse_atom(line, len, width, &ts->coords[3 * (size_t)out++]))
+        return FRAME_ERROR;
+    }
+  }
+
+  if (!lexer_next_line(lx, &line, &len)) return FRAME_ERROR;
+  gro_set_box(line, len, ts);
+  return FRAME_OK;
+}
+
+/*
+ * Frame Source
+ *
+ * Frames come from the fast path while it accepts the file; if it rejects
+ * the first frame the file is reopened through gromacsplugin, which reads
+ * it (and, later, other trajectory formats) one timestep at a time.
+ *
+ * The fast path reads compressed files through the lexer. gromacsplugin
+ * opens files by name and cannot, so for it a compressed file is inflated
+ * into an anonymous memory file (Linux) passed as /proc/self/fd/N; no
+ * uncompressed copy is written to disk.
+ */
+
+typedef struct {
+  const char *path;
+  int natoms;                /* Atoms written per frame */
+  atom_mask_t mask;          /* Atoms of the file they come from */
+  int fast;                  /* Non-zero while lx is the active reader */
+  lexer_t lx;                /* Mapped file for the fast path */
+  void *gro_handle;          /* gromacsplugin handle for the fallback */
+  molfile_timestep_t full;   /* Whole frames for the fallback, when filtered */
+  int memfd;                 /* Inflated file for the fallback, 0 if none */
+  int frames;                /* Frames decoded so far */
+} frame_source_t;
+
+static int gro_compressed(const char *path) {
+  unsigned char magic[4];
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return 0;
+  size_t n = fread(magic, 1, sizeof(magic), fp);
+  fclose(fp);
+  return input_format(magic, n) != INPUT_PLAIN;
+}
+
+/* Memory file holding the inflated contents of path, or -1 */
+static int inflate_to_memfd(const char *path) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+  lexer_t lx;
+  if (!lexer_open(&lx, path, NULL)) return -1;
+
+  int fd = (int)syscall(SYS_memfd_create, "gro", 0);
+  for (size_t done = 0; fd >= 0 && done < lx.len; ) {
+    ssize_t n = write(fd, lx.buf + done, lx.len - done);
+    if (n <= 0) {
+      close(fd);
+      fd = -1;
+    } else {
+      done += (size_t)n;
+    }
+  }
+  lexer_close(&lx);
+  return fd;
+#else
+  (void)path;
+  return -1;
+#endif
+}
+
+static int open_fallback(frame_source_t *src) {
+  const char *path = src->path;
+  char inflated[64];
+  if (gro_compressed(src->path)) {
+    src->memfd = inflate_to_memfd(src->path);
+    if (src->memfd <= 0) {
+      fprintf(stderr, "ERROR: Failed to decompress the GRO file for gromacsplugin\n");
+      src->memfd = 0;
+      return 0;
+    }
+    snprintf(inflated, sizeof(inflated), "/proc/self/fd/%d", src->memfd);
+    path = inflated;
+  }
+
+  int gro_natoms = 0;
+  src->gro_handle = open_gro_read_wrapper(path, "gro", &gro_natoms);
+  if (!src->gro_handle) {
+    fprintf(stderr, "ERROR: Failed to open GRO file\n");
+    return 0;
+  }
+
+  if (gro_natoms != src->mask.file_natoms) {
+    fprintf(stderr, "ERROR: Atom count mismatch between topology (%d) and GRO (%d)\n",
+            src->mask.file_natoms, gro_natoms);
+    close_gro_read_wrapper(src->gro_handle);
+    src->gro_handle = NULL;
+    return 0;
+  }
+
+  /* gromacsplugin reads every atom, so filtered frames go through a full buffer */
+  if (gro_natoms != src->natoms) {
+    src->full.coords = (float *)calloc(3 * (size_t)gro_natoms + 3, sizeof(float));
+    if (!src->full.coords) {
+      fprintf(stderr, "ERROR: Failed to allocate memory for timestep\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Copy the kept atoms and the box of a whole frame */
+static void gather_frame(const atom_mask_t *mask, const molfile_timestep_t *full, molfile_timestep_t *ts) {
+  float *out = ts->coords;
+  for (int k = 0; k < mask->nruns; k++) {
+    memcpy(out, &full->coords[3 * (size_t)mask->runs[k].first], 3 * (size_t)mask->runs[k].count * sizeof(float));
+    out += 3 * (size_t)mask->runs[k].count;
+  }
+  ts->A = full->A;
+  ts->B = full->B;
+  ts->C = full->C;
+  ts->alpha = full->alpha;
+  ts->beta = full->beta;
+  ts->gamma = full->gamma;
+  ts->physical_time = full->physical_time;
+}
+
+/* Runs of the file's atoms that the topology keeps, from its molecule filter */
+static int build_atom_mask(void *grotop_handle, atom_mask_t *mask) {
+  long long system_atoms = grotop_system_atoms(grotop_handle);
+  if (system_atoms > INT_MAX) {
+    fprintf(stderr, "ERROR: %lld atoms do not fit in a GRO file\n", system_atoms);
+    return 0;
+  }
+  mask->file_natoms = (int)system_atoms;
+
+  long long first, count;
+  mask->nruns = 0;
+  while (grotop_selected_atoms(grotop_handle, mask->nruns, &first, &count)) mask->nruns++;
+  mask->runs = (atom_run_t *)calloc(mask->nruns + 1, sizeof(atom_run_t));
+  if (!mask->runs) return 0;
+
+  for (int k = 0; k < mask->nruns; k++) {
+    grotop_selected_atoms(grotop_handle, k, &first, &count);
+    mask->runs[k].first = (int)first;
+    mask->runs[k].count = (int)count;
+  }
+  return 1;
+}
+
+static int frame_source_open(frame_source_t *src, const char *path, int natoms, void *grotop_handle) {
+  memset(src, 0, sizeof(frame_source_t));
+  src->path = path;
+  src->natoms = natoms;
+  if (!build_atom_mask(grotop_handle, &src->mask)) return 0;
+
+  if (lexer_open(&src->lx, path, NULL)) {
+    src->fast = 1;
+    return 1;
+  }
+  return open_fallback(src);
+}
+
+/* Decode the next frame into ts: FRAME_OK, FRAME_END or FRAME_ERROR */
+static int frame_source_next(frame_source_t *src, molfile_timestep_t *ts) {
+  if (src->fast) {
+    int frame_natoms = 0;
+    int rc = gro_read_frame(&src->lx, &src->mask, ts, &frame_natoms);
+    if (rc == FRAME_OK) src->frames++;
+    if (rc != FRAME_ERROR) return rc;
+
+    if (frame_natoms != src->mask.file_natoms) {
+      fprintf(stderr, "ERROR: Atom count mismatch between topology (%d) and GRO frame %d (%d)\n",
+              src->mask.file_natoms, src->frames, frame_natoms);
+      return FRAME_ERROR;
+    }
+    if (src->frames > 0) {
+      fprintf(stderr, "ERROR: Malformed GRO frame %d\n", src->frames);
+      return FRAME_ERROR;
+    }
+
+    printf("  - Fast path rejected the GRO file, using gromacsplugin\n");
+    lexer_close(&src->lx);
+    src->fast = 0;
+    if (!open_fallback(src)) return FRAME_ERROR;
+  }
+
+  if (!src->gro_handle) return FRAME_ERROR;
+  /* Like VMD, take a failed read after the first frame as the end of the file */
+  molfile_timestep_t *dst = src->full.coords ? &src->full : ts;
+  if (read_gro_timestep_wrapper(src->gro_handle, src->mask.file_natoms, dst) == MOLFILE_SUCCESS) {
+    if (dst != ts) gather_frame(&src->mask, dst, ts);
+    src->frames++;
+    return FRAME_OK;
+  }
+  if (src->frames > 0) return FRAME_END;
+  fprintf(stderr, "ERROR: Failed to read coordinates\n");
+  return FRAME_ERROR;
+}
+
+static void frame_source_close(frame_source_t *src) {
+  if (src->fast) lexer_close(&src->lx);
+  if (src->gro_handle) close_gro_read_wrapper(src->gro_handle);
+#ifndef _WIN32
+  if (src->memfd > 0) close(src->memfd);
+#endif
+  free(src->full.coords);
+  free(src->mask.runs);
+  src->fast = 0;
+  src->gro_handle = NULL;
+  src->memfd = 0;
+  src->full.coords = NULL;
+  src->mask.runs = NULL;
+}
+
+/*
+ * Frame Pipeline
+ *
+ * With --all-frames a reader thread decodes frame N+1 into one timestep
+ * buffer while the main thread hands frame N to js_write_timestep(). The
+ * two buffers alternate, so decoding overlaps with output.
+ */
+
+/* Frame 0 is already in first; returns the number of frames written, or -1 */
+static int write_frames_serial(void *js_handle, frame_source_t *src,
+                               molfile_timestep_t *first, molfile_timestep_t *second) {
+  molfile_timestep_t *slots[2] = { first, second };
+  int rc = FRAME_OK;
+  int written = 0;
+
+  for (int idx = 0; rc == FRAME_OK; idx ^= 1) {
+    if (js_write_timestep(js_handle, slots[idx]) != MOLFILE_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to write coordinates of frame %d\n", written);
+      return -1;
+    }
+    written++;
+    rc = frame_source_next(src, slots[idx ^ 1]);
+  }
+
+  return rc == FRAME_END ? written : -1;
+}
+
+#ifndef _WIN32
+typedef struct {
+  frame_source_t *src;
+  molfile_timestep_t *slots[2];
+  int full[2];               /* Slot holds a decoded frame, or the end of input */
+  int rc[2];                 /* frame_source_next() result for a full slot */
+  int stop;                  /* Writer is done; the reader must exit */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} frame_pipeline_t;
+
+static void *frame_reader(void *arg) {
+  frame_pipeline_t *pl = (frame_pipeline_t *)arg;
+
+  for (int idx = 1;; idx ^= 1) {
+    pthread_mutex_lock(&pl->lock);
+    while (pl->full[idx] && !pl->stop) pthread_cond_wait(&pl->cond, &pl->lock);
+    int stop = pl->stop;
+    pthread_mutex_unlock(&pl->lock);
+    if (stop) break;
+
+    int rc = frame_source_next(pl->src, pl->slots[idx]);
+
+    pthread_mutex_lock(&pl->lock);
+    pl->rc[idx] = rc;
+    pl->full[idx] = 1;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+    if (rc != FRAME_OK) break;
+  }
+  return NULL;
+}
+#endif
+
+static int write_all_frames(void *js_handle, frame_source_t *src,
+                            molfile_timestep_t *first, molfile_timestep_t *second) {
+#ifndef _WIN32
+  frame_pipeline_t pl;
+  memset(&pl, 0, sizeof(pl));
+  pl.src = src;
+  pl.slots[0] = first;
+  pl.slots[1] = second;
+  pl.full[0] = 1;
+  pl.rc[0] = FRAME_OK;
+  pthread_mutex_init(&pl.lock, NULL);
+  pthread_cond_init(&pl.cond, NULL);
+
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, frame_reader, &pl) != 0) {
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.cond);
+    return write_frames_serial(js_handle, src, first, second);
+  }
+
+  int written = 0, result;
+  for (int idx = 0;; idx ^= 1) {
+    pthread_mutex_lock(&pl.lock);
+    while (!pl.full[idx]) pthread_cond_wait(&pl.cond, &pl.lock);
+    int rc = pl.rc[idx];
+    pthread_mutex_unlock(&pl.lock);
+
+    if (rc != FRAME_OK) {
+      result = (rc == FRAME_END) ? written : -1;
+      break;
+    }
+    if (js_write_timestep(js_handle, pl.slots[idx]) != MOLFILE_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to write coordinates of frame %d\n", written);
+      result = -1;
+      break;
+    }
+    written++;
+
+    pthread_mutex_lock(&pl.lock);
+    pl.full[idx] = 0;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+  }
+
+  pthread_mutex_lock(&pl.lock);
+  pl.stop = 1;
+  pthread_cond_broadcast(&pl.cond);
+  pthread_mutex_unlock(&pl.lock);
+  pthread_join(reader, NULL);
+
+  pthread_mutex_destroy(&pl.lock);
+  pthread_cond_destroy(&pl.cond);
+  return result;
+#else
+  return write_frames_serial(js_handle, src, first, second);
+#endif
+}
+
+/* One timestep with room for natoms coordinates */
+static molfile_timestep_t *alloc_timestep(int natoms) {
+  molfile_timestep_t *ts = (molfile_timestep_t *)calloc(1, sizeof(molfile_timestep_t));
+  if (!ts) return NULL;
+  ts->coords = (float *)calloc(3 * (size_t)natoms + 3, sizeof(float));
+  if (!ts->coords) {
+    free(ts);
+    return NULL;
+  }
+  return ts;
+}
+
+static void free_timestep(molfile_timestep_t *ts) {
+  if (!ts) return;
+  free(ts->coords);
+  free(ts);
+}
+
+/*
+ * Section Writer
+ *
+ * The bonds, structure and angles sections need nothing from the
+ * coordinates, so they are handed to a writer thread while the calling
+ * thread decodes the first frame. The writer releases the connectivity
+ * slab as soon as jsplugin has its copy.
+ */
+
+typedef struct {
+  void *js_handle;
+  int optflags;
+  const molfile_atom_t *atoms;
+  grotop_connectivity_t *conn;
+  const char *failed;        /* Section that could not be written, NULL on success */
+#ifndef _WIN32
+  pthread_t thread;
+  int threaded;
+#endif
+} section_writer_t;
+
+static void *write_sections(void *arg) {
+  section_writer_t *w = (section_writer_t *)arg;
+  const grotop_connectivity_t *conn = w->conn;
+  int nbonds = (int)conn->counts[GROTOP_BONDS];
+  int nangles = (int)conn->counts[GROTOP_ANGLES];
+  int ndihedrals = (int)conn->counts[GROTOP_DIHEDRALS];
+  int nimpropers = (int)conn->counts[GROTOP_IMPROPERS];
+
+  /* The molfile API requires write_bonds() to be called before write_structure() */
+  if (nbonds > 0 &&
+      js_write_bonds(w->js_handle, nbonds, conn->bond_from, conn->bond_to, NULL, NULL, 0, NULL) != MOLFILE_SUCCESS)
+    w->failed = "bonds";
+  else if (js_write_structure(w->js_handle, w->optflags, w->atoms) != MOLFILE_SUCCESS)
+    w->failed = "structure";
+  else if ((nangles > 0 || ndihedrals > 0 || nimpropers > 0) &&
+           js_write_angles(w->js_handle,
+                           nangles, conn->angles, NULL, 0, NULL,
+                           ndihedrals, conn->dihedrals, NULL, 0, NULL,
+                           nimpropers, conn->impropers, NULL, 0, NULL,
+                           0, NULL, 0, 0) != MOLFILE_SUCCESS)
+    w->failed = "angles/dihedrals/impropers";
+
+  /* The writer has its own copy now */
+  grotop_free_connectivity(w->conn);
+  return NULL;
+}
+
+/* Start writing the sections; they are written here if no thread can be started */
+static void start_sections(section_writer_t *w, void *js_handle, int optflags,
+                           const molfile_atom_t *atoms, grotop_connectivity_t *conn) {
+  w->js_handle = js_handle;
+  w->optflags = optflags;
+  w->atoms = atoms;
+  w->conn = conn;
+  w->failed = NULL;
+#ifndef _WIN32
+  w->threaded = pthread_create(&w->thread, NULL, write_sections, w) == 0;
+  if (w->threaded) return;
+#endif
+  write_sections(w);
+}
+
+/* Wait for the sections; the section that failed, NULL on success */
+static const char *finish_sections(section_writer_t *w) {
+#ifndef _WIN32
+  if (w->threaded) pthread_join(w->thread, NULL);
+  w->threaded = 0;
+#endif
+  return w->failed;
+}
+
+/*
+ * One job of a batch: "<input.top> <input.gro> <output.js>", the steps of
+ * main() without their progress output. options points to all_frames.
+ */
+static int convert_batch_job(batch_job_t *job, void *options) {
+  int all_frames = *(const int *)options;
+  int natoms = 0, optflags = 0;
+  void *handle = grotop_open(job->fields[0], LOG_SILENT, &natoms, job->error, sizeof(job->error));
+  if (!handle) return 0;
+
+  molfile_atom_t *atoms = (molfile_atom_t *)calloc(natoms > 0 ? natoms : 1, sizeof(molfile_atom_t));
+  molfile_timestep_t *ts = alloc_timestep(natoms);
+  molfile_timestep_t *next_ts = all_frames ? alloc_timestep(natoms) : NULL;
+  grotop_connectivity_t conn;
+  frame_source_t source;
+  void *js_handle = NULL;
+  const char *failed = NULL;
+  memset(&conn, 0, sizeof(conn));
+  memset(&source, 0, sizeof(source));
+
+  if (!atoms || !ts || (all_frames && !next_ts)) {
+    failed = "Out of memory";
+  } else if (read_grotop_structure(handle, &optflags, atoms) != MOLFILE_SUCCESS) {
+    failed = "Failed to read structure";
+  } else if (grotop_take_connectivity(handle, &conn) != 0 ||
+             conn.counts[GROTOP_BONDS] > INT_MAX || conn.counts[GROTOP_ANGLES] > INT_MAX ||
+             conn.counts[GROTOP_DIHEDRALS] > INT_MAX || conn.counts[GROTOP_IMPROPERS] > INT_MAX) {
+    failed = "Failed to read connectivity";
+  } else if (!frame_source_open(&source, job->fields[1], natoms, handle)) {
+    failed = "Failed to read coordinates";
+  } else if (!(js_handle = js_open_write(job->fields[2], "js", natoms))) {
+    failed = "Failed to open the JS file";
+  } else {
+    /* Sections are written while the first frame is decoded */
+    section_writer_t sections;
+    start_sections(&sections, js_handle, optflags, atoms, &conn);
+    int rc = frame_source_next(&source, ts);
+    if (finish_sections(&sections)) {
+      failed = "Failed to write the JS structure";
+    } else if (rc != FRAME_OK) {
+      failed = "Failed to read coordinates";
+    } else {
+      int nframes = all_frames ? write_all_frames(js_handle, &source, ts, next_ts)
+                               : (js_write_timestep(js_handle, ts) == MOLFILE_SUCCESS ? 1 : -1);
+      if (nframes < 0) failed = "Failed to write coordinates";
+    }
+  }
+
+  if (failed) {
+    const char *reason = grotop_last_error(handle);
+    snprintf(job->error, sizeof(job->error), "%s%s%.200s", failed, reason[0] ? ": " : "", reason);
+  }
+  batch_record(job, handle);
+
+  if (js_handle) js_close_write(js_handle);
+  frame_source_close(&source);
+  grotop_free_connectivity(&conn);
+  close_grotop_read(handle);
+  free_timestep(ts);
+  free_timestep(next_ts);
+  free(atoms);
+  return failed == NULL;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 4) {
-    fprintf(stderr, "Usage: %s <input.top> <input.gro> <output.js>\n", argv[0]);
+  int all_frames = 0, memory = 0, first = 1, threads = 0;
+  const char *manifest = NULL;
+  for (; first < argc; first++) {
+    if (strcmp(argv[first], "--all-frames") == 0) all_frames = 1;
+    else if (strcmp(argv[first], "--memory") == 0) memory = 1;
+    else if (strcmp(argv[first], "--batch") == 0 && first + 1 < argc) manifest = argv[++first];
+    else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) threads = atoi(argv[++first]);
+    else break;
+  }
+  if (manifest) {
+    init_js_plugin();
+    return batch_run(manifest, threads, 3, convert_batch_job, &all_frames);
+  }
+
+  if (argc < first + 3) {
+    fprintf(stderr, "Usage: %s [--all-frames] [--memory] <input.top> <input.gro> <output.js>\n"
+                    "       %s --batch <manifest> [--all-frames] [-j threads]\n", argv[0], argv[0]);
     return 1;
   }
 
-  const char *top_file = argv[1];
-  const char *gro_file = argv[2];
-  const char *output_file = argv[3];
+  const char *top_file = argv[first];
+  const char *gro_file = argv[first + 1];
+  const char *output_file = argv[first + 2];
 
   /* Initialize JS plugin */
   init_js_plugin();
@@ -121,239 +845,144 @@ int main(int argc, char *argv[]) {
   printf("  - Read structure successfully\n");
   printf("  - Optional flags: 0x%x\n", optflags);
 
-  /* Read bonds */
-  int nbonds = 0;
-  int *from = NULL, *to = NULL;
-  float *bondorder = NULL;
-  int *bondtype = NULL;
-  int nbondtypes = 0;
-  char **bondtypename = NULL;
-
-  rc = read_grotop_bonds(grotop_handle, &nbonds, &from, &to, &bondorder,
-                         &bondtype, &nbondtypes, &bondtypename);
-
-  if (rc != MOLFILE_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to read bonds\n");
+  /*
+   * Take the connectivity slab rather than borrowing the reader's arrays:
+   * it is released as soon as the writer has it, so only one copy is held
+   * while the coordinates are written.
+   */
+  grotop_connectivity_t conn;
+  if (grotop_take_connectivity(grotop_handle, &conn) != 0 ||
+      conn.counts[GROTOP_BONDS] > INT_MAX || conn.counts[GROTOP_ANGLES] > INT_MAX ||
+      conn.counts[GROTOP_DIHEDRALS] > INT_MAX || conn.counts[GROTOP_IMPROPERS] > INT_MAX) {
+    fprintf(stderr, "ERROR: Failed to read connectivity: %s\n", grotop_last_error(grotop_handle));
+    grotop_free_connectivity(&conn);
     free(atoms);
     close_grotop_read(grotop_handle);
     return 1;
   }
 
+  int nbonds = (int)conn.counts[GROTOP_BONDS];
   printf("  - Total bonds: %d\n", nbonds);
 
-  /* Read angles, dihedrals, impropers */
-  int numangles = 0, numdihedrals = 0, numimpropers = 0, numcterms = 0;
-  int *angles = NULL, *angletypes = NULL, *dihedrals = NULL, *dihedraltypes = NULL;
-  int *impropers = NULL, *impropertypes = NULL, *cterms = NULL;
-  int numangletypes = 0, numdihedraltypes = 0, numimpropertypes = 0;
-  int ctermcols = 0, ctermrows = 0;
-  char **angletypenames = NULL, **dihedraltypenames = NULL, **impropertypenames = NULL;
-
-  rc = read_grotop_angles(grotop_handle, &numangles, &angles, &angletypes,
-                          &numangletypes, &angletypenames, &numdihedrals,
-                          &dihedrals, &dihedraltypes, &numdihedraltypes,
-                          &dihedraltypenames, &numimpropers, &impropers,
-                          &impropertypes, &numimpropertypes, &impropertypenames,
-                          &numcterms, &cterms, &ctermcols, &ctermrows);
-
-  if (rc != MOLFILE_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to read angles/dihedrals/impropers\n");
-    free(atoms);
-    close_grotop_read(grotop_handle);
-    return 1;
-  }
+  int numangles = (int)conn.counts[GROTOP_ANGLES];
+  int numdihedrals = (int)conn.counts[GROTOP_DIHEDRALS];
+  int numimpropers = (int)conn.counts[GROTOP_IMPROPERS];
 
   printf("  - Total angles: %d\n", numangles);
   printf("  - Total dihedrals: %d\n", numdihedrals);
   printf("  - Total impropers: %d\n\n", numimpropers);
 
-  /* Step 2: Read coordinates from GRO file */
-  printf("Step 2: Reading coordinates from GRO file...\n");
+  /* Step 2: Write the JS structure while the first frame is decoded */
+  printf("Step 2: Writing JS structure and reading coordinates from GRO file...\n");
 
-  int gro_natoms = 0;
-  void *gro_handle = open_gro_read_wrapper(gro_file, "gro", &gro_natoms);
-
-  if (!gro_handle) {
-    fprintf(stderr, "ERROR: Failed to open GRO file\n");
-    free(atoms);
-    close_grotop_read(grotop_handle);
-    return 1;
-  }
-
-  if (gro_natoms != natoms) {
-    fprintf(stderr, "ERROR: Atom count mismatch between topology (%d) and GRO (%d)\n",
-            natoms, gro_natoms);
-    close_gro_read_wrapper(gro_handle);
-    free(atoms);
-    close_grotop_read(grotop_handle);
-    return 1;
-  }
-
-  printf("  - GRO file contains %d atoms (matches topology)\n", gro_natoms);
-
-  /* Allocate separate atom array for GRO file (we'll extract coords from it) */
-  molfile_atom_t *gro_atoms = (molfile_atom_t *)calloc(gro_natoms, sizeof(molfile_atom_t));
-  if (!gro_atoms) {
-    fprintf(stderr, "ERROR: Failed to allocate memory for GRO atoms\n");
-    close_gro_read_wrapper(gro_handle);
-    free(atoms);
-    close_grotop_read(grotop_handle);
-    return 1;
-  }
-
-  /* Read structure from GRO file (this includes coordinates) */
-  int gro_optflags = 0;
-  printf("  - Reading structure and coordinates from GRO file...\n");
-  rc = read_gro_structure_wrapper(gro_handle, &gro_optflags, gro_atoms);
-
-  if (rc != MOLFILE_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to read structure from GRO file (return code %d)\n", rc);
-    free(gro_atoms);
-    close_gro_read_wrapper(gro_handle);
-    free(atoms);
-    close_grotop_read(grotop_handle);
-    return 1;
-  }
-
-  printf("  - Read structure successfully (optflags: 0x%x)\n", gro_optflags);
-  printf("  - First atom: %s %s\n", gro_atoms[0].resname, gro_atoms[0].name);
-
-  /* Now read timestep to get coordinates */
-  molfile_timestep_t *ts = (molfile_timestep_t *)calloc(1, sizeof(molfile_timestep_t));
-  if (!ts) {
+  molfile_timestep_t *ts = alloc_timestep(natoms);
+  molfile_timestep_t *next_ts = all_frames ? alloc_timestep(natoms) : NULL;
+  if (!ts || (all_frames && !next_ts)) {
     fprintf(stderr, "ERROR: Failed to allocate memory for timestep\n");
-    free(gro_atoms);
-    close_gro_read_wrapper(gro_handle);
+    free_timestep(ts);
+    free_timestep(next_ts);
     free(atoms);
+    grotop_free_connectivity(&conn);
     close_grotop_read(grotop_handle);
     return 1;
   }
 
-  /* Allocate coordinate array */
-  ts->coords = (float *)calloc(3 * natoms, sizeof(float));
-  if (!ts->coords) {
-    fprintf(stderr, "ERROR: Failed to allocate memory for coordinates\n");
-    free(ts);
-    free(gro_atoms);
-    close_gro_read_wrapper(gro_handle);
+  /* The topology supplies names and residues, so only coordinates are read */
+  frame_source_t source;
+  if (!frame_source_open(&source, gro_file, natoms, grotop_handle)) {
+    frame_source_close(&source);
+    free_timestep(ts);
+    free_timestep(next_ts);
     free(atoms);
+    grotop_free_connectivity(&conn);
     close_grotop_read(grotop_handle);
     return 1;
   }
 
-  /* Read coordinates using timestep reader */
-  printf("  - Reading coordinates...\n");
-  rc = read_gro_timestep_wrapper(gro_handle, natoms, ts);
-
-  if (rc != MOLFILE_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to read coordinates (return code %d)\n", rc);
-    free(ts->coords);
-    free(ts);
-    free(gro_atoms);
-    close_gro_read_wrapper(gro_handle);
-    free(atoms);
-    close_grotop_read(grotop_handle);
-    return 1;
-  }
-
-  printf("  - Read coordinates successfully\n");
-  printf("  - First atom coordinates: (%.3f, %.3f, %.3f)\n",
-         ts->coords[0], ts->coords[1], ts->coords[2]);
-
-  free(gro_atoms);
-  close_gro_read_wrapper(gro_handle);
-  printf("\n");
-
-  /* Step 3: Write JS file */
-  printf("Step 3: Writing JS file...\n");
-
   void *js_handle = js_open_write(output_file, "js", natoms);
-
   if (!js_handle) {
     fprintf(stderr, "ERROR: Failed to open JS file for writing\n");
+    frame_source_close(&source);
+    free_timestep(ts);
+    free_timestep(next_ts);
     free(atoms);
+    grotop_free_connectivity(&conn);
     close_grotop_read(grotop_handle);
     return 1;
   }
 
-  /* IMPORTANT: Write bonds BEFORE structure! */
-  /* The molfile API requires write_bonds() to be called before write_structure() */
-  if (nbonds > 0) {
-    rc = js_write_bonds(js_handle, nbonds, from, to, bondorder,
-                        bondtype, nbondtypes, bondtypename);
-
-    if (rc != MOLFILE_SUCCESS) {
-      fprintf(stderr, "ERROR: Failed to write JS bonds\n");
-      js_close_write(js_handle);
-      free(ts->coords);
-      free(ts);
-      free(atoms);
-      close_grotop_read(grotop_handle);
-      return 1;
-    }
-
-    printf("  - Saved bonds to JS structure\n");
-  }
-
-  /* Write structure (this includes bond data saved above) */
-  rc = js_write_structure(js_handle, optflags, atoms);
+  section_writer_t sections;
+  start_sections(&sections, js_handle, optflags, atoms, &conn);
+  rc = frame_source_next(&source, ts);
+  const char *failed = finish_sections(&sections);
 
-  if (rc != MOLFILE_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to write JS structure\n");
+  if (failed || rc != FRAME_OK) {
+    if (failed) fprintf(stderr, "ERROR: Failed to write JS %s\n", failed);
+    else if (rc == FRAME_END) fprintf(stderr, "ERROR: GRO file contains no frames\n");
     js_close_write(js_handle);
+    frame_source_close(&source);
+    free_timestep(ts);
+    free_timestep(next_ts);
     free(atoms);
     close_grotop_read(grotop_handle);
     return 1;
   }
 
+  if (nbonds > 0) printf("  - Saved bonds to JS structure\n");
   printf("  - Wrote structure successfully\n");
+  if (numangles > 0 || numdihedrals > 0 || numimpropers > 0)
+    printf("  - Wrote angles/dihedrals/impropers successfully\n");
 
-  /* Write angles, dihedrals, and impropers */
-  if (numangles > 0 || numdihedrals > 0 || numimpropers > 0) {
-    rc = js_write_angles(js_handle,
-                         numangles, angles, angletypes, numangletypes,
-                         (const char **)angletypenames,
-                         numdihedrals, dihedrals, dihedraltypes, numdihedraltypes,
-                         (const char **)dihedraltypenames,
-                         numimpropers, impropers, impropertypes, numimpropertypes,
-                         (const char **)impropertypenames,
-                         numcterms, cterms, ctermcols, ctermrows);
-
-    if (rc != MOLFILE_SUCCESS) {
-      fprintf(stderr, "ERROR: Failed to write angles/dihedrals/impropers to JS\n");
-      js_close_write(js_handle);
-      free(ts->coords);
-      free(ts);
-      free(atoms);
-      close_grotop_read(grotop_handle);
-      return 1;
-    }
+  if (source.mask.file_natoms != natoms)
+    printf("  - GRO file contains %d atoms, %d kept by the molecule filter\n", source.mask.file_natoms, natoms);
+  else
+    printf("  - GRO file contains %d atoms (matches topology)\n", natoms);
+  if (!all_frames) frame_source_close(&source);
 
-    printf("  - Wrote angles/dihedrals/impropers successfully\n");
-  }
+  printf("  - Read coordinates successfully\n");
+  if (natoms > 0)
+    printf("  - First atom coordinates: (%.3f, %.3f, %.3f)\n",
+           ts->coords[0], ts->coords[1], ts->coords[2]);
+  printf("\n");
 
-  /* Write coordinates */
-  rc = js_write_timestep(js_handle, ts);
+  /* Step 3: Write coordinates */
+  printf("Step 3: Writing coordinates to JS file...\n");
+
+  /* Write coordinates: the first frame, or every frame through the pipeline */
+  int nframes = 1;
+  if (all_frames) {
+    nframes = write_all_frames(js_handle, &source, ts, next_ts);
+    rc = (nframes < 0) ? MOLFILE_ERROR : MOLFILE_SUCCESS;
+  } else {
+    rc = js_write_timestep(js_handle, ts);
+    if (rc != MOLFILE_SUCCESS) fprintf(stderr, "ERROR: Failed to write coordinates\n");
+  }
 
   if (rc != MOLFILE_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to write coordinates\n");
     js_close_write(js_handle);
-    free(ts->coords);
-    free(ts);
+    frame_source_close(&source);
+    free_timestep(ts);
+    free_timestep(next_ts);
     free(atoms);
     close_grotop_read(grotop_handle);
     return 1;
   }
 
-  printf("  - Wrote coordinates successfully\n");
+  printf("  - Wrote coordinates of %d frame(s) successfully\n", nframes);
+
+  /* Reader statistics, while the handle is still open */
+  printf("\nReader statistics:\n");
+  grotop_print_stats(grotop_handle, stdout);
+  if (memory) grotop_print_memory(grotop_handle, stdout);
 
   /* Step 4: Clean up */
   printf("\nStep 4: Cleaning up...\n");
 
   js_close_write(js_handle);
+  frame_source_close(&source);
   close_grotop_read(grotop_handle);
-  free(ts->coords);
-  free(ts);
+  free_timestep(ts);
+  free_timestep(next_ts);
   free(atoms);
 
   printf("\n=======================================================\n");
@@ -365,6 +994,7 @@ int main(int argc, char *argv[]) {
   printf("  Angles:     %d\n", numangles);
   printf("  Dihedrals:  %d\n", numdihedrals);
   printf("  Impropers:  %d\n", numimpropers);
+  printf("  Frames:     %d\n", nframes);
   printf("\n");
 
   return 0;
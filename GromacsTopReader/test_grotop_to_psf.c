@@ -3,11 +3,27 @@
  *
  * This validates the grotopplugin by using it to read .top files
  * and writing the result to .psf using the standard psfplugin.
+ *
+ * With --stream the PSF is written directly from the moltype templates in
+ * bounded chunks instead, so memory stays at the size of the templates
+ * rather than of the whole system. A writer thread writes the filled
+ * buffers behind the reader, see grotop_output.h. --check then reads the
+ * streamed file back and compares every atom and connectivity item with
+ * what read_grotop_structure(), read_grotop_bonds() and read_grotop_angles()
+ * instantiate for the same topology.
+ *
+ * With --memory the bytes held by the reader per category, and their peaks,
+ * are printed after the statistics.
+ *
+ * With --batch every "<input.top> <output.psf>" line of a manifest is
+ * streamed on a pool of -j worker threads (default one per CPU) that
+ * share parsed includes, see grotop_batch.h.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 /* We'll compile both plugins directly into this test */
 #define STATIC_PLUGIN
@@ -34,6 +50,9 @@
 /* We need to initialize the PSF plugin to populate the structure */
 extern molfile_plugin_t plugin;  /* This is from psfplugin.c */
 
+#include "grotop_batch.h"
+#include "grotop_output.h"
+
 static void *(*psf_open_write)(const char *, const char *, int);
 static int (*psf_write_structure)(void *, int, const molfile_atom_t *);
 static int (*psf_write_bonds)(void *, int, int *, int *, float *, int *, int, char **);
@@ -52,15 +71,226 @@ static void init_psf_plugin(void) {
   psf_close_write = plugin.close_file_write;
 }
 
+/*
+ * Streaming writer
+ *
+ * Writes the X-PLOR PSF layout of psfplugin section by section, pulling
+ * atoms and connectivity from the reader STREAM_CHUNK items at a time.
+ * Output goes through the write-behind buffers of grotop_output.h, so the
+ * next chunk is instantiated while the previous ones are being written.
+ */
+
+#define STREAM_CHUNK 65536
+
+/* One connectivity section, per_line items to a line as psfplugin does */
+static int stream_connectivity(output_t *out, void *handle, int kind, int per_line, const char *title,
+                               int *buffer) {
+  int width = grotop_connectivity_width(kind);
+  long long total = grotop_connectivity_count(handle, kind);
+  long long first = 0;
+  int n;
+
+  output_printf(out, "%8lld !%s\n", total, title);
+  while ((n = grotop_read_connectivity(handle, kind, first, STREAM_CHUNK, buffer)) > 0) {
+    for (int i = 0; i < n; i++) {
+      for (int k = 0; k < width; k++) output_printf(out, "%8d", buffer[i * width + k]);
+      if ((first + i) % per_line == per_line - 1) output_putc(out, '\n');
+    }
+    first += n;
+  }
+  if (first % per_line != 0) output_putc(out, '\n');
+  output_putc(out, '\n');
+
+  return (n < 0 || first != total) ? -1 : 0;
+}
+
+/* Stream a PSF of the handle to output_file; stats (if not NULL) gets the writer's counters */
+static int stream_psf(void *handle, int natoms, const char *output_file, output_stats_t *stats) {
+  output_t *out = output_open(output_file);
+  if (!out) {
+    fprintf(stderr, "ERROR: Failed to open PSF file for writing\n");
+    return -1;
+  }
+
+  /* Atoms and items share one buffer; an atom is larger than any item */
+  void *buffer = malloc((size_t)STREAM_CHUNK * sizeof(molfile_atom_t));
+  if (!buffer) {
+    fprintf(stderr, "ERROR: Failed to allocate stream buffer\n");
+    output_close(out, NULL);
+    return -1;
+  }
+
+  output_printf(out, "PSF\n\n%8d !NTITLE\n", 1);
+  output_printf(out, " REMARKS %s\n\n", "VMD-generated NAMD/X-Plor PSF structure file");
+
+  output_printf(out, "%8d !NATOM\n", natoms);
+  molfile_atom_t *atoms = (molfile_atom_t *)buffer;
+  int first = 0, n = 0;
+  while ((n = grotop_read_atoms(handle, first, STREAM_CHUNK, atoms)) > 0) {
+    for (int i = 0; i < n; i++) {
+      const molfile_atom_t *a = &atoms[i];
+      output_printf(out, "%8d %-4s %-4d %-4s %-4s %-4s %10.6f     %9.4f  %10d\n",
+                    first + i + 1, a->segid, a->resid, a->resname, a->name, a->type,
+                    a->charge, a->mass, 0);
+    }
+    first += n;
+  }
+  output_putc(out, '\n');
+
+  int rc = (n < 0 || first != natoms) ? -1 : 0;
+  if (rc == 0) rc = stream_connectivity(out, handle, GROTOP_BONDS, 4, "NBOND: bonds", buffer);
+  if (rc == 0) rc = stream_connectivity(out, handle, GROTOP_ANGLES, 3, "NTHETA: angles", buffer);
+  if (rc == 0) rc = stream_connectivity(out, handle, GROTOP_DIHEDRALS, 2, "NPHI: dihedrals", buffer);
+  if (rc == 0) rc = stream_connectivity(out, handle, GROTOP_IMPROPERS, 2, "NIMPHI: impropers", buffer);
+
+  /* No donors, acceptors or exclusions; one group */
+  output_printf(out, "%8d !NDON: donors\n\n\n", 0);
+  output_printf(out, "%8d !NACC: acceptors\n\n\n", 0);
+  output_printf(out, "%8d !NNB\n\n", 0);
+  for (int i = 0; i < natoms; i++) {
+    output_printf(out, "%8d", 0);
+    if (i % 8 == 7) output_putc(out, '\n');
+  }
+  output_printf(out, "\n\n%8d %7d !NGRP\n%8d%8d%8d\n\n", 1, 0, 0, 0, 0);
+
+  free(buffer);
+  if (output_close(out, stats) != 0) rc = -1;
+  if (rc != 0) fprintf(stderr, "ERROR: Failed to write PSF file\n");
+  return rc;
+}
+
+/*
+ * Stream check
+ */
+
+/* Skip to the line with a section title and return its count, -1 if missing */
+static long long check_find_section(FILE *fp, const char *title) {
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    if (strstr(line, title)) return atoll(line);
+  }
+  return -1;
+}
+
+/* Compare a connectivity section with count items of width instantiated indices */
+static int check_items(FILE *fp, const char *title, long long count, int width, const int *a,
+                       const int *b) {
+  long long stored = check_find_section(fp, title);
+  if (stored != count) {
+    fprintf(stderr, "ERROR: %s has %lld items, expected %lld\n", title, stored, count);
+    return 0;
+  }
+  for (long long i = 0; i < count; i++) {
+    for (int k = 0; k < width; k++) {
+      /* Bonds come as two arrays, everything else as width ints per item */
+      int expect = b ? (k == 0 ? a[i] : b[i]) : a[i * width + k];
+      int value;
+      if (fscanf(fp, "%d", &value) != 1 || value != expect) {
+        fprintf(stderr, "ERROR: %s item %lld differs from the instantiated one\n", title, i + 1);
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Read a streamed PSF back and compare it with the handle's instantiated arrays */
+static int check_stream(void *handle, int natoms, const char *psf_file) {
+  molfile_atom_t *atoms = (molfile_atom_t *)calloc(natoms > 0 ? natoms : 1, sizeof(molfile_atom_t));
+  int nbonds = 0, nbondtypes = 0, optflags = 0;
+  int *from = NULL, *to = NULL, *bondtype = NULL;
+  float *bondorder = NULL;
+  char **bondtypename = NULL;
+  int nangles = 0, ndihedrals = 0, nimpropers = 0, ncterms = 0, ctermcols = 0, ctermrows = 0;
+  int *angles = NULL, *angletypes = NULL, *dihedrals = NULL, *dihedraltypes = NULL;
+  int *impropers = NULL, *impropertypes = NULL, *cterms = NULL;
+  int nangletypes = 0, ndihedraltypes = 0, nimpropertypes = 0;
+  char **angletypenames = NULL, **dihedraltypenames = NULL, **impropertypenames = NULL;
+
+  if (!atoms || read_grotop_structure(handle, &optflags, atoms) != MOLFILE_SUCCESS ||
+      read_grotop_bonds(handle, &nbonds, &from, &to, &bondorder, &bondtype, &nbondtypes,
+                        &bondtypename) != MOLFILE_SUCCESS ||
+      read_grotop_angles(handle, &nangles, &angles, &angletypes, &nangletypes, &angletypenames,
+                         &ndihedrals, &dihedrals, &dihedraltypes, &ndihedraltypes, &dihedraltypenames,
+                         &nimpropers, &impropers, &impropertypes, &nimpropertypes, &impropertypenames,
+                         &ncterms, &cterms, &ctermcols, &ctermrows) != MOLFILE_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to instantiate the topology for the check\n");
+    free(atoms);
+    return 0;
+  }
+
+  FILE *fp = fopen(psf_file, "r");
+  int ok = fp != NULL;
+  if (!fp) fprintf(stderr, "ERROR: Failed to reopen %s\n", psf_file);
+
+  if (ok && check_find_section(fp, "!NATOM") != natoms) {
+    fprintf(stderr, "ERROR: !NATOM differs from %d atoms\n", natoms);
+    ok = 0;
+  }
+  for (int i = 0; ok && i < natoms; i++) {
+    const molfile_atom_t *a = &atoms[i];
+    char line[512], segid[16], resname[16], name[32], type[32];
+    int index, resid;
+    float charge, mass;
+    ok = fgets(line, sizeof(line), fp) &&
+         sscanf(line, "%d %15s %d %15s %31s %31s %f %f", &index, segid, &resid, resname, name, type,
+                &charge, &mass) == 8 &&
+         index == i + 1 && strcmp(segid, a->segid) == 0 && resid == a->resid &&
+         strcmp(resname, a->resname) == 0 && strcmp(name, a->name) == 0 &&
+         strcmp(type, a->type) == 0 && fabsf(charge - a->charge) <= 5e-7f * (1.0f + fabsf(a->charge)) &&
+         fabsf(mass - a->mass) <= 5e-5f * (1.0f + fabsf(a->mass));
+    if (!ok) fprintf(stderr, "ERROR: Atom %d differs from the instantiated one\n", i + 1);
+  }
+
+  ok = ok && check_items(fp, "!NBOND", nbonds, 2, from, to);
+  ok = ok && check_items(fp, "!NTHETA", nangles, 3, angles, NULL);
+  ok = ok && check_items(fp, "!NPHI", ndihedrals, 4, dihedrals, NULL);
+  ok = ok && check_items(fp, "!NIMPHI", nimpropers, 4, impropers, NULL);
+
+  if (fp) fclose(fp);
+  free(atoms);
+  if (ok) {
+    printf("  - Checked %d atoms, %d bonds, %d angles, %d dihedrals, %d impropers\n",
+           natoms, nbonds, nangles, ndihedrals, nimpropers);
+  }
+  return ok;
+}
+
+/* One job of a batch: "<input.top> <output.psf>", always streamed */
+static int convert_batch_job(batch_job_t *job, void *options) {
+  int natoms = 0;
+  void *handle = grotop_open(job->fields[0], LOG_SILENT, &natoms, job->error, sizeof(job->error));
+  if (!handle) return 0;
+
+  int ok = stream_psf(handle, natoms, job->fields[1], NULL) == 0;
+  if (!ok) snprintf(job->error, sizeof(job->error), "Failed to write %.100s: %.120s", job->fields[1],
+                    grotop_last_error(handle));
+  batch_record(job, handle);
+  close_grotop_read(handle);
+  return ok;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <input.top> <output.psf>\n", argv[0]);
+  int stream = 0, memory = 0, check = 0, first = 1, threads = 0;
+  const char *manifest = NULL;
+  for (; first < argc; first++) {
+    if (strcmp(argv[first], "--stream") == 0) stream = 1;
+    else if (strcmp(argv[first], "--memory") == 0) memory = 1;
+    else if (strcmp(argv[first], "--check") == 0) stream = check = 1;
+    else if (strcmp(argv[first], "--batch") == 0 && first + 1 < argc) manifest = argv[++first];
+    else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) threads = atoi(argv[++first]);
+    else break;
+  }
+  if (manifest) return batch_run(manifest, threads, 2, convert_batch_job, NULL);
+
+  if (argc < first + 2) {
+    fprintf(stderr, "Usage: %s [--stream | --check] [--memory] <input.top> <output.psf>\n"
+                    "       %s --batch <manifest> [-j threads]\n", argv[0], argv[0]);
     return 1;
   }
 
-  const char *input_file = argv[1];
-  const char *output_file = argv[2];
+  const char *input_file = argv[first];
+  const char *output_file = argv[first + 1];
 
   /* Initialize PSF plugin */
   init_psf_plugin();
@@ -85,6 +315,44 @@ int main(int argc, char *argv[]) {
 
   printf("  - Total atoms: %d\n", natoms);
 
+  if (stream) {
+    printf("\nStep 2: Streaming PSF file...\n");
+    output_stats_t written;
+    int rc = stream_psf(grotop_handle, natoms, output_file, &written);
+    if (rc == 0) {
+      printf("  - Wrote complete PSF file successfully\n");
+      printf("  - %lld bytes in %lld writes (%s), %.3f s waiting for the writer\n",
+             written.bytes, written.writes, written.backend, written.stall_seconds);
+      printf("\nReader statistics:\n");
+      grotop_print_stats(grotop_handle, stdout);
+      if (memory) grotop_print_memory(grotop_handle, stdout);
+    }
+
+    if (rc == 0 && check) {
+      printf("\nChecking the streamed file...\n");
+      if (!check_stream(grotop_handle, natoms, output_file)) rc = -1;
+    }
+
+    printf("\nStep 3: Cleaning up...\n");
+    long long counts[4];
+    for (int kind = GROTOP_BONDS; kind <= GROTOP_IMPROPERS; kind++)
+      counts[kind] = grotop_connectivity_count(grotop_handle, kind);
+    close_grotop_read(grotop_handle);
+    if (rc != 0) return 1;
+
+    printf("\n=======================================================\n");
+    printf("SUCCESS: PSF file streamed to %s\n", output_file);
+    printf("=======================================================\n");
+    printf("\nSummary:\n");
+    printf("  Atoms:      %d\n", natoms);
+    printf("  Bonds:      %lld\n", counts[GROTOP_BONDS]);
+    printf("  Angles:     %lld\n", counts[GROTOP_ANGLES]);
+    printf("  Dihedrals:  %lld\n", counts[GROTOP_DIHEDRALS]);
+    printf("  Impropers:  %lld\n", counts[GROTOP_IMPROPERS]);
+    printf("\n");
+    return 0;
+  }
+
   /* Allocate atom array */
   molfile_atom_t *atoms = (molfile_atom_t *)calloc(natoms, sizeof(molfile_atom_t));
   if (!atoms) {
@@ -219,6 +487,11 @@ int main(int argc, char *argv[]) {
 
   printf("  - Wrote complete PSF file successfully\n");
 
+  /* Reader statistics, while the handle is still open */
+  printf("\nReader statistics:\n");
+  grotop_print_stats(grotop_handle, stdout);
+  if (memory) grotop_print_memory(grotop_handle, stdout);
+
   /* Step 3: Clean up */
   printf("\nStep 3: Cleaning up...\n");
 
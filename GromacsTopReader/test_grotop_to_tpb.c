@@ -0,0 +1,185 @@
+/*
+ * Test program: Compile a GROMACS topology into a .tpb snapshot
+ *
+ * Reads a .top file with the grotop reader, writes the resolved topology
+ * as .tpb, then reopens it with the grotpb reader and checks that both
+ * handles instantiate the same system.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* We'll compile the plugin directly into this test */
+#define STATIC_PLUGIN
+#include "grotopplugin.c"
+
+/* Compare two atoms field by field */
+static int same_atom(const molfile_atom_t *a, const molfile_atom_t *b) {
+  return strcmp(a->name, b->name) == 0 &&
+         strcmp(a->type, b->type) == 0 &&
+         strcmp(a->resname, b->resname) == 0 &&
+         strcmp(a->segid, b->segid) == 0 &&
+         a->resid == b->resid &&
+         a->charge == b->charge &&
+         a->mass == b->mass;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <input.top> <output.tpb>\n", argv[0]);
+    return 1;
+  }
+
+  const char *input_file = argv[1];
+  const char *output_file = argv[2];
+
+  VMDPLUGIN_init();
+
+  printf("=======================================================\n");
+  printf("GROMACS Topology to TPB Compiler\n");
+  printf("=======================================================\n");
+  printf("Input:  %s\n", input_file);
+  printf("Output: %s\n", output_file);
+  printf("=======================================================\n\n");
+
+  /* Step 1: Read GROMACS topology */
+  printf("Step 1: Reading GROMACS topology...\n");
+
+  int natoms = 0;
+  void *top_handle = open_grotop_read(input_file, "grotop", &natoms);
+
+  if (!top_handle) {
+    fprintf(stderr, "ERROR: Failed to open topology file\n");
+    return 1;
+  }
+
+  printf("  - Total atoms: %d\n\n", natoms);
+
+  /* Step 2: Write the compiled topology */
+  printf("Step 2: Writing TPB file...\n");
+
+  if (grotop_write_tpb(top_handle, output_file) != MOLFILE_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to write TPB file\n");
+    close_grotop_read(top_handle);
+    return 1;
+  }
+
+  printf("  - Wrote TPB file successfully\n\n");
+
+  /* Step 3: Reopen and compare */
+  printf("Step 3: Verifying TPB file...\n");
+
+  int tpb_natoms = 0;
+  void *tpb_handle = tpb_plugin.open_file_read(output_file, "grotpb", &tpb_natoms);
+
+  if (!tpb_handle) {
+    fprintf(stderr, "ERROR: Failed to reopen TPB file\n");
+    close_grotop_read(top_handle);
+    return 1;
+  }
+
+  if (tpb_natoms != natoms) {
+    fprintf(stderr, "ERROR: Atom count mismatch between topology (%d) and TPB (%d)\n",
+            natoms, tpb_natoms);
+    close_grotop_read(tpb_handle);
+    close_grotop_read(top_handle);
+    return 1;
+  }
+
+  molfile_atom_t *atoms = (molfile_atom_t *)calloc(natoms + 1, sizeof(molfile_atom_t));
+  molfile_atom_t *tpb_atoms = (molfile_atom_t *)calloc(natoms + 1, sizeof(molfile_atom_t));
+  if (!atoms || !tpb_atoms) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for atoms\n");
+    free(atoms);
+    free(tpb_atoms);
+    close_grotop_read(tpb_handle);
+    close_grotop_read(top_handle);
+    return 1;
+  }
+
+  int optflags = 0;
+  int mismatches = 0;
+  if (read_grotop_structure(top_handle, &optflags, atoms) != MOLFILE_SUCCESS ||
+      tpb_plugin.read_structure(tpb_handle, &optflags, tpb_atoms) != MOLFILE_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to read structure\n");
+    mismatches++;
+  }
+
+  for (int i = 0; i < natoms && !mismatches; i++) {
+    if (!same_atom(&atoms[i], &tpb_atoms[i])) {
+      fprintf(stderr, "ERROR: Atom %d differs between topology and TPB\n", i + 1);
+      mismatches++;
+    }
+  }
+
+  /* Bonds */
+  int nbonds = 0, tpb_nbonds = 0;
+  int *from = NULL, *to = NULL, *tpb_from = NULL, *tpb_to = NULL;
+  float *bondorder = NULL;
+  int *bondtype = NULL;
+  int nbondtypes = 0;
+  char **bondtypename = NULL;
+
+  if (!mismatches &&
+      (read_grotop_bonds(top_handle, &nbonds, &from, &to, &bondorder,
+                         &bondtype, &nbondtypes, &bondtypename) != MOLFILE_SUCCESS ||
+       tpb_plugin.read_bonds(tpb_handle, &tpb_nbonds, &tpb_from, &tpb_to, &bondorder,
+                             &bondtype, &nbondtypes, &bondtypename) != MOLFILE_SUCCESS ||
+       nbonds != tpb_nbonds ||
+       (nbonds > 0 && (memcmp(from, tpb_from, nbonds * sizeof(int)) != 0 ||
+                       memcmp(to, tpb_to, nbonds * sizeof(int)) != 0)))) {
+    fprintf(stderr, "ERROR: Bonds differ between topology and TPB\n");
+    mismatches++;
+  }
+
+  /* Angles, dihedrals and impropers */
+  int nangles = 0, ndihedrals = 0, nimpropers = 0;
+  int tpb_nangles = 0, tpb_ndihedrals = 0, tpb_nimpropers = 0;
+  int *angles = NULL, *dihedrals = NULL, *impropers = NULL;
+  int *tpb_angles = NULL, *tpb_dihedrals = NULL, *tpb_impropers = NULL;
+  int *angletypes = NULL, *dihedraltypes = NULL, *impropertypes = NULL, *cterms = NULL;
+  int nangletypes = 0, ndihedraltypes = 0, nimpropertypes = 0;
+  int ncterms = 0, ctermcols = 0, ctermrows = 0;
+  char **angletypenames = NULL, **dihedraltypenames = NULL, **impropertypenames = NULL;
+
+  if (!mismatches &&
+      (read_grotop_angles(top_handle, &nangles, &angles, &angletypes, &nangletypes, &angletypenames,
+                          &ndihedrals, &dihedrals, &dihedraltypes, &ndihedraltypes, &dihedraltypenames,
+                          &nimpropers, &impropers, &impropertypes, &nimpropertypes, &impropertypenames,
+                          &ncterms, &cterms, &ctermcols, &ctermrows) != MOLFILE_SUCCESS ||
+       tpb_plugin.read_angles(tpb_handle, &tpb_nangles, &tpb_angles, &angletypes, &nangletypes,
+                              &angletypenames, &tpb_ndihedrals, &tpb_dihedrals, &dihedraltypes,
+                              &ndihedraltypes, &dihedraltypenames, &tpb_nimpropers, &tpb_impropers,
+                              &impropertypes, &nimpropertypes, &impropertypenames,
+                              &ncterms, &cterms, &ctermcols, &ctermrows) != MOLFILE_SUCCESS ||
+       nangles != tpb_nangles || ndihedrals != tpb_ndihedrals || nimpropers != tpb_nimpropers ||
+       (nangles > 0 && memcmp(angles, tpb_angles, (size_t)nangles * 3 * sizeof(int)) != 0) ||
+       (ndihedrals > 0 && memcmp(dihedrals, tpb_dihedrals, (size_t)ndihedrals * 4 * sizeof(int)) != 0) ||
+       (nimpropers > 0 && memcmp(impropers, tpb_impropers, (size_t)nimpropers * 4 * sizeof(int)) != 0))) {
+    fprintf(stderr, "ERROR: Angles, dihedrals or impropers differ between topology and TPB\n");
+    mismatches++;
+  }
+
+  printf("  - Atoms:     %d\n", natoms);
+  printf("  - Bonds:     %d\n", nbonds);
+  printf("  - Angles:    %d\n", nangles);
+  printf("  - Dihedrals: %d\n", ndihedrals);
+  printf("  - Impropers: %d\n", nimpropers);
+
+  free(atoms);
+  free(tpb_atoms);
+  close_grotop_read(tpb_handle);
+  close_grotop_read(top_handle);
+
+  if (mismatches) {
+    printf("\nFAILED: TPB file does not match the topology\n");
+    return 1;
+  }
+
+  printf("\n=======================================================\n");
+  printf("SUCCESS: TPB file written to %s\n", output_file);
+  printf("=======================================================\n");
+
+  return 0;
+}